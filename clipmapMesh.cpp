@@ -0,0 +1,140 @@
+//
+//  File: clipmapMesh.cpp
+//
+//  Description:
+//		Clipmap rings around a camera.
+//
+
+#include <math.h>
+#include <vector>
+
+#include "clipmapMesh.h"
+
+
+ClipmapParams::ClipmapParams()
+    : levels(6), resolution(128), cellSize(0.5)
+{}
+
+
+static int clipmap_resolution(const ClipmapParams& params)
+{
+    int m = params.resolution < 8 ? 8 : params.resolution;
+    return (m + 3)/4*4;
+}
+
+static int clipmap_levels(const ClipmapParams& params)
+{
+    return params.levels < 1 ? 1 : params.levels > 24 ? 24 : params.levels;
+}
+
+int clipmap_vertex_count(const ClipmapParams& params)
+{
+    int m = clipmap_resolution(params);
+    int hole = m/2 + 1;     // vertices along a side of the hole, made by the level inside
+    return (m + 1)*(m + 1) + (clipmap_levels(params) - 1)*((m + 1)*(m + 1) - hole*hole);
+}
+
+bool clipmap_build(const ClipmapParams& params, const double u, const double v, ClipmapMesh& mesh)
+{
+    const int m = clipmap_resolution(params);
+    const int levels = clipmap_levels(params);
+    const double cell = params.cellSize > 0.0 ? params.cellSize : 1.0;
+
+    // centers in cells of level 0, level L on a multiple of 2^(L+1)
+    std::vector<long long> centers(2*levels);
+    for (int level = 0; level < levels; level++) {
+        double snap = 2.0*cell*(1LL << level);
+        centers[2*level] = (long long)floor(u/snap + 0.5)*(2LL << level);
+        centers[2*level + 1] = (long long)floor(v/snap + 0.5)*(2LL << level);
+    }
+    WaterHash signature = clipmap_signature(params);
+    if (signature == mesh.signature && centers == mesh.centers)
+        return false;
+
+    mesh.points.clear();
+    mesh.polygonCounts.clear();
+    mesh.polygonConnects.clear();
+    mesh.points.reserve(3*clipmap_vertex_count(params));
+
+    const int side = m + 1;
+    std::vector<int> index(side*side), inner(side*side);
+    long long innerU = 0, innerV = 0;       // origin of the level inside, in cells of level 0
+
+    for (int level = 0; level < levels; level++) {
+        const long long step = 1LL << level;
+        const long long originU = centers[2*level] - (m/2)*step;
+        const long long originV = centers[2*level + 1] - (m/2)*step;
+
+        // the hole the finer level fills, in cells of this level, closed
+        // at the far side so its border vertices come from inside
+        int hole0U = -1, hole0V = -1, hole1U = -2, hole1V = -2;
+        if (level > 0) {
+            inner.swap(index);
+            hole0U = (int)((innerU - originU)/step);
+            hole0V = (int)((innerV - originV)/step);
+            hole1U = hole0U + m/2;
+            hole1V = hole0V + m/2;
+        }
+
+        for (int j = 0; j <= m; j++)
+            for (int i = 0; i <= m; i++) {
+                long long pu = originU + i*step;
+                long long pv = originV + j*step;
+                if (i >= hole0U && i <= hole1U && j >= hole0V && j <= hole1V) {
+                    bool border = i == hole0U || i == hole1U || j == hole0V || j == hole1V;
+                    index[j*side + i] = border ? inner[((pv - innerV)/(step/2))*side + (pu - innerU)/(step/2)] : -1;
+                    continue;
+                }
+                index[j*side + i] = (int)(mesh.points.size()/3);
+                mesh.points.push_back((float)(pu*cell));
+                mesh.points.push_back(0.0f);
+                mesh.points.push_back((float)(pv*cell));
+            }
+
+        // corners counterclockwise seen from above, the middle of an edge
+        // along the hole goes in between its corners
+        for (int j = 0; j < m; j++)
+            for (int i = 0; i < m; i++) {
+                if (i >= hole0U && i < hole1U && j >= hole0V && j < hole1V)
+                    continue;
+                static const int corner[5][2] = { {0, 0}, {0, 1}, {1, 1}, {1, 0}, {0, 0} };
+                static const int across[4][2] = { {-1, 0}, {0, 1}, {1, 0}, {0, -1} };
+                int count = 0;
+                for (int c = 0; c < 4; c++) {
+                    int ci = i + corner[c][0], cj = j + corner[c][1];
+                    mesh.polygonConnects.push_back(index[cj*side + ci]);
+                    count++;
+                    int ni = i + across[c][0], nj = j + across[c][1];
+                    if (ni >= hole0U && ni < hole1U && nj >= hole0V && nj < hole1V) {
+                        // both corners are on the border of the hole,
+                        // the finer level has a vertex between them
+                        long long mu = originU*2 + (ci + i + corner[c + 1][0])*step;
+                        long long mv = originV*2 + (cj + j + corner[c + 1][1])*step;
+                        mu = (mu/2 - innerU)/(step/2);
+                        mv = (mv/2 - innerV)/(step/2);
+                        mesh.polygonConnects.push_back(inner[mv*side + mu]);
+                        count++;
+                    }
+                }
+                mesh.polygonCounts.push_back(count);
+            }
+
+        innerU = originU;
+        innerV = originV;
+    }
+
+    mesh.centers.swap(centers);
+    mesh.signature = signature;
+    return true;
+}
+
+
+WaterHash clipmap_signature(const ClipmapParams& params)
+{
+    // field by field, the padding of the struct is not initialized
+    WaterHash hash = WATER_HASH_BASIS;
+    hash = water_hash(hash, &params.levels, sizeof(params.levels));
+    hash = water_hash(hash, &params.resolution, sizeof(params.resolution));
+    hash = water_hash(hash, &params.cellSize, sizeof(params.cellSize));
+    return hash;
+}
@@ -0,0 +1,57 @@
+//
+//  File: clipmapMesh.h
+//
+//  Description:
+//		Geometry of the ocean around a camera as nested clipmap levels.
+//		Level 0 is a square grid of the finest cells, every further level
+//		a ring of cells twice as large around the one inside it, so the
+//		vertex count only depends on the number of levels and the cells
+//		per level, not on how far the water reaches.
+//
+//		Every level snaps to twice its own cell size, so its vertices do
+//		not slide over the water as the camera moves and the level inside
+//		always starts on a vertex of its ring. The ring cells along the
+//		hole take the middle vertex of the finer edge they border into
+//		their polygon, so the levels share every vertex of the seam and
+//		no crack opens when the points are displaced.
+//
+
+#ifndef CLIPMAP_MESH_H_
+#define CLIPMAP_MESH_H_
+
+#include <vector>
+
+#include "waterHash.h"
+
+
+// Attribute values of the proWaterSurface node that the geometry depends on.
+struct ClipmapParams {
+    int levels;
+    int resolution;         // cells along a level side, rounded up to a multiple of 4
+    double cellSize;        // of level 0
+
+    ClipmapParams();
+};
+
+struct ClipmapMesh {
+    std::vector<float> points;              // x, y and z per vertex, on the plane y = 0
+    std::vector<int> polygonCounts;         // 4, or 5 along a seam
+    std::vector<int> polygonConnects;
+    std::vector<long long> centers;         // snapped center per level, in cells of level 0
+    WaterHash signature;                    // of the parameters it was built with
+
+    ClipmapMesh() : signature(0) {}
+};
+
+// Builds the levels around the camera at (u, v) of the plane. Returns
+// false, leaving the mesh alone, if no level snapped to a new place.
+bool clipmap_build(const ClipmapParams& params, const double u, const double v, ClipmapMesh& mesh);
+
+// Vertices of the mesh for the parameters, whatever the camera.
+int clipmap_vertex_count(const ClipmapParams& params);
+
+// Hash of the parameters.
+WaterHash clipmap_signature(const ClipmapParams& params);
+
+
+#endif /*CLIPMAP_MESH_H_*/
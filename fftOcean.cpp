@@ -0,0 +1,464 @@
+//
+//  File: fftOcean.cpp
+//
+//  Description:
+//		Spectral ocean after Tessendorf.
+//
+
+#include <math.h>
+#include <vector>
+
+#include "fftOcean.h"
+
+
+static const double OCEAN_PI = 3.14159265358979323846;
+static const double OCEAN_GRAVITY = 9.81;
+
+// Tile size of one cascade over the next. Not a whole number, so the tiles
+// of the cascades never line up.
+static const double OCEAN_CASCADE_RATIO = 5.3;
+
+// A cascade hands its band over to the next one this many of the next
+// tile's fundamental wave numbers up, so the next cascade still resolves
+// the directions of its longest waves.
+static const double OCEAN_HANDOVER = 4.0;
+
+// Share of the spectrum going against the wind.
+static const double OCEAN_BACKWARD = 0.07;
+
+// Standard deviations of the height in its range. A Gaussian gets past six
+// once in 500 million samples, 2.6 million samples of the default spectrum
+// got to 4.9.
+static const double OCEAN_HEIGHT_SIGMAS = 6.0;
+
+// Real maps per cascade, the velocity ones last. Two maps share one
+// complex plane of the inverse FFT.
+enum {
+    OCEAN_HEIGHT = 0,
+    OCEAN_X,
+    OCEAN_Z,
+    OCEAN_SLOPE_X,
+    OCEAN_SLOPE_Z,
+    OCEAN_XX,
+    OCEAN_ZZ,
+    OCEAN_XZ,
+    OCEAN_VY,
+    OCEAN_VX,
+    OCEAN_VZ,
+    OCEAN_MAPS
+};
+static const int OCEAN_SHAPE_MAPS = OCEAN_VY;
+
+
+OceanParams::OceanParams()
+    : direction(45.0), windSpeed(10.0), spectrum(OCEAN_PHILLIPS), fetch(100.0), amplitude(1.0),
+      choppiness(1.0), tileSize(200.0), resolution(256), cascades(2), loopLength(0.0), seed(0)
+{}
+
+
+// Uniform in (0, 1), the same sequence on every platform.
+static double ocean_random(unsigned int& state)
+{
+    state = state*1664525u + 1013904223u;
+    return ((state >> 8) + 0.5)*(1.0/16777216.0);
+}
+
+// Two independent standard normal numbers, Box-Muller.
+static void ocean_gaussian(unsigned int& state, double& a, double& b)
+{
+    double radius = sqrt(-2.0*log(ocean_random(state)));
+    double angle = 2*OCEAN_PI*ocean_random(state);
+    a = radius*cos(angle);
+    b = radius*sin(angle);
+}
+
+// Energy of the wave vector (kx, kz) per unit wave number area, both
+// spectra are in the Pierson-Moskowitz form alpha/(2 k^4) and spread
+// around the wind with cos^2.
+static double ocean_energy(const OceanParams& params, const double kx, const double kz,
+                           const double windX, const double windZ)
+{
+    double k = sqrt(kx*kx + kz*kz);
+    double wind = params.windSpeed > 0.1 ? params.windSpeed : 0.1;
+    double energy;
+    if (params.spectrum == OCEAN_JONSWAP) {
+        double fetch = (params.fetch > 0.001 ? params.fetch : 0.001)*1000.0;
+        double alpha = 0.076*pow(wind*wind/(fetch*OCEAN_GRAVITY), 0.22);
+        double peak = 22.0*pow(OCEAN_GRAVITY*OCEAN_GRAVITY/(wind*fetch), 1.0/3.0);
+        double omega = sqrt(OCEAN_GRAVITY*k);
+        double sigma = omega <= peak ? 0.07 : 0.09;
+        double r = exp(-(omega - peak)*(omega - peak)/(2*sigma*sigma*peak*peak));
+        double s = alpha*OCEAN_GRAVITY*OCEAN_GRAVITY/pow(omega, 5.0)*exp(-1.25*pow(peak/omega, 4.0))*pow(3.3, r);
+        // from frequency to wave number, dw/dk = g/(2w), and per unit area
+        energy = s*OCEAN_GRAVITY/(2*omega)/k;
+    }
+    else {
+        double length = wind*wind/OCEAN_GRAVITY;
+        double damping = length*0.001;
+        energy = 0.0081/(2*k*k*k*k)*exp(-1.0/(k*length*k*length))*exp(-k*k*damping*damping);
+    }
+
+    double c = (kx*windX + kz*windZ)/k;
+    double spread = 2.0/OCEAN_PI*c*c;
+    return energy*(c > 0.0 ? spread : OCEAN_BACKWARD*spread);
+}
+
+void ocean_build(const OceanParams& params, OceanSurface& surface)
+{
+    int size = 16;
+    while (size < 2048 && size*3 < params.resolution*2)
+        size *= 2;
+    surface.size = size;
+    surface.choppiness = params.choppiness;
+    surface.time = 0.0;
+    surface.hasVelocity = false;
+
+    surface.twiddle.resize(size);
+    for (int j = 0; j < size/2; j++) {
+        surface.twiddle[2*j] = cos(2*OCEAN_PI*j/size);
+        surface.twiddle[2*j + 1] = sin(2*OCEAN_PI*j/size);
+    }
+    int bits = 0;
+    while ((1 << bits) < size)
+        bits++;
+    surface.reverse.resize(size);
+    for (int i = 0; i < size; i++) {
+        int r = 0;
+        for (int b = 0; b < bits; b++)
+            if (i & (1 << b))
+                r |= 1 << (bits - 1 - b);
+        surface.reverse[i] = r;
+    }
+
+    int count = params.cascades > 0 ? params.cascades : 1;
+    double angle = params.direction*OCEAN_PI/180;
+    double windX = cos(angle), windZ = sin(angle);
+    double low = 0.0;
+    surface.cascades.resize(count);
+    for (int c = 0; c < count; c++) {
+        OceanCascade& cascade = surface.cascades[c];
+        double tile = params.tileSize/pow(OCEAN_CASCADE_RATIO, c);
+        double dk = 2*OCEAN_PI/tile;
+        double high = c + 1 < count ? OCEAN_HANDOVER*dk*OCEAN_CASCADE_RATIO : 1e30;
+        if (high > dk*(size/2))
+            high = dk*(size/2);
+
+        cascade.tileSize = tile;
+        cascade.h0.assign(2*size*size, 0.0f);
+        cascade.omega.assign(size*size, 0.0f);
+        cascade.spectrum.clear();
+        cascade.maps.clear();
+
+        unsigned int state = 2654435761u ^ (unsigned int)params.seed ^ (unsigned int)(c*40503u);
+        for (int row = 0; row < size; row++)
+            for (int col = 0; col < size; col++) {
+                double a, b;
+                ocean_gaussian(state, a, b);
+
+                // the Nyquist row and column have no partner of opposite
+                // wave vector and stay empty
+                int mx = col < size/2 ? col : col - size;
+                int mz = row < size/2 ? row : row - size;
+                if (mx == -size/2 || mz == -size/2 || (mx == 0 && mz == 0))
+                    continue;
+                double kx = mx*dk, kz = mz*dk;
+                double k = sqrt(kx*kx + kz*kz);
+                if (k < low || k >= high)
+                    continue;
+
+                double omega = sqrt(OCEAN_GRAVITY*k);
+                if (params.loopLength > 0.0) {
+                    double unit = 2*OCEAN_PI/params.loopLength;
+                    double periods = floor(omega/unit + 0.5);
+                    omega = (periods < 1.0 ? 1.0 : periods)*unit;
+                }
+
+                double scale = params.amplitude*sqrt(ocean_energy(params, kx, kz, windX, windZ)*dk*dk/2)/sqrt(2.0);
+                int i = row*size + col;
+                cascade.h0[2*i] = a*scale;
+                cascade.h0[2*i + 1] = b*scale;
+                cascade.omega[i] = omega;
+            }
+        low = high;
+    }
+}
+
+
+// In place inverse FFT of one line of complex values, without the 1/size.
+static void ocean_fft(const OceanSurface& surface, float* data)
+{
+    const int size = surface.size;
+    const float* twiddle = &surface.twiddle[0];
+    for (int i = 0; i < size; i++) {
+        int j = surface.reverse[i];
+        if (j > i) {
+            float re = data[2*i], im = data[2*i + 1];
+            data[2*i] = data[2*j];
+            data[2*i + 1] = data[2*j + 1];
+            data[2*j] = re;
+            data[2*j + 1] = im;
+        }
+    }
+    for (int half = 1; half < size; half *= 2) {
+        int stride = size/(2*half);
+        for (int start = 0; start < size; start += 2*half)
+            for (int j = 0; j < half; j++) {
+                float wr = twiddle[2*j*stride], wi = twiddle[2*j*stride + 1];
+                float* a = data + 2*(start + j);
+                float* b = a + 2*half;
+                float tr = wr*b[0] - wi*b[1];
+                float ti = wr*b[1] + wi*b[0];
+                b[0] = a[0] - tr;
+                b[1] = a[1] - ti;
+                a[0] += tr;
+                a[1] += ti;
+            }
+    }
+}
+
+// 2D inverse FFT of planes planes of size*size complex values, rows
+// then columns, both over the threads.
+static void ocean_fft_2d(const OceanSurface& surface, float* planes, const int count)
+{
+    const int size = surface.size;
+    const int lines = count*size;
+
+    #pragma omp parallel for schedule(static)
+    for (int line = 0; line < lines; line++)
+        ocean_fft(surface, planes + 2*size*line);
+
+    #pragma omp parallel
+    {
+        std::vector<float> column(2*size);
+        #pragma omp for schedule(static)
+        for (int line = 0; line < lines; line++) {
+            float* plane = planes + 2*size*size*(line/size);
+            int col = line % size;
+            for (int row = 0; row < size; row++) {
+                column[2*row] = plane[2*(row*size + col)];
+                column[2*row + 1] = plane[2*(row*size + col) + 1];
+            }
+            ocean_fft(surface, &column[0]);
+            for (int row = 0; row < size; row++) {
+                plane[2*(row*size + col)] = column[2*row];
+                plane[2*(row*size + col) + 1] = column[2*row + 1];
+            }
+        }
+    }
+}
+
+void ocean_update(OceanSurface& surface, const double time, const bool velocity)
+{
+    const int size = surface.size;
+    const int area = size*size;
+    const int maps = velocity ? OCEAN_MAPS : OCEAN_SHAPE_MAPS;
+    const int planes = (maps + 1)/2;
+    const float chop = surface.choppiness;
+
+    if (!surface.cascades.empty() && !surface.cascades[0].maps.empty() &&
+        surface.time == time && (surface.hasVelocity || !velocity))
+        return;
+
+    for (unsigned int c = 0; c < surface.cascades.size(); c++) {
+        OceanCascade& cascade = surface.cascades[c];
+        const float dk = 2*OCEAN_PI/cascade.tileSize;
+        cascade.spectrum.assign(2*area*planes, 0.0f);
+        float* spectrum = &cascade.spectrum[0];
+
+        #pragma omp parallel for schedule(static)
+        for (int row = 0; row < size; row++)
+            for (int col = 0; col < size; col++) {
+                int i = row*size + col;
+                int mx = col < size/2 ? col : col - size;
+                int mz = row < size/2 ? row : row - size;
+                if (mx == -size/2 || mz == -size/2 || (mx == 0 && mz == 0))
+                    continue;
+
+                // h(k, t) = h0(k) e^(-iwt) + conj(h0(-k)) e^(iwt), waves
+                // travel along k
+                int opposite = ((size - row) % size)*size + (size - col) % size;
+                double phase = fmod(cascade.omega[i]*time, 2*OCEAN_PI);
+                float cw = cos(phase), sw = sin(phase);
+                float ar = cascade.h0[2*i], ai = cascade.h0[2*i + 1];
+                float br = cascade.h0[2*opposite], bi = -cascade.h0[2*opposite + 1];
+                float hr = (ar*cw + ai*sw) + (br*cw - bi*sw);
+                float hi = (ai*cw - ar*sw) + (bi*cw + br*sw);
+
+                float kx = mx*dk, kz = mz*dk;
+                float k = sqrtf(kx*kx + kz*kz);
+                float dx = chop*kx/k, dz = chop*kz/k;
+
+                // channels as complex values, the offsets i*chop*k/|k|*h,
+                // the slopes i*k*h and the offset derivatives
+                // -chop*kx*kz/|k|*h
+                float channel[2*OCEAN_MAPS];
+                channel[2*OCEAN_HEIGHT] = hr;
+                channel[2*OCEAN_HEIGHT + 1] = hi;
+                channel[2*OCEAN_X] = -dx*hi;
+                channel[2*OCEAN_X + 1] = dx*hr;
+                channel[2*OCEAN_Z] = -dz*hi;
+                channel[2*OCEAN_Z + 1] = dz*hr;
+                channel[2*OCEAN_SLOPE_X] = -kx*hi;
+                channel[2*OCEAN_SLOPE_X + 1] = kx*hr;
+                channel[2*OCEAN_SLOPE_Z] = -kz*hi;
+                channel[2*OCEAN_SLOPE_Z + 1] = kz*hr;
+                channel[2*OCEAN_XX] = -dx*kx*hr;
+                channel[2*OCEAN_XX + 1] = -dx*kx*hi;
+                channel[2*OCEAN_ZZ] = -dz*kz*hr;
+                channel[2*OCEAN_ZZ + 1] = -dz*kz*hi;
+                channel[2*OCEAN_XZ] = -dx*kz*hr;
+                channel[2*OCEAN_XZ + 1] = -dx*kz*hi;
+                if (velocity) {
+                    // dh/dt = -iw h0(k) e^(-iwt) + iw conj(h0(-k)) e^(iwt)
+                    float w = cascade.omega[i];
+                    float vr = w*((ai*cw - ar*sw) - (bi*cw + br*sw));
+                    float vi = -w*((ar*cw + ai*sw) - (br*cw - bi*sw));
+                    channel[2*OCEAN_VY] = vr;
+                    channel[2*OCEAN_VY + 1] = vi;
+                    channel[2*OCEAN_VX] = -dx*vi;
+                    channel[2*OCEAN_VX + 1] = dx*vr;
+                    channel[2*OCEAN_VZ] = -dz*vi;
+                    channel[2*OCEAN_VZ + 1] = dz*vr;
+                }
+
+                // two real maps per plane, a + i*b
+                for (int p = 0; p < planes; p++) {
+                    const float* a = channel + 4*p;
+                    float* plane = spectrum + 2*area*p + 2*i;
+                    if (2*p + 1 < maps) {
+                        plane[0] = a[0] - a[3];
+                        plane[1] = a[1] + a[2];
+                    }
+                    else {
+                        plane[0] = a[0];
+                        plane[1] = a[1];
+                    }
+                }
+            }
+
+        ocean_fft_2d(surface, spectrum, planes);
+
+        // the maps of one sample are kept together, so sampling a point
+        // touches a few cache lines per cascade instead of one per map
+        cascade.maps.resize(area*maps);
+        for (int m = 0; m < maps; m++) {
+            const float* plane = spectrum + 2*area*(m/2) + (m & 1);
+            float* map = &cascade.maps[m];
+            for (int i = 0; i < area; i++)
+                map[maps*i] = plane[2*i];
+        }
+    }
+    surface.time = time;
+    surface.hasVelocity = velocity;
+}
+
+void ocean_sample_n(const OceanSurface& surface, const int n, const float* u, const float* v,
+                    float* offset, float* normals, float* velocity, float* jacobian)
+{
+    const int size = surface.size;
+    const int cascades = surface.cascades.size();
+    const int stride = surface.hasVelocity ? OCEAN_MAPS : OCEAN_SHAPE_MAPS;
+    const int maps = velocity && surface.hasVelocity ? OCEAN_MAPS : normals || jacobian ? OCEAN_SHAPE_MAPS : OCEAN_SLOPE_X;
+
+    #pragma omp parallel for schedule(static, 256)
+    for (int p = 0; p < n; p++) {
+        float sums[OCEAN_MAPS] = {0.0f};
+        for (int c = 0; c < cascades; c++) {
+            const OceanCascade& cascade = surface.cascades[c];
+            if (cascade.maps.empty())
+                continue;
+
+            // bilinear weights of the four samples around the point, the
+            // maps wrap around
+            double x = u[p]/cascade.tileSize*size, z = v[p]/cascade.tileSize*size;
+            double x0 = floor(x), z0 = floor(z);
+            float fx = x - x0, fz = z - z0;
+            int col = (int)(x0 - floor(x0/size)*size);
+            int row = (int)(z0 - floor(z0/size)*size);
+            int col1 = col + 1 < size ? col + 1 : 0;
+            int row1 = row + 1 < size ? row + 1 : 0;
+            const float* s00 = &cascade.maps[stride*(row*size + col)];
+            const float* s01 = &cascade.maps[stride*(row*size + col1)];
+            const float* s10 = &cascade.maps[stride*(row1*size + col)];
+            const float* s11 = &cascade.maps[stride*(row1*size + col1)];
+            float w00 = (1 - fx)*(1 - fz), w01 = fx*(1 - fz), w10 = (1 - fx)*fz, w11 = fx*fz;
+            for (int m = 0; m < maps; m++)
+                sums[m] += w00*s00[m] + w01*s01[m] + w10*s10[m] + w11*s11[m];
+        }
+
+        offset[3*p] = sums[OCEAN_X];
+        offset[3*p + 1] = sums[OCEAN_HEIGHT];
+        offset[3*p + 2] = sums[OCEAN_Z];
+        // tangents of the displaced surface along u and v
+        float tux = 1.0f + sums[OCEAN_XX], tuy = sums[OCEAN_SLOPE_X], tuz = sums[OCEAN_XZ];
+        float tvx = sums[OCEAN_XZ], tvy = sums[OCEAN_SLOPE_Z], tvz = 1.0f + sums[OCEAN_ZZ];
+        if (normals) {
+            float nx = tvy*tuz - tvz*tuy;
+            float ny = tvz*tux - tvx*tuz;
+            float nz = tvx*tuy - tvy*tux;
+            float length = sqrtf(nx*nx + ny*ny + nz*nz);
+            normals[3*p] = nx/length;
+            normals[3*p + 1] = ny/length;
+            normals[3*p + 2] = nz/length;
+        }
+        if (velocity) {
+            velocity[3*p] = sums[OCEAN_VX];
+            velocity[3*p + 1] = sums[OCEAN_VY];
+            velocity[3*p + 2] = sums[OCEAN_VZ];
+        }
+        if (jacobian)
+            jacobian[p] = tux*tvz - tuz*tvx;
+    }
+}
+
+void ocean_height_range(const OceanSurface& surface, float& low, float& high)
+{
+    // |h(k, t)| is at most |h0(k)| + |h0(-k)|, so every amplitude counts
+    // twice in the hard bound. The variance of the height is the sum of
+    // the mean |h(k, t)|^2, 2 |h0(k)|^2 per wave vector
+    double sum = 0.0, variance = 0.0;
+    for (unsigned int c = 0; c < surface.cascades.size(); c++) {
+        const std::vector<float>& h0 = surface.cascades[c].h0;
+        for (unsigned int i = 0; i < h0.size(); i += 2) {
+            double power = (double)h0[i]*h0[i] + (double)h0[i + 1]*h0[i + 1];
+            sum += 2*sqrt(power);
+            variance += 2*power;
+        }
+    }
+    double bound = OCEAN_HEIGHT_SIGMAS*sqrt(variance);
+    bound = bound < sum ? bound : sum;
+    low = (float)-bound;
+    high = (float)bound;
+}
+
+
+float ocean_peak_wavelength(const OceanParams& params)
+{
+    double wind = params.windSpeed > 0.1 ? params.windSpeed : 0.1;
+    if (params.spectrum == OCEAN_JONSWAP) {
+        double fetch = (params.fetch > 0.001 ? params.fetch : 0.001)*1000.0;
+        double peak = 22.0*pow(OCEAN_GRAVITY*OCEAN_GRAVITY/(wind*fetch), 1.0/3.0);
+        return (float)(2*OCEAN_PI*OCEAN_GRAVITY/(peak*peak));
+    }
+    // k^-4 exp(-1/(k L)^2) peaks at k = 1/(sqrt(2) L)
+    double length = wind*wind/OCEAN_GRAVITY;
+    return (float)(2*OCEAN_PI*sqrt(2.0)*length);
+}
+
+
+WaterHash ocean_signature(const OceanParams& params)
+{
+    WaterHash hash = WATER_HASH_BASIS;
+    hash = water_hash(hash, &params.direction, sizeof(params.direction));
+    hash = water_hash(hash, &params.windSpeed, sizeof(params.windSpeed));
+    hash = water_hash(hash, &params.spectrum, sizeof(params.spectrum));
+    hash = water_hash(hash, &params.fetch, sizeof(params.fetch));
+    hash = water_hash(hash, &params.amplitude, sizeof(params.amplitude));
+    hash = water_hash(hash, &params.choppiness, sizeof(params.choppiness));
+    hash = water_hash(hash, &params.tileSize, sizeof(params.tileSize));
+    hash = water_hash(hash, &params.resolution, sizeof(params.resolution));
+    hash = water_hash(hash, &params.cascades, sizeof(params.cascades));
+    hash = water_hash(hash, &params.loopLength, sizeof(params.loopLength));
+    hash = water_hash(hash, &params.seed, sizeof(params.seed));
+    return hash;
+}
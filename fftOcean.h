@@ -0,0 +1,96 @@
+//
+//  File: fftOcean.h
+//
+//  Description:
+//		Spectral ocean after Tessendorf, for open water with many more
+//		vertices than the noise layers can afford. A wind driven spectrum,
+//		Phillips or JONSWAP, gives every wave vector of a square tile a
+//		random amplitude and phase once. Every frame the phases are
+//		advanced with the deep water dispersion and one inverse FFT per
+//		pair of channels turns them into periodic maps of the height, the
+//		horizontal offsets, the slopes and the derivatives of the
+//		horizontal offsets. The deformer samples the maps bilinearly, so
+//		the cost per vertex does not depend on the number of waves.
+//
+//		Several cascades with tiles of different sizes each take a band
+//		of the spectrum, so the repetition of one tile is hidden by the
+//		others.
+//
+
+#ifndef FFT_OCEAN_H_
+#define FFT_OCEAN_H_
+
+#include <vector>
+
+#include "waterHash.h"
+
+
+enum OceanSpectrum {
+    OCEAN_PHILLIPS = 0,
+    OCEAN_JONSWAP = 1
+};
+
+// Attribute values of the proWater node that the ocean depends on.
+struct OceanParams {
+    double direction;       // wind direction in degrees
+    double windSpeed;       // at 10 m, in units per second
+    int spectrum;           // OceanSpectrum
+    double fetch;           // JONSWAP only, distance the wind has blown over the water
+    double amplitude;       // scales the heights of the spectrum
+    double choppiness;      // scales the horizontal offsets
+    double tileSize;        // of the largest cascade
+    int resolution;         // samples along a tile side, rounded to a power of two
+    int cascades;
+    double loopLength;      // snap the frequencies to repeat after this long, 0 disables it
+    int seed;
+
+    OceanParams();
+};
+
+// A square tile of the spectrum and the maps made from it.
+struct OceanCascade {
+    float tileSize;
+    std::vector<float> h0;          // complex amplitude at time 0, re and im per wave vector
+    std::vector<float> omega;       // angular frequency per wave vector
+    std::vector<float> spectrum;    // complex channels at the current time, two real maps per plane
+    std::vector<float> maps;        // real maps, all maps of a sample next to each other
+};
+
+struct OceanSurface {
+    int size;                           // samples along a tile side
+    float choppiness;
+    std::vector<OceanCascade> cascades;
+    std::vector<float> twiddle;         // e^(2 pi i j/size), re and im
+    std::vector<int> reverse;           // bit reversed indices
+    double time;                        // of the maps
+    bool hasVelocity;                   // the maps include the velocity
+
+    OceanSurface() : size(0), choppiness(0.0f), time(0.0), hasVelocity(false) {}
+};
+
+// Draws the amplitudes of all cascades. The maps are left empty.
+void ocean_build(const OceanParams& params, OceanSurface& surface);
+
+// Fills the maps at time t, a no-op if they are already there.
+void ocean_update(OceanSurface& surface, const double time, const bool velocity);
+
+// Offsets of n points (u, v) of the rest plane, x, y and z per point with
+// y up, from the current maps. Normals, velocities, which need maps updated
+// with velocity, and the Jacobian are only sampled for the arrays given,
+// as in gerstner_displacement_n.
+void ocean_sample_n(const OceanSurface& surface, const int n, const float* u, const float* v,
+                    float* offset, float* normals = 0, float* velocity = 0, float* jacobian = 0);
+
+// Bounds of the vertical offset at any time. With many waves of random
+// phase the height is close to Gaussian, so the bound is six standard
+// deviations of it, and never more than every wave at its crest.
+void ocean_height_range(const OceanSurface& surface, float& low, float& high);
+
+// Wavelength of the most energetic waves of the spectrum.
+float ocean_peak_wavelength(const OceanParams& params);
+
+// Hash of everything the amplitudes depend on.
+WaterHash ocean_signature(const OceanParams& params);
+
+
+#endif /*FFT_OCEAN_H_*/
@@ -0,0 +1,270 @@
+//
+//  File: gerstnerWaves.cpp
+//
+//  Description:
+//		Sum of Gerstner waves.
+//
+
+#include <math.h>
+#include <vector>
+
+#include "waterSimd.h"
+
+#include "gerstnerWaves.h"
+
+
+static const double GERSTNER_PI = 3.14159265358979323846;
+static const double GERSTNER_GRAVITY = 9.81;
+
+// The shortest wave is this much shorter than the longest.
+static const double GERSTNER_RANGE = 16.0;
+
+
+GerstnerParams::GerstnerParams()
+    : time(0.0), direction(45.0), count(32), wavelength(40.0), amplitude(1.0),
+      steepness(0.6), spread(30.0), loopLength(0.0), seed(0)
+{}
+
+
+// Uniform in [0, 1), the same sequence on every platform.
+static double gerstner_random(unsigned int& state)
+{
+    state = state*1664525u + 1013904223u;
+    return (state >> 8)*(1.0/16777216.0);
+}
+
+void gerstner_build_waves(const GerstnerParams& params, GerstnerWaves& waves)
+{
+    int count = params.count > 0 ? params.count : 0;
+    waves.count = (count + 3) & ~3;
+    waves.kx.assign(waves.count, 0.0f);
+    waves.kz.assign(waves.count, 0.0f);
+    waves.omega.assign(waves.count, 0.0f);
+    waves.phase.assign(waves.count, 0.0f);
+    waves.amplitude.assign(waves.count, 0.0f);
+    waves.chopX.assign(waves.count, 0.0f);
+    waves.chopZ.assign(waves.count, 0.0f);
+
+    unsigned int state = 2654435761u ^ (unsigned int)params.seed;
+    for (int i = 0; i < count; i++) {
+        // wavelengths fall geometrically, each jittered within its step
+        double step = count > 1 ? (i + 0.5*gerstner_random(state))/(count - 1) : 0.0;
+        double wavelength = params.wavelength*pow(GERSTNER_RANGE, -step);
+        double angle = (params.direction + params.spread*(2*gerstner_random(state) - 1))*GERSTNER_PI/180;
+        double k = 2*GERSTNER_PI/wavelength;
+        double omega = sqrt(GERSTNER_GRAVITY*k);
+
+        // a whole number of periods per cycle in loop mode
+        if (params.loopLength > 0.0) {
+            double unit = 2*GERSTNER_PI/params.loopLength;
+            double periods = floor(omega/unit + 0.5);
+            omega = (periods < 1.0 ? 1.0 : periods)*unit;
+        }
+
+        double amplitude = params.amplitude*wavelength/params.wavelength;
+
+        // Q*k*A summed over the waves is the steepness, so the horizontal
+        // motion never folds the surface over
+        double chop = amplitude > 0.0 ? params.steepness/(k*count) : 0.0;
+
+        waves.kx[i] = k*cos(angle);
+        waves.kz[i] = k*sin(angle);
+        waves.omega[i] = omega;
+        waves.phase[i] = 2*GERSTNER_PI*gerstner_random(state);
+        waves.amplitude[i] = amplitude;
+        waves.chopX[i] = chop*cos(angle);
+        waves.chopZ[i] = chop*sin(angle);
+    }
+}
+
+
+#if defined(WATER_SSE2)
+// sin and cos of four angles. The angles are reduced by pi/2 in three
+// parts and the remainder in [-pi/4, pi/4] goes through the cephes
+// polynomials, good to about 1e-7 plus the float error of the angle.
+static inline void sincos4(const __m128 x, __m128& s, __m128& c)
+{
+    __m128i q = _mm_cvtps_epi32(_mm_mul_ps(x, _mm_set1_ps(0.63661977236758134f)));
+    __m128 fq = _mm_cvtepi32_ps(q);
+    __m128 r = _mm_sub_ps(x, _mm_mul_ps(fq, _mm_set1_ps(1.5703125f)));
+    r = _mm_sub_ps(r, _mm_mul_ps(fq, _mm_set1_ps(4.837512969970703125e-4f)));
+    r = _mm_sub_ps(r, _mm_mul_ps(fq, _mm_set1_ps(7.54978995489188216e-8f)));
+
+    __m128 z = _mm_mul_ps(r, r);
+    __m128 ps = _mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(-1.9515295891e-4f)), _mm_set1_ps(8.3321608736e-3f));
+    ps = _mm_add_ps(_mm_mul_ps(ps, z), _mm_set1_ps(-1.6666654611e-1f));
+    ps = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(ps, z), r), r);
+    __m128 pc = _mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(2.443315711809948e-5f)), _mm_set1_ps(-1.388731625493765e-3f));
+    pc = _mm_add_ps(_mm_mul_ps(pc, z), _mm_set1_ps(4.166664568298827e-2f));
+    pc = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(pc, z), z), _mm_sub_ps(_mm_set1_ps(1.0f), _mm_mul_ps(z, _mm_set1_ps(0.5f))));
+
+    // odd quadrants swap sin and cos, sin changes sign in quadrants 2 and
+    // 3 and cos in quadrants 1 and 2
+    __m128 swap = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(q, _mm_set1_epi32(1)), _mm_set1_epi32(1)));
+    __m128 sinSign = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(q, _mm_set1_epi32(2)), 30));
+    __m128 cosSign = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(_mm_add_epi32(q, _mm_set1_epi32(1)), _mm_set1_epi32(2)), 30));
+    s = _mm_or_ps(_mm_and_ps(swap, pc), _mm_andnot_ps(swap, ps));
+    c = _mm_or_ps(_mm_and_ps(swap, ps), _mm_andnot_ps(swap, pc));
+    s = _mm_xor_ps(s, sinSign);
+    c = _mm_xor_ps(c, cosSign);
+}
+
+static inline float sum4(const __m128 a)
+{
+    WATER_ALIGN16 float lanes[4];
+    _mm_store_ps(lanes, a);
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+#endif
+
+
+// Sums of one point over all waves, named after what they multiply.
+struct GerstnerSums {
+    float x, y, z;                  // offsets
+    float slopeX, slopeZ;           // height
+    float vx, vy, vz;               // velocity
+    float xx, zz, xz;               // horizontal motion
+};
+
+static void gerstner_point(const GerstnerWaves& waves, const float* phase, const float u, const float v,
+                           const bool derivatives, GerstnerSums& sums)
+{
+    int i = 0;
+#if defined(WATER_SSE2)
+    __m128 pu = _mm_set1_ps(u), pv = _mm_set1_ps(v);
+    __m128 x = _mm_setzero_ps(), y = x, z = x;
+    __m128 slopeX = x, slopeZ = x, vx = x, vy = x, vz = x, xx = x, zz = x, xz = x;
+    for ( ; i < waves.count; i += 4) {
+        __m128 kx = _mm_loadu_ps(&waves.kx[i]);
+        __m128 kz = _mm_loadu_ps(&waves.kz[i]);
+        __m128 theta = _mm_add_ps(_mm_add_ps(_mm_mul_ps(kx, pu), _mm_mul_ps(kz, pv)), _mm_loadu_ps(phase + i));
+        __m128 s, c;
+        sincos4(theta, s, c);
+
+        __m128 a = _mm_loadu_ps(&waves.amplitude[i]);
+        __m128 cx = _mm_loadu_ps(&waves.chopX[i]);
+        __m128 cz = _mm_loadu_ps(&waves.chopZ[i]);
+        x = _mm_add_ps(x, _mm_mul_ps(cx, c));
+        y = _mm_add_ps(y, _mm_mul_ps(a, s));
+        z = _mm_add_ps(z, _mm_mul_ps(cz, c));
+        if (!derivatives)
+            continue;
+
+        __m128 ac = _mm_mul_ps(a, c);
+        __m128 sxx = _mm_mul_ps(_mm_mul_ps(cx, kx), s);
+        __m128 szz = _mm_mul_ps(_mm_mul_ps(cz, kz), s);
+        __m128 omega = _mm_loadu_ps(&waves.omega[i]);
+        slopeX = _mm_add_ps(slopeX, _mm_mul_ps(kx, ac));
+        slopeZ = _mm_add_ps(slopeZ, _mm_mul_ps(kz, ac));
+        vx = _mm_add_ps(vx, _mm_mul_ps(_mm_mul_ps(cx, omega), s));
+        vy = _mm_sub_ps(vy, _mm_mul_ps(omega, ac));
+        vz = _mm_add_ps(vz, _mm_mul_ps(_mm_mul_ps(cz, omega), s));
+        xx = _mm_add_ps(xx, sxx);
+        zz = _mm_add_ps(zz, szz);
+        xz = _mm_add_ps(xz, _mm_mul_ps(_mm_mul_ps(cx, kz), s));
+    }
+    sums.x = sum4(x);
+    sums.y = sum4(y);
+    sums.z = sum4(z);
+    sums.slopeX = sum4(slopeX);
+    sums.slopeZ = sum4(slopeZ);
+    sums.vx = sum4(vx);
+    sums.vy = sum4(vy);
+    sums.vz = sum4(vz);
+    sums.xx = sum4(xx);
+    sums.zz = sum4(zz);
+    sums.xz = sum4(xz);
+#else
+    sums.x = sums.y = sums.z = 0.0f;
+    sums.slopeX = sums.slopeZ = 0.0f;
+    sums.vx = sums.vy = sums.vz = 0.0f;
+    sums.xx = sums.zz = sums.xz = 0.0f;
+    for ( ; i < waves.count; i++) {
+        float theta = waves.kx[i]*u + waves.kz[i]*v + phase[i];
+        float s = sinf(theta), c = cosf(theta);
+        sums.x += waves.chopX[i]*c;
+        sums.y += waves.amplitude[i]*s;
+        sums.z += waves.chopZ[i]*c;
+        if (!derivatives)
+            continue;
+
+        float ac = waves.amplitude[i]*c;
+        float sxx = waves.chopX[i]*waves.kx[i]*s;
+        float szz = waves.chopZ[i]*waves.kz[i]*s;
+        sums.slopeX += waves.kx[i]*ac;
+        sums.slopeZ += waves.kz[i]*ac;
+        sums.vx += waves.chopX[i]*waves.omega[i]*s;
+        sums.vy -= waves.omega[i]*ac;
+        sums.vz += waves.chopZ[i]*waves.omega[i]*s;
+        sums.xx += sxx;
+        sums.zz += szz;
+        sums.xz += waves.chopX[i]*waves.kz[i]*s;
+    }
+#endif
+}
+
+void gerstner_displacement_n(const GerstnerWaves& waves, const double time, const int n,
+                             const float* u, const float* v, float* offset,
+                             float* normals, float* velocity, float* jacobian)
+{
+    // phases at this time, wrapped in double so late times keep their precision
+    std::vector<float> phase(waves.count > 0 ? waves.count : 1);
+    for (int i = 0; i < waves.count; i++)
+        phase[i] = fmod(waves.phase[i] - waves.omega[i]*time, 2*GERSTNER_PI);
+
+    bool derivatives = normals || velocity || jacobian;
+
+    #pragma omp parallel for schedule(static, 256)
+    for (int p = 0; p < n; p++) {
+        GerstnerSums sums;
+        gerstner_point(waves, &phase[0], u[p], v[p], derivatives, sums);
+
+        offset[3*p] = sums.x;
+        offset[3*p + 1] = sums.y;
+        offset[3*p + 2] = sums.z;
+        // tangents of the displaced surface along u and v
+        float tux = 1.0f - sums.xx, tuy = sums.slopeX, tuz = -sums.xz;
+        float tvx = -sums.xz, tvy = sums.slopeZ, tvz = 1.0f - sums.zz;
+        if (normals) {
+            float nx = tvy*tuz - tvz*tuy;
+            float ny = tvz*tux - tvx*tuz;
+            float nz = tvx*tuy - tvy*tux;
+            float length = sqrtf(nx*nx + ny*ny + nz*nz);
+            normals[3*p] = nx/length;
+            normals[3*p + 1] = ny/length;
+            normals[3*p + 2] = nz/length;
+        }
+        if (velocity) {
+            velocity[3*p] = sums.vx;
+            velocity[3*p + 1] = sums.vy;
+            velocity[3*p + 2] = sums.vz;
+        }
+        if (jacobian)
+            jacobian[p] = tux*tvz - tuz*tvx;
+    }
+}
+
+
+WaterHash gerstner_signature(const GerstnerParams& params)
+{
+    // field by field, the padding of the struct is not initialized
+    WaterHash hash = WATER_HASH_BASIS;
+    hash = water_hash(hash, &params.direction, sizeof(params.direction));
+    hash = water_hash(hash, &params.count, sizeof(params.count));
+    hash = water_hash(hash, &params.wavelength, sizeof(params.wavelength));
+    hash = water_hash(hash, &params.amplitude, sizeof(params.amplitude));
+    hash = water_hash(hash, &params.steepness, sizeof(params.steepness));
+    hash = water_hash(hash, &params.spread, sizeof(params.spread));
+    hash = water_hash(hash, &params.loopLength, sizeof(params.loopLength));
+    hash = water_hash(hash, &params.seed, sizeof(params.seed));
+    return hash;
+}
+
+void gerstner_height_range(const GerstnerWaves& waves, float& low, float& high)
+{
+    double sum = 0.0;
+    for (int w = 0; w < waves.count; w++)
+        sum += waves.amplitude[w];
+    low = (float)-sum;
+    high = (float)sum;
+}
@@ -0,0 +1,76 @@
+//
+//  File: gerstnerWaves.h
+//
+//  Description:
+//		Sum of Gerstner waves, an alternative to the noise layers with
+//		sharp trochoidal crests. Every wave moves the points of the
+//		surface on a circle: a point (x, z) of the rest plane goes to
+//
+//			x + sum Q*A*dx*cos(theta), sum A*sin(theta), z + sum Q*A*dz*cos(theta)
+//
+//			theta = k*(dx*x + dz*z) - omega*t + phase
+//
+//		with the deep water dispersion omega = sqrt(g*k). The steepness Q
+//		sharpens the crests and is split between the waves so their sum
+//		never folds the surface over.
+//
+//		The waves are kept in structure-of-arrays form, padded to a
+//		multiple of four, and every point sums them four at a time with
+//		SSE2 when available.
+//
+
+#ifndef GERSTNER_WAVES_H_
+#define GERSTNER_WAVES_H_
+
+#include <vector>
+
+#include "waterHash.h"
+
+
+// Attribute values of the proWater node that the waves depend on.
+struct GerstnerParams {
+    double time;
+    double direction;       // dominant wind direction in degrees
+    int count;              // number of waves
+    double wavelength;      // of the longest wave
+    double amplitude;       // of the longest wave, shorter ones scale with their length
+    double steepness;       // 0 gives sine waves, 1 the sharpest crests that do not fold
+    double spread;          // largest deviation of a wave from the wind in degrees
+    double loopLength;      // snap the frequencies to repeat after this long, 0 disables it
+    int seed;
+
+    GerstnerParams();
+};
+
+// The wave set, one entry per wave. Padding waves have zero amplitude.
+struct GerstnerWaves {
+    int count;                          // multiple of 4
+    std::vector<float> kx, kz;          // wave vector
+    std::vector<float> omega;           // angular frequency
+    std::vector<float> phase;           // at time 0
+    std::vector<float> amplitude;
+    std::vector<float> chopX, chopZ;    // Q*A*dx and Q*A*dz
+
+    GerstnerWaves() : count(0) {}
+};
+
+// Spreads params.count waves from the wind direction and the longest
+// wavelength down to 1/16 of it, jittered by the seed.
+void gerstner_build_waves(const GerstnerParams& params, GerstnerWaves& waves);
+
+// Offsets of n points (u, v) of the rest plane at time t, x, y and z per
+// point with y up. The unit normals and the velocities, also three per
+// point, and the Jacobian of the horizontal motion, which drops below 0
+// where the surface would fold, are only evaluated for the arrays given.
+void gerstner_displacement_n(const GerstnerWaves& waves, const double time, const int n,
+                             const float* u, const float* v, float* offset,
+                             float* normals = 0, float* velocity = 0, float* jacobian = 0);
+
+// Hash of everything except time the waves depend on.
+WaterHash gerstner_signature(const GerstnerParams& params);
+
+// Bounds of the vertical offset, every wave at its crest or trough.
+void gerstner_height_range(const GerstnerWaves& waves, float& low, float& high);
+
+
+#endif /*GERSTNER_WAVES_H_*/
@@ -0,0 +1,230 @@
+//
+//  File: meshNormals.cpp
+//
+//  Description:
+//		Normals and tangents from topology and of displaced grids.
+//
+
+#include <math.h>
+#include <vector>
+
+#include "waterEngine.h"
+#include "meshNormals.h"
+
+
+// Rows of a grid displaced together by one thread.
+static const int MESH_GRID_BAND = 16;
+
+
+bool mesh_build_topology(const int vertexCount, const int polygonCount, const int* polygonCounts,
+                         const int* polygonConnects, MeshTopology& topology)
+{
+    topology = MeshTopology();
+    topology.vertexCount = vertexCount > 0 ? vertexCount : 0;
+    topology.polygonCount = polygonCount > 0 ? polygonCount : 0;
+    topology.polygonStarts.assign(topology.polygonCount + 1, 0);
+    topology.vertexStarts.assign(topology.vertexCount + 1, 0);
+
+    // the polygons, without the indices out of range
+    int at = 0;
+    for (int p = 0; p < topology.polygonCount; p++) {
+        if (polygonCounts[p] < 0)
+            return false;
+        for (int k = 0; k < polygonCounts[p]; k++, at++) {
+            int vertex = polygonConnects[at];
+            if (vertex >= 0 && vertex < topology.vertexCount) {
+                topology.connects.push_back(vertex);
+                topology.vertexStarts[vertex + 1]++;
+            }
+        }
+        topology.polygonStarts[p + 1] = (int)topology.connects.size();
+    }
+
+    // counted, then the prefix sum and the fill in polygon order
+    for (int i = 0; i < topology.vertexCount; i++)
+        topology.vertexStarts[i + 1] += topology.vertexStarts[i];
+    topology.vertexPolygons.resize(topology.connects.size());
+    std::vector<int> fill(topology.vertexStarts.begin(), topology.vertexStarts.end() - 1);
+    for (int p = 0; p < topology.polygonCount; p++)
+        for (int k = topology.polygonStarts[p]; k < topology.polygonStarts[p + 1]; k++)
+            topology.vertexPolygons[fill[topology.connects[k]]++] = p;
+    return true;
+}
+
+static void normalize_or(float* x, const float fx, const float fy, const float fz)
+{
+    float length = sqrtf(x[0]*x[0] + x[1]*x[1] + x[2]*x[2]);
+    if (length > 0.0f) {
+        x[0] /= length;
+        x[1] /= length;
+        x[2] /= length;
+    }
+    else {
+        x[0] = fx;
+        x[1] = fy;
+        x[2] = fz;
+    }
+}
+
+void mesh_normals(const MeshTopology& topology, const float* points, float* normals)
+{
+    // Newell's normal of every polygon, twice its area long
+    std::vector<float> polygonNormals(3*(size_t)topology.polygonCount);
+
+    #pragma omp parallel for schedule(static)
+    for (int p = 0; p < topology.polygonCount; p++) {
+        float n[3] = { 0.0f, 0.0f, 0.0f };
+        int first = topology.polygonStarts[p], last = topology.polygonStarts[p + 1];
+        for (int k = first; k < last; k++) {
+            const float* a = points + 3*topology.connects[k];
+            const float* b = points + 3*topology.connects[k + 1 < last ? k + 1 : first];
+            n[0] += (a[1] - b[1])*(a[2] + b[2]);
+            n[1] += (a[2] - b[2])*(a[0] + b[0]);
+            n[2] += (a[0] - b[0])*(a[1] + b[1]);
+        }
+        float* out = &polygonNormals[3*(size_t)p];
+        out[0] = n[0];
+        out[1] = n[1];
+        out[2] = n[2];
+    }
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < topology.vertexCount; i++) {
+        float* n = normals + 3*i;
+        n[0] = n[1] = n[2] = 0.0f;
+        for (int k = topology.vertexStarts[i]; k < topology.vertexStarts[i + 1]; k++) {
+            const float* m = &polygonNormals[3*(size_t)topology.vertexPolygons[k]];
+            n[0] += m[0];
+            n[1] += m[1];
+            n[2] += m[2];
+        }
+        normalize_or(n, 0.0f, 1.0f, 0.0f);
+    }
+}
+
+void mesh_tangents(const MeshTopology& topology, const float* points, const float* uvs,
+                   const float* normals, float* tangents)
+{
+    // derivatives of the position along s and t per polygon, summed over
+    // a fan of triangles and weighted by their area in the texture
+    std::vector<float> polygonTangents(6*(size_t)topology.polygonCount);
+
+    #pragma omp parallel for schedule(static)
+    for (int p = 0; p < topology.polygonCount; p++) {
+        float* out = &polygonTangents[6*(size_t)p];
+        for (int c = 0; c < 6; c++)
+            out[c] = 0.0f;
+        int first = topology.polygonStarts[p], last = topology.polygonStarts[p + 1];
+        if (last - first < 3)
+            continue;
+        int i0 = topology.connects[first];
+        const float* p0 = points + 3*i0;
+        float s0 = uvs ? uvs[2*i0] : p0[0], t0 = uvs ? uvs[2*i0 + 1] : p0[2];
+        for (int k = first + 1; k + 1 < last; k++) {
+            int i1 = topology.connects[k], i2 = topology.connects[k + 1];
+            const float* p1 = points + 3*i1;
+            const float* p2 = points + 3*i2;
+            float s1 = (uvs ? uvs[2*i1] : p1[0]) - s0, t1 = (uvs ? uvs[2*i1 + 1] : p1[2]) - t0;
+            float s2 = (uvs ? uvs[2*i2] : p2[0]) - s0, t2 = (uvs ? uvs[2*i2 + 1] : p2[2]) - t0;
+            float det = s1*t2 - s2*t1;
+            if (det == 0.0f)
+                continue;
+            // dP/ds and dP/dt times det, the sign keeps mirrored
+            // triangles from cancelling the others
+            float sign = det > 0.0f ? 1.0f : -1.0f;
+            for (int c = 0; c < 3; c++) {
+                float e1 = p1[c] - p0[c], e2 = p2[c] - p0[c];
+                out[c] += (e1*t2 - e2*t1)*sign;
+                out[3 + c] += (e2*s1 - e1*s2)*sign;
+            }
+        }
+    }
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < topology.vertexCount; i++) {
+        float t[3] = { 0.0f, 0.0f, 0.0f }, b[3] = { 0.0f, 0.0f, 0.0f };
+        for (int k = topology.vertexStarts[i]; k < topology.vertexStarts[i + 1]; k++) {
+            const float* m = &polygonTangents[6*(size_t)topology.vertexPolygons[k]];
+            for (int c = 0; c < 3; c++) {
+                t[c] += m[c];
+                b[c] += m[3 + c];
+            }
+        }
+        const float* n = normals + 3*i;
+        float tn = t[0]*n[0] + t[1]*n[1] + t[2]*n[2];
+        float* out = tangents + 4*i;
+        out[0] = t[0] - n[0]*tn;
+        out[1] = t[1] - n[1]*tn;
+        out[2] = t[2] - n[2]*tn;
+        normalize_or(out, 1.0f, 0.0f, 0.0f);
+        float handedness = (n[1]*out[2] - n[2]*out[1])*b[0] + (n[2]*out[0] - n[0]*out[2])*b[1]
+                         + (n[0]*out[1] - n[1]*out[0])*b[2];
+        out[3] = handedness < 0.0f ? -1.0f : 1.0f;
+    }
+}
+
+void mesh_grid_displace(const WaterPlan& plan, const int columns, const int rows,
+                        const float u0, const float v0, const float du, const float dv,
+                        float* points, float* normals, float* tangents)
+{
+    if (columns < 1 || rows < 1)
+        return;
+    int bands = (rows + MESH_GRID_BAND - 1)/MESH_GRID_BAND;
+
+    // the engine runs serially within a band, one band per thread
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int band = 0; band < bands; band++) {
+        int j0 = band*MESH_GRID_BAND;
+        int j1 = j0 + MESH_GRID_BAND < rows ? j0 + MESH_GRID_BAND : rows;
+        bool halo = normals || tangents;
+        int r0 = halo && j0 > 0 ? j0 - 1 : j0;
+        int r1 = halo && j1 < rows ? j1 + 1 : j1;
+
+        int n = (r1 - r0)*columns;
+        std::vector<float> u(n), v(n), disp(n);
+        for (int j = r0; j < r1; j++)
+            for (int i = 0; i < columns; i++) {
+                u[(j - r0)*columns + i] = u0 + i*du;
+                v[(j - r0)*columns + i] = v0 + j*dv;
+            }
+        water_displacement_n(plan, n, &u[0], &v[0], &disp[0]);
+
+        for (int j = j0; j < j1; j++) {
+            const float* row = &disp[(j - r0)*columns];
+            for (int i = 0; i < columns; i++) {
+                size_t at = (size_t)j*columns + i;
+                points[3*at] = u0 + i*du;
+                points[3*at + 1] = row[i];
+                points[3*at + 2] = v0 + j*dv;
+                if (!halo)
+                    continue;
+
+                // slopes of the mesh, one sided at the borders
+                int i0 = i > 0 ? i - 1 : i, i1 = i + 1 < columns ? i + 1 : i;
+                int k0 = j > r0 ? j - 1 : j, k1 = j + 1 < r1 ? j + 1 : j;
+                float slopeU = i1 > i0 ? (row[i1] - row[i0])/((i1 - i0)*du) : 0.0f;
+                float slopeV = k1 > k0 ? (disp[(k1 - r0)*columns + i] - disp[(k0 - r0)*columns + i])/((k1 - k0)*dv) : 0.0f;
+
+                float m[3] = { -slopeU, 1.0f, -slopeV };
+                normalize_or(m, 0.0f, 1.0f, 0.0f);
+                if (normals) {
+                    normals[3*at] = m[0];
+                    normals[3*at + 1] = m[1];
+                    normals[3*at + 2] = m[2];
+                }
+                if (tangents) {
+                    // (1, slopeU, 0) made orthogonal to the normal, the
+                    // bitangent along v is (0, slopeV, 1)
+                    float tn = m[0] + slopeU*m[1];
+                    float* out = tangents + 4*at;
+                    out[0] = 1.0f - m[0]*tn;
+                    out[1] = slopeU - m[1]*tn;
+                    out[2] = -m[2]*tn;
+                    normalize_or(out, 1.0f, 0.0f, 0.0f);
+                    float handedness = (m[2]*out[0] - m[0]*out[2])*slopeV + (m[0]*out[1] - m[1]*out[0]);
+                    out[3] = handedness < 0.0f ? -1.0f : 1.0f;
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,65 @@
+//
+//  File: meshNormals.h
+//
+//  Description:
+//		Normals and tangents of displaced meshes rebuilt from their
+//		topology, for the tools that export meshes without Maya. Instead
+//		of every face adding into its vertices, which needs atomics or
+//		locks once the faces are split over threads, the vertex to face
+//		adjacency is built once in compressed rows. Each pass then
+//		computes the faces in parallel and every vertex gathers its own
+//		faces in parallel, writing nothing but its own result.
+//
+//		Regular grids need no adjacency at all. For them displacement,
+//		normals and tangents are fused into one pass over bands of rows,
+//		each band displacing one extra row above and below for the
+//		central differences.
+//
+
+#ifndef MESH_NORMALS_H_
+#define MESH_NORMALS_H_
+
+#include <vector>
+
+#include "waterEngine.h"
+
+
+// Polygons, triangles, quads or any other, and the polygons of each vertex.
+struct MeshTopology {
+    int vertexCount;
+    int polygonCount;
+    std::vector<int> polygonStarts;     // polygonCount + 1 offsets into connects
+    std::vector<int> connects;          // vertices of the polygons
+    std::vector<int> vertexStarts;      // vertexCount + 1 offsets into vertexPolygons
+    std::vector<int> vertexPolygons;    // polygons of the vertices, in order
+
+    MeshTopology() : vertexCount(0), polygonCount(0) {}
+};
+
+// Builds the topology from the vertex counts of the polygons and their
+// vertex indices, as MFnMesh::getVertices() gives them. Indices out of
+// range are dropped. Returns false if the counts and connects disagree.
+bool mesh_build_topology(const int vertexCount, const int polygonCount, const int* polygonCounts,
+                         const int* polygonConnects, MeshTopology& topology);
+
+// Area weighted unit normals, x, y and z per vertex, from the points, x, y
+// and z per vertex. Vertices of no polygon get (0, 1, 0).
+void mesh_normals(const MeshTopology& topology, const float* points, float* normals);
+
+// Unit tangents along increasing s of the texture coordinates, s and t per
+// vertex or the rest plane (x, z) when uvs is 0, made orthogonal to the
+// normals. Four values per vertex, the fourth being the handedness +1 or
+// -1 of the bitangent cross(normal, tangent).
+void mesh_tangents(const MeshTopology& topology, const float* points, const float* uvs,
+                   const float* normals, float* tangents);
+
+// Displaces a grid of columns*rows vertices, rows along u, at
+// (u0 + i*du, v0 + j*dv) of the rest plane and writes the points, and for
+// the arrays given the normals and tangents along u, as mesh_normals() and
+// mesh_tangents() would for its quads but from central differences.
+void mesh_grid_displace(const WaterPlan& plan, const int columns, const int rows,
+                        const float u0, const float v0, const float du, const float dv,
+                        float* points, float* normals = 0, float* tangents = 0);
+
+
+#endif /*MESH_NORMALS_H_*/
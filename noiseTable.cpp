@@ -0,0 +1,146 @@
+//
+//  File: noiseTable.cpp
+//
+//  Description:
+//		Wavetable of 3D simplex noise.
+//
+
+#include <math.h>
+#include <vector>
+
+#include "waterSimd.h"
+
+#include "simplexNoise.h"
+#include "noiseTable.h"
+
+
+static const int NOISE_TABLE_MASK = NOISE_TABLE_SIZE - 1;
+static const float NOISE_TABLE_RATE = (float)NOISE_TABLE_SIZE/NOISE_TABLE_PERIOD;
+static const float NOISE_TABLE_UNIT = 1.0f/32767;
+
+static std::vector<short> noiseTable;
+
+
+void noise_table_init()
+{
+    #pragma omp critical(noise_table_init)
+    {
+        if (noiseTable.empty()) {
+            std::vector<short> table(NOISE_TABLE_SIZE*NOISE_TABLE_SIZE*NOISE_TABLE_SIZE);
+
+            #pragma omp parallel for
+            for (int k = 0; k < NOISE_TABLE_SIZE; k++)
+                for (int j = 0; j < NOISE_TABLE_SIZE; j++)
+                    for (int i = 0; i < NOISE_TABLE_SIZE; i++) {
+                        float n = raw_noise_3d_periodic(i/NOISE_TABLE_RATE, j/NOISE_TABLE_RATE, k/NOISE_TABLE_RATE,
+                                                        NOISE_TABLE_PERIOD, NOISE_TABLE_PERIOD, NOISE_TABLE_PERIOD);
+                        table[(k*NOISE_TABLE_SIZE + j)*NOISE_TABLE_SIZE + i] = (short)floorf(n*32767 + 0.5f);
+                    }
+
+            noiseTable.swap(table);
+        }
+    }
+}
+
+
+float table_noise_3d(const float x, const float y, const float z)
+{
+    float fx = x*NOISE_TABLE_RATE;
+    float fy = y*NOISE_TABLE_RATE;
+    float fz = z*NOISE_TABLE_RATE;
+    int i = fastfloor(fx);
+    int j = fastfloor(fy);
+    int k = fastfloor(fz);
+    fx -= i;
+    fy -= j;
+    fz -= k;
+
+    int i0 = i & NOISE_TABLE_MASK;
+    int i1 = (i + 1) & NOISE_TABLE_MASK;
+    int j0 = (j & NOISE_TABLE_MASK)*NOISE_TABLE_SIZE;
+    int j1 = ((j + 1) & NOISE_TABLE_MASK)*NOISE_TABLE_SIZE;
+    int k0 = (k & NOISE_TABLE_MASK)*NOISE_TABLE_SIZE*NOISE_TABLE_SIZE;
+    int k1 = ((k + 1) & NOISE_TABLE_MASK)*NOISE_TABLE_SIZE*NOISE_TABLE_SIZE;
+
+    const short* t = &noiseTable[0];
+    float c00 = t[k0+j0+i0] + (t[k0+j0+i1] - t[k0+j0+i0])*fx;
+    float c10 = t[k0+j1+i0] + (t[k0+j1+i1] - t[k0+j1+i0])*fx;
+    float c01 = t[k1+j0+i0] + (t[k1+j0+i1] - t[k1+j0+i0])*fx;
+    float c11 = t[k1+j1+i0] + (t[k1+j1+i1] - t[k1+j1+i0])*fx;
+    float c0 = c00 + (c10 - c00)*fy;
+    float c1 = c01 + (c11 - c01)*fy;
+    return (c0 + (c1 - c0)*fz)*NOISE_TABLE_UNIT;
+}
+
+
+#if defined(WATER_SSE2)
+static inline __m128 lerp4(const __m128 a, const __m128 b, const __m128 t)
+{
+    return _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), t));
+}
+
+// Four lookups. Cell indices and weights are computed in SSE registers,
+// only the eight corner loads are done per lane.
+static void table_noise_3d_sse(const float* x, const float* y, const float* z, float* out)
+{
+    __m128 rate = _mm_set1_ps(NOISE_TABLE_RATE);
+    __m128 fx = _mm_mul_ps(_mm_loadu_ps(x), rate);
+    __m128 fy = _mm_mul_ps(_mm_loadu_ps(y), rate);
+    __m128 fz = _mm_mul_ps(_mm_loadu_ps(z), rate);
+
+    // fastfloor() as in raw_noise_4d_sse()
+    __m128i minusOne = _mm_set1_epi32(-1);
+    __m128i i = _mm_cvttps_epi32(fx);
+    __m128i j = _mm_cvttps_epi32(fy);
+    __m128i k = _mm_cvttps_epi32(fz);
+    i = _mm_add_epi32(i, _mm_andnot_si128(_mm_castps_si128(_mm_cmpgt_ps(fx, _mm_setzero_ps())), minusOne));
+    j = _mm_add_epi32(j, _mm_andnot_si128(_mm_castps_si128(_mm_cmpgt_ps(fy, _mm_setzero_ps())), minusOne));
+    k = _mm_add_epi32(k, _mm_andnot_si128(_mm_castps_si128(_mm_cmpgt_ps(fz, _mm_setzero_ps())), minusOne));
+    fx = _mm_sub_ps(fx, _mm_cvtepi32_ps(i));
+    fy = _mm_sub_ps(fy, _mm_cvtepi32_ps(j));
+    fz = _mm_sub_ps(fz, _mm_cvtepi32_ps(k));
+
+    __m128i mask = _mm_set1_epi32(NOISE_TABLE_MASK);
+    __m128i one = _mm_set1_epi32(1);
+    int i0[4], i1[4], j0[4], j1[4], k0[4], k1[4];
+    _mm_storeu_si128((__m128i*)i0, _mm_and_si128(i, mask));
+    _mm_storeu_si128((__m128i*)i1, _mm_and_si128(_mm_add_epi32(i, one), mask));
+    _mm_storeu_si128((__m128i*)j0, _mm_slli_epi32(_mm_and_si128(j, mask), NOISE_TABLE_BITS));
+    _mm_storeu_si128((__m128i*)j1, _mm_slli_epi32(_mm_and_si128(_mm_add_epi32(j, one), mask), NOISE_TABLE_BITS));
+    _mm_storeu_si128((__m128i*)k0, _mm_slli_epi32(_mm_and_si128(k, mask), 2*NOISE_TABLE_BITS));
+    _mm_storeu_si128((__m128i*)k1, _mm_slli_epi32(_mm_and_si128(_mm_add_epi32(k, one), mask), 2*NOISE_TABLE_BITS));
+
+    // corners as [corner][lane], corner bits are (k,j,i)
+    WATER_ALIGN16 float c[8][4];
+    const short* t = &noiseTable[0];
+    for (int lane = 0; lane < 4; lane++) {
+        c[0][lane] = t[k0[lane]+j0[lane]+i0[lane]];
+        c[1][lane] = t[k0[lane]+j0[lane]+i1[lane]];
+        c[2][lane] = t[k0[lane]+j1[lane]+i0[lane]];
+        c[3][lane] = t[k0[lane]+j1[lane]+i1[lane]];
+        c[4][lane] = t[k1[lane]+j0[lane]+i0[lane]];
+        c[5][lane] = t[k1[lane]+j0[lane]+i1[lane]];
+        c[6][lane] = t[k1[lane]+j1[lane]+i0[lane]];
+        c[7][lane] = t[k1[lane]+j1[lane]+i1[lane]];
+    }
+
+    __m128 c00 = lerp4(_mm_load_ps(c[0]), _mm_load_ps(c[1]), fx);
+    __m128 c10 = lerp4(_mm_load_ps(c[2]), _mm_load_ps(c[3]), fx);
+    __m128 c01 = lerp4(_mm_load_ps(c[4]), _mm_load_ps(c[5]), fx);
+    __m128 c11 = lerp4(_mm_load_ps(c[6]), _mm_load_ps(c[7]), fx);
+    __m128 n = lerp4(lerp4(c00, c10, fy), lerp4(c01, c11, fy), fz);
+    _mm_storeu_ps(out, _mm_mul_ps(n, _mm_set1_ps(NOISE_TABLE_UNIT)));
+}
+#endif
+
+
+void table_noise_3d_n(const int n, const float* x, const float* y, const float* z, float* out)
+{
+    int i = 0;
+#if defined(WATER_SSE2)
+    for ( ; i+4 <= n; i += 4)
+        table_noise_3d_sse(x+i, y+i, z+i, out+i);
+#endif
+    for ( ; i < n; i++)
+        out[i] = table_noise_3d(x[i], y[i], z[i]);
+}
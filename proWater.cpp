@@ -29,6 +29,8 @@
 #include <maya/MPxLocatorNode.h> 
 
 #include <maya/MFnNumericAttribute.h>
+#include <maya/MFnEnumAttribute.h>
+#include <maya/MFnTypedAttribute.h>
 #include <maya/MFnMatrixAttribute.h>
 #include <maya/MFnMatrixData.h>
 
@@ -44,12 +46,47 @@
 
 #include <maya/MPoint.h>
 #include <maya/MVector.h>
+#include <maya/MPointArray.h>
+#include <maya/MVectorArray.h>
 #include <maya/MMatrix.h>
 #include <maya/MFnMesh.h>
+#include <maya/MColor.h>
+#include <maya/MColorArray.h>
+#include <maya/MIntArray.h>
+#include <maya/MStringArray.h>
 
 #include <maya/MDagModifier.h>
+#include <maya/MDagPath.h>
+#include <maya/MFnGeometryFilter.h>
+#include <maya/MPxCommand.h>
+#include <maya/MSyntax.h>
+#include <maya/MArgDatabase.h>
+#include <maya/MSelectionList.h>
+#include <maya/MDoubleArray.h>
+#include <maya/MFnMeshData.h>
+#include <maya/MPlugArray.h>
+#include <maya/MFloatPointArray.h>
+#include <maya/MFloatArray.h>
+#include <maya/MFloatVectorArray.h>
+#include <maya/MObjectArray.h>
+#include <maya/MFnDoubleArrayData.h>
+#include <maya/MMutexLock.h>
+#include <maya/MGlobal.h>
 #include <simplexNoise.cpp>
+#include <noiseTable.cpp>
+#include <waterEngine.cpp>
+#include <gerstnerWaves.cpp>
+#include <fftOcean.cpp>
+#include <rippleSolver.cpp>
+#include <terrainGrid.cpp>
+#include <clipmapMesh.cpp>
+#include <meshNormals.cpp>
+#include <waterBake.cpp>
+#include <waterTexture.cpp>
+#include <vatExport.cpp>
 #include <complex>
+#include <vector>
+#include <map>
 
 
 class proWater : public MPxDeformerNode
@@ -63,6 +100,9 @@ public:
     
     
     MStatus compute(const MPlug& plug, MDataBlock& dataBlock);
+    
+    // flags the terrain grid for a rebuild when the terrain changes
+    virtual MStatus setDependentsDirty(const MPlug& plug, MPlugArray& plugArray);
 
 	// when the accessory is deleted, this node will clean itself up
 	//
@@ -88,8 +128,88 @@ public:
     static MObject frequency2;
     static MObject frequency3;
     static MObject dir;
+    static MObject loop;
+    static MObject loopLength;
+    static MObject cacheFrames;
+    static MObject cacheMemory;
+    static MObject tileSize;
+    static MObject noiseBasis;
+    static MObject coarseTolerance;
+    static MObject driftTolerance;
+    static MObject timeStep;
+    static MObject timeTolerance;
+    static MObject outputVelocity;
+    static MObject outputNormals;
+    static MObject outputFoam;
+    static MObject minDisplacement;
+    static MObject maxDisplacement;
+    static MObject waveEngine;
+    static MObject gerstnerCount;
+    static MObject gerstnerWavelength;
+    static MObject gerstnerAmplitude;
+    static MObject gerstnerSteepness;
+    static MObject gerstnerSpread;
+    static MObject gerstnerSeed;
+    static MObject oceanWindSpeed;
+    static MObject oceanSpectrum;
+    static MObject oceanFetch;
+    static MObject oceanAmplitude;
+    static MObject oceanChoppiness;
+    static MObject oceanTileSize;
+    static MObject oceanResolution;
+    static MObject oceanCascades;
+    static MObject oceanSeed;
+    static MObject ripples;
+    static MObject rippleResolution;
+    static MObject rippleSize;
+    static MObject rippleSpeed;
+    static MObject rippleDamping;
+    static MObject rippleStrength;
+    static MObject rippleFrameRate;
+    static MObject rippleCheckpoint;
+    static MObject rippleSources;
+    static MObject rippleSourceRadius;
+    static MObject terrainMesh;
+    static MObject terrainResolution;
+    static MObject shallowDepth;
+    static MObject waterSignature;
+    static MObject waterParams;
+
+    // Parameters of the height field as currently set on a proWater node.
+    // Fails with kNotImplemented when the node uses another wave engine.
+    static MStatus getParams(const MObject& node, WaterParams& params);
+    // The layers of the deformer the noise field leaves out, or "".
+    static MString getSkippedLayers(const MObject& node);
+    // The noise parameters besides the time and the wave engine as the
+    // array of waterParams, and back. unpackParams() leaves the defaults
+    // and returns false for an array of another length.
+    static void packParams(const WaterParams& params, const short engine, MDoubleArray& values);
+    static bool unpackParams(const MDoubleArray& values, WaterParams& params, short& engine);
 
 private:
+    void evaluate(const WaterParams& params, const WaterPlan& plan, unsigned int count, const float* u, const float* v,
+                  float* disp, float* velocity, float* gradient, float* crest);
+    MStatus getOceanParams(MDataBlock& dataBlock, OceanParams& params);
+    void evaluateWaves(short engine, double time, unsigned int count, const float* u, const float* v,
+                       float* offset, float* normals, float* velocity, float* jacobian);
+
+    WaterFrameCache frameCache;
+    WaterFrameCache velocityCache;
+    WaterFrameCache gradientCache;
+    WaterFrameCache crestCache;
+    WaterTileMap tileMap;
+    WaterCaches caches;
+    WaterTimeSampler timeSampler;
+    GerstnerWaves waves;
+    WaterHash wavesSignature;
+    OceanSurface ocean;
+    WaterHash oceanSignature;
+    std::map<unsigned int, RippleSolver> rippleSolvers;     // per outputGeom index
+    TerrainGrid terrain;
+    MMatrix terrainMatrix;      // world to object space the grid was built with
+    bool terrainDirty;
+    double snapWarnedTile;      // tileSize the snapping was last warned about
+    bool derivWarned;           // the derivative outputs bypassing the approximations
 };
 
 MTypeId     proWater::id( 0x8000c );
@@ -107,9 +227,56 @@ MObject proWater::frequency1;
 MObject proWater::frequency2;
 MObject proWater::frequency3;
 MObject proWater::dir;
+MObject proWater::loop;
+MObject proWater::loopLength;
+MObject proWater::cacheFrames;
+MObject proWater::cacheMemory;
+MObject proWater::tileSize;
+MObject proWater::noiseBasis;
+MObject proWater::coarseTolerance;
+MObject proWater::driftTolerance;
+MObject proWater::timeStep;
+MObject proWater::timeTolerance;
+MObject proWater::outputVelocity;
+MObject proWater::outputNormals;
+MObject proWater::outputFoam;
+MObject proWater::minDisplacement;
+MObject proWater::maxDisplacement;
+MObject proWater::waveEngine;
+MObject proWater::gerstnerCount;
+MObject proWater::gerstnerWavelength;
+MObject proWater::gerstnerAmplitude;
+MObject proWater::gerstnerSteepness;
+MObject proWater::gerstnerSpread;
+MObject proWater::gerstnerSeed;
+MObject proWater::oceanWindSpeed;
+MObject proWater::oceanSpectrum;
+MObject proWater::oceanFetch;
+MObject proWater::oceanAmplitude;
+MObject proWater::oceanChoppiness;
+MObject proWater::oceanTileSize;
+MObject proWater::oceanResolution;
+MObject proWater::oceanCascades;
+MObject proWater::oceanSeed;
+MObject proWater::ripples;
+MObject proWater::rippleResolution;
+MObject proWater::rippleSize;
+MObject proWater::rippleSpeed;
+MObject proWater::rippleDamping;
+MObject proWater::rippleStrength;
+MObject proWater::rippleFrameRate;
+MObject proWater::rippleCheckpoint;
+MObject proWater::rippleSources;
+MObject proWater::rippleSourceRadius;
+MObject proWater::terrainMesh;
+MObject proWater::terrainResolution;
+MObject proWater::shallowDepth;
+MObject proWater::waterSignature;
+MObject proWater::waterParams;
 
 
-proWater::proWater() {}
+proWater::proWater() : wavesSignature(0), oceanSignature(0), terrainDirty(true), snapWarnedTile(0.0),
+                       derivWarned(false) {}
 proWater::~proWater() {}
 
 void* proWater::creator()
@@ -211,6 +378,615 @@ MStatus proWater::initialize()
     attributeAffects(proWater::frequency2, proWater::outputGeom);
     //
     
+    //loop parameter, maps time onto a circle so the animation repeats
+    MFnNumericAttribute loopAttr;
+    loop = loopAttr.create("loop", "lp", MFnNumericData::kBoolean);
+    loopAttr.setDefault(false);
+    loopAttr.setKeyable(true);
+    addAttribute(loop);
+    attributeAffects(proWater::loop, proWater::outputGeom);
+    //
+    
+    //loopLength parameter, length of one cycle in time units
+    MFnNumericAttribute loopLengthAttr;
+    loopLength = loopLengthAttr.create("loopLength", "ll", MFnNumericData::kDouble);
+    loopLengthAttr.setDefault(100);
+    loopLengthAttr.setKeyable(true);
+    loopLengthAttr.setSoftMin(1);
+    loopLengthAttr.setSoftMax(1000);
+    loopLengthAttr.setMin(0.001);
+    addAttribute(loopLength);
+    attributeAffects(proWater::loopLength, proWater::outputGeom);
+    //
+    
+    //cacheFrames parameter, keeps evaluated frames around for playback.
+    //Off for the noise engine over a terrain
+    MFnNumericAttribute cacheAttr;
+    cacheFrames = cacheAttr.create("cacheFrames", "cf", MFnNumericData::kBoolean);
+    cacheAttr.setDefault(false);
+    addAttribute(cacheFrames);
+    attributeAffects(proWater::cacheFrames, proWater::outputGeom);
+    //
+    
+    //cacheMemory parameter, megabytes the cached frames may take together,
+    //the oldest frames are dropped beyond it
+    MFnNumericAttribute cacheMemoryAttr;
+    cacheMemory = cacheMemoryAttr.create("cacheMemory", "cmb", MFnNumericData::kInt);
+    cacheMemoryAttr.setDefault(1024);
+    cacheMemoryAttr.setSoftMin(16);
+    cacheMemoryAttr.setSoftMax(8192);
+    cacheMemoryAttr.setMin(1);
+    addAttribute(cacheMemory);
+    attributeAffects(proWater::cacheMemory, proWater::outputGeom);
+    //
+    
+    //tileSize parameter, makes the field periodic so repeated tiles share
+    //their evaluation. Frequencies are snapped to fit the tile, 0 disables it.
+    //A tile too small for a layer raises its frequency noticeably, which
+    //is warned about once per tileSize.
+    //Over a terrain the field stays periodic but every point is evaluated
+    MFnNumericAttribute tileAttr;
+    tileSize = tileAttr.create("tileSize", "ts", MFnNumericData::kDouble);
+    tileAttr.setDefault(0.0);
+    tileAttr.setKeyable(true);
+    tileAttr.setSoftMin(0.0);
+    tileAttr.setSoftMax(1000);
+    tileAttr.setMin(0.0);
+    addAttribute(tileSize);
+    attributeAffects(proWater::tileSize, proWater::outputGeom);
+    //
+    
+    //noiseBasis parameter, the wavetable is a faster approximation of the
+    //noise for previews and far-field water. wavetableDetail keeps the big
+    //waves analytic so the overall shape matches the final result
+    MFnEnumAttribute basisAttr;
+    noiseBasis = basisAttr.create("noiseBasis", "nb", 0);
+    basisAttr.addField("analytic", 0);
+    basisAttr.addField("wavetable", 1);
+    basisAttr.addField("wavetableDetail", 2);
+    basisAttr.setKeyable(true);
+    addAttribute(noiseBasis);
+    attributeAffects(proWater::noiseBasis, proWater::outputGeom);
+    //
+    
+    //coarseTolerance parameter, smooth layers are evaluated on a coarse
+    //lattice and interpolated when that errs by less than this. 0 disables it.
+    //Off over a terrain and with outputVelocity, outputNormals or outputFoam
+    MFnNumericAttribute coarseAttr;
+    coarseTolerance = coarseAttr.create("coarseTolerance", "ct", MFnNumericData::kDouble);
+    coarseAttr.setDefault(0.0);
+    coarseAttr.setKeyable(true);
+    coarseAttr.setSoftMin(0.0);
+    coarseAttr.setSoftMax(0.1);
+    coarseAttr.setMin(0.0);
+    addAttribute(coarseTolerance);
+    attributeAffects(proWater::coarseTolerance, proWater::outputGeom);
+    //
+    
+    //driftTolerance parameter, layers that only translate over time are
+    //cached and resampled each frame, layers that evolve slowly enough to
+    //err by less than this are cached too. 0 disables the cache. Off over
+    //a terrain and with outputVelocity, outputNormals or outputFoam
+    MFnNumericAttribute driftAttr;
+    driftTolerance = driftAttr.create("driftTolerance", "dt", MFnNumericData::kDouble);
+    driftAttr.setDefault(0.0);
+    driftAttr.setKeyable(true);
+    driftAttr.setSoftMin(0.0);
+    driftAttr.setSoftMax(0.1);
+    driftAttr.setMin(0.0);
+    addAttribute(driftTolerance);
+    attributeAffects(proWater::driftTolerance, proWater::outputGeom);
+    //
+    
+    //timeStep parameter, the height field is only evaluated at multiples
+    //of this and interpolated in between. 0 evaluates every time directly.
+    //Off over a terrain and with outputVelocity, outputNormals or outputFoam
+    MFnNumericAttribute stepAttr;
+    timeStep = stepAttr.create("timeStep", "tst", MFnNumericData::kDouble);
+    stepAttr.setDefault(0.0);
+    stepAttr.setKeyable(true);
+    stepAttr.setSoftMin(0.0);
+    stepAttr.setSoftMax(4);
+    stepAttr.setMin(0.0);
+    addAttribute(timeStep);
+    attributeAffects(proWater::timeStep, proWater::outputGeom);
+    //
+    
+    //timeTolerance parameter, time keys are added where interpolating
+    //between them errs by more than this
+    MFnNumericAttribute timeTolAttr;
+    timeTolerance = timeTolAttr.create("timeTolerance", "ttl", MFnNumericData::kDouble);
+    timeTolAttr.setDefault(0.01);
+    timeTolAttr.setKeyable(true);
+    timeTolAttr.setSoftMin(0.0);
+    timeTolAttr.setSoftMax(0.1);
+    timeTolAttr.setMin(0.0);
+    addAttribute(timeTolerance);
+    attributeAffects(proWater::timeTolerance, proWater::outputGeom);
+    //
+    
+    //outputVelocity parameter, writes the analytic velocity of every
+    //vertex, per unit of time, to the velocityPV color set. Like the other
+    //outputs it evaluates the field exactly, bypassing coarseTolerance,
+    //driftTolerance and timeStep
+    MFnNumericAttribute velocityAttr;
+    outputVelocity = velocityAttr.create("outputVelocity", "ov", MFnNumericData::kBoolean);
+    velocityAttr.setDefault(false);
+    velocityAttr.setKeyable(true);
+    addAttribute(outputVelocity);
+    attributeAffects(proWater::outputVelocity, proWater::outputGeom);
+    //
+    
+    //outputNormals parameter, sets the vertex normals from the analytic
+    //gradient of the height field so they need not be rebuilt from the
+    //topology. They are locked like user set normals. Exact like
+    //outputVelocity
+    MFnNumericAttribute normalsAttr;
+    outputNormals = normalsAttr.create("outputNormals", "onm", MFnNumericData::kBoolean);
+    normalsAttr.setDefault(false);
+    normalsAttr.setKeyable(true);
+    addAttribute(outputNormals);
+    attributeAffects(proWater::outputNormals, proWater::outputGeom);
+    //
+    
+    //outputFoam parameter, writes the wave height, the sharpness of the
+    //ridged crests and a foam mask from both to the heightPV, crestPV and
+    //foamPV color sets. Exact like outputVelocity
+    MFnNumericAttribute foamAttr;
+    outputFoam = foamAttr.create("outputFoam", "ofm", MFnNumericData::kBoolean);
+    foamAttr.setDefault(false);
+    foamAttr.setKeyable(true);
+    addAttribute(outputFoam);
+    attributeAffects(proWater::outputFoam, proWater::outputGeom);
+    //
+    
+    //minDisplacement and maxDisplacement outputs, the range the surface can
+    //move along the normals for any time, from the amplitudes alone. Pad
+    //the bounding box of the input with them for culling before evaluation.
+    //The ripples add the highest crest their simulation has reached so far
+    MFnNumericAttribute minDispAttr;
+    minDisplacement = minDispAttr.create("minDisplacement", "mnd", MFnNumericData::kDouble);
+    minDispAttr.setWritable(false);
+    minDispAttr.setStorable(false);
+    addAttribute(minDisplacement);
+    
+    MFnNumericAttribute maxDispAttr;
+    maxDisplacement = maxDispAttr.create("maxDisplacement", "mxd", MFnNumericData::kDouble);
+    maxDispAttr.setWritable(false);
+    maxDispAttr.setStorable(false);
+    addAttribute(maxDisplacement);
+    
+    attributeAffects(proWater::bigFreq, proWater::minDisplacement);
+    attributeAffects(proWater::amplitude1, proWater::minDisplacement);
+    attributeAffects(proWater::amplitude2, proWater::minDisplacement);
+    attributeAffects(proWater::bigFreq, proWater::maxDisplacement);
+    attributeAffects(proWater::amplitude1, proWater::maxDisplacement);
+    attributeAffects(proWater::amplitude2, proWater::maxDisplacement);
+    //
+    
+    //waveEngine parameter, the noise layers, a sum of Gerstner waves with
+    //sharp trochoidal crests that also move the points horizontally, or a
+    //spectral ocean made with FFTs for large open water. All of them blow
+    //along the direction parameter
+    MFnEnumAttribute engineAttr;
+    waveEngine = engineAttr.create("waveEngine", "we", 0);
+    engineAttr.addField("noise", 0);
+    engineAttr.addField("gerstner", 1);
+    engineAttr.addField("fft", 2);
+    engineAttr.setKeyable(true);
+    addAttribute(waveEngine);
+    attributeAffects(proWater::waveEngine, proWater::outputGeom);
+    //
+    
+    //gerstnerCount parameter, number of Gerstner waves
+    MFnNumericAttribute gCountAttr;
+    gerstnerCount = gCountAttr.create("gerstnerCount", "gwc", MFnNumericData::kInt);
+    gCountAttr.setDefault(32);
+    gCountAttr.setKeyable(true);
+    gCountAttr.setSoftMin(1);
+    gCountAttr.setSoftMax(128);
+    gCountAttr.setMin(1);
+    addAttribute(gerstnerCount);
+    attributeAffects(proWater::gerstnerCount, proWater::outputGeom);
+    //
+    
+    //gerstnerWavelength parameter, length of the longest wave, the others
+    //are down to 1/16 of it
+    MFnNumericAttribute gLengthAttr;
+    gerstnerWavelength = gLengthAttr.create("gerstnerWavelength", "gwl", MFnNumericData::kDouble);
+    gLengthAttr.setDefault(40);
+    gLengthAttr.setKeyable(true);
+    gLengthAttr.setSoftMin(1);
+    gLengthAttr.setSoftMax(1000);
+    gLengthAttr.setMin(0.001);
+    addAttribute(gerstnerWavelength);
+    attributeAffects(proWater::gerstnerWavelength, proWater::outputGeom);
+    //
+    
+    //gerstnerAmplitude parameter, amplitude of the longest wave, the others
+    //scale with their length
+    MFnNumericAttribute gAmpAttr;
+    gerstnerAmplitude = gAmpAttr.create("gerstnerAmplitude", "gam", MFnNumericData::kDouble);
+    gAmpAttr.setDefault(1);
+    gAmpAttr.setKeyable(true);
+    gAmpAttr.setSoftMin(0.0);
+    gAmpAttr.setSoftMax(10);
+    gAmpAttr.setMin(0.0);
+    addAttribute(gerstnerAmplitude);
+    attributeAffects(proWater::gerstnerAmplitude, proWater::outputGeom);
+    //
+    
+    //gerstnerSteepness parameter, 0 gives round sine waves, 1 the sharpest
+    //crests that do not fold over
+    MFnNumericAttribute gSteepAttr;
+    gerstnerSteepness = gSteepAttr.create("gerstnerSteepness", "gst", MFnNumericData::kDouble);
+    gSteepAttr.setDefault(0.6);
+    gSteepAttr.setKeyable(true);
+    gSteepAttr.setMin(0.0);
+    gSteepAttr.setMax(1.0);
+    addAttribute(gerstnerSteepness);
+    attributeAffects(proWater::gerstnerSteepness, proWater::outputGeom);
+    //
+    
+    //gerstnerSpread parameter, how far in degrees the waves turn away from
+    //the wind direction
+    MFnNumericAttribute gSpreadAttr;
+    gerstnerSpread = gSpreadAttr.create("gerstnerSpread", "gsp", MFnNumericData::kDouble);
+    gSpreadAttr.setDefault(30);
+    gSpreadAttr.setKeyable(true);
+    gSpreadAttr.setMin(0.0);
+    gSpreadAttr.setMax(180);
+    addAttribute(gerstnerSpread);
+    attributeAffects(proWater::gerstnerSpread, proWater::outputGeom);
+    //
+    
+    //gerstnerSeed parameter, picks another random wave set
+    MFnNumericAttribute gSeedAttr;
+    gerstnerSeed = gSeedAttr.create("gerstnerSeed", "gsd", MFnNumericData::kInt);
+    gSeedAttr.setDefault(0);
+    gSeedAttr.setKeyable(true);
+    addAttribute(gerstnerSeed);
+    attributeAffects(proWater::gerstnerSeed, proWater::outputGeom);
+    //
+    
+    attributeAffects(proWater::waveEngine, proWater::minDisplacement);
+    attributeAffects(proWater::waveEngine, proWater::maxDisplacement);
+    attributeAffects(proWater::gerstnerCount, proWater::minDisplacement);
+    attributeAffects(proWater::gerstnerCount, proWater::maxDisplacement);
+    attributeAffects(proWater::gerstnerWavelength, proWater::minDisplacement);
+    attributeAffects(proWater::gerstnerWavelength, proWater::maxDisplacement);
+    attributeAffects(proWater::gerstnerAmplitude, proWater::minDisplacement);
+    attributeAffects(proWater::gerstnerAmplitude, proWater::maxDisplacement);
+    attributeAffects(proWater::gerstnerSeed, proWater::minDisplacement);
+    attributeAffects(proWater::gerstnerSeed, proWater::maxDisplacement);
+    
+    //oceanWindSpeed parameter, wind speed of the fft engine in units per
+    //second, scene units are taken as meters
+    MFnNumericAttribute oWindAttr;
+    oceanWindSpeed = oWindAttr.create("oceanWindSpeed", "ows", MFnNumericData::kDouble);
+    oWindAttr.setDefault(10);
+    oWindAttr.setKeyable(true);
+    oWindAttr.setSoftMin(1);
+    oWindAttr.setSoftMax(30);
+    oWindAttr.setMin(0.1);
+    addAttribute(oceanWindSpeed);
+    attributeAffects(proWater::oceanWindSpeed, proWater::outputGeom);
+    //
+    
+    //oceanSpectrum parameter, Phillips for a fully developed sea or JONSWAP
+    //for a sea limited by the fetch
+    MFnEnumAttribute oSpectrumAttr;
+    oceanSpectrum = oSpectrumAttr.create("oceanSpectrum", "osp", 0);
+    oSpectrumAttr.addField("phillips", OCEAN_PHILLIPS);
+    oSpectrumAttr.addField("jonswap", OCEAN_JONSWAP);
+    oSpectrumAttr.setKeyable(true);
+    addAttribute(oceanSpectrum);
+    attributeAffects(proWater::oceanSpectrum, proWater::outputGeom);
+    //
+    
+    //oceanFetch parameter, distance in km the wind has blown over the
+    //water, only used by the JONSWAP spectrum
+    MFnNumericAttribute oFetchAttr;
+    oceanFetch = oFetchAttr.create("oceanFetch", "ofe", MFnNumericData::kDouble);
+    oFetchAttr.setDefault(100);
+    oFetchAttr.setKeyable(true);
+    oFetchAttr.setSoftMin(1);
+    oFetchAttr.setSoftMax(1000);
+    oFetchAttr.setMin(0.001);
+    addAttribute(oceanFetch);
+    attributeAffects(proWater::oceanFetch, proWater::outputGeom);
+    //
+    
+    //oceanAmplitude parameter, scales the heights of the spectrum
+    MFnNumericAttribute oAmpAttr;
+    oceanAmplitude = oAmpAttr.create("oceanAmplitude", "oam", MFnNumericData::kDouble);
+    oAmpAttr.setDefault(1);
+    oAmpAttr.setKeyable(true);
+    oAmpAttr.setSoftMin(0.0);
+    oAmpAttr.setSoftMax(5);
+    oAmpAttr.setMin(0.0);
+    addAttribute(oceanAmplitude);
+    attributeAffects(proWater::oceanAmplitude, proWater::outputGeom);
+    //
+    
+    //oceanChoppiness parameter, scales the horizontal motion that sharpens
+    //the crests, the surface folds over where the Jacobian drops below 0
+    MFnNumericAttribute oChopAttr;
+    oceanChoppiness = oChopAttr.create("oceanChoppiness", "och", MFnNumericData::kDouble);
+    oChopAttr.setDefault(1);
+    oChopAttr.setKeyable(true);
+    oChopAttr.setSoftMin(0.0);
+    oChopAttr.setSoftMax(2);
+    oChopAttr.setMin(0.0);
+    addAttribute(oceanChoppiness);
+    attributeAffects(proWater::oceanChoppiness, proWater::outputGeom);
+    //
+    
+    //oceanTileSize parameter, side of the largest tile, the others are
+    //about 5 times smaller each
+    MFnNumericAttribute oTileAttr;
+    oceanTileSize = oTileAttr.create("oceanTileSize", "ots", MFnNumericData::kDouble);
+    oTileAttr.setDefault(200);
+    oTileAttr.setKeyable(true);
+    oTileAttr.setSoftMin(10);
+    oTileAttr.setSoftMax(2000);
+    oTileAttr.setMin(0.01);
+    addAttribute(oceanTileSize);
+    attributeAffects(proWater::oceanTileSize, proWater::outputGeom);
+    //
+    
+    //oceanResolution parameter, samples along a tile side, rounded to a
+    //power of two
+    MFnNumericAttribute oResAttr;
+    oceanResolution = oResAttr.create("oceanResolution", "ors", MFnNumericData::kInt);
+    oResAttr.setDefault(256);
+    oResAttr.setSoftMin(32);
+    oResAttr.setSoftMax(1024);
+    oResAttr.setMin(16);
+    oResAttr.setMax(2048);
+    addAttribute(oceanResolution);
+    attributeAffects(proWater::oceanResolution, proWater::outputGeom);
+    //
+    
+    //oceanCascades parameter, number of tiles, each covering a band of the
+    //spectrum, more of them hide the repetition of the largest one
+    MFnNumericAttribute oCascadeAttr;
+    oceanCascades = oCascadeAttr.create("oceanCascades", "oca", MFnNumericData::kInt);
+    oCascadeAttr.setDefault(2);
+    oCascadeAttr.setMin(1);
+    oCascadeAttr.setMax(4);
+    addAttribute(oceanCascades);
+    attributeAffects(proWater::oceanCascades, proWater::outputGeom);
+    //
+    
+    //oceanSeed parameter, picks another random sea
+    MFnNumericAttribute oSeedAttr;
+    oceanSeed = oSeedAttr.create("oceanSeed", "osd", MFnNumericData::kInt);
+    oSeedAttr.setDefault(0);
+    oSeedAttr.setKeyable(true);
+    addAttribute(oceanSeed);
+    attributeAffects(proWater::oceanSeed, proWater::outputGeom);
+    //
+    
+    attributeAffects(proWater::dir, proWater::minDisplacement);
+    attributeAffects(proWater::dir, proWater::maxDisplacement);
+    attributeAffects(proWater::oceanWindSpeed, proWater::minDisplacement);
+    attributeAffects(proWater::oceanWindSpeed, proWater::maxDisplacement);
+    attributeAffects(proWater::oceanSpectrum, proWater::minDisplacement);
+    attributeAffects(proWater::oceanSpectrum, proWater::maxDisplacement);
+    attributeAffects(proWater::oceanFetch, proWater::minDisplacement);
+    attributeAffects(proWater::oceanFetch, proWater::maxDisplacement);
+    attributeAffects(proWater::oceanAmplitude, proWater::minDisplacement);
+    attributeAffects(proWater::oceanAmplitude, proWater::maxDisplacement);
+    attributeAffects(proWater::oceanTileSize, proWater::minDisplacement);
+    attributeAffects(proWater::oceanTileSize, proWater::maxDisplacement);
+    attributeAffects(proWater::oceanResolution, proWater::minDisplacement);
+    attributeAffects(proWater::oceanResolution, proWater::maxDisplacement);
+    attributeAffects(proWater::oceanCascades, proWater::minDisplacement);
+    attributeAffects(proWater::oceanCascades, proWater::maxDisplacement);
+    attributeAffects(proWater::oceanSeed, proWater::minDisplacement);
+    attributeAffects(proWater::oceanSeed, proWater::maxDisplacement);
+    
+    //ripples parameter, adds the wakes of the ripple sources on top of the
+    //waves of the engine
+    MFnNumericAttribute rippleAttr;
+    ripples = rippleAttr.create("ripples", "rpl", MFnNumericData::kBoolean);
+    rippleAttr.setDefault(false);
+    rippleAttr.setKeyable(true);
+    addAttribute(ripples);
+    attributeAffects(proWater::ripples, proWater::outputGeom);
+    //
+    
+    //rippleResolution parameter, cells along a side of the ripple grid
+    MFnNumericAttribute rResAttr;
+    rippleResolution = rResAttr.create("rippleResolution", "rrs", MFnNumericData::kInt);
+    rResAttr.setDefault(256);
+    rResAttr.setSoftMin(64);
+    rResAttr.setSoftMax(1024);
+    rResAttr.setMin(8);
+    rResAttr.setMax(4096);
+    addAttribute(rippleResolution);
+    attributeAffects(proWater::rippleResolution, proWater::outputGeom);
+    //
+    
+    //rippleSize parameter, side of the ripple grid, centered on the origin
+    //of the deformed object
+    MFnNumericAttribute rSizeAttr;
+    rippleSize = rSizeAttr.create("rippleSize", "rsz", MFnNumericData::kDouble);
+    rSizeAttr.setDefault(100);
+    rSizeAttr.setKeyable(true);
+    rSizeAttr.setSoftMin(1);
+    rSizeAttr.setSoftMax(1000);
+    rSizeAttr.setMin(0.01);
+    addAttribute(rippleSize);
+    attributeAffects(proWater::rippleSize, proWater::outputGeom);
+    //
+    
+    //rippleSpeed parameter, speed of the ripples in units per second
+    MFnNumericAttribute rSpeedAttr;
+    rippleSpeed = rSpeedAttr.create("rippleSpeed", "rsp", MFnNumericData::kDouble);
+    rSpeedAttr.setDefault(5);
+    rSpeedAttr.setKeyable(true);
+    rSpeedAttr.setSoftMin(0.1);
+    rSpeedAttr.setSoftMax(50);
+    rSpeedAttr.setMin(0.001);
+    addAttribute(rippleSpeed);
+    attributeAffects(proWater::rippleSpeed, proWater::outputGeom);
+    //
+    
+    //rippleDamping parameter, how fast the ripples die out, per second
+    MFnNumericAttribute rDampAttr;
+    rippleDamping = rDampAttr.create("rippleDamping", "rdm", MFnNumericData::kDouble);
+    rDampAttr.setDefault(0.5);
+    rDampAttr.setKeyable(true);
+    rDampAttr.setSoftMin(0.0);
+    rDampAttr.setSoftMax(5);
+    rDampAttr.setMin(0.0);
+    addAttribute(rippleDamping);
+    attributeAffects(proWater::rippleDamping, proWater::outputGeom);
+    //
+    
+    //rippleStrength parameter, how hard the sources push the water
+    MFnNumericAttribute rStrengthAttr;
+    rippleStrength = rStrengthAttr.create("rippleStrength", "rst", MFnNumericData::kDouble);
+    rStrengthAttr.setDefault(2);
+    rStrengthAttr.setKeyable(true);
+    rStrengthAttr.setSoftMin(0.0);
+    rStrengthAttr.setSoftMax(20);
+    addAttribute(rippleStrength);
+    attributeAffects(proWater::rippleStrength, proWater::outputGeom);
+    //
+    
+    //rippleFrameRate parameter, frames per second of the simulation, the
+    //time parameter is in seconds
+    MFnNumericAttribute rRateAttr;
+    rippleFrameRate = rRateAttr.create("rippleFrameRate", "rfr", MFnNumericData::kDouble);
+    rRateAttr.setDefault(24);
+    rRateAttr.setSoftMin(1);
+    rRateAttr.setSoftMax(120);
+    rRateAttr.setMin(0.01);
+    addAttribute(rippleFrameRate);
+    attributeAffects(proWater::rippleFrameRate, proWater::outputGeom);
+    //
+    
+    //rippleCheckpoint parameter, frames between the saved states scrubbing
+    //backwards restarts from
+    MFnNumericAttribute rCheckAttr;
+    rippleCheckpoint = rCheckAttr.create("rippleCheckpoint", "rci", MFnNumericData::kInt);
+    rCheckAttr.setDefault(10);
+    rCheckAttr.setSoftMin(1);
+    rCheckAttr.setSoftMax(100);
+    rCheckAttr.setMin(1);
+    addAttribute(rippleCheckpoint);
+    attributeAffects(proWater::rippleCheckpoint, proWater::outputGeom);
+    //
+    
+    //rippleSources parameter, world matrices of the objects making ripples,
+    //connect the worldMatrix of a mesh or a locator. Each one is a sphere
+    //around its pivot scaled by its x axis
+    MFnMatrixAttribute rSourceAttr;
+    rippleSources = rSourceAttr.create("rippleSources", "rsr");
+    rSourceAttr.setArray(true);
+    rSourceAttr.setStorable(false);
+    rSourceAttr.setConnectable(true);
+    addAttribute(rippleSources);
+    attributeAffects(proWater::rippleSources, proWater::outputGeom);
+    //
+    
+    //rippleSourceRadius parameter, radius of the sources at scale 1
+    MFnNumericAttribute rRadiusAttr;
+    rippleSourceRadius = rRadiusAttr.create("rippleSourceRadius", "rsrd", MFnNumericData::kDouble);
+    rRadiusAttr.setDefault(1);
+    rRadiusAttr.setKeyable(true);
+    rRadiusAttr.setSoftMin(0.01);
+    rRadiusAttr.setSoftMax(10);
+    rRadiusAttr.setMin(0.0);
+    addAttribute(rippleSourceRadius);
+    attributeAffects(proWater::rippleSourceRadius, proWater::outputGeom);
+    //
+    
+    MObject rippleInputs[] = { ripples, rippleResolution, rippleSize, rippleSpeed, rippleDamping,
+                               rippleStrength, rippleFrameRate, rippleCheckpoint, rippleSources,
+                               rippleSourceRadius, time };
+    for (unsigned int i = 0; i < sizeof(rippleInputs)/sizeof(rippleInputs[0]); i++) {
+        attributeAffects(rippleInputs[i], proWater::minDisplacement);
+        attributeAffects(rippleInputs[i], proWater::maxDisplacement);
+    }
+    
+    //terrainMesh parameter, world space mesh of the ground under the
+    //water, the waves shrink where it gets shallow. The noise engine then
+    //evaluates every point directly from its depth, so cacheFrames, the
+    //tile sharing of tileSize, timeStep, coarseTolerance and driftTolerance
+    //have no effect while it is connected
+    MFnTypedAttribute terrainAttr;
+    terrainMesh = terrainAttr.create("terrainMesh", "tm", MFnData::kMesh);
+    terrainAttr.setStorable(false);
+    terrainAttr.setConnectable(true);
+    addAttribute(terrainMesh);
+    attributeAffects(proWater::terrainMesh, proWater::outputGeom);
+    //
+    
+    //terrainResolution parameter, cells of the terrain height grid along
+    //the longer side of the terrain
+    MFnNumericAttribute tResAttr;
+    terrainResolution = tResAttr.create("terrainResolution", "trs", MFnNumericData::kInt);
+    tResAttr.setDefault(512);
+    tResAttr.setSoftMin(64);
+    tResAttr.setSoftMax(2048);
+    tResAttr.setMin(1);
+    tResAttr.setMax(8192);
+    addAttribute(terrainResolution);
+    attributeAffects(proWater::terrainResolution, proWater::outputGeom);
+    //
+    
+    //shallowDepth parameter, water at most this deep over the terrain is
+    //left flat without evaluating the waves
+    MFnNumericAttribute shallowAttr;
+    shallowDepth = shallowAttr.create("shallowDepth", "sdp", MFnNumericData::kDouble);
+    shallowAttr.setDefault(0.1);
+    shallowAttr.setKeyable(true);
+    shallowAttr.setSoftMin(0.0);
+    shallowAttr.setSoftMax(5);
+    addAttribute(shallowDepth);
+    attributeAffects(proWater::shallowDepth, proWater::outputGeom);
+    //
+    
+    //waterSignature, hash of the noise parameters besides the time and of
+    //the wave engine, to tell when the field changed. The 64 bit hash is
+    //folded to the 32 of an int, so two parameter sets share a value about
+    //once in 4 billion. Nodes that must not mix them up connect waterParams
+    MFnNumericAttribute signatureAttr;
+    waterSignature = signatureAttr.create("waterSignature", "wsg", MFnNumericData::kInt);
+    signatureAttr.setWritable(false);
+    signatureAttr.setStorable(false);
+    addAttribute(waterSignature);
+    attributeAffects(proWater::dir, proWater::waterSignature);
+    attributeAffects(proWater::bigFreq, proWater::waterSignature);
+    attributeAffects(proWater::amplitude1, proWater::waterSignature);
+    attributeAffects(proWater::frequency1, proWater::waterSignature);
+    attributeAffects(proWater::amplitude2, proWater::waterSignature);
+    attributeAffects(proWater::frequency2, proWater::waterSignature);
+    attributeAffects(proWater::loop, proWater::waterSignature);
+    attributeAffects(proWater::loopLength, proWater::waterSignature);
+    attributeAffects(proWater::tileSize, proWater::waterSignature);
+    attributeAffects(proWater::noiseBasis, proWater::waterSignature);
+    attributeAffects(proWater::waveEngine, proWater::waterSignature);
+    //
+    
+    //waterParams, the same parameters as an array, for nodes that evaluate
+    //the field such as proWaterTexture. They get it through the connection
+    //instead of reading the plugs of this node from their compute()
+    MFnTypedAttribute paramsAttr;
+    waterParams = paramsAttr.create("waterParams", "wpa", MFnData::kDoubleArray);
+    paramsAttr.setWritable(false);
+    paramsAttr.setStorable(false);
+    addAttribute(waterParams);
+    MObject paramInputs[] = { dir, bigFreq, amplitude1, frequency1, amplitude2, frequency2, loop,
+                              loopLength, tileSize, noiseBasis, waveEngine };
+    for (unsigned int i = 0; i < sizeof(paramInputs)/sizeof(paramInputs[0]); i++)
+        attributeAffects(paramInputs[i], proWater::waterParams);
+    //
+    
     
     
 	MFnMatrixAttribute  mAttr;
@@ -227,10 +1003,191 @@ MStatus proWater::initialize()
 }
 
 
+MStatus proWater::setDependentsDirty(const MPlug& plug, MPlugArray& plugArray)
+//
+//	Description:
+//		The terrain grid is only rasterized again after the terrain mesh
+//		or the resolution of the grid changed.
+//
+{
+    if (plug == terrainMesh || plug == terrainResolution)
+        terrainDirty = true;
+    return MPxDeformerNode::setDependentsDirty(plug, plugArray);
+}
+
+
+static void setColorSet(MFnMesh& meshFn, const MString& name, const MColorArray& colors, const MIntArray& vertices)
+//
+//	Description:
+//		Writes per vertex colors to the named color set, creating the
+//		set the first time.
+//
+{
+    MStringArray colorSets;
+    meshFn.getColorSetNames(colorSets);
+    bool found = false;
+    for (unsigned int i = 0; i < colorSets.length(); i++)
+        found = found || colorSets[i] == name;
+    if (!found)
+        meshFn.createColorSetWithName(name);
+    meshFn.setCurrentColorSetName(name);
+    meshFn.setVertexColors(colors, vertices);
+}
+
+
 MStatus proWater::compute(const MPlug& plug, MDataBlock& dataBlock)
 {
     MStatus status = MStatus::kUnknownParameter;
-    if (plug.attribute() == outputGeom) {
+    if (plug.attribute() == minDisplacement || plug.attribute() == maxDisplacement) {
+        // only the amplitudes matter for the range
+        MStatus returnStatus;
+        
+        MDataHandle bigData = dataBlock.inputValue(bigFreq, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        
+        MDataHandle ampData = dataBlock.inputValue(amplitude1, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        
+        MDataHandle ampData2 = dataBlock.inputValue(amplitude2, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        
+        MDataHandle engineData = dataBlock.inputValue(waveEngine, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        
+        MDataHandle gCountData = dataBlock.inputValue(gerstnerCount, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        
+        MDataHandle gLengthData = dataBlock.inputValue(gerstnerWavelength, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        
+        MDataHandle gAmpData = dataBlock.inputValue(gerstnerAmplitude, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        
+        MDataHandle gSeedData = dataBlock.inputValue(gerstnerSeed, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        
+        MDataHandle ripplesData = dataBlock.inputValue(ripples, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        
+        float low, high;
+        if (engineData.asShort() == 2) {
+            OceanParams oceanParams;
+            returnStatus = getOceanParams(dataBlock, oceanParams);
+            if(MS::kSuccess != returnStatus) return returnStatus;
+            WaterHash oceanKey = ocean_signature(oceanParams);
+            if (oceanKey != oceanSignature) {
+                ocean_build(oceanParams, ocean);
+                oceanSignature = oceanKey;
+            }
+            ocean_height_range(ocean, low, high);
+        }
+        else if (engineData.asShort() == 1) {
+            // the seed jitters the wavelengths and with them the
+            // amplitudes, so the range is taken from the wave set itself
+            GerstnerParams gerstner;
+            gerstner.count = gCountData.asInt();
+            gerstner.wavelength = gLengthData.asDouble();
+            gerstner.amplitude = gAmpData.asDouble();
+            gerstner.seed = gSeedData.asInt();
+            GerstnerWaves rangeWaves;
+            gerstner_build_waves(gerstner, rangeWaves);
+            gerstner_height_range(rangeWaves, low, high);
+        }
+        else {
+            WaterParams params;
+            params.bigAmplitude = bigData.asDouble();
+            params.amplitude1 = ampData.asDouble();
+            params.amplitude2 = ampData2.asDouble();
+            WaterPlan plan;
+            water_build_plan(params, plan);
+            water_displacement_range(plan, low, high);
+        }
+        
+        // the ripples go on top along the normals, as high as they have
+        // been so far since their height depends on the whole shot
+        if (ripplesData.asBool()) {
+            float peak = 0.0f;
+            for (std::map<unsigned int, RippleSolver>::const_iterator it = rippleSolvers.begin();
+                 it != rippleSolvers.end(); ++it)
+                peak = std::max(peak, it->second.peak());
+            low -= peak;
+            high += peak;
+        }
+        
+        MDataHandle lowData = dataBlock.outputValue(minDisplacement);
+        lowData.set((double)low);
+        lowData.setClean();
+        MDataHandle highData = dataBlock.outputValue(maxDisplacement);
+        highData.set((double)high);
+        highData.setClean();
+        status = MStatus::kSuccess;
+    }
+    else if (plug.attribute() == waterSignature || plug.attribute() == waterParams) {
+        // the same parameters getParams() reads, from the data block
+        MStatus returnStatus;
+        WaterParams params;
+        
+        MDataHandle dirData = dataBlock.inputValue(dir, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        params.direction = dirData.asDouble();
+        
+        MDataHandle bigData = dataBlock.inputValue(bigFreq, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        params.bigAmplitude = bigData.asDouble();
+        
+        MDataHandle ampData = dataBlock.inputValue(amplitude1, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        params.amplitude1 = ampData.asDouble();
+        
+        MDataHandle freqData = dataBlock.inputValue(frequency1, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        params.frequency1 = freqData.asDouble();
+        
+        MDataHandle ampData2 = dataBlock.inputValue(amplitude2, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        params.amplitude2 = ampData2.asDouble();
+        
+        MDataHandle freqData2 = dataBlock.inputValue(frequency2, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        params.frequency2 = freqData2.asDouble();
+        
+        MDataHandle loopData = dataBlock.inputValue(loop, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        
+        MDataHandle loopLengthData = dataBlock.inputValue(loopLength, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        params.loopLength = loopData.asBool() ? loopLengthData.asDouble() : 0.0;
+        
+        MDataHandle tileData = dataBlock.inputValue(tileSize, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        params.tileSize = tileData.asDouble();
+        
+        MDataHandle basisData = dataBlock.inputValue(noiseBasis, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        short basis = basisData.asShort();
+        params.tableLayers = basis == 1 ? WATER_TABLE_ALL : basis == 2 ? WATER_TABLE_DETAIL : WATER_TABLE_NONE;
+        
+        // the engine goes in on top so switching it reaches the textures
+        MDataHandle engineData = dataBlock.inputValue(waveEngine, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        short engine = engineData.asShort();
+        WaterHash signature = water_hash(water_signature(params, 0, 0, 0), &engine, sizeof(engine));
+        
+        MDataHandle signatureData = dataBlock.outputValue(waterSignature);
+        signatureData.set((int)(signature ^ (signature >> 32)));
+        signatureData.setClean();
+        
+        MDoubleArray values;
+        packParams(params, engine, values);
+        MFnDoubleArrayData valuesFn;
+        MObject valuesObj = valuesFn.create(values, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        MDataHandle paramsData = dataBlock.outputValue(waterParams);
+        paramsData.set(valuesObj);
+        paramsData.setClean();
+        status = MStatus::kSuccess;
+    }
+    else if (plug.attribute() == outputGeom) {
         // get the input corresponding to this output
         //
         unsigned int index = plug.logicalIndex();
@@ -286,72 +1243,601 @@ MStatus proWater::compute(const MPlug& plug, MDataBlock& dataBlock)
         double freq2 = freqData2.asDouble();
         
         
+        MDataHandle loopData = dataBlock.inputValue(loop, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        bool loopOn = loopData.asBool();
+        
+        MDataHandle loopLengthData = dataBlock.inputValue(loopLength, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        double cycle = loopLengthData.asDouble();
+        
+        MDataHandle cacheData = dataBlock.inputValue(cacheFrames, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        bool cacheOn = cacheData.asBool();
+        
+        MDataHandle cacheMemoryData = dataBlock.inputValue(cacheMemory, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        size_t cacheBytes = (size_t)std::max(1, cacheMemoryData.asInt()) << 20;
+        
+        MDataHandle tileData = dataBlock.inputValue(tileSize, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        double tile = tileData.asDouble();
+        
+        MDataHandle basisData = dataBlock.inputValue(noiseBasis, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        short basis = basisData.asShort();
+        
+        MDataHandle coarseData = dataBlock.inputValue(coarseTolerance, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        double tolerance = coarseData.asDouble();
+        
+        MDataHandle driftData = dataBlock.inputValue(driftTolerance, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        double drift = driftData.asDouble();
+        
+        MDataHandle stepData = dataBlock.inputValue(timeStep, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        double step = stepData.asDouble();
+        
+        MDataHandle timeTolData = dataBlock.inputValue(timeTolerance, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        double timeTol = timeTolData.asDouble();
+        
+        MDataHandle velocityData = dataBlock.inputValue(outputVelocity, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        bool velocityOn = velocityData.asBool();
+        
+        MDataHandle normalsData = dataBlock.inputValue(outputNormals, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        bool normalsOn = normalsData.asBool();
+        
+        MDataHandle foamData = dataBlock.inputValue(outputFoam, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        bool foamOn = foamData.asBool();
+        
+        MDataHandle engineData = dataBlock.inputValue(waveEngine, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        short engine = engineData.asShort();
+        
+        MDataHandle gCountData = dataBlock.inputValue(gerstnerCount, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        
+        MDataHandle gLengthData = dataBlock.inputValue(gerstnerWavelength, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        
+        MDataHandle gAmpData = dataBlock.inputValue(gerstnerAmplitude, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        
+        MDataHandle gSteepData = dataBlock.inputValue(gerstnerSteepness, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        
+        MDataHandle gSpreadData = dataBlock.inputValue(gerstnerSpread, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        
+        MDataHandle gSeedData = dataBlock.inputValue(gerstnerSeed, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        
+        MDataHandle ripplesData = dataBlock.inputValue(ripples, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        bool ripplesOn = ripplesData.asBool();
+        
+        MDataHandle rResData = dataBlock.inputValue(rippleResolution, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        
+        MDataHandle rSizeData = dataBlock.inputValue(rippleSize, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        
+        MDataHandle rSpeedData = dataBlock.inputValue(rippleSpeed, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        
+        MDataHandle rDampData = dataBlock.inputValue(rippleDamping, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        
+        MDataHandle rStrengthData = dataBlock.inputValue(rippleStrength, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        
+        MDataHandle rRateData = dataBlock.inputValue(rippleFrameRate, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        
+        MDataHandle rCheckData = dataBlock.inputValue(rippleCheckpoint, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        
+        MDataHandle rRadiusData = dataBlock.inputValue(rippleSourceRadius, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        
+        MDataHandle terrainData = dataBlock.inputValue(terrainMesh, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        
+        MDataHandle tResData = dataBlock.inputValue(terrainResolution, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        
+        MDataHandle shallowData = dataBlock.inputValue(shallowDepth, &returnStatus);
+        if(MS::kSuccess != returnStatus) return returnStatus;
+        float shallow = shallowData.asDouble();
+        
+        GerstnerParams gerstner;
+        gerstner.time = t;
+        gerstner.direction = dirDeg;
+        gerstner.count = gCountData.asInt();
+        gerstner.wavelength = gLengthData.asDouble();
+        gerstner.amplitude = gAmpData.asDouble();
+        gerstner.steepness = gSteepData.asDouble();
+        gerstner.spread = gSpreadData.asDouble();
+        gerstner.loopLength = loopOn ? cycle : 0.0;
+        gerstner.seed = gSeedData.asInt();
+        
+        WaterParams params;
+        params.time = t;
+        params.direction = dirDeg;
+        params.bigAmplitude = bigFreqAmp;
+        params.amplitude1 = amp1;
+        params.frequency1 = freq1;
+        params.amplitude2 = amp2;
+        params.frequency2 = freq2;
+        params.loopLength = loopOn ? cycle : 0.0;
+        params.tileSize = tile;
+        params.tableLayers = basis == 1 ? WATER_TABLE_ALL : basis == 2 ? WATER_TABLE_DETAIL : WATER_TABLE_NONE;
+        params.coarseTolerance = tolerance;
+        params.driftTolerance = drift;
+        params.timeStep = step;
+        params.timeTolerance = timeTol;
+        
+        if (engine == 0 && tile > 0.0 && tile != snapWarnedTile) {
+            int layer;
+            float minTile;
+            float snap = water_tile_snap(params, layer, minTile);
+            if (snap > WATER_TILE_SNAP) {
+                MString message("proWater: tileSize ");
+                message += tile;
+                message += " raises the frequency of layer ";
+                message += layer;
+                message += " by ";
+                message += snap;
+                message += " times, a tileSize of ";
+                message += minTile;
+                message += " or more keeps every layer within 25%";
+                MGlobal::displayWarning(message);
+            }
+            snapWarnedTile = tile;
+        }
+        
         // Get the MFnMesh
         MStatus stat;
         MObject inputObj = hOutput.data();
         MFnMesh * meshFn = new MFnMesh(inputObj, &stat);
         
-        // do the deformation
+        // gather the points, the height field is evaluated for all of
+        // them at once by the engine
         //
         MItGeometry iter(hOutput,groupId,false);
         
-        for ( ; !iter.isDone(); iter.next()) {
-            MPoint pt = iter.position();
+        MPointArray points;
+        iter.allPositions(points);
+        unsigned int count = points.length();
+        
+        MVectorArray normals(count);
+        MIntArray vertices(count);
+        std::vector<float> u(count), v(count);
+        for (unsigned int i = 0; !iter.isDone(); iter.next(), i++) {
+            normals[i] = iter.normal();
+            vertices[i] = iter.index();
+            u[i] = points[i].x;
+            v[i] = points[i].z;
+        }
+        
+        // the terrain and the ripple sources come in world space
+        MMatrix worldToObject;
+        MDagPath path;
+        MFnGeometryFilter fnFilter(thisNode);
+        if (fnFilter.getPathAtIndex(index, path) == MS::kSuccess)
+            worldToObject = path.inclusiveMatrix().inverse();
+        
+        // depth of the water over the terrain per point, left empty
+        // without a terrain
+        std::vector<float> depth, depthU, depthV;
+        MObject terrainObj = terrainData.asMesh();
+        if (terrainObj.isNull()) {
+            terrain = TerrainGrid();
+            terrainDirty = true;
+        }
+        else if (count > 0) {
+            if (terrainDirty || terrainMatrix != worldToObject) {
+                MFnMesh terrainFn(terrainObj);
+                MPointArray terrainPoints;
+                terrainFn.getPoints(terrainPoints, MSpace::kWorld);
+                MIntArray triangleCounts, triangleVertices;
+                terrainFn.getTriangles(triangleCounts, triangleVertices);
+                std::vector<float> xyz(3*terrainPoints.length() + 3);
+                for (unsigned int k = 0; k < terrainPoints.length(); k++) {
+                    MPoint p = terrainPoints[k]*worldToObject;
+                    xyz[3*k] = p.x;
+                    xyz[3*k + 1] = p.y;
+                    xyz[3*k + 2] = p.z;
+                }
+                std::vector<int> triangles(triangleVertices.length() + 3);
+                for (unsigned int k = 0; k < triangleVertices.length(); k++)
+                    triangles[k] = triangleVertices[k];
+                terrain_build(terrainPoints.length(), &xyz[0], triangleVertices.length()/3,
+                              &triangles[0], tResData.asInt(), terrain);
+                terrainMatrix = worldToObject;
+                terrainDirty = false;
+            }
+            // the slopes of the depth are those of the terrain turned
+            // over, the points themselves are on the rest plane
+            depth.resize(count);
+            if (engine == 0 && (velocityOn || normalsOn || foamOn)) {
+                depthU.resize(count);
+                depthV.resize(count);
+                terrain_height_n(terrain, count, &u[0], &v[0], &depth[0], &depthU[0], &depthV[0]);
+                for (unsigned int i = 0; i < count; i++) {
+                    depthU[i] = -depthU[i];
+                    depthV[i] = -depthV[i];
+                }
+            }
+            else
+                terrain_height_n(terrain, count, &u[0], &v[0], &depth[0]);
+            for (unsigned int i = 0; i < count; i++)
+                depth[i] = points[i].y - depth[i];
+        }
+        
+        // the ripples are stepped before the waves so their height and
+        // motion can go into the color sets along with those of the waves,
+        // each geometry keeps its own simulation
+        std::vector<float> rippleHeight, rippleU, rippleV, rippleVelocity;
+        if (count > 0 && ripplesOn) {
+            RippleParams rippleParams;
+            rippleParams.resolution = rResData.asInt();
+            rippleParams.size = rSizeData.asDouble();
+            rippleParams.speed = rSpeedData.asDouble();
+            rippleParams.damping = rDampData.asDouble();
+            rippleParams.strength = rStrengthData.asDouble();
+            rippleParams.frameLength = 1.0/rRateData.asDouble();
+            rippleParams.checkpoint = rCheckData.asInt();
+            RippleSolver& ripple = rippleSolvers[index];
+            ripple.validate(rippleParams, ripple_signature(rippleParams));
             
-            //float2 uvPoint;
-            //float u,v;
+            // the sources in the space of the deformed object
+            double sourceRadius = rRadiusData.asDouble();
+            std::vector<RippleSource> sourceList;
+            MArrayDataHandle sourceArray = dataBlock.inputArrayValue(rippleSources, &returnStatus);
+            if(MS::kSuccess != returnStatus) return returnStatus;
+            unsigned int sourceCount = sourceArray.elementCount();
+            for (unsigned int k = 0; k < sourceCount; k++) {
+                sourceArray.jumpToArrayElement(k);
+                MMatrix sourceMatrix = sourceArray.inputValue().asMatrix()*worldToObject;
+                MPoint center = MPoint(0.0, 0.0, 0.0)*sourceMatrix;
+                MVector axis = MVector(1.0, 0.0, 0.0)*sourceMatrix;
+                RippleSource source;
+                source.x = center.x;
+                source.y = center.y;
+                source.z = center.z;
+                source.radius = sourceRadius*axis.length();
+                sourceList.push_back(source);
+            }
             
-            //uvPoint[0] = u;
-            //uvPoint[1] = v;
+            int frame = (int)floor(t*rRateData.asDouble() + 0.5);
+            ripple.setSources(frame, sourceList);
+            ripple.advance(frame);
             
-            //meshFn->getUVAtPoint(pt, uvPoint, MSpace::kObject);
+            rippleHeight.resize(count);
+            if (normalsOn) {
+                rippleU.resize(count);
+                rippleV.resize(count);
+            }
+            if (velocityOn)
+                rippleVelocity.resize(count);
+            ripple.sample(count, &u[0], &v[0], &rippleHeight[0],
+                          rippleU.empty() ? 0 : &rippleU[0], rippleV.empty() ? 0 : &rippleV[0],
+                          rippleVelocity.empty() ? 0 : &rippleVelocity[0]);
+        }
+        else if (!ripplesOn)
+            rippleSolvers.erase(index);
+        
+        MVectorArray displacedNormals;
+        if (count > 0 && engine != 0) {
+            WaterHash wavesKey;
+            float peakWavelength = gerstner.wavelength;
+            if (engine == 2) {
+                OceanParams oceanParams;
+                returnStatus = getOceanParams(dataBlock, oceanParams);
+                if(MS::kSuccess != returnStatus) return returnStatus;
+                wavesKey = ocean_signature(oceanParams);
+                if (wavesKey != oceanSignature) {
+                    ocean_build(oceanParams, ocean);
+                    oceanSignature = wavesKey;
+                }
+                peakWavelength = ocean_peak_wavelength(oceanParams);
+            }
+            else {
+                wavesKey = gerstner_signature(gerstner);
+                if (wavesKey != wavesSignature) {
+                    gerstner_build_waves(gerstner, waves);
+                    wavesSignature = wavesKey;
+                }
+            }
             
-            float u = pt.x; //uvPoint[0]*100;
-            float v = pt.z; //uvPoint[1]*100;
+            // one frame holds every channel that is switched on, the
+            // offsets first, then the normals, the velocities and the
+            // Jacobian
+            const unsigned int normalsAt = 3*count;
+            const unsigned int velocityAt = normalsAt + (normalsOn ? 3*count : 0);
+            const unsigned int jacobianAt = velocityAt + (velocityOn ? 3*count : 0);
+            const unsigned int frameSize = jacobianAt + (foamOn ? count : 0);
             
-            float degDir = dirDeg;
+            std::vector<float> channels;
+            const float* d;
+            velocityCache.clear();
+            gradientCache.clear();
+            crestCache.clear();
+            if (cacheOn) {
+                frameCache.setMaxBytes(cacheBytes);
+                WaterHash mask = (normalsOn ? 1 : 0) | (velocityOn ? 2 : 0) | (foamOn ? 4 : 0);
+                frameCache.validate((wavesKey ^ water_points_signature(count, &u[0], &v[0])*31) + mask);
+                double key = water_wrap_time(params);
+                const std::vector<float>* cached = frameCache.find(key);
+                if (!cached) {
+                    std::vector<float>& frame = frameCache.insert(key, frameSize);
+                    evaluateWaves(engine, t, count, &u[0], &v[0], &frame[0],
+                                  normalsOn ? &frame[normalsAt] : 0,
+                                  velocityOn ? &frame[velocityAt] : 0,
+                                  foamOn ? &frame[jacobianAt] : 0);
+                    cached = &frame;
+                }
+                d = &(*cached)[0];
+            }
+            else {
+                frameCache.clear();
+                channels.resize(frameSize);
+                evaluateWaves(engine, t, count, &u[0], &v[0], &channels[0],
+                              normalsOn ? &channels[normalsAt] : 0,
+                              velocityOn ? &channels[velocityAt] : 0,
+                              foamOn ? &channels[jacobianAt] : 0);
+                d = &channels[0];
+            }
             
-            float dir = degDir* M_PI/180;
+            // over a terrain the whole spectrum is scaled down by how much
+            // the depth leaves of its longest waves, a copy so the cached
+            // frame stays valid for other terrains
+            std::vector<float> shoaled;
+            if (!depth.empty()) {
+                shoaled.assign(d, d + frameSize);
+                for (unsigned int i = 0; i < count; i++) {
+                    float f = depth[i] > shallow ? water_shoaling(depth[i], peakWavelength) : 0.0f;
+                    for (int c = 0; c < 3; c++)
+                        shoaled[3*i + c] *= f;
+                    if (normalsOn) {
+                        float* m = &shoaled[normalsAt + 3*i];
+                        m[0] *= f;
+                        m[1] = f*m[1] + (1 - f);
+                        m[2] *= f;
+                    }
+                    if (velocityOn)
+                        for (int c = 0; c < 3; c++)
+                            shoaled[velocityAt + 3*i + c] *= f;
+                    if (foamOn)
+                        shoaled[jacobianAt + i] = 1 - f*(1 - shoaled[jacobianAt + i]);
+                }
+                d = &shoaled[0];
+            }
             
-            float dirX = cos(dir);
-            float dirY = sin(dir);
+            // the waves are defined on the rest plane with y up, the up
+            // offset goes along the point normal and the horizontal ones
+            // are added in object space
+            for (unsigned int i = 0; i < count; i++) {
+                const float* o = d + 3*i;
+                points[i] = points[i] + normals[i]*o[1] + MVector(o[0], 0.0, o[2]);
+            }
             
+            if (velocityOn && stat == MS::kSuccess) {
+                MColorArray colors(count);
+                for (unsigned int i = 0; i < count; i++) {
+                    const float* w = d + velocityAt + 3*i;
+                    float up = w[1] + (rippleVelocity.empty() ? 0.0f : rippleVelocity[i]);
+                    MVector velocityVector = normals[i]*up + MVector(w[0], 0.0, w[2]);
+                    colors[i] = MColor(velocityVector.x, velocityVector.y, velocityVector.z, 1.0f);
+                }
+                setColorSet(*meshFn, "velocityPV", colors, vertices);
+            }
             
-            float bigFreq = 0.01;
+            // the crests are where the horizontal motion squeezes the
+            // surface together, which shows as the Jacobian dropping
+            // below 1
+            if (foamOn && stat == MS::kSuccess) {
+                MColorArray heights(count), crests(count), foam(count);
+                for (unsigned int i = 0; i < count; i++) {
+                    float h = d[3*i + 1] + (rippleHeight.empty() ? 0.0f : rippleHeight[i]);
+                    float c = std::max(0.0f, 1.0f - d[jacobianAt + i]);
+                    float f = std::min(1.0f, c);
+                    heights[i] = MColor(h, h, h, 1.0f);
+                    crests[i] = MColor(c, c, c, 1.0f);
+                    foam[i] = MColor(f, f, f, 1.0f);
+                }
+                setColorSet(*meshFn, "heightPV", heights, vertices);
+                setColorSet(*meshFn, "crestPV", crests, vertices);
+                setColorSet(*meshFn, "foamPV", foam, vertices);
+            }
             
-            float bigWaves = scaled_raw_noise_3d(0, 1, (u + 3*t*dirX)*bigFreq*dirX, (v + 3*t*dirY)*bigFreq*dirY*2, t*0.01);
+            if (normalsOn && stat == MS::kSuccess) {
+                displacedNormals.setLength(count);
+                for (unsigned int i = 0; i < count; i++) {
+                    const float* m = d + normalsAt + 3*i;
+                    displacedNormals[i] = (normals[i]*m[1] + MVector(m[0], 0.0, m[2])).normal();
+                }
+            }
+        }
+        else if (count > 0) {
+            WaterPlan plan;
+            water_build_plan(params, plan);
             
+            // in loop mode the cache key wraps with the cycle, so the cache
+            // never holds more than one cycle worth of frames
+            std::vector<float> disp, velocity, gradient, crest;
+            const float* d;
+            const float* dv = 0;
+            const float* dg = 0;    // derivatives along u, then along v
+            const float* dc = 0;    // crest sharpness, then foam
+            if (!depth.empty()) {
+                // the depths change with every edit of the terrain, so the
+                // shallows are evaluated directly and skipped where dry
+                frameCache.clear();
+                velocityCache.clear();
+                gradientCache.clear();
+                crestCache.clear();
+                disp.resize(count);
+                if (velocityOn || normalsOn || foamOn) {
+                    // one pass for the displacement and the derivatives of
+                    // the wet points, with the slopes of the shallows
+                    if (velocityOn)
+                        velocity.resize(count);
+                    if (normalsOn)
+                        gradient.resize(2*count);
+                    if (foamOn)
+                        crest.resize(2*count);
+                    water_displacement_depth_deriv_n(plan, count, &u[0], &v[0], &depth[0], &depthU[0], &depthV[0],
+                                                     shallow, &disp[0], velocityOn ? &velocity[0] : 0,
+                                                     normalsOn ? &gradient[0] : 0, normalsOn ? &gradient[count] : 0,
+                                                     foamOn ? &crest[0] : 0, foamOn ? &crest[count] : 0);
+                }
+                else
+                    water_displacement_depth_n(plan, count, &u[0], &v[0], &depth[0], shallow, &disp[0]);
+                d = &disp[0];
+                dv = velocityOn ? &velocity[0] : 0;
+                dg = normalsOn ? &gradient[0] : 0;
+                dc = foamOn ? &crest[0] : 0;
+            }
+            else if (cacheOn) {
+                // the budget is shared by the caches in use, in proportion
+                // to the values they store per point
+                size_t share = cacheBytes/(1 + (velocityOn ? 1 : 0) + (normalsOn ? 2 : 0) + (foamOn ? 2 : 0));
+                frameCache.setMaxBytes(share);
+                velocityCache.setMaxBytes(velocityOn ? share : 0);
+                gradientCache.setMaxBytes(normalsOn ? 2*share : 0);
+                crestCache.setMaxBytes(foamOn ? 2*share : 0);
+                WaterHash signature = water_signature(params, count, &u[0], &v[0]);
+                frameCache.validate(signature);
+                velocityCache.validate(signature);
+                gradientCache.validate(signature);
+                crestCache.validate(signature);
+                double key = water_wrap_time(params);
+                const std::vector<float>* cached = frameCache.find(key);
+                const std::vector<float>* cachedVelocity = velocityCache.find(key);
+                const std::vector<float>* cachedGradient = gradientCache.find(key);
+                const std::vector<float>* cachedCrest = crestCache.find(key);
+                if (!cached || (velocityOn && !cachedVelocity) || (normalsOn && !cachedGradient) ||
+                    (foamOn && !cachedCrest)) {
+                    std::vector<float>& frame = frameCache.insert(key, count);
+                    float* frameVelocity = 0;
+                    float* frameGradient = 0;
+                    float* frameCrest = 0;
+                    if (velocityOn) {
+                        std::vector<float>& vframe = velocityCache.insert(key, count);
+                        frameVelocity = &vframe[0];
+                        cachedVelocity = &vframe;
+                    }
+                    if (normalsOn) {
+                        std::vector<float>& gframe = gradientCache.insert(key, 2*count);
+                        frameGradient = &gframe[0];
+                        cachedGradient = &gframe;
+                    }
+                    if (foamOn) {
+                        std::vector<float>& cframe = crestCache.insert(key, 2*count);
+                        frameCrest = &cframe[0];
+                        cachedCrest = &cframe;
+                    }
+                    evaluate(params, plan, count, &u[0], &v[0], &frame[0], frameVelocity, frameGradient, frameCrest);
+                    cached = &frame;
+                }
+                d = &(*cached)[0];
+                if (velocityOn)
+                    dv = &(*cachedVelocity)[0];
+                if (normalsOn)
+                    dg = &(*cachedGradient)[0];
+                if (foamOn)
+                    dc = &(*cachedCrest)[0];
+            }
+            else {
+                frameCache.clear();
+                velocityCache.clear();
+                gradientCache.clear();
+                crestCache.clear();
+                disp.resize(count);
+                if (velocityOn)
+                    velocity.resize(count);
+                if (normalsOn)
+                    gradient.resize(2*count);
+                if (foamOn)
+                    crest.resize(2*count);
+                evaluate(params, plan, count, &u[0], &v[0], &disp[0],
+                         velocityOn ? &velocity[0] : 0, normalsOn ? &gradient[0] : 0, foamOn ? &crest[0] : 0);
+                d = &disp[0];
+                dv = velocityOn ? &velocity[0] : 0;
+                dg = normalsOn ? &gradient[0] : 0;
+                dc = foamOn ? &crest[0] : 0;
+            }
             
-            float frequency1 = freq1/10;//0.2;
-            float amplitude1 = amp1;//1.3;
+            // do the deformation
+            //
+            for (unsigned int i = 0; i < count; i++)
+                points[i] = points[i] + normals[i]*d[i];
             
-            float firstOctave = -(std::abs(scaled_raw_noise_3d(-amplitude1, amplitude1, (float)(u + 0.7*t*dirX)*frequency1*0.4, (float)(v + 0.7*t*dirY)*frequency1*0.6, 0.05*t))-amplitude1);
+            // the points move along their normal, so that is the direction
+            // of the velocity too
+            if (dv && stat == MS::kSuccess) {
+                MColorArray colors(count);
+                for (unsigned int i = 0; i < count; i++) {
+                    float up = dv[i] + (rippleVelocity.empty() ? 0.0f : rippleVelocity[i]);
+                    MVector velocityVector = normals[i]*up;
+                    colors[i] = MColor(velocityVector.x, velocityVector.y, velocityVector.z, 1.0f);
+                }
+                setColorSet(*meshFn, "velocityPV", colors, vertices);
+            }
             
-            float frequency2 = freq2/10;
-            float amplitude2 = amp2;
-        
-            float secondOctave = - (std::abs(scaled_raw_noise_3d(-amplitude2, amplitude2, (float)(u + 0.7*t*dirX)*frequency2*0.35, (float)(v + 0.7*t*dirY)*frequency2*0.65, 0.005*t))-amplitude2);
-            
-            float frequency3 = freq1/10;
-            float amplitude3 = amp1/1.5;
-            
-            float thirdOctave = - (std::abs(scaled_raw_noise_3d(-amplitude3, amplitude3, (float)(u + t*0.5*dirX)*frequency3*0.4, (float)(v + t*0.5*dirY)*frequency3*0.6, 30))-amplitude3);
-            
-            float frequency4 = freq2/10;
-            float amplitude4 = amp2/1.5;
-            
-            float fourthOctave = scaled_raw_noise_3d(-amplitude4, amplitude4, (float)(u + t*0.5*dirX)*frequency4*0.4, (float)(v + t*0.5*dirY)*frequency4*0.6, 50);
-            
-            float frequency5 = freq2;
-            float amplitude5 = amp2/2;
+            // the masks come from the same pass as the displacement, the
+            // height is the displacement itself with the ripples
+            if (dc && stat == MS::kSuccess) {
+                MColorArray heights(count), crests(count), foam(count);
+                for (unsigned int i = 0; i < count; i++) {
+                    float h = d[i] + (rippleHeight.empty() ? 0.0f : rippleHeight[i]);
+                    heights[i] = MColor(h, h, h, 1.0f);
+                    crests[i] = MColor(dc[i], dc[i], dc[i], 1.0f);
+                    foam[i] = MColor(dc[count + i], dc[count + i], dc[count + i], 1.0f);
+                }
+                setColorSet(*meshFn, "heightPV", heights, vertices);
+                setColorSet(*meshFn, "crestPV", crests, vertices);
+                setColorSet(*meshFn, "foamPV", foam, vertices);
+            }
             
-            float fifthOctave = scaled_raw_noise_3d(-amplitude5, amplitude5, (float)(u + t*0.5*dirX)*frequency5*0.15, (float)(v + t*0.5*dirY)*frequency5*0.85, 0.001*t);
-            
-            float disp = bigFreqAmp*bigWaves + 7*(bigWaves)*firstOctave + secondOctave + thirdOctave*thirdOctave + fourthOctave + std::abs(bigWaves-1)*fifthOctave;
-            
-            pt = pt + iter.normal()*disp;
-            
-            iter.setPosition(pt);
+            // normals of the displaced surface from the height field
+            // gradient, exact for a flat input and close for gently curved
+            // ones since the bend of the input normals is left out
+            if (dg && stat == MS::kSuccess) {
+                displacedNormals.setLength(count);
+                for (unsigned int i = 0; i < count; i++) {
+                    MVector g(dg[i], 0.0, dg[count + i]);
+                    MVector tangential = g - normals[i]*(g*normals[i]);
+                    displacedNormals[i] = (normals[i] - tangential).normal();
+                }
+            }
+        }
+        
+        // the ripples go on top of whichever engine made the waves, along
+        // the input normals like the noise and tilting the displaced
+        // normals by their gradient
+        if (!rippleHeight.empty()) {
+            for (unsigned int i = 0; i < count; i++)
+                points[i] = points[i] + normals[i]*rippleHeight[i];
+            if (!rippleU.empty() && displacedNormals.length() == count)
+                for (unsigned int i = 0; i < count; i++) {
+                    MVector g(rippleU[i], 0.0, rippleV[i]);
+                    MVector tangential = g - displacedNormals[i]*(g*displacedNormals[i]);
+                    displacedNormals[i] = (displacedNormals[i] - tangential).normal();
+                }
+        }
+        
+        if (count > 0) {
+            iter.setAllPositions(points);
+            if (displacedNormals.length() == count)
+                meshFn->setVertexNormals(displacedNormals, vertices);
         }
         
         delete meshFn;
@@ -363,6 +1849,236 @@ MStatus proWater::compute(const MPlug& plug, MDataBlock& dataBlock)
 }
 
 
+void proWater::evaluate(const WaterParams& params, const WaterPlan& plan, unsigned int count, const float* u, const float* v,
+                        float* disp, float* velocity, float* gradient, float* crest)
+//
+//	Description:
+//		Displacement of all points for the given plan. In tile mode the
+//		points are grouped by their position within the tile once, and
+//		only one point per group is evaluated every frame. With a time
+//		step the field is interpolated between time keys. Otherwise the
+//		layers that only translate are resampled from cached fields.
+//		The velocity, the gradient, laid out as all derivatives along
+//		u then all along v, and the crest sharpness followed by the foam
+//		mask come from one analytic pass that gives the displacement as
+//		well. That pass evaluates every layer exactly at params.time, so
+//		when any of them is asked for, coarseTolerance, driftTolerance
+//		and timeStep have no effect, which is warned about once.
+//
+{
+    if (plan.tiled) {
+        if (tileMap.tileSize != plan.tileSize ||
+            tileMap.signature != water_points_signature(count, u, v))
+            water_build_tile_map(plan.tileSize, count, u, v, tileMap);
+        water_displacement_tiled(plan, tileMap, disp, velocity,
+                                 gradient ? gradient : 0, gradient ? gradient + count : 0,
+                                 crest ? crest : 0, crest ? crest + count : 0);
+        return;
+    }
+    
+    if (velocity || gradient || crest) {
+        bool approximated = params.coarseTolerance > 0.0 || params.driftTolerance > 0.0 || params.timeStep > 0.0;
+        if (approximated && !derivWarned)
+            MGlobal::displayWarning("proWater: outputVelocity, outputNormals and outputFoam evaluate the "
+                                    "field exactly, coarseTolerance, driftTolerance and timeStep are ignored");
+        derivWarned = approximated;
+        water_displacement_deriv_n(plan, count, u, v, disp, velocity,
+                                   gradient ? gradient : 0, gradient ? gradient + count : 0,
+                                   crest ? crest : 0, crest ? crest + count : 0);
+        return;
+    }
+    
+    if (params.timeStep > 0.0) {
+        timeSampler.validate(water_signature(params, count, u, v));
+        timeSampler.displacement(params, count, u, v, disp);
+        return;
+    }
+    timeSampler.clear();
+    
+    water_displacement_n(plan, count, u, v, disp, &caches);
+}
+
+
+void proWater::evaluateWaves(short engine, double time, unsigned int count, const float* u, const float* v,
+                             float* offset, float* normals, float* velocity, float* jacobian)
+//
+//	Description:
+//		Offsets of all points for the Gerstner or the fft engine, with
+//		the same layout either way. The fft maps are only remade when the
+//		time changes, or when the velocity is first asked for.
+//
+{
+    if (engine == 2) {
+        ocean_update(ocean, time, velocity != 0);
+        ocean_sample_n(ocean, count, u, v, offset, normals, velocity, jacobian);
+        return;
+    }
+    gerstner_displacement_n(waves, time, count, u, v, offset, normals, velocity, jacobian);
+}
+
+
+MStatus proWater::getOceanParams(MDataBlock& dataBlock, OceanParams& params)
+//
+//	Description:
+//		Reads the attributes of the fft engine from the data block.
+//
+{
+    MStatus returnStatus;
+    
+    MDataHandle dirData = dataBlock.inputValue(dir, &returnStatus);
+    if(MS::kSuccess != returnStatus) return returnStatus;
+    
+    MDataHandle loopData = dataBlock.inputValue(loop, &returnStatus);
+    if(MS::kSuccess != returnStatus) return returnStatus;
+    
+    MDataHandle loopLengthData = dataBlock.inputValue(loopLength, &returnStatus);
+    if(MS::kSuccess != returnStatus) return returnStatus;
+    
+    MDataHandle windData = dataBlock.inputValue(oceanWindSpeed, &returnStatus);
+    if(MS::kSuccess != returnStatus) return returnStatus;
+    
+    MDataHandle spectrumData = dataBlock.inputValue(oceanSpectrum, &returnStatus);
+    if(MS::kSuccess != returnStatus) return returnStatus;
+    
+    MDataHandle fetchData = dataBlock.inputValue(oceanFetch, &returnStatus);
+    if(MS::kSuccess != returnStatus) return returnStatus;
+    
+    MDataHandle ampData = dataBlock.inputValue(oceanAmplitude, &returnStatus);
+    if(MS::kSuccess != returnStatus) return returnStatus;
+    
+    MDataHandle chopData = dataBlock.inputValue(oceanChoppiness, &returnStatus);
+    if(MS::kSuccess != returnStatus) return returnStatus;
+    
+    MDataHandle tileData = dataBlock.inputValue(oceanTileSize, &returnStatus);
+    if(MS::kSuccess != returnStatus) return returnStatus;
+    
+    MDataHandle resolutionData = dataBlock.inputValue(oceanResolution, &returnStatus);
+    if(MS::kSuccess != returnStatus) return returnStatus;
+    
+    MDataHandle cascadeData = dataBlock.inputValue(oceanCascades, &returnStatus);
+    if(MS::kSuccess != returnStatus) return returnStatus;
+    
+    MDataHandle seedData = dataBlock.inputValue(oceanSeed, &returnStatus);
+    if(MS::kSuccess != returnStatus) return returnStatus;
+    
+    params.direction = dirData.asDouble();
+    params.loopLength = loopData.asBool() ? loopLengthData.asDouble() : 0.0;
+    params.windSpeed = windData.asDouble();
+    params.spectrum = spectrumData.asShort();
+    params.fetch = fetchData.asDouble();
+    params.amplitude = ampData.asDouble();
+    params.choppiness = chopData.asDouble();
+    params.tileSize = tileData.asDouble();
+    params.resolution = resolutionData.asInt();
+    params.cascades = cascadeData.asInt();
+    params.seed = seedData.asInt();
+    
+    return MS::kSuccess;
+}
+
+
+MStatus proWater::getParams(const MObject& node, WaterParams& params)
+//
+//	Description:
+//		Reads the attributes that shape the height field from the plugs of
+//		a node, for callers outside of compute() such as proWaterQuery.
+//		The tolerances are left at 0 so the field is evaluated exactly.
+//		Only the noise engine can be evaluated away from the deformer, the
+//		Gerstner and FFT engines are rejected with kNotImplemented.
+//
+{
+    MStatus status;
+    MFnDependencyNode fnNode(node, &status);
+    if (!status || fnNode.typeId() != proWater::id)
+        return MS::kInvalidParameter;
+    if (MPlug(node, waveEngine).asShort() != 0)
+        return MS::kNotImplemented;
+    
+    params.time = MPlug(node, time).asDouble();
+    params.direction = MPlug(node, dir).asDouble();
+    params.bigAmplitude = MPlug(node, bigFreq).asDouble();
+    params.amplitude1 = MPlug(node, amplitude1).asDouble();
+    params.frequency1 = MPlug(node, frequency1).asDouble();
+    params.amplitude2 = MPlug(node, amplitude2).asDouble();
+    params.frequency2 = MPlug(node, frequency2).asDouble();
+    params.loopLength = MPlug(node, loop).asBool() ? MPlug(node, loopLength).asDouble() : 0.0;
+    params.tileSize = MPlug(node, tileSize).asDouble();
+    short basis = MPlug(node, noiseBasis).asShort();
+    params.tableLayers = basis == 1 ? WATER_TABLE_ALL : basis == 2 ? WATER_TABLE_DETAIL : WATER_TABLE_NONE;
+    
+    return MS::kSuccess;
+}
+
+
+// Layout of the waterParams array.
+enum WaterParamsSlot {
+    WATER_PARAM_DIRECTION,
+    WATER_PARAM_BIG_AMPLITUDE,
+    WATER_PARAM_AMPLITUDE1,
+    WATER_PARAM_FREQUENCY1,
+    WATER_PARAM_AMPLITUDE2,
+    WATER_PARAM_FREQUENCY2,
+    WATER_PARAM_LOOP_LENGTH,
+    WATER_PARAM_TILE_SIZE,
+    WATER_PARAM_TABLE_LAYERS,
+    WATER_PARAM_ENGINE,
+    WATER_PARAM_COUNT
+};
+
+void proWater::packParams(const WaterParams& params, const short engine, MDoubleArray& values)
+{
+    values.setLength(WATER_PARAM_COUNT);
+    values[WATER_PARAM_DIRECTION] = params.direction;
+    values[WATER_PARAM_BIG_AMPLITUDE] = params.bigAmplitude;
+    values[WATER_PARAM_AMPLITUDE1] = params.amplitude1;
+    values[WATER_PARAM_FREQUENCY1] = params.frequency1;
+    values[WATER_PARAM_AMPLITUDE2] = params.amplitude2;
+    values[WATER_PARAM_FREQUENCY2] = params.frequency2;
+    values[WATER_PARAM_LOOP_LENGTH] = params.loopLength;
+    values[WATER_PARAM_TILE_SIZE] = params.tileSize;
+    values[WATER_PARAM_TABLE_LAYERS] = params.tableLayers;
+    values[WATER_PARAM_ENGINE] = engine;
+}
+
+bool proWater::unpackParams(const MDoubleArray& values, WaterParams& params, short& engine)
+{
+    engine = 0;
+    if (values.length() != WATER_PARAM_COUNT)
+        return false;
+    params.direction = values[WATER_PARAM_DIRECTION];
+    params.bigAmplitude = values[WATER_PARAM_BIG_AMPLITUDE];
+    params.amplitude1 = values[WATER_PARAM_AMPLITUDE1];
+    params.frequency1 = values[WATER_PARAM_FREQUENCY1];
+    params.amplitude2 = values[WATER_PARAM_AMPLITUDE2];
+    params.frequency2 = values[WATER_PARAM_FREQUENCY2];
+    params.loopLength = values[WATER_PARAM_LOOP_LENGTH];
+    params.tileSize = values[WATER_PARAM_TILE_SIZE];
+    params.tableLayers = (int)values[WATER_PARAM_TABLE_LAYERS];
+    engine = (short)values[WATER_PARAM_ENGINE];
+    return true;
+}
+
+
+MString proWater::getSkippedLayers(const MObject& node)
+//
+//	Description:
+//		Names the layers the deformer puts on top of the noise field that
+//		getParams() callers do not evaluate, the ripples need the whole
+//		simulation and the terrain its depth grid.
+//
+{
+    MString skipped;
+    if (MPlug(node, ripples).asBool())
+        skipped += "ripples";
+    if (MPlug(node, terrainMesh).isConnected()) {
+        if (skipped.length() > 0)
+            skipped += " and ";
+        skipped += "terrain";
+    }
+    return skipped;
+}
+
+
 /* override */
 MObject&
 proWater::accessoryAttribute() const
@@ -419,12 +2135,1037 @@ proWater::accessoryNodeSetup(MDagModifier& cmd)
 // standard initialization procedures
 //
 
+//
+//  proWaterQuery
+//
+//  Description:
+//		Water surface at arbitrary world space points, for buoyancy rigs
+//		and particles, without deforming or reading back a mesh:
+//
+//			proWaterQuery -p 1 0 2 -p 5 0 3 -normal -velocity proWater1;
+//
+//		Points are taken into the space of the first geometry the node
+//		deforms, whose undisplaced plane sits at -baseHeight (default 0)
+//		along its local y axis. For every point the result holds the world
+//		space height, then the world space normal with -normal and the
+//		vertical velocity per unit of time with -velocity. -time
+//		overrides the time attribute of the node.
+//
+
+class proWaterQuery : public MPxCommand
+{
+public:
+    virtual MStatus doIt(const MArgList& args);
+    
+    static void* creator();
+    static MSyntax newSyntax();
+};
+
+void* proWaterQuery::creator()
+{
+	return new proWaterQuery();
+}
+
+MSyntax proWaterQuery::newSyntax()
+{
+    MSyntax syntax;
+    syntax.addFlag("-p", "-position", MSyntax::kDouble, MSyntax::kDouble, MSyntax::kDouble);
+    syntax.makeFlagMultiUse("-p");
+    syntax.addFlag("-n", "-normal");
+    syntax.addFlag("-v", "-velocity");
+    syntax.addFlag("-t", "-time", MSyntax::kDouble);
+    syntax.addFlag("-bh", "-baseHeight", MSyntax::kDouble);
+    syntax.setObjectType(MSyntax::kSelectionList, 1);
+    syntax.setMaxObjects(1);
+    return syntax;
+}
+
+MStatus proWaterQuery::doIt(const MArgList& args)
+{
+    MStatus status;
+    MArgDatabase argData(syntax(), args, &status);
+    if (!status) return status;
+    
+    MSelectionList objects;
+    argData.getObjects(objects);
+    MObject node;
+    objects.getDependNode(0, node);
+    
+    WaterParams params;
+    status = proWater::getParams(node, params);
+    if (status == MS::kNotImplemented) {
+        displayError("proWaterQuery: only the noise engine (waveEngine 0) is supported");
+        return MS::kInvalidParameter;
+    }
+    if (!status) {
+        displayError("proWaterQuery: expects a proWater node");
+        return status;
+    }
+    MString skipped = proWater::getSkippedLayers(node);
+    if (skipped.length() > 0)
+        displayWarning(MString("proWaterQuery: the ") + skipped + " of the node are left out");
+    if (argData.isFlagSet("-t"))
+        argData.getFlagArgument("-t", 0, params.time);
+    
+    double base = 0.0;
+    if (argData.isFlagSet("-bh"))
+        argData.getFlagArgument("-bh", 0, base);
+    bool normalsOn = argData.isFlagSet("-n");
+    bool velocityOn = argData.isFlagSet("-v");
+    
+    // the field lives in the space of the deformed geometry
+    MMatrix toWorld;
+    MDagPath path;
+    if (MFnGeometryFilter(node).getPathAtIndex(0, path))
+        toWorld = path.inclusiveMatrix();
+    MMatrix toLocal = toWorld.inverse();
+    
+    unsigned int count = argData.numberOfFlagUses("-p");
+    std::vector<float> u(count), v(count);
+    for (unsigned int i = 0; i < count; i++) {
+        MArgList position;
+        argData.getFlagArgumentList("-p", i, position);
+        MPoint p(position.asDouble(0), position.asDouble(1), position.asDouble(2));
+        p = p*toLocal;
+        u[i] = p.x;
+        v[i] = p.z;
+    }
+    
+    WaterPlan plan;
+    water_build_plan(params, plan);
+    std::vector<float> height(count), normals(normalsOn ? 3*count : 0), velocity(velocityOn ? count : 0);
+    if (count > 0)
+        water_query_n(plan, count, &u[0], &v[0], &height[0],
+                      normalsOn ? &normals[0] : 0, velocityOn ? &velocity[0] : 0);
+    
+    // normals transform with the inverse transpose
+    MMatrix normalToWorld = toLocal.transpose();
+    MDoubleArray result;
+    for (unsigned int i = 0; i < count; i++) {
+        MPoint surface = MPoint(u[i], height[i] - base, v[i])*toWorld;
+        result.append(surface.y);
+        if (normalsOn) {
+            MVector normal = (MVector(normals[3*i], normals[3*i + 1], normals[3*i + 2])*normalToWorld).normal();
+            result.append(normal.x);
+            result.append(normal.y);
+            result.append(normal.z);
+        }
+        if (velocityOn)
+            result.append((MVector(0.0, velocity[i], 0.0)*toWorld).y);
+    }
+    setResult(result);
+    
+    return MS::kSuccess;
+}
+
+
+//
+//  proWaterBake
+//
+//  Description:
+//		Bakes the height field of a proWater node over a rectangle of its
+//		rest plane into float images, for displacing a light mesh with a
+//		texture at render time:
+//
+//			proWaterBake -r -50 -50 50 50 -res 2048 2048 -normal -foam
+//			             -file "/tmp/ocean" proWater1;
+//
+//		-format pfm, the default, writes file_height.pfm and, with -normal
+//		and -foam, file_normal.pfm and file_foam.pfm. -format tiled writes
+//		all channels with their mip levels to file.pwt, in tiles of
+//		-tileSize pixels that are also the batches the image is evaluated
+//		in. The rectangle and the heights are in the space of the deformed
+//		geometry like the noise itself, -time overrides the time attribute.
+//		Returns the files written.
+//
+
+class proWaterBake : public MPxCommand
+{
+public:
+    virtual MStatus doIt(const MArgList& args);
+    
+    static void* creator();
+    static MSyntax newSyntax();
+};
+
+void* proWaterBake::creator()
+{
+	return new proWaterBake();
+}
+
+MSyntax proWaterBake::newSyntax()
+{
+    MSyntax syntax;
+    syntax.addFlag("-r", "-rectangle", MSyntax::kDouble, MSyntax::kDouble, MSyntax::kDouble, MSyntax::kDouble);
+    syntax.addFlag("-res", "-resolution", MSyntax::kLong, MSyntax::kLong);
+    syntax.addFlag("-ts", "-tileSize", MSyntax::kLong);
+    syntax.addFlag("-n", "-normal");
+    syntax.addFlag("-fm", "-foam");
+    syntax.addFlag("-t", "-time", MSyntax::kDouble);
+    syntax.addFlag("-f", "-file", MSyntax::kString);
+    syntax.addFlag("-fmt", "-format", MSyntax::kString);
+    syntax.setObjectType(MSyntax::kSelectionList, 1);
+    syntax.setMaxObjects(1);
+    return syntax;
+}
+
+MStatus proWaterBake::doIt(const MArgList& args)
+{
+    MStatus status;
+    MArgDatabase argData(syntax(), args, &status);
+    if (!status) return status;
+    
+    MSelectionList objects;
+    argData.getObjects(objects);
+    MObject node;
+    objects.getDependNode(0, node);
+    
+    WaterParams params;
+    status = proWater::getParams(node, params);
+    if (status == MS::kNotImplemented) {
+        displayError("proWaterBake: only the noise engine (waveEngine 0) is supported");
+        return MS::kInvalidParameter;
+    }
+    if (!status) {
+        displayError("proWaterBake: expects a proWater node");
+        return status;
+    }
+    MString skipped = proWater::getSkippedLayers(node);
+    if (skipped.length() > 0)
+        displayWarning(MString("proWaterBake: the ") + skipped + " of the node are left out");
+    if (argData.isFlagSet("-t"))
+        argData.getFlagArgument("-t", 0, params.time);
+    
+    MString file;
+    if (!argData.isFlagSet("-f")) {
+        displayError("proWaterBake: -file is required");
+        return MS::kInvalidParameter;
+    }
+    argData.getFlagArgument("-f", 0, file);
+    MString format("pfm");
+    if (argData.isFlagSet("-fmt"))
+        argData.getFlagArgument("-fmt", 0, format);
+    if (!(format == "pfm") && !(format == "tiled")) {
+        displayError("proWaterBake: -format is pfm or tiled");
+        return MS::kInvalidParameter;
+    }
+    
+    WaterBakeParams bake;
+    if (argData.isFlagSet("-r")) {
+        double corner;
+        argData.getFlagArgument("-r", 0, corner); bake.u0 = corner;
+        argData.getFlagArgument("-r", 1, corner); bake.v0 = corner;
+        argData.getFlagArgument("-r", 2, corner); bake.u1 = corner;
+        argData.getFlagArgument("-r", 3, corner); bake.v1 = corner;
+    }
+    if (argData.isFlagSet("-res")) {
+        argData.getFlagArgument("-res", 0, bake.width);
+        argData.getFlagArgument("-res", 1, bake.height);
+    }
+    if (argData.isFlagSet("-ts"))
+        argData.getFlagArgument("-ts", 0, bake.tileSize);
+    bake.normals = argData.isFlagSet("-n");
+    bake.foam = argData.isFlagSet("-fm");
+    if (bake.width < 1 || bake.height < 1 || bake.tileSize < 1 || bake.u1 == bake.u0 || bake.v1 == bake.v0) {
+        displayError("proWaterBake: empty rectangle, resolution or tile size");
+        return MS::kInvalidParameter;
+    }
+    
+    WaterPlan plan;
+    water_build_plan(params, plan);
+    WaterImage image;
+    water_bake(plan, bake, image);
+    
+    // the channels of a pixel are the height, the normal and the foam
+    int normalAt = bake.normals ? 1 : -1;
+    int foamAt = bake.normals ? 4 : 1;
+    MStringArray written;
+    bool ok = true;
+    if (format == "tiled") {
+        MString path = file + ".pwt";
+        ok = water_write_tiled(path.asChar(), image, bake.tileSize, normalAt);
+        written.append(path);
+    }
+    else {
+        MString path = file + "_height.pfm";
+        ok = water_write_pfm(path.asChar(), image, 0, 1);
+        written.append(path);
+        if (ok && bake.normals) {
+            path = file + "_normal.pfm";
+            ok = water_write_pfm(path.asChar(), image, normalAt, 3);
+            written.append(path);
+        }
+        if (ok && bake.foam) {
+            path = file + "_foam.pfm";
+            ok = water_write_pfm(path.asChar(), image, foamAt, 1);
+            written.append(path);
+        }
+    }
+    if (!ok) {
+        displayError(MString("proWaterBake: could not write ") + written[written.length() - 1]);
+        return MS::kFailure;
+    }
+    setResult(written);
+    
+    return MS::kSuccess;
+}
+
+
+//
+//  proWaterVat
+//
+//  Description:
+//		Bakes the deformation of a proWater node over a range of frames
+//		into vertex animation textures, for playing the water back in a
+//		game engine:
+//
+//			proWaterVat -s 1 -e 240 -fps 24 -format png16
+//			            -file "/tmp/ocean" proWater1;
+//
+//		Writes file_offset and file_normal, .png with -format png16 and
+//		.exr with -format float, and file.json with the layout and the
+//		bounds the 16 bit offsets were scaled by. Each frame is a block of
+//		rows with one texel per vertex of the undeformed mesh, up to
+//		-maxWidth texels per row. With -uvSet the texel of a vertex at the
+//		first frame is written to that uv set of the deformed mesh, which
+//		undo restores, otherwise the mesh is left alone and the json has
+//		no uv set. The time attribute goes up by -timeStep per frame. The
+//		normals are those of the height field, exact for flat input, or
+//		with -meshNormals rebuilt from the faces of the displaced mesh,
+//		which suits curved input and matches the shading of the mesh. The
+//		frames are evaluated in parallel. Returns the files written.
+//
+
+class proWaterVat : public MPxCommand
+{
+public:
+    proWaterVat() : created(false), assigned(false) {}
+    
+    virtual MStatus doIt(const MArgList& args);
+    virtual MStatus redoIt();
+    virtual MStatus undoIt();
+    virtual bool isUndoable() const { return assigned; }
+    
+    static void* creator();
+    static MSyntax newSyntax();
+    
+private:
+    // the uv set written to the deformed mesh and what it held before,
+    // the files are not part of the undo
+    MDagPath path;
+    MString uvSet;
+    MFloatArray s, t;                   // texel of each vertex
+    bool created;                       // the set did not exist before
+    MFloatArray oldU, oldV;
+    MIntArray oldCounts, oldIds;
+    bool assigned;
+};
+
+void* proWaterVat::creator()
+{
+	return new proWaterVat();
+}
+
+MSyntax proWaterVat::newSyntax()
+{
+    MSyntax syntax;
+    syntax.addFlag("-s", "-start", MSyntax::kLong);
+    syntax.addFlag("-e", "-end", MSyntax::kLong);
+    syntax.addFlag("-ts", "-timeStep", MSyntax::kDouble);
+    syntax.addFlag("-fps", "-framesPerSecond", MSyntax::kDouble);
+    syntax.addFlag("-mw", "-maxWidth", MSyntax::kLong);
+    syntax.addFlag("-uv", "-uvSet", MSyntax::kString);
+    syntax.addFlag("-mn", "-meshNormals");
+    syntax.addFlag("-f", "-file", MSyntax::kString);
+    syntax.addFlag("-fmt", "-format", MSyntax::kString);
+    syntax.setObjectType(MSyntax::kSelectionList, 1);
+    syntax.setMaxObjects(1);
+    return syntax;
+}
+
+MStatus proWaterVat::doIt(const MArgList& args)
+{
+    MStatus status;
+    MArgDatabase argData(syntax(), args, &status);
+    if (!status) return status;
+    
+    MSelectionList objects;
+    argData.getObjects(objects);
+    MObject node;
+    objects.getDependNode(0, node);
+    
+    WaterParams params;
+    status = proWater::getParams(node, params);
+    if (status == MS::kNotImplemented) {
+        displayError("proWaterVat: only the noise engine (waveEngine 0) is supported");
+        return MS::kInvalidParameter;
+    }
+    if (!status) {
+        displayError("proWaterVat: expects a proWater node");
+        return status;
+    }
+    MString skipped = proWater::getSkippedLayers(node);
+    if (skipped.length() > 0)
+        displayWarning(MString("proWaterVat: the ") + skipped + " of the node are left out");
+    
+    MString file;
+    if (!argData.isFlagSet("-f")) {
+        displayError("proWaterVat: -file is required");
+        return MS::kInvalidParameter;
+    }
+    argData.getFlagArgument("-f", 0, file);
+    MString format("png16");
+    if (argData.isFlagSet("-fmt"))
+        argData.getFlagArgument("-fmt", 0, format);
+    if (!(format == "png16") && !(format == "float")) {
+        displayError("proWaterVat: -format is png16 or float");
+        return MS::kInvalidParameter;
+    }
+    bool assignUVs = argData.isFlagSet("-uv");
+    if (assignUVs)
+        argData.getFlagArgument("-uv", 0, uvSet);
+    
+    WaterVatParams vatParams;
+    vatParams.format = format == "float" ? WATER_VAT_EXR : WATER_VAT_PNG16;
+    if (argData.isFlagSet("-s"))
+        argData.getFlagArgument("-s", 0, vatParams.start);
+    if (argData.isFlagSet("-e"))
+        argData.getFlagArgument("-e", 0, vatParams.end);
+    if (argData.isFlagSet("-ts"))
+        argData.getFlagArgument("-ts", 0, vatParams.timeStep);
+    if (argData.isFlagSet("-fps"))
+        argData.getFlagArgument("-fps", 0, vatParams.fps);
+    if (argData.isFlagSet("-mw"))
+        argData.getFlagArgument("-mw", 0, vatParams.maxWidth);
+    if (vatParams.end < vatParams.start || vatParams.maxWidth < 1 || vatParams.fps <= 0.0) {
+        displayError("proWaterVat: empty frame range, width or frame rate");
+        return MS::kInvalidParameter;
+    }
+    
+    // the rest positions and normals come from the undeformed mesh, the
+    // uv set goes on the deformed one
+    MFnGeometryFilter fnFilter(node);
+    MObjectArray inputs;
+    fnFilter.getInputGeometry(inputs);
+    if (inputs.length() == 0 || !inputs[0].hasFn(MFn::kMesh) || fnFilter.getPathAtIndex(0, path) != MS::kSuccess) {
+        displayError("proWaterVat: the proWater node does not deform a mesh");
+        return MS::kFailure;
+    }
+    MFnMesh restFn(inputs[0]);
+    MPointArray points;
+    MFloatVectorArray restNormals;
+    restFn.getPoints(points);
+    restFn.getVertexNormals(false, restNormals);
+    int count = points.length();
+    std::vector<float> u(count), v(count), normals(3*count), restPoints(3*count);
+    for (int i = 0; i < count; i++) {
+        u[i] = points[i].x;
+        v[i] = points[i].z;
+        restPoints[3*i] = points[i].x;
+        restPoints[3*i + 1] = points[i].y;
+        restPoints[3*i + 2] = points[i].z;
+        normals[3*i] = restNormals[i].x;
+        normals[3*i + 1] = restNormals[i].y;
+        normals[3*i + 2] = restNormals[i].z;
+    }
+    
+    // with -meshNormals the normals of every frame come from the faces of
+    // the displaced mesh
+    MIntArray polygonCounts, polygonConnects;
+    MeshTopology topology;
+    bool hasTopology = false;
+    if (argData.isFlagSet("-mn") && count > 0) {
+        restFn.getVertices(polygonCounts, polygonConnects);
+        std::vector<int> counts(polygonCounts.length() + 1), connects(polygonConnects.length() + 1);
+        for (unsigned int k = 0; k < polygonCounts.length(); k++)
+            counts[k] = polygonCounts[k];
+        for (unsigned int k = 0; k < polygonConnects.length(); k++)
+            connects[k] = polygonConnects[k];
+        hasTopology = mesh_build_topology(count, polygonCounts.length(), &counts[0], &connects[0], topology);
+    }
+    
+    WaterVat vat;
+    water_vat_bake(params, vatParams, count, count ? &u[0] : 0, count ? &v[0] : 0,
+                   count ? &normals[0] : 0, vat, hasTopology ? &topology : 0,
+                   count ? &restPoints[0] : 0);
+    
+    MString extension = vatParams.format == WATER_VAT_EXR ? ".exr" : ".png";
+    MString offsetPath = file + "_offset" + extension;
+    MString normalPath = file + "_normal" + extension;
+    MString jsonPath = file + ".json";
+    MStringArray written;
+    written.append(offsetPath);
+    bool ok = water_vat_write_image(offsetPath.asChar(), vat, vat.offsets, vatParams.format, false);
+    if (ok) {
+        written.append(normalPath);
+        ok = water_vat_write_image(normalPath.asChar(), vat, vat.normals, vatParams.format, true);
+    }
+    if (ok) {
+        written.append(jsonPath);
+        ok = water_vat_write_json(jsonPath.asChar(), vat, vatParams, offsetPath.asChar(),
+                                  normalPath.asChar(), assignUVs ? uvSet.asChar() : 0);
+    }
+    if (!ok) {
+        displayError(MString("proWaterVat: could not write ") + written[written.length() - 1]);
+        return MS::kFailure;
+    }
+    
+    setResult(written);
+    if (!assignUVs)
+        return MS::kSuccess;
+    
+    // one uv per vertex, shared by all of its faces
+    s.setLength(count);
+    t.setLength(count);
+    for (int i = 0; i < count; i++)
+        water_vat_uv(vat, i, s[i], t[i]);
+    MFnMesh meshFn(path, &status);
+    if (status == MS::kSuccess && meshFn.numVertices() != count)
+        status = MS::kFailure;
+    if (status == MS::kSuccess) {
+        MStringArray uvSets;
+        meshFn.getUVSetNames(uvSets);
+        created = true;
+        for (unsigned int i = 0; i < uvSets.length(); i++)
+            created = created && !(uvSets[i] == uvSet);
+        if (!created) {
+            meshFn.getUVs(oldU, oldV, &uvSet);
+            meshFn.getAssignedUVs(oldCounts, oldIds, &uvSet);
+        }
+        status = redoIt();
+    }
+    if (status != MS::kSuccess)
+        displayWarning(MString("proWaterVat: could not set the uv set ") + uvSet);
+    return MS::kSuccess;
+}
+
+MStatus proWaterVat::redoIt()
+{
+    MStatus status;
+    MFnMesh meshFn(path, &status);
+    if (status != MS::kSuccess)
+        return status;
+    if (created)
+        uvSet = meshFn.createUVSetWithName(uvSet);
+    else
+        meshFn.clearUVs(&uvSet);
+    MIntArray polygonCounts, polygonConnects;
+    meshFn.getVertices(polygonCounts, polygonConnects);
+    status = meshFn.setUVs(s, t, &uvSet);
+    if (status == MS::kSuccess)
+        status = meshFn.assignUVs(polygonCounts, polygonConnects, &uvSet);
+    assigned = status == MS::kSuccess;
+    return status;
+}
+
+MStatus proWaterVat::undoIt()
+{
+    MStatus status;
+    MFnMesh meshFn(path, &status);
+    if (status != MS::kSuccess)
+        return status;
+    if (created)
+        return meshFn.deleteUVSet(uvSet);
+    meshFn.clearUVs(&uvSet);
+    status = meshFn.setUVs(oldU, oldV, &uvSet);
+    if (status == MS::kSuccess)
+        status = meshFn.assignUVs(oldCounts, oldIds, &uvSet);
+    return status;
+}
+
+
+//
+//  proWaterSurface
+//
+//  Description:
+//		Generates the ocean itself instead of deforming a mesh of uniform
+//		density. The output is a flat mesh of nested clipmap levels around
+//		the camera whose world matrix drives cameraMatrix, dense close to
+//		it and coarser further out, with the same number of vertices
+//		however far the water reaches:
+//
+//			connectAttr camera1.worldMatrix proWaterSurface1.cameraMatrix;
+//			connectAttr proWaterSurface1.outMesh oceanShape.inMesh;
+//			deformer -type proWater ocean;
+//
+//		The mesh is made in world space, for a shape whose transform is
+//		left at identity, and goes through the proWater deformer like any
+//		other mesh. The vertices stay put while the camera moves within a
+//		cell, so the deformer only sees new points when a level snaps.
+//
+
+class proWaterSurface : public MPxNode
+{
+public:
+    proWaterSurface() {}
+    virtual ~proWaterSurface() {}
+    
+    virtual MStatus compute(const MPlug& plug, MDataBlock& dataBlock);
+    
+    static void* creator();
+    static MStatus initialize();
+    
+    static MTypeId id;
+    
+    static MObject cameraMatrix;
+    static MObject levels;
+    static MObject ringResolution;
+    static MObject cellSize;
+    static MObject outMesh;
+    
+private:
+    ClipmapMesh clipmap;
+};
+
+MTypeId proWaterSurface::id( 0x8000d );
+
+MObject proWaterSurface::cameraMatrix;
+MObject proWaterSurface::levels;
+MObject proWaterSurface::ringResolution;
+MObject proWaterSurface::cellSize;
+MObject proWaterSurface::outMesh;
+
+void* proWaterSurface::creator()
+{
+	return new proWaterSurface();
+}
+
+MStatus proWaterSurface::initialize()
+{
+    //cameraMatrix parameter, world matrix of the camera the levels follow
+    MFnMatrixAttribute camAttr;
+    cameraMatrix = camAttr.create("cameraMatrix", "cam");
+    camAttr.setStorable(false);
+    camAttr.setConnectable(true);
+    addAttribute(cameraMatrix);
+    //
+    
+    //levels parameter, each one doubles the cell size and the reach
+    MFnNumericAttribute levelsAttr;
+    levels = levelsAttr.create("levels", "lvl", MFnNumericData::kInt);
+    levelsAttr.setDefault(6);
+    levelsAttr.setSoftMin(1);
+    levelsAttr.setSoftMax(12);
+    levelsAttr.setMin(1);
+    levelsAttr.setMax(24);
+    addAttribute(levels);
+    //
+    
+    //ringResolution parameter, cells along a side of every level
+    MFnNumericAttribute resAttr;
+    ringResolution = resAttr.create("ringResolution", "rres", MFnNumericData::kInt);
+    resAttr.setDefault(128);
+    resAttr.setSoftMin(16);
+    resAttr.setSoftMax(512);
+    resAttr.setMin(8);
+    resAttr.setMax(4096);
+    addAttribute(ringResolution);
+    //
+    
+    //cellSize parameter, side of the cells closest to the camera
+    MFnNumericAttribute cellAttr;
+    cellSize = cellAttr.create("cellSize", "csz", MFnNumericData::kDouble);
+    cellAttr.setDefault(0.5);
+    cellAttr.setSoftMin(0.01);
+    cellAttr.setSoftMax(10);
+    cellAttr.setMin(0.0001);
+    addAttribute(cellSize);
+    //
+    
+    //outMesh, the flat levels for the deformer
+    MFnTypedAttribute meshAttr;
+    outMesh = meshAttr.create("outMesh", "out", MFnData::kMesh);
+    meshAttr.setWritable(false);
+    meshAttr.setStorable(false);
+    addAttribute(outMesh);
+    //
+    
+    attributeAffects(proWaterSurface::cameraMatrix, proWaterSurface::outMesh);
+    attributeAffects(proWaterSurface::levels, proWaterSurface::outMesh);
+    attributeAffects(proWaterSurface::ringResolution, proWaterSurface::outMesh);
+    attributeAffects(proWaterSurface::cellSize, proWaterSurface::outMesh);
+    
+    return MS::kSuccess;
+}
+
+MStatus proWaterSurface::compute(const MPlug& plug, MDataBlock& dataBlock)
+{
+    if (plug != outMesh)
+        return MS::kUnknownParameter;
+    
+    MStatus returnStatus;
+    
+    MDataHandle camData = dataBlock.inputValue(cameraMatrix, &returnStatus);
+    if(MS::kSuccess != returnStatus) return returnStatus;
+    MPoint eye = MPoint(0.0, 0.0, 0.0)*camData.asMatrix();
+    
+    MDataHandle levelsData = dataBlock.inputValue(levels, &returnStatus);
+    if(MS::kSuccess != returnStatus) return returnStatus;
+    
+    MDataHandle resData = dataBlock.inputValue(ringResolution, &returnStatus);
+    if(MS::kSuccess != returnStatus) return returnStatus;
+    
+    MDataHandle cellData = dataBlock.inputValue(cellSize, &returnStatus);
+    if(MS::kSuccess != returnStatus) return returnStatus;
+    
+    ClipmapParams params;
+    params.levels = levelsData.asInt();
+    params.resolution = resData.asInt();
+    params.cellSize = cellData.asDouble();
+    clipmap_build(params, eye.x, eye.z, clipmap);
+    
+    // the arrays are kept between evaluations, only the Maya mesh is
+    // made again every time
+    unsigned int vertexCount = clipmap.points.size()/3;
+    MFloatPointArray points(vertexCount);
+    for (unsigned int i = 0; i < vertexCount; i++)
+        points[i] = MFloatPoint(clipmap.points[3*i], clipmap.points[3*i + 1], clipmap.points[3*i + 2]);
+    MIntArray polygonCounts(clipmap.polygonCounts.size());
+    for (unsigned int i = 0; i < clipmap.polygonCounts.size(); i++)
+        polygonCounts[i] = clipmap.polygonCounts[i];
+    MIntArray polygonConnects(clipmap.polygonConnects.size());
+    for (unsigned int i = 0; i < clipmap.polygonConnects.size(); i++)
+        polygonConnects[i] = clipmap.polygonConnects[i];
+    
+    MFnMeshData dataCreator;
+    MObject meshData = dataCreator.create(&returnStatus);
+    if(MS::kSuccess != returnStatus) return returnStatus;
+    MFnMesh meshFn;
+    meshFn.create(vertexCount, polygonCounts.length(), points, polygonCounts, polygonConnects,
+                  meshData, &returnStatus);
+    if(MS::kSuccess != returnStatus) return returnStatus;
+    
+    MDataHandle outData = dataBlock.outputValue(outMesh);
+    outData.set(meshData);
+    outData.setClean();
+    return MS::kSuccess;
+}
+
+
+//
+//  proWaterTexture
+//
+//  Description:
+//		The height field of a proWater node as a 2D texture, so shading
+//		networks can use the same water as the deformer for foam, colour
+//		variation or displacement:
+//
+//			connectAttr proWater1.waterParams proWaterTexture1.waterParams;
+//			connectAttr time1.outTime proWaterTexture1.time;
+//			connectAttr place2dTexture1.outUV proWaterTexture1.uvCoord;
+//
+//		The uv square maps to size units of the rest plane from
+//		(originU, originV). Texels every texelSize units are evaluated in
+//		tiles of tileSize texels as samples first reach them, and at most
+//		maxTiles tiles are kept until the time or the parameters change.
+//		outHeight and the grey outColor are the displacement, outFoam and
+//		outAlpha the foam mask. Without a proWater node the default
+//		parameters are used, and a proWater node on the Gerstner or FFT
+//		engine gives a flat surface. Renderers sample from several threads
+//		at once, so the plan is rebuilt under a lock and the tile cache
+//		guards its own tiles.
+//
+
+class proWaterTexture : public MPxNode
+{
+public:
+    proWaterTexture() : planSignature(0), planTime(0.0), planValid(false), tileSignature(0) {}
+    virtual ~proWaterTexture() {}
+    
+    virtual MStatus compute(const MPlug& plug, MDataBlock& dataBlock);
+    
+    static void* creator();
+    static MStatus initialize();
+    
+    static MTypeId id;
+    
+    static MObject uCoord;
+    static MObject vCoord;
+    static MObject uvCoord;
+    static MObject uvFilterSizeX;
+    static MObject uvFilterSizeY;
+    static MObject uvFilterSize;
+    static MObject time;
+    static MObject waterParams;
+    static MObject originU;
+    static MObject originV;
+    static MObject size;
+    static MObject texelSize;
+    static MObject tileSize;
+    static MObject maxTiles;
+    static MObject outHeight;
+    static MObject outFoam;
+    static MObject outColor;
+    static MObject outAlpha;
+    
+private:
+    MMutexLock lock;            // of the plan and its signatures
+    WaterPlan plan;
+    WaterHash planSignature;
+    double planTime;
+    bool planValid;
+    WaterHash tileSignature;
+    WaterTileCache tiles;       // thread safe on its own
+};
+
+MTypeId proWaterTexture::id( 0x8000e );
+
+MObject proWaterTexture::uCoord;
+MObject proWaterTexture::vCoord;
+MObject proWaterTexture::uvCoord;
+MObject proWaterTexture::uvFilterSizeX;
+MObject proWaterTexture::uvFilterSizeY;
+MObject proWaterTexture::uvFilterSize;
+MObject proWaterTexture::time;
+MObject proWaterTexture::waterParams;
+MObject proWaterTexture::originU;
+MObject proWaterTexture::originV;
+MObject proWaterTexture::size;
+MObject proWaterTexture::texelSize;
+MObject proWaterTexture::tileSize;
+MObject proWaterTexture::maxTiles;
+MObject proWaterTexture::outHeight;
+MObject proWaterTexture::outFoam;
+MObject proWaterTexture::outColor;
+MObject proWaterTexture::outAlpha;
+
+void* proWaterTexture::creator()
+{
+	return new proWaterTexture();
+}
+
+MStatus proWaterTexture::initialize()
+{
+    //uvCoord and uvFilterSize, named as place2dTexture expects them
+    MFnNumericAttribute uvAttr;
+    uCoord = uvAttr.create("uCoord", "u", MFnNumericData::kFloat);
+    vCoord = uvAttr.create("vCoord", "v", MFnNumericData::kFloat);
+    uvCoord = uvAttr.create("uvCoord", "uv", uCoord, vCoord);
+    uvAttr.setKeyable(true);
+    uvAttr.setHidden(true);
+    addAttribute(uvCoord);
+    
+    MFnNumericAttribute filterAttr;
+    uvFilterSizeX = filterAttr.create("uvFilterSizeX", "fsx", MFnNumericData::kFloat);
+    uvFilterSizeY = filterAttr.create("uvFilterSizeY", "fsy", MFnNumericData::kFloat);
+    uvFilterSize = filterAttr.create("uvFilterSize", "fs", uvFilterSizeX, uvFilterSizeY);
+    filterAttr.setKeyable(true);
+    filterAttr.setHidden(true);
+    addAttribute(uvFilterSize);
+    //
+    
+    //time parameter
+    MFnNumericAttribute timeAttr;
+    time = timeAttr.create("time", "t", MFnNumericData::kDouble);
+    timeAttr.setDefault(0.0);
+    timeAttr.setKeyable(true);
+    addAttribute(time);
+    //
+    
+    //waterParams, connected from the proWater node to evaluate
+    MFnTypedAttribute paramsAttr;
+    waterParams = paramsAttr.create("waterParams", "wpa", MFnData::kDoubleArray);
+    paramsAttr.setStorable(false);
+    paramsAttr.setConnectable(true);
+    addAttribute(waterParams);
+    //
+    
+    //originU, originV and size parameters, the rest plane square the uv
+    //square maps to
+    MFnNumericAttribute originUAttr;
+    originU = originUAttr.create("originU", "ou", MFnNumericData::kDouble);
+    originUAttr.setDefault(-50.0);
+    originUAttr.setKeyable(true);
+    addAttribute(originU);
+    
+    MFnNumericAttribute originVAttr;
+    originV = originVAttr.create("originV", "ov", MFnNumericData::kDouble);
+    originVAttr.setDefault(-50.0);
+    originVAttr.setKeyable(true);
+    addAttribute(originV);
+    
+    MFnNumericAttribute sizeAttr;
+    size = sizeAttr.create("size", "sz", MFnNumericData::kDouble);
+    sizeAttr.setDefault(100.0);
+    sizeAttr.setKeyable(true);
+    sizeAttr.setSoftMin(1);
+    sizeAttr.setSoftMax(1000);
+    addAttribute(size);
+    //
+    
+    //texelSize parameter, spacing of the evaluated texels on the rest plane
+    MFnNumericAttribute texelAttr;
+    texelSize = texelAttr.create("texelSize", "txs", MFnNumericData::kDouble);
+    texelAttr.setDefault(0.25);
+    texelAttr.setSoftMin(0.01);
+    texelAttr.setSoftMax(2);
+    texelAttr.setMin(0.0001);
+    addAttribute(texelSize);
+    //
+    
+    //tileSize parameter, texels along a side of an evaluated tile
+    MFnNumericAttribute tileAttr;
+    tileSize = tileAttr.create("tileSize", "tls", MFnNumericData::kInt);
+    tileAttr.setDefault(64);
+    tileAttr.setSoftMin(8);
+    tileAttr.setSoftMax(256);
+    tileAttr.setMin(1);
+    addAttribute(tileSize);
+    //
+    
+    //maxTiles parameter, tiles kept before the least recently used go
+    MFnNumericAttribute maxAttr;
+    maxTiles = maxAttr.create("maxTiles", "mxt", MFnNumericData::kInt);
+    maxAttr.setDefault(256);
+    maxAttr.setSoftMin(16);
+    maxAttr.setSoftMax(4096);
+    maxAttr.setMin(1);
+    addAttribute(maxTiles);
+    //
+    
+    //outputs
+    MFnNumericAttribute outAttr;
+    outHeight = outAttr.create("outHeight", "oh", MFnNumericData::kFloat);
+    outAttr.setWritable(false);
+    outAttr.setStorable(false);
+    addAttribute(outHeight);
+    
+    outFoam = outAttr.create("outFoam", "of", MFnNumericData::kFloat);
+    outAttr.setWritable(false);
+    outAttr.setStorable(false);
+    addAttribute(outFoam);
+    
+    outColor = outAttr.createColor("outColor", "oc");
+    outAttr.setWritable(false);
+    outAttr.setStorable(false);
+    addAttribute(outColor);
+    
+    outAlpha = outAttr.create("outAlpha", "oa", MFnNumericData::kFloat);
+    outAttr.setWritable(false);
+    outAttr.setStorable(false);
+    addAttribute(outAlpha);
+    //
+    
+    MObject inputs[] = { uvCoord, uvFilterSize, time, waterParams, originU, originV, size,
+                         texelSize, tileSize, maxTiles };
+    MObject outputs[] = { outHeight, outFoam, outColor, outAlpha };
+    for (unsigned int i = 0; i < sizeof(inputs)/sizeof(inputs[0]); i++)
+        for (unsigned int o = 0; o < sizeof(outputs)/sizeof(outputs[0]); o++)
+            attributeAffects(inputs[i], outputs[o]);
+    
+    return MS::kSuccess;
+}
+
+MStatus proWaterTexture::compute(const MPlug& plug, MDataBlock& dataBlock)
+{
+    if (plug != outHeight && plug != outFoam && plug != outColor && plug.parent() != outColor &&
+        plug != outAlpha)
+        return MS::kUnknownParameter;
+    
+    MStatus returnStatus;
+    
+    MDataHandle uvData = dataBlock.inputValue(uvCoord, &returnStatus);
+    if(MS::kSuccess != returnStatus) return returnStatus;
+    float2& uv = uvData.asFloat2();
+    
+    MDataHandle timeData = dataBlock.inputValue(time, &returnStatus);
+    if(MS::kSuccess != returnStatus) return returnStatus;
+    double t = timeData.asDouble();
+    
+    MDataHandle paramsData = dataBlock.inputValue(waterParams, &returnStatus);
+    if(MS::kSuccess != returnStatus) return returnStatus;
+    MFnDoubleArrayData valuesFn(paramsData.data(), &returnStatus);
+    MDoubleArray values;
+    if (returnStatus == MS::kSuccess)
+        values = valuesFn.array();
+    
+    // a Gerstner or FFT node is not evaluated here, rather than showing
+    // the noise field its sliders would make
+    WaterParams params;
+    short engine;
+    proWater::unpackParams(values, params, engine);
+    if (engine != 0)
+        params.bigAmplitude = params.amplitude1 = params.amplitude2 = 0.0;
+    WaterHash signature = water_signature(params, 0, 0, 0);
+    
+    MDataHandle originUData = dataBlock.inputValue(originU, &returnStatus);
+    if(MS::kSuccess != returnStatus) return returnStatus;
+    
+    MDataHandle originVData = dataBlock.inputValue(originV, &returnStatus);
+    if(MS::kSuccess != returnStatus) return returnStatus;
+    
+    MDataHandle sizeData = dataBlock.inputValue(size, &returnStatus);
+    if(MS::kSuccess != returnStatus) return returnStatus;
+    
+    MDataHandle texelData = dataBlock.inputValue(texelSize, &returnStatus);
+    if(MS::kSuccess != returnStatus) return returnStatus;
+    
+    MDataHandle tileData = dataBlock.inputValue(tileSize, &returnStatus);
+    if(MS::kSuccess != returnStatus) return returnStatus;
+    
+    MDataHandle maxData = dataBlock.inputValue(maxTiles, &returnStatus);
+    if(MS::kSuccess != returnStatus) return returnStatus;
+    
+    // the plan is only rebuilt when the parameters or the time changed,
+    // not for every sample, and copied out so the lock is not held while
+    // sampling
+    float height, foam;
+    lock.lock();
+    if (!planValid || signature != planSignature || t != planTime) {
+        params.time = t;
+        params.coarseTolerance = 0.0;
+        water_build_plan(params, plan);
+        
+        // the time goes in as if it were a point
+        float key = (float)water_wrap_time(params);
+        tileSignature = water_signature(params, 1, &key, &key);
+        planSignature = signature;
+        planTime = t;
+        planValid = true;
+    }
+    WaterPlan samplePlan = plan;
+    WaterHash sampleSignature = tileSignature;
+    lock.unlock();
+    
+    tiles.setLattice(texelData.asDouble(), tileData.asInt(), maxData.asInt());
+    tiles.sample(sampleSignature, samplePlan, originUData.asDouble() + uv[0]*sizeData.asDouble(),
+                 originVData.asDouble() + uv[1]*sizeData.asDouble(), height, foam);
+    
+    MDataHandle heightOut = dataBlock.outputValue(outHeight);
+    heightOut.set(height);
+    heightOut.setClean();
+    MDataHandle foamOut = dataBlock.outputValue(outFoam);
+    foamOut.set(foam);
+    foamOut.setClean();
+    MDataHandle colorOut = dataBlock.outputValue(outColor);
+    colorOut.set(height, height, height);
+    colorOut.setClean();
+    MDataHandle alphaOut = dataBlock.outputValue(outAlpha);
+    alphaOut.set(foam);
+    alphaOut.setClean();
+    return MS::kSuccess;
+}
+
+
 MStatus initializePlugin( MObject obj )
 {
 	MStatus result;
 	MFnPlugin plugin( obj, PLUGIN_COMPANY, "3.0", "Any");
 	result = plugin.registerNode( "proWater", proWater::id, proWater::creator,
 								  proWater::initialize, MPxNode::kDeformerNode );
+	if (!result) return result;
+	result = plugin.registerCommand( "proWaterQuery", proWaterQuery::creator, proWaterQuery::newSyntax );
+	if (!result) return result;
+	result = plugin.registerCommand( "proWaterBake", proWaterBake::creator, proWaterBake::newSyntax );
+	if (!result) return result;
+	result = plugin.registerCommand( "proWaterVat", proWaterVat::creator, proWaterVat::newSyntax );
+	if (!result) return result;
+	result = plugin.registerNode( "proWaterSurface", proWaterSurface::id, proWaterSurface::creator,
+								  proWaterSurface::initialize );
+	if (!result) return result;
+	MString textureClassification("texture/2d");
+	result = plugin.registerNode( "proWaterTexture", proWaterTexture::id, proWaterTexture::creator,
+								  proWaterTexture::initialize, MPxNode::kDependNode, &textureClassification );
     
 	return result;
 }
@@ -434,5 +3175,15 @@ MStatus uninitializePlugin( MObject obj)
 	MStatus result;
 	MFnPlugin plugin( obj );
 	result = plugin.deregisterNode( proWater::id );
+	if (!result) return result;
+	result = plugin.deregisterCommand( "proWaterQuery" );
+	if (!result) return result;
+	result = plugin.deregisterCommand( "proWaterBake" );
+	if (!result) return result;
+	result = plugin.deregisterCommand( "proWaterVat" );
+	if (!result) return result;
+	result = plugin.deregisterNode( proWaterSurface::id );
+	if (!result) return result;
+	result = plugin.deregisterNode( proWaterTexture::id );
 	return result;
 }
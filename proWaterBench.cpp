@@ -0,0 +1,665 @@
+//
+//  File: proWaterBench.cpp
+//
+//  Description:
+//		Benchmarks and regression checks of the engine outside of Maya.
+//		Each check prints what it measured and PASS or FAIL, and the exit
+//		status is the number of checks that failed:
+//
+//			proWaterBench                  every check
+//			proWaterBench rays caches      only those
+//
+//		simd    the SSE2 kernels of the simplex noise, the wavetable and
+//		        the Gerstner waves against the scalar functions and a
+//		        double precision sum.
+//		rays    water_intersect_n() against a brute force march of 0.01
+//		        steps, the surface evaluations per ray, and the time per
+//		        ray on one core in packets against one ray per call.
+//		caches  the frame cache, the time keys, the advected fields, the
+//		        tile map, the texture tiles and the ripple checkpoints
+//		        against evaluating the same frame directly.
+//
+//		The other half of the SSE2 check is a scalar build of the same
+//		file. It writes what the whole engine gives for a fixed scene and
+//		the SSE2 build compares against that:
+//
+//			./proWaterBenchScalar -write scalar.bin
+//			./proWaterBench -compare scalar.bin
+//
+//		make proWaterBench builds it, and make check builds both and runs
+//		the comparison and every check.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <vector>
+#include <algorithm>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <simplexNoise.cpp>
+#include <noiseTable.cpp>
+#include <waterEngine.cpp>
+#include <gerstnerWaves.cpp>
+#include <rippleSolver.cpp>
+#include <waterTexture.cpp>
+
+
+// Points of the scene every check shares, a jittered square of the rest
+// plane.
+static const int BENCH_SIDE = 128;
+static const float BENCH_SPACING = 0.37f;
+
+static int benchFailures = 0;
+
+static double bench_seconds()
+{
+#ifdef _OPENMP
+    return omp_get_wtime();
+#else
+    return (double)clock()/CLOCKS_PER_SEC;
+#endif
+}
+
+static void bench_threads(const int threads)
+{
+#ifdef _OPENMP
+    omp_set_num_threads(threads);
+#else
+    (void)threads;
+#endif
+}
+
+static int bench_max_threads()
+{
+#ifdef _OPENMP
+    return omp_get_num_procs();
+#else
+    return 1;
+#endif
+}
+
+// rand() in [0, 1], as the rays were first measured with.
+static float bench_rand()
+{
+    return rand()/(float)RAND_MAX;
+}
+
+// Same numbers on every platform, unlike rand().
+static float bench_random(unsigned int& state)
+{
+    state = state*1664525u + 1013904223u;
+    return (state >> 8)*(1.0f/16777216.0f);
+}
+
+static void bench_points(std::vector<float>& u, std::vector<float>& v)
+{
+    unsigned int state = 7;
+    u.resize(BENCH_SIDE*BENCH_SIDE);
+    v.resize(BENCH_SIDE*BENCH_SIDE);
+    for (int j = 0; j < BENCH_SIDE; j++)
+        for (int i = 0; i < BENCH_SIDE; i++) {
+            u[j*BENCH_SIDE + i] = (i + bench_random(state))*BENCH_SPACING - 20.0f;
+            v[j*BENCH_SIDE + i] = (j + bench_random(state))*BENCH_SPACING - 20.0f;
+        }
+}
+
+static float bench_max_difference(const int n, const float* a, const float* b)
+{
+    float worst = 0.0f;
+    for (int i = 0; i < n; i++) {
+        float d = fabsf(a[i] - b[i]);
+        worst = d > worst || d != d ? d : worst;
+    }
+    return worst;
+}
+
+static void bench_report(const char* name, const bool pass, const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    printf("  %-34s ", name);
+    vprintf(format, args);
+    printf("  %s\n", pass ? "PASS" : "FAIL");
+    va_end(args);
+    if (!pass)
+        benchFailures++;
+}
+
+
+// The batched SSE2 kernels against the scalar functions of the same
+// build, which never use SSE2.
+static void bench_simd()
+{
+    printf("simd\n");
+    const int n = 100003;
+    std::vector<float> x(n), y(n), z(n), w(n);
+    unsigned int state = 1;
+    for (int i = 0; i < n; i++) {
+        x[i] = (bench_random(state) - 0.5f)*200.0f;
+        y[i] = (bench_random(state) - 0.5f)*200.0f;
+        z[i] = (bench_random(state) - 0.5f)*20.0f;
+        w[i] = (bench_random(state) - 0.5f)*20.0f;
+    }
+
+    std::vector<float> out(n), dx(n), dy(n), dz(n), ref(n), gx(n), gy(n), gz(n);
+    raw_noise_4d_n(n, &x[0], &y[0], &z[0], &w[0], &out[0]);
+    for (int i = 0; i < n; i++)
+        ref[i] = raw_noise_4d(x[i], y[i], z[i], w[i]);
+    float error = bench_max_difference(n, &out[0], &ref[0]);
+    bench_report("raw_noise_4d_n", error < 1e-5f, "max error %.2g", error);
+
+    raw_noise_2d_deriv_n(n, &x[0], &y[0], &out[0], &dx[0], &dy[0]);
+    for (int i = 0; i < n; i++) {
+        float g[2];
+        ref[i] = raw_noise_2d_deriv(x[i], y[i], g);
+        gx[i] = g[0];
+        gy[i] = g[1];
+    }
+    error = bench_max_difference(n, &out[0], &ref[0]);
+    float gradient = std::max(bench_max_difference(n, &dx[0], &gx[0]), bench_max_difference(n, &dy[0], &gy[0]));
+    bench_report("raw_noise_2d_deriv_n", error < 1e-5f && gradient < 1e-4f, "max error %.2g, gradient %.2g",
+                 error, gradient);
+
+    raw_noise_3d_deriv_n(n, &x[0], &y[0], &z[0], &out[0], &dx[0], &dy[0], &dz[0]);
+    for (int i = 0; i < n; i++) {
+        float g[3];
+        ref[i] = raw_noise_3d_deriv(x[i], y[i], z[i], g);
+        gx[i] = g[0];
+        gy[i] = g[1];
+        gz[i] = g[2];
+    }
+    error = bench_max_difference(n, &out[0], &ref[0]);
+    gradient = std::max(std::max(bench_max_difference(n, &dx[0], &gx[0]), bench_max_difference(n, &dy[0], &gy[0])),
+                        bench_max_difference(n, &dz[0], &gz[0]));
+    bench_report("raw_noise_3d_deriv_n", error < 1e-5f && gradient < 1e-4f, "max error %.2g, gradient %.2g",
+                 error, gradient);
+
+    noise_table_init();
+    table_noise_3d_n(n, &x[0], &y[0], &z[0], &out[0]);
+    for (int i = 0; i < n; i++)
+        ref[i] = table_noise_3d(x[i], y[i], z[i]);
+    error = bench_max_difference(n, &out[0], &ref[0]);
+    bench_report("table_noise_3d_n", error < 1e-5f, "max error %.2g", error);
+
+    // the Gerstner sums against the same sums in double, the wave count
+    // is not a multiple of 4 so the padding is covered too
+    GerstnerParams params;
+    params.count = 37;
+    params.time = 12.5;
+    GerstnerWaves waves;
+    gerstner_build_waves(params, waves);
+    std::vector<float> u, v;
+    bench_points(u, v);
+    int m = (int)u.size();
+    std::vector<float> offset(3*m);
+    gerstner_displacement_n(waves, params.time, m, &u[0], &v[0], &offset[0]);
+    double amplitude = 0.0;
+    for (int k = 0; k < waves.count; k++)
+        amplitude += waves.amplitude[k];
+    error = 0.0f;
+    for (int p = 0; p < m; p++) {
+        double sum[3] = {0.0, 0.0, 0.0};
+        for (int k = 0; k < waves.count; k++) {
+            double theta = (double)waves.kx[k]*u[p] + (double)waves.kz[k]*v[p] +
+                           fmod((double)waves.phase[k] - (double)waves.omega[k]*params.time, 2*GERSTNER_PI);
+            sum[0] += waves.chopX[k]*cos(theta);
+            sum[1] += waves.amplitude[k]*sin(theta);
+            sum[2] += waves.chopZ[k]*cos(theta);
+        }
+        for (int c = 0; c < 3; c++)
+            error = std::max(error, (float)fabs(offset[3*p + c] - sum[c]));
+    }
+    bench_report("gerstner_displacement_n", error < 1e-5f*amplitude, "max error %.2g of %.3g amplitude",
+                 error, amplitude);
+}
+
+
+// Evaluations per ray the tracer may take on average over the test rays,
+// it took 102.9 when it was added.
+static const double BENCH_RAY_EVALUATIONS = 105.0;
+
+// 4096 rays over the default field, one in eight starting under the water
+// and going up.
+static void bench_rays()
+{
+    printf("rays\n");
+    WaterParams params;
+    params.time = 4.0;
+    WaterPlan plan;
+    water_build_plan(params, plan);
+
+    const int n = 4096;
+    const float maxDistance = 200.0f, tolerance = 1e-3f;
+    std::vector<float> origins(3*n), directions(3*n);
+    srand(3);
+    for (int i = 0; i < n; i++) {
+        origins[3*i] = bench_rand()*50.0f;
+        origins[3*i + 1] = i % 8 == 0 ? -3.0f : 12.0f + bench_rand()*5.0f;
+        origins[3*i + 2] = bench_rand()*50.0f;
+        float angle = bench_rand()*6.283f;
+        directions[3*i] = cosf(angle);
+        directions[3*i + 1] = i % 8 == 0 ? 0.3f : -(0.05f + bench_rand()*0.6f);
+        directions[3*i + 2] = sinf(angle);
+    }
+
+    // the fastest of three runs, in packets and one ray per call
+    std::vector<float> t(n), single(n);
+    std::vector<int> evaluations(n);
+    double packets = 1e30, alone = 1e30;
+    bench_threads(1);
+    for (int run = 0; run < 3; run++) {
+        double start = bench_seconds();
+        water_intersect_n(plan, n, &origins[0], &directions[0], maxDistance, tolerance, &t[0], &evaluations[0]);
+        double middle = bench_seconds();
+        for (int i = 0; i < n; i++)
+            water_intersect_n(plan, 1, &origins[3*i], &directions[3*i], maxDistance, tolerance, &single[i]);
+        double end = bench_seconds();
+        packets = std::min(packets, middle - start);
+        alone = std::min(alone, end - middle);
+    }
+    bench_threads(bench_max_threads());
+
+    // every 16th ray marched in steps of 0.01 until it changes side, a
+    // grazing ray may come within tolerance of the surface before the
+    // march sees it cross, or without crossing at all
+    int checked = 0, hits = 0, wrong = 0, grazing = 0;
+    for (int i = 0; i < n; i += 16) {
+        const float* o = &origins[3*i];
+        const float* d = &directions[3*i];
+        float found = -1.0f, side = 0.0f;
+        for (float s = 0.0f; s <= maxDistance; s += 0.01f) {
+            float f = o[1] + s*d[1] - water_displacement(plan, o[0] + s*d[0], o[2] + s*d[2]);
+            if (side == 0.0f)
+                side = f >= 0.0f ? 1.0f : -1.0f;
+            if (side*f <= 0.0f) {
+                found = s;
+                break;
+            }
+        }
+        checked++;
+        hits += found >= 0.0f;
+        if ((found >= 0.0f) == (t[i] >= 0.0f) && (found < 0.0f || fabsf(found - t[i]) <= 0.05f))
+            continue;
+        float gap = t[i] >= 0.0f ? fabsf(o[1] + t[i]*d[1] - water_displacement(plan, o[0] + t[i]*d[0], o[2] + t[i]*d[2]))
+                                 : 1.0f;
+        if (gap <= tolerance && (found < 0.0f || t[i] < found))
+            grazing++;
+        else
+            wrong++;
+    }
+    bench_report("hits against a 0.01 march", wrong == 0, "%d rays, %d hits, %d wrong, %d grazing",
+                 checked, hits, wrong, grazing);
+
+    double count = 0.0;
+    int differ = 0;
+    for (int i = 0; i < n; i++) {
+        count += evaluations[i];
+        differ += t[i] != single[i];
+    }
+    count /= n;
+    bench_report("evaluations per ray", count <= BENCH_RAY_EVALUATIONS, "%.1f, at most %.0f",
+                 count, BENCH_RAY_EVALUATIONS);
+    bench_report("one ray per call", differ == 0, "%d rays differ from the packets", differ);
+    bench_report("time per ray on one core", packets < alone, "%.1f us in packets, %.1f us one per call",
+                 1e6*packets/n, 1e6*alone/n);
+}
+
+
+// Every cache against evaluating the same points directly.
+static void bench_caches()
+{
+    printf("caches\n");
+    std::vector<float> u, v;
+    bench_points(u, v);
+    const int n = (int)u.size();
+    std::vector<float> direct(n), cached(n), again(n);
+
+    // frame cache: a frame of a loop stored at one time and found a
+    // cycle later, against evaluating the later time directly
+    WaterParams params;
+    params.time = 3.25;
+    WaterParams looping = params;
+    looping.loopLength = 10.0;
+    WaterPlan plan;
+    water_build_plan(looping, plan);
+    WaterFrameCache frames;
+    frames.validate(water_signature(looping, n, &u[0], &v[0]));
+    std::vector<float>& stored = frames.insert(water_wrap_time(looping), n);
+    water_displacement_n(plan, n, &u[0], &v[0], &stored[0]);
+    looping.time += looping.loopLength;
+    water_build_plan(looping, plan);
+    water_displacement_n(plan, n, &u[0], &v[0], &direct[0]);
+    const std::vector<float>* found = frames.find(water_wrap_time(looping));
+    float error = found ? bench_max_difference(n, &(*found)[0], &direct[0]) : 1e30f;
+    bench_report("WaterFrameCache a cycle later", found && error < 1e-4f, "max error %.2g", error);
+
+    // a budget of three frames keeps the last three of ten
+    WaterFrameCache budget(3*n*sizeof(float));
+    for (int f = 0; f < 10; f++)
+        budget.insert(f, n);
+    bool newest = budget.find(7) && budget.find(8) && budget.find(9);
+    bench_report("WaterFrameCache over its budget", budget.size() == 3 && newest && budget.bytes() <= 3*n*sizeof(float),
+                 "%u frames, %u bytes", budget.size(), (unsigned int)budget.bytes());
+
+    // time keys: exact on a key, within the tolerance between keys, and a
+    // second call reuses the keys of the first
+    WaterParams stepped = params;
+    stepped.timeStep = 0.25;
+    stepped.timeTolerance = 0.01;
+    WaterTimeSampler sampler;
+    sampler.validate(water_signature(stepped, n, &u[0], &v[0]));
+    water_build_plan(params, plan);
+    water_displacement_n(plan, n, &u[0], &v[0], &direct[0]);
+    sampler.displacement(stepped, n, &u[0], &v[0], &cached[0]);
+    sampler.displacement(stepped, n, &u[0], &v[0], &again[0]);
+    error = bench_max_difference(n, &cached[0], &direct[0]);
+    float repeat = bench_max_difference(n, &cached[0], &again[0]);
+    bench_report("WaterTimeSampler on a key", error < 1e-5f && repeat == 0.0f, "max error %.2g, repeat %.2g",
+                 error, repeat);
+
+    double rms = 0.0;
+    const int subframes = 10;
+    for (int s = 1; s <= subframes; s++) {
+        WaterParams between = stepped;
+        between.time = params.time + 0.25*s/(subframes + 1);
+        WaterParams exact = between;
+        exact.timeStep = 0.0;
+        WaterPlan exactPlan;
+        water_build_plan(exact, exactPlan);
+        sampler.displacement(between, n, &u[0], &v[0], &cached[0]);
+        water_displacement_n(exactPlan, n, &u[0], &v[0], &direct[0]);
+        for (int i = 0; i < n; i++)
+            rms += (double)(cached[i] - direct[i])*(cached[i] - direct[i]);
+    }
+    rms = sqrt(rms/(n*subframes));
+    bench_report("WaterTimeSampler between keys", rms <= stepped.timeTolerance, "rms error %.2g", rms);
+
+    // a budget far below the keys of the subframes evicts all along, and
+    // the evicted keys come back the same; a short last chunk as well
+    const int m = n - 100;
+    WaterTimeSampler roomy, tight(4, 64 << 10);
+    float evicted = 0.0f;
+    for (int s = 1; s <= subframes; s++) {
+        WaterParams between = stepped;
+        between.time = params.time + 0.25*s/(subframes + 1);
+        roomy.displacement(between, m, &u[0], &v[0], &cached[0]);
+        tight.displacement(between, m, &u[0], &v[0], &again[0]);
+        evicted = std::max(evicted, bench_max_difference(m, &cached[0], &again[0]));
+    }
+    bench_report("WaterTimeSampler over its budget", evicted == 0.0f, "max difference %.2g", evicted);
+
+    // advected fields: a window following a camera for 60 frames, updated
+    // frame to frame, against fields built fresh for the last frame
+    WaterParams drifting = params;
+    drifting.driftTolerance = 0.01;
+    WaterCaches caches;
+    std::vector<float> pu(n), pv(n);
+    for (int frame = 0; frame < 60; frame++) {
+        drifting.time = params.time + frame/24.0;
+        for (int i = 0; i < n; i++) {
+            pu[i] = u[i] + 0.4f*frame;
+            pv[i] = v[i] + 0.15f*frame;
+        }
+        water_build_plan(drifting, plan);
+        water_displacement_n(plan, n, &pu[0], &pv[0], &cached[0], &caches);
+    }
+    WaterCaches fresh;
+    water_displacement_n(plan, n, &pu[0], &pv[0], &again[0], &fresh);
+    error = bench_max_difference(n, &cached[0], &again[0]);
+    bench_report("WaterCaches after 60 frames", error <= drifting.driftTolerance, "max error %.2g against fresh fields",
+                 error);
+    WaterPlan uncached = plan;
+    uncached.driftTolerance = 0.0f;
+    water_displacement_n(uncached, n, &pu[0], &pv[0], &direct[0]);
+    error = bench_max_difference(n, &cached[0], &direct[0]);
+    bench_report("WaterCaches against direct", error <= drifting.driftTolerance, "max error %.2g", error);
+
+    // tile map: a lattice of 4 tiles a side, every tile position
+    // evaluated once and scattered to the 16 points that share it. The
+    // lattice is offset from the noise lattice, on which rounding picks
+    // between two simplices that do not quite agree.
+    WaterParams tiled = params;
+    tiled.tileSize = 8.0;
+    water_build_plan(tiled, plan);
+    const int lattice = 64;
+    std::vector<float> lu(lattice*lattice), lv(lattice*lattice);
+    for (int j = 0; j < lattice; j++)
+        for (int i = 0; i < lattice; i++) {
+            lu[j*lattice + i] = i*0.5f - 15.9f;
+            lv[j*lattice + i] = j*0.5f - 15.7f;
+        }
+    WaterTileMap map;
+    water_build_tile_map(plan.tileSize, lattice*lattice, &lu[0], &lv[0], map);
+    water_displacement_tiled(plan, map, &cached[0]);
+    water_displacement_n(plan, lattice*lattice, &lu[0], &lv[0], &direct[0]);
+    error = bench_max_difference(lattice*lattice, &cached[0], &direct[0]);
+    bench_report("WaterTileMap", error < 1e-4f, "max error %.2g, %d of %d points evaluated",
+                 error, (int)map.u.size(), lattice*lattice);
+
+    // tile snapping: a small tile is warned about, the tile it suggests
+    // is not
+    WaterParams small = params;
+    small.tileSize = 50.0;
+    int layer;
+    float minTile;
+    float snap = water_tile_snap(small, layer, minTile);
+    small.tileSize = minTile;
+    float minTileAgain;
+    float snapAgain = water_tile_snap(small, layer, minTileAgain);
+    bench_report("tile snapping", snap > WATER_TILE_SNAP && snapAgain <= WATER_TILE_SNAP,
+                 "%.2f times at 50, %.2f at %g", snap, snapAgain, minTile);
+
+    // texture tiles: samples on texels are the texels themselves, the
+    // second pass only finds tiles
+    water_build_plan(params, plan);
+    const float texel = 0.25f;
+    const int side = 96;
+    std::vector<float> tu(side*side), tv(side*side), th(side*side), heights(side*side);
+    for (int j = 0; j < side; j++)
+        for (int i = 0; i < side; i++) {
+            tu[j*side + i] = (i - side/2)*texel;
+            tv[j*side + i] = (j - side/2)*texel;
+        }
+    WaterTileCache tiles;
+    tiles.setLattice(texel, 32, 64);
+    for (int pass = 0; pass < 2; pass++) {
+        #pragma omp parallel for schedule(dynamic, 64)
+        for (int k = 0; k < side*side; k++) {
+            float foam;
+            tiles.sample(1, plan, tu[k], tv[k], pass ? heights[k] : th[k], foam);
+        }
+    }
+    water_displacement_n(plan, side*side, &tu[0], &tv[0], &direct[0]);
+    error = bench_max_difference(side*side, &th[0], &direct[0]);
+    repeat = bench_max_difference(side*side, &th[0], &heights[0]);
+    bench_report("WaterTileCache", error < 1e-5f && repeat == 0.0f, "max error %.2g, repeat %.2g",
+                 error, repeat);
+    // the 96 texels a side around the origin touch 4 by 4 tiles of 32,
+    // each filled once however the threads met on it
+    bench_report("WaterTileCache fills", tiles.fills() == 16 && tiles.size() == 16, "%u fills, %u tiles",
+                 tiles.fills(), tiles.size());
+
+    // a bound below the tiles in use evicts, and evicted tiles come back
+    // the same
+    WaterTileCache few;
+    few.setLattice(texel, 32, 2);
+    float revisited = 0.0f;
+    for (int k = 0; k < side*side; k++) {
+        float h, foam;
+        few.sample(1, plan, tu[(k*37) % (side*side)], tv[(k*37) % (side*side)], h, foam);
+        revisited = std::max(revisited, fabsf(h - th[(k*37) % (side*side)]));
+    }
+    bench_report("WaterTileCache over its bound", revisited == 0.0f && few.size() <= 2,
+                 "max difference %.2g, %u tiles", revisited, few.size());
+
+    // ripple checkpoints: scrubbing back restores a saved frame and steps
+    // on from it, which has to give what stepping from the start gives
+    RippleParams rippleParams;
+    rippleParams.resolution = 128;
+    rippleParams.size = 40.0;
+    std::vector<RippleSource> sources(1);
+    RippleSolver scrubbed, straight;
+    scrubbed.validate(rippleParams, ripple_signature(rippleParams));
+    straight.validate(rippleParams, ripple_signature(rippleParams));
+    for (int frame = 0; frame <= 40; frame++) {
+        sources[0].x = -15.0f + 0.7f*frame;
+        sources[0].y = 0.0f;
+        sources[0].z = 2.0f*sinf(0.2f*frame);
+        sources[0].radius = 1.0f;
+        scrubbed.setSources(frame, sources);
+        straight.setSources(frame, sources);
+    }
+    scrubbed.advance(40);
+    scrubbed.advance(25);
+    straight.advance(25);
+    scrubbed.sample(n, &u[0], &v[0], &cached[0]);
+    straight.sample(n, &u[0], &v[0], &direct[0]);
+    error = bench_max_difference(n, &cached[0], &direct[0]);
+    float peak = 0.0f;
+    for (int i = 0; i < n; i++)
+        peak = std::max(peak, fabsf(direct[i]));
+    bench_report("RippleSolver checkpoints", error == 0.0f && peak > 0.0f, "max error %.2g, peak %.3g",
+                 error, peak);
+}
+
+
+// What the engine gives for a fixed scene, for comparing builds.
+static void bench_scene(std::vector<float>& values)
+{
+    std::vector<float> u, v;
+    bench_points(u, v);
+    const int n = (int)u.size();
+    values.clear();
+
+    WaterParams params;
+    params.time = 7.5;
+    for (int table = 0; table < 2; table++) {
+        params.tableLayers = table ? WATER_TABLE_ALL : WATER_TABLE_NONE;
+        WaterPlan plan;
+        water_build_plan(params, plan);
+        std::vector<float> disp(n), velocity(n), gradU(n), gradV(n), crest(n), foam(n);
+        water_displacement_n(plan, n, &u[0], &v[0], &disp[0]);
+        values.insert(values.end(), disp.begin(), disp.end());
+        water_displacement_deriv_n(plan, n, &u[0], &v[0], &disp[0], &velocity[0], &gradU[0], &gradV[0],
+                                   &crest[0], &foam[0]);
+        values.insert(values.end(), velocity.begin(), velocity.end());
+        values.insert(values.end(), gradU.begin(), gradU.end());
+        values.insert(values.end(), gradV.begin(), gradV.end());
+        values.insert(values.end(), foam.begin(), foam.end());
+    }
+
+    GerstnerParams gerstner;
+    gerstner.time = 7.5;
+    GerstnerWaves waves;
+    gerstner_build_waves(gerstner, waves);
+    std::vector<float> offset(3*n), normals(3*n), velocity(3*n), jacobian(n);
+    gerstner_displacement_n(waves, gerstner.time, n, &u[0], &v[0], &offset[0], &normals[0], &velocity[0],
+                            &jacobian[0]);
+    values.insert(values.end(), offset.begin(), offset.end());
+    values.insert(values.end(), normals.begin(), normals.end());
+    values.insert(values.end(), jacobian.begin(), jacobian.end());
+
+    RippleParams rippleParams;
+    rippleParams.resolution = 128;
+    rippleParams.size = 40.0;
+    RippleSolver ripple;
+    ripple.validate(rippleParams, ripple_signature(rippleParams));
+    std::vector<RippleSource> sources(1);
+    for (int frame = 0; frame <= 24; frame++) {
+        sources[0].x = -15.0f + 0.7f*frame;
+        sources[0].y = 0.0f;
+        sources[0].z = 0.0f;
+        sources[0].radius = 1.0f;
+        ripple.setSources(frame, sources);
+    }
+    ripple.advance(24);
+    std::vector<float> height(n);
+    ripple.sample(n, &u[0], &v[0], &height[0]);
+    values.insert(values.end(), height.begin(), height.end());
+}
+
+static bool bench_write(const char* path)
+{
+    std::vector<float> values;
+    bench_scene(values);
+    FILE* file = fopen(path, "wb");
+    if (!file)
+        return false;
+    bool ok = fwrite(&values[0], sizeof(float), values.size(), file) == values.size();
+    return fclose(file) == 0 && ok;
+}
+
+static void bench_compare(const char* path)
+{
+    printf("compare\n");
+    std::vector<float> values, other;
+    bench_scene(values);
+    other.resize(values.size());
+    FILE* file = fopen(path, "rb");
+    bool read = file && fread(&other[0], sizeof(float), other.size(), file) == other.size() &&
+                fgetc(file) == EOF;
+    if (file)
+        fclose(file);
+    if (!read) {
+        bench_report(path, false, "could not be read or is from another scene");
+        return;
+    }
+    float error = bench_max_difference((int)values.size(), &values[0], &other[0]);
+    bench_report("against the other build", error < 1e-4f, "max difference %.2g over %d values",
+                 error, (int)values.size());
+}
+
+
+int main(int argc, char** argv)
+{
+    bool all = true, simd = false, rays = false, caches = false;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-write") && i + 1 < argc) {
+            if (!bench_write(argv[++i])) {
+                fprintf(stderr, "proWaterBench: could not write %s\n", argv[i]);
+                return 1;
+            }
+            all = false;
+        }
+        else if (!strcmp(argv[i], "-compare") && i + 1 < argc) {
+            bench_compare(argv[++i]);
+            all = false;
+        }
+        else if (!strcmp(argv[i], "simd"))
+            simd = true;
+        else if (!strcmp(argv[i], "rays"))
+            rays = true;
+        else if (!strcmp(argv[i], "caches"))
+            caches = true;
+        else {
+            fprintf(stderr, "usage: proWaterBench [simd] [rays] [caches] [-write file] [-compare file]\n");
+            return 1;
+        }
+    }
+    if (simd || rays || caches)
+        all = false;
+    else
+        simd = rays = caches = all;
+
+#if defined(WATER_SSE2)
+    printf("SSE2 build, %d threads\n", bench_max_threads());
+#else
+    printf("scalar build, %d threads\n", bench_max_threads());
+#endif
+    if (simd)
+        bench_simd();
+    if (rays)
+        bench_rays();
+    if (caches)
+        bench_caches();
+    if (benchFailures > 0)
+        printf("%d checks failed\n", benchFailures);
+    return benchFailures;
+}
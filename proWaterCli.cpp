@@ -0,0 +1,544 @@
+//
+//  File: proWaterCli.cpp
+//
+//  Description:
+//		Displaces water meshes with the proWater height field outside of
+//		Maya, for meshes far larger than a session can hold:
+//
+//			proWaterCli -t 120 -a1 0.5 -f1 0.5 ocean.ply ocean_0120.ply
+//
+//		The mesh is streamed through a buffer of -chunk megabytes. Each
+//		chunk of vertices is read, displaced by the engine over all
+//		threads and written out before the next one is read, so the
+//		memory used depends on the chunk size and not on the mesh. The
+//		points move along +y, or along their normals when a PLY mesh has
+//		them, like the deformer does with the rest plane in x and z.
+//
+//		Binary PLY, either byte order, with the vertex element first and
+//		every vertex property a scalar is rewritten record by record and
+//		everything after the vertices is copied as it is. Normals are
+//		tilted by the gradient of the height field as in the deformer.
+//		OBJ is read as text and only its v lines are rewritten.
+//
+//		Build with
+//
+//			make proWaterCli
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <simplexNoise.cpp>
+#include <noiseTable.cpp>
+#include <waterEngine.cpp>
+
+
+// What is displaced and how the stream is cut, from the command line.
+struct CliOptions {
+    WaterParams params;
+    size_t chunkBytes;
+    bool normals;           // tilt the normals of PLY meshes, when they have them
+    bool quiet;
+    const char* input;
+    const char* output;
+
+    CliOptions() : chunkBytes(64 << 20), normals(true), quiet(false), input(0), output(0) {}
+};
+
+// Counters for the report at the end.
+struct CliStats {
+    double vertices;
+    double bytesRead, bytesWritten;
+    double readSeconds, displaceSeconds, writeSeconds;
+    size_t peakBuffer;      // bytes held by the buffers at once
+
+    CliStats() : vertices(0.0), bytesRead(0.0), bytesWritten(0.0),
+                 readSeconds(0.0), displaceSeconds(0.0), writeSeconds(0.0), peakBuffer(0) {}
+};
+
+static double cli_seconds()
+{
+#ifdef _OPENMP
+    return omp_get_wtime();
+#else
+    return (double)clock()/CLOCKS_PER_SEC;
+#endif
+}
+
+static void cli_usage()
+{
+    fprintf(stderr,
+        "usage: proWaterCli [options] input.(ply|obj) output.(ply|obj)\n"
+        "  -t time             time of the height field (0)\n"
+        "  -dir degrees        wind direction (45)\n"
+        "  -big amplitude      big waves (3)\n"
+        "  -a1 -f1 value       amplitude and frequency of the first octaves (0.5, 0.5)\n"
+        "  -a2 -f2 value       amplitude and frequency of the second octaves (1.3, 0.7)\n"
+        "  -loop length        seamless cycle of this length in time units\n"
+        "  -tile size          repeat the field every size units in x and z\n"
+        "  -basis name         simplex, table or detail (simplex)\n"
+        "  -tol error          error allowed for layers on a coarse lattice (0)\n"
+        "  -chunk megabytes    size of the stream buffer (64)\n"
+        "  -noNormals          leave the normals of PLY meshes as they are\n"
+        "  -q                  no report\n");
+}
+
+static bool cli_parse(int argc, char** argv, CliOptions& options)
+{
+    for (int i = 1; i < argc; i++) {
+        const char* flag = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (flag[0] != '-') {
+            if (!options.input)
+                options.input = flag;
+            else if (!options.output)
+                options.output = flag;
+            else
+                return false;
+        }
+        else if (!strcmp(flag, "-noNormals"))
+            options.normals = false;
+        else if (!strcmp(flag, "-q"))
+            options.quiet = true;
+        else if (!hasValue)
+            return false;
+        else if (!strcmp(flag, "-basis")) {
+            const char* basis = argv[++i];
+            if (!strcmp(basis, "simplex"))
+                options.params.tableLayers = WATER_TABLE_NONE;
+            else if (!strcmp(basis, "table"))
+                options.params.tableLayers = WATER_TABLE_ALL;
+            else if (!strcmp(basis, "detail"))
+                options.params.tableLayers = WATER_TABLE_DETAIL;
+            else
+                return false;
+        }
+        else {
+            char* end;
+            double value = strtod(argv[++i], &end);
+            if (*end)
+                return false;
+            WaterParams& p = options.params;
+            if (!strcmp(flag, "-t")) p.time = value;
+            else if (!strcmp(flag, "-dir")) p.direction = value;
+            else if (!strcmp(flag, "-big")) p.bigAmplitude = value;
+            else if (!strcmp(flag, "-a1")) p.amplitude1 = value;
+            else if (!strcmp(flag, "-f1")) p.frequency1 = value;
+            else if (!strcmp(flag, "-a2")) p.amplitude2 = value;
+            else if (!strcmp(flag, "-f2")) p.frequency2 = value;
+            else if (!strcmp(flag, "-loop")) p.loopLength = value;
+            else if (!strcmp(flag, "-tile")) p.tileSize = value;
+            else if (!strcmp(flag, "-tol")) p.coarseTolerance = value;
+            else if (!strcmp(flag, "-chunk") && value >= 1.0) options.chunkBytes = (size_t)(value*(1 << 20));
+            else return false;
+        }
+    }
+    return options.input && options.output;
+}
+
+static bool cli_has_suffix(const char* path, const char* suffix)
+{
+    size_t length = strlen(path), suffixLength = strlen(suffix);
+    if (length < suffixLength)
+        return false;
+    for (size_t i = 0; i < suffixLength; i++)
+        if (tolower(path[length - suffixLength + i]) != suffix[i])
+            return false;
+    return true;
+}
+
+// Displacement and, for the arrays given, its gradient for one chunk.
+static void cli_displace(const WaterPlan& plan, const int n, const float* u, const float* v,
+                         float* disp, float* gradU, float* gradV, CliStats& stats)
+{
+    double begin = cli_seconds();
+    if (gradU)
+        water_displacement_deriv_n(plan, n, u, v, disp, 0, gradU, gradV);
+    else
+        water_displacement_n(plan, n, u, v, disp);
+    stats.displaceSeconds += cli_seconds() - begin;
+    stats.vertices += n;
+}
+
+static size_t cli_read(void* data, const size_t size, FILE* file, CliStats& stats)
+{
+    double begin = cli_seconds();
+    size_t count = fread(data, 1, size, file);
+    stats.readSeconds += cli_seconds() - begin;
+    stats.bytesRead += count;
+    return count;
+}
+
+static bool cli_write(const void* data, const size_t size, FILE* file, CliStats& stats)
+{
+    double begin = cli_seconds();
+    bool ok = fwrite(data, 1, size, file) == size;
+    stats.writeSeconds += cli_seconds() - begin;
+    stats.bytesWritten += size;
+    return ok;
+}
+
+
+// A scalar property of the PLY vertex element.
+struct PlyProperty {
+    std::string name;
+    int size;
+    bool isFloat;
+    int offset;
+};
+
+static int ply_type_size(const std::string& type, bool& isFloat)
+{
+    isFloat = type == "float" || type == "float32" || type == "double" || type == "float64";
+    if (type == "char" || type == "uchar" || type == "int8" || type == "uint8")
+        return 1;
+    if (type == "short" || type == "ushort" || type == "int16" || type == "uint16")
+        return 2;
+    if (type == "int" || type == "uint" || type == "int32" || type == "uint32" || type == "float" || type == "float32")
+        return 4;
+    if (type == "double" || type == "float64")
+        return 8;
+    return 0;
+}
+
+static double ply_get(const unsigned char* at, const PlyProperty& property, const bool swap)
+{
+    unsigned char bytes[8];
+    for (int i = 0; i < property.size; i++)
+        bytes[i] = at[property.offset + (swap ? property.size - 1 - i : i)];
+    if (property.size == 4) {
+        float x;
+        memcpy(&x, bytes, 4);
+        return x;
+    }
+    double x;
+    memcpy(&x, bytes, 8);
+    return x;
+}
+
+static void ply_set(unsigned char* at, const PlyProperty& property, const bool swap, const double value)
+{
+    unsigned char bytes[8];
+    if (property.size == 4) {
+        float x = (float)value;
+        memcpy(bytes, &x, 4);
+    }
+    else
+        memcpy(bytes, &value, 8);
+    for (int i = 0; i < property.size; i++)
+        at[property.offset + (swap ? property.size - 1 - i : i)] = bytes[i];
+}
+
+static bool cli_ply(const CliOptions& options, FILE* in, FILE* out, CliStats& stats)
+{
+    // the header is text up to end_header, copied as it is
+    std::string header;
+    char line[1024];
+    std::vector<std::string> lines;
+    while (fgets(line, sizeof(line), in)) {
+        header += line;
+        std::string text(line);
+        while (!text.empty() && (text[text.size() - 1] == '\n' || text[text.size() - 1] == '\r'))
+            text.erase(text.size() - 1);
+        lines.push_back(text);
+        if (text == "end_header")
+            break;
+    }
+    if (lines.empty() || lines[0] != "ply" || lines[lines.size() - 1] != "end_header") {
+        fprintf(stderr, "proWaterCli: %s is not a PLY file\n", options.input);
+        return false;
+    }
+    stats.bytesRead += header.size();
+
+    unsigned int one = 1;
+    bool littleEndian = *(unsigned char*)&one == 1;
+    bool swap = false;
+    long long vertexCount = -1;
+    bool vertexFirst = false, inVertex = false;
+    int recordSize = 0;
+    std::vector<PlyProperty> properties;
+    for (size_t i = 1; i < lines.size(); i++) {
+        char word[64], type[64], name[256];
+        long long count;
+        if (sscanf(lines[i].c_str(), "format %63s", word) == 1) {
+            if (!strcmp(word, "binary_little_endian"))
+                swap = !littleEndian;
+            else if (!strcmp(word, "binary_big_endian"))
+                swap = littleEndian;
+            else {
+                fprintf(stderr, "proWaterCli: only binary PLY is streamed, not %s\n", word);
+                return false;
+            }
+        }
+        else if (sscanf(lines[i].c_str(), "element %63s %lld", word, &count) == 2) {
+            inVertex = !strcmp(word, "vertex");
+            if (inVertex) {
+                vertexFirst = vertexCount < 0 && properties.empty() && recordSize == 0;
+                vertexCount = count;
+            }
+            else if (vertexCount < 0)
+                recordSize = -1;    // something comes before the vertices
+        }
+        else if (inVertex && sscanf(lines[i].c_str(), "property %63s %255s", type, name) == 2) {
+            PlyProperty property;
+            property.name = name;
+            property.size = ply_type_size(type, property.isFloat);
+            property.offset = recordSize;
+            if (property.size == 0) {
+                fprintf(stderr, "proWaterCli: vertex property %s is not a scalar\n", name);
+                return false;
+            }
+            recordSize += property.size;
+            properties.push_back(property);
+        }
+    }
+    if (vertexCount < 0 || !vertexFirst) {
+        fprintf(stderr, "proWaterCli: the vertex element must come first in %s\n", options.input);
+        return false;
+    }
+
+    const PlyProperty* position[3] = { 0, 0, 0 };
+    const PlyProperty* normal[3] = { 0, 0, 0 };
+    static const char* positionNames[3] = { "x", "y", "z" };
+    static const char* normalNames[3] = { "nx", "ny", "nz" };
+    for (size_t i = 0; i < properties.size(); i++)
+        for (int k = 0; k < 3; k++) {
+            if (properties[i].isFloat && properties[i].name == positionNames[k])
+                position[k] = &properties[i];
+            if (properties[i].isFloat && properties[i].name == normalNames[k])
+                normal[k] = &properties[i];
+        }
+    if (!position[0] || !position[1] || !position[2]) {
+        fprintf(stderr, "proWaterCli: the vertices need float or double x, y and z\n");
+        return false;
+    }
+    bool hasNormals = normal[0] && normal[1] && normal[2];
+    bool tilt = hasNormals && options.normals;
+
+    if (!cli_write(header.data(), header.size(), out, stats))
+        return false;
+
+    size_t perVertex = recordSize + (tilt ? 5 : 3)*sizeof(float);
+    size_t chunk = options.chunkBytes/perVertex;
+    chunk = chunk > 0 ? chunk : 1;
+    chunk = (long long)chunk < vertexCount ? chunk : (size_t)(vertexCount > 0 ? vertexCount : 1);
+    std::vector<unsigned char> records(chunk*recordSize);
+    std::vector<float> u(chunk), v(chunk), disp(chunk), gradU(tilt ? chunk : 0), gradV(tilt ? chunk : 0);
+    stats.peakBuffer = chunk*perVertex;
+
+    WaterPlan plan;
+    water_build_plan(options.params, plan);
+
+    for (long long first = 0; first < vertexCount; first += chunk) {
+        int n = (int)(vertexCount - first < (long long)chunk ? vertexCount - first : chunk);
+        if (cli_read(&records[0], (size_t)n*recordSize, in, stats) != (size_t)n*recordSize) {
+            fprintf(stderr, "proWaterCli: %s ends within the vertices\n", options.input);
+            return false;
+        }
+        for (int i = 0; i < n; i++) {
+            const unsigned char* record = &records[(size_t)i*recordSize];
+            u[i] = (float)ply_get(record, *position[0], swap);
+            v[i] = (float)ply_get(record, *position[2], swap);
+        }
+        cli_displace(plan, n, &u[0], &v[0], &disp[0], tilt ? &gradU[0] : 0, tilt ? &gradV[0] : 0, stats);
+
+        #pragma omp parallel for schedule(static)
+        for (int i = 0; i < n; i++) {
+            unsigned char* record = &records[(size_t)i*recordSize];
+            double m[3] = { 0.0, 1.0, 0.0 };
+            if (hasNormals)
+                for (int k = 0; k < 3; k++)
+                    m[k] = ply_get(record, *normal[k], swap);
+            for (int k = 0; k < 3; k++)
+                ply_set(record, *position[k], swap, ply_get(record, *position[k], swap) + m[k]*disp[i]);
+            if (tilt) {
+                // the same tilt as the deformer, exact for a flat input
+                double gn = gradU[i]*m[0] + gradV[i]*m[2];
+                double t[3] = { gradU[i] - m[0]*gn, -m[1]*gn, gradV[i] - m[2]*gn };
+                double x = m[0] - t[0], y = m[1] - t[1], z = m[2] - t[2];
+                double length = sqrt(x*x + y*y + z*z);
+                length = length > 0.0 ? length : 1.0;
+                ply_set(record, *normal[0], swap, x/length);
+                ply_set(record, *normal[1], swap, y/length);
+                ply_set(record, *normal[2], swap, z/length);
+            }
+        }
+        if (!cli_write(&records[0], (size_t)n*recordSize, out, stats))
+            return false;
+    }
+
+    // faces and anything else after the vertices, through the same buffer
+    if (records.size() < (1 << 20))
+        records.resize(1 << 20);
+    stats.peakBuffer = records.size() > stats.peakBuffer ? records.size() : stats.peakBuffer;
+    size_t count;
+    while ((count = cli_read(&records[0], records.size(), in, stats)) > 0)
+        if (!cli_write(&records[0], count, out, stats))
+            return false;
+    return true;
+}
+
+
+// Rewrites the text of an OBJ file chunk by chunk. A chunk ends at its last
+// newline, the rest of the line starts the next one.
+static bool cli_obj(const CliOptions& options, FILE* in, FILE* out, CliStats& stats)
+{
+    WaterPlan plan;
+    water_build_plan(options.params, plan);
+
+    std::vector<char> text(options.chunkBytes + 1);
+    std::string result;
+    std::vector<size_t> lineStart, tailStart;
+    std::vector<double> positions;
+    std::vector<float> u, v, disp;
+    size_t carried = 0;
+    bool atEnd = false;
+    while (!atEnd || carried > 0) {
+        size_t count = carried;
+        if (!atEnd) {
+            count += cli_read(&text[carried], options.chunkBytes - carried, in, stats);
+            atEnd = count < options.chunkBytes;
+        }
+        size_t end = count;
+        if (!atEnd) {
+            while (end > 0 && text[end - 1] != '\n')
+                end--;
+            if (end == 0) {
+                fprintf(stderr, "proWaterCli: a line of %s is longer than the chunk\n", options.input);
+                return false;
+            }
+        }
+
+        // the vertices of the chunk
+        lineStart.clear();
+        tailStart.clear();
+        positions.clear();
+        for (size_t at = 0; at < end; ) {
+            size_t next = at;
+            while (next < end && text[next] != '\n')
+                next++;
+            if (next - at > 2 && text[at] == 'v' && (text[at + 1] == ' ' || text[at + 1] == '\t')) {
+                char saved = text[next];
+                text[next] = 0;
+                char* cursor = &text[at + 1];
+                double p[3];
+                bool ok = true;
+                for (int k = 0; k < 3 && ok; k++) {
+                    char* after;
+                    p[k] = strtod(cursor, &after);
+                    ok = after != cursor;
+                    cursor = after;
+                }
+                text[next] = saved;
+                if (ok) {
+                    lineStart.push_back(at);
+                    tailStart.push_back(cursor - &text[0]);
+                    positions.insert(positions.end(), p, p + 3);
+                }
+            }
+            at = next + 1;
+        }
+        int n = (int)lineStart.size();
+        u.resize(n);
+        v.resize(n);
+        disp.resize(n);
+        for (int i = 0; i < n; i++) {
+            u[i] = (float)positions[3*i];
+            v[i] = (float)positions[3*i + 2];
+        }
+        if (n > 0)
+            cli_displace(plan, n, &u[0], &v[0], &disp[0], 0, 0, stats);
+
+        // the chunk again with the vertex lines replaced
+        result.clear();
+        size_t copied = 0;
+        char number[128];
+        for (int i = 0; i < n; i++) {
+            result.append(&text[copied], lineStart[i] - copied);
+            sprintf(number, "v %.9g %.9g %.9g", positions[3*i], positions[3*i + 1] + disp[i], positions[3*i + 2]);
+            result += number;
+            copied = tailStart[i];
+        }
+        result.append(&text[copied], end - copied);
+        size_t held = text.size() + result.capacity() + positions.capacity()*sizeof(double)
+            + (u.capacity() + v.capacity() + disp.capacity())*sizeof(float)
+            + (lineStart.capacity() + tailStart.capacity())*sizeof(size_t);
+        stats.peakBuffer = held > stats.peakBuffer ? held : stats.peakBuffer;
+        if (!cli_write(result.data(), result.size(), out, stats))
+            return false;
+
+        carried = count - end;
+        memmove(&text[0], &text[end], carried);
+        if (atEnd && carried == 0)
+            break;
+    }
+    return true;
+}
+
+
+int main(int argc, char** argv)
+{
+    CliOptions options;
+    if (!cli_parse(argc, argv, options)) {
+        cli_usage();
+        return 1;
+    }
+    int layer;
+    float minTile;
+    float snap = water_tile_snap(options.params, layer, minTile);
+    if (snap > WATER_TILE_SNAP)
+        fprintf(stderr, "proWaterCli: -tile %g raises the frequency of layer %d by %.2f times, "
+                "a tile of %g or more keeps every layer within 25%%\n", options.params.tileSize, layer, snap, minTile);
+
+    bool isPly = cli_has_suffix(options.input, ".ply");
+    if (!isPly && !cli_has_suffix(options.input, ".obj")) {
+        fprintf(stderr, "proWaterCli: %s is neither .ply nor .obj\n", options.input);
+        return 1;
+    }
+
+    FILE* in = fopen(options.input, "rb");
+    if (!in) {
+        fprintf(stderr, "proWaterCli: could not open %s\n", options.input);
+        return 1;
+    }
+    FILE* out = fopen(options.output, "wb");
+    if (!out) {
+        fprintf(stderr, "proWaterCli: could not create %s\n", options.output);
+        fclose(in);
+        return 1;
+    }
+
+    CliStats stats;
+    double begin = cli_seconds();
+    bool ok = isPly ? cli_ply(options, in, out, stats) : cli_obj(options, in, out, stats);
+    fclose(in);
+    ok = fclose(out) == 0 && ok;
+    double seconds = cli_seconds() - begin;
+    if (!ok) {
+        fprintf(stderr, "proWaterCli: could not write %s\n", options.output);
+        return 1;
+    }
+
+    if (!options.quiet) {
+        double megabytes = 1.0/(1 << 20);
+        seconds = seconds > 0.0 ? seconds : 1e-9;
+        fprintf(stderr, "proWaterCli: %.0f vertices in %.3f s, %.2f M vertices/s\n",
+                stats.vertices, seconds, stats.vertices/seconds*1e-6);
+        fprintf(stderr, "  read %.1f MB in %.3f s, displaced in %.3f s, wrote %.1f MB in %.3f s\n",
+                stats.bytesRead*megabytes, stats.readSeconds, stats.displaceSeconds,
+                stats.bytesWritten*megabytes, stats.writeSeconds);
+        fprintf(stderr, "  %.1f MB/s through, %.1f MB of buffers\n",
+                (stats.bytesRead + stats.bytesWritten)*megabytes/seconds, stats.peakBuffer*megabytes);
+    }
+    return 0;
+}
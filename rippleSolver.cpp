@@ -0,0 +1,371 @@
+//
+//  File: rippleSolver.cpp
+//
+//  Description:
+//		Damped wave equation on a grid for ripples and wakes.
+//
+
+#include <math.h>
+#include <vector>
+#include <map>
+
+#include "waterSimd.h"
+
+#include "rippleSolver.h"
+
+
+// c dt/dx of a step, below the 1/sqrt(2) the leapfrog scheme needs to stay
+// stable in 2D.
+static const double RIPPLE_COURANT = 0.5;
+
+// Cells of a tile, a tile and its neighbour rows stay in the cache while
+// it is updated.
+static const int RIPPLE_TILE_ROWS = 32;
+static const int RIPPLE_TILE_COLUMNS = 256;
+
+// Share of the height the outermost cell of the sponge loses every step.
+static const float RIPPLE_SPONGE = 0.1f;
+
+
+// Steps per frame for the Courant number above.
+static int ripple_steps(const RippleParams& params)
+{
+    int steps = (int)ceil(params.speed*params.frameLength*params.resolution/params.size/RIPPLE_COURANT);
+    return steps > 1 ? steps : 1;
+}
+
+
+RippleParams::RippleParams()
+    : resolution(256), size(100.0), speed(5.0), damping(0.5), strength(2.0),
+      frameLength(1.0/24.0), checkpoint(10)
+{}
+
+
+RippleSolver::RippleSolver(const unsigned int maxCheckpoints)
+    : maxCheckpoints(maxCheckpoints), signature(0), stride(0), current(0), highest(0.0f)
+{}
+
+void RippleSolver::clear()
+{
+    height.clear();
+    previous.clear();
+    checkpoints.clear();
+    sources.clear();
+    current = 0;
+    highest = 0.0f;
+}
+
+void RippleSolver::validate(const RippleParams& newParams, const WaterHash newSignature)
+{
+    if (newSignature != signature) {
+        clear();
+        params = newParams;
+        signature = newSignature;
+    }
+}
+
+// Still water at frame 0.
+void RippleSolver::reset()
+{
+    const int n = params.resolution;
+    stride = n + 2;
+    height.assign(stride*stride, 0.0f);
+    previous.assign(stride*stride, 0.0f);
+    current = 0;
+
+    // quadratic ramp over the outer cells of the grid
+    int width = n/32 > 4 ? n/32 : 4;
+    sponge.assign(n, 1.0f);
+    for (int i = 0; i < width && i < n; i++) {
+        float depth = (float)(width - i)/width;
+        sponge[i] = sponge[n - 1 - i] = 1.0f - RIPPLE_SPONGE*depth*depth;
+    }
+}
+
+static bool ripple_same(const std::vector<RippleSource>& a, const std::vector<RippleSource>& b)
+{
+    if (a.size() != b.size())
+        return false;
+    for (unsigned int i = 0; i < a.size(); i++)
+        if (a[i].x != b[i].x || a[i].y != b[i].y || a[i].z != b[i].z || a[i].radius != b[i].radius)
+            return false;
+    return true;
+}
+
+void RippleSolver::setSources(const int frame, const std::vector<RippleSource>& newSources)
+{
+    std::map<int, std::vector<RippleSource> >::iterator it = sources.find(frame);
+    if (it != sources.end() && ripple_same(it->second, newSources))
+        return;
+
+    // frames since the last given one were interpolated towards this one,
+    // so their states are stale as well
+    int stale = 1;
+    std::map<int, std::vector<RippleSource> >::iterator before = sources.lower_bound(frame);
+    if (before != sources.begin())
+        stale = (--before)->first + 1;
+    sources[frame] = newSources;
+
+    checkpoints.erase(checkpoints.lower_bound(stale), checkpoints.end());
+    if (current >= stale)
+        current = -1;
+}
+
+void RippleSolver::sourcesAt(const int frame, std::vector<RippleSource>& result) const
+{
+    result.clear();
+    if (sources.empty())
+        return;
+    std::map<int, std::vector<RippleSource> >::const_iterator next = sources.lower_bound(frame);
+    if (next != sources.end() && next->first == frame) {
+        result = next->second;
+        return;
+    }
+    if (next == sources.end()) {
+        result = (--next)->second;
+        return;
+    }
+    if (next == sources.begin()) {
+        result = next->second;
+        return;
+    }
+    std::map<int, std::vector<RippleSource> >::const_iterator last = next;
+    --last;
+    result = last->second;
+    if (last->second.size() != next->second.size())
+        return;
+    float f = (float)(frame - last->first)/(next->first - last->first);
+    for (unsigned int i = 0; i < result.size(); i++) {
+        const RippleSource& a = last->second[i];
+        const RippleSource& b = next->second[i];
+        result[i].x = a.x + (b.x - a.x)*f;
+        result[i].y = a.y + (b.y - a.y)*f;
+        result[i].z = a.z + (b.z - a.z)*f;
+        result[i].radius = a.radius + (b.radius - a.radius)*f;
+    }
+}
+
+void RippleSolver::advance(const int target)
+{
+    int frame = target > 0 ? target : 0;
+    if (height.empty())
+        reset();
+
+    // back to the closest saved state, or to still water
+    if (frame < current || current < 0) {
+        std::map<int, std::vector<float> >::iterator it = checkpoints.upper_bound(frame);
+        if (it != checkpoints.begin()) {
+            --it;
+            const int cells = stride*stride;
+            height.assign(it->second.begin(), it->second.begin() + cells);
+            previous.assign(it->second.begin() + cells, it->second.end());
+            current = it->first;
+        }
+        else
+            reset();
+    }
+
+    const int steps = ripple_steps(params);
+    std::vector<RippleSource> from, to;
+    sourcesAt(current, from);
+    while (current < frame) {
+        sourcesAt(current + 1, to);
+        for (int s = 0; s < steps; s++)
+            step(from, to, (float)s/steps, (float)(s + 1)/steps);
+        current++;
+        for (unsigned int i = 0; i < height.size(); i++) {
+            float size = height[i] < 0.0f ? -height[i] : height[i];
+            highest = size > highest ? size : highest;
+        }
+
+        if (params.checkpoint > 0 && current % params.checkpoint == 0) {
+            std::vector<float>& saved = checkpoints[current];
+            saved.assign(height.begin(), height.end());
+            saved.insert(saved.end(), previous.begin(), previous.end());
+
+            // thin out to every other state when there are too many, so
+            // long shots keep states over their whole length
+            if (checkpoints.size() > maxCheckpoints) {
+                std::map<int, std::vector<float> >::iterator it = checkpoints.begin();
+                while (it != checkpoints.end()) {
+                    checkpoints.erase(it++);
+                    if (it != checkpoints.end())
+                        ++it;
+                }
+            }
+        }
+        from.swap(to);
+    }
+}
+
+// One leapfrog step of the cells [begin, end) of a row. The new height is
+// written over the previous one, which is only read at the same cell.
+static void ripple_row(const float* h, float* prev, const int begin, const int end, const int stride,
+                       const float keep, const float carry, const float a, const float rowSponge,
+                       const float* sponge)
+{
+    int c = begin;
+#if defined(WATER_SSE2)
+    __m128 vKeep = _mm_set1_ps(keep), vCarry = _mm_set1_ps(carry), vA = _mm_set1_ps(a);
+    __m128 vFour = _mm_set1_ps(4.0f), vRow = _mm_set1_ps(rowSponge);
+    for ( ; c + 4 <= end; c += 4) {
+        __m128 center = _mm_loadu_ps(h + c);
+        __m128 sides = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(h + c - 1), _mm_loadu_ps(h + c + 1)),
+                                  _mm_add_ps(_mm_loadu_ps(h + c - stride), _mm_loadu_ps(h + c + stride)));
+        __m128 laplace = _mm_sub_ps(sides, _mm_mul_ps(vFour, center));
+        __m128 next = _mm_sub_ps(_mm_mul_ps(vKeep, center), _mm_mul_ps(vCarry, _mm_loadu_ps(prev + c)));
+        next = _mm_add_ps(next, _mm_mul_ps(vA, laplace));
+        next = _mm_mul_ps(next, _mm_mul_ps(vRow, _mm_loadu_ps(sponge + c - 1)));
+        _mm_storeu_ps(prev + c, next);
+    }
+#endif
+    for ( ; c < end; c++) {
+        float laplace = h[c - 1] + h[c + 1] + h[c - stride] + h[c + stride] - 4.0f*h[c];
+        prev[c] = (keep*h[c] - carry*prev[c] + a*laplace)*rowSponge*sponge[c - 1];
+    }
+}
+
+void RippleSolver::step(const std::vector<RippleSource>& from, const std::vector<RippleSource>& to,
+                        const float begin, const float end)
+{
+    const int n = params.resolution;
+    const double dx = params.size/n;
+    const double dt = params.frameLength/ripple_steps(params);
+    const float courant = params.speed*dt/dx;
+    const float loss = params.damping*dt < 1.0 ? params.damping*dt : 1.0;
+    const float keep = 2.0f - loss, carry = 1.0f - loss, a = courant*courant;
+
+    const float* h = &height[0];
+    float* prev = &previous[0];
+    const float* edge = &sponge[0];
+    const int tileRows = (n + RIPPLE_TILE_ROWS - 1)/RIPPLE_TILE_ROWS;
+    const int tileColumns = (n + RIPPLE_TILE_COLUMNS - 1)/RIPPLE_TILE_COLUMNS;
+    const int tiles = tileRows*tileColumns;
+
+    #pragma omp parallel for schedule(static)
+    for (int tile = 0; tile < tiles; tile++) {
+        int row0 = (tile/tileColumns)*RIPPLE_TILE_ROWS;
+        int col0 = (tile % tileColumns)*RIPPLE_TILE_COLUMNS;
+        int row1 = row0 + RIPPLE_TILE_ROWS < n ? row0 + RIPPLE_TILE_ROWS : n;
+        int col1 = col0 + RIPPLE_TILE_COLUMNS < n ? col0 + RIPPLE_TILE_COLUMNS : n;
+        for (int row = row0; row < row1; row++) {
+            int offset = (row + 1)*stride;
+            ripple_row(h + offset, prev + offset, col0 + 1, col1 + 1, stride,
+                       keep, carry, a, edge[row], edge);
+        }
+    }
+
+    // the sources push the water down where they move through it, more
+    // the deeper they are
+    const float half = params.size/2;
+    const float force = params.strength*dt*dt;
+    const float middle = 0.5f*(begin + end);
+    for (unsigned int s = 0; s < to.size(); s++) {
+        RippleSource source = to[s];
+        float speed = 0.0f;
+        if (from.size() == to.size()) {
+            const RippleSource& start = from[s];
+            float mx = to[s].x - start.x, my = to[s].y - start.y, mz = to[s].z - start.z;
+            speed = sqrtf(mx*mx + my*my + mz*mz)/params.frameLength;
+            source.x = start.x + mx*middle;
+            source.y = start.y + my*middle;
+            source.z = start.z + mz*middle;
+        }
+        if (speed <= 0.0f || source.radius <= 0.0f)
+            continue;
+        float submerged = (source.radius - source.y)/(2*source.radius);
+        if (submerged <= 0.0f)
+            continue;
+        if (submerged > 1.0f)
+            submerged = 1.0f;
+
+        float cx = (source.x + half)/dx - 0.5f, cz = (source.z + half)/dx - 0.5f;
+        float reach = source.radius/dx;
+        int c0 = (int)floor(cx - reach), c1 = (int)ceil(cx + reach);
+        int r0 = (int)floor(cz - reach), r1 = (int)ceil(cz + reach);
+        c0 = c0 > 0 ? c0 : 0;
+        r0 = r0 > 0 ? r0 : 0;
+        c1 = c1 < n - 1 ? c1 : n - 1;
+        r1 = r1 < n - 1 ? r1 : n - 1;
+        float push = force*speed*submerged;
+        for (int row = r0; row <= r1; row++)
+            for (int col = c0; col <= c1; col++) {
+                float du = (col - cx)/reach, dv = (row - cz)/reach;
+                float q = du*du + dv*dv;
+                if (q < 1.0f)
+                    prev[(row + 1)*stride + col + 1] -= push*(1.0f - q)*(1.0f - q);
+            }
+    }
+
+    height.swap(previous);
+}
+
+void RippleSolver::sample(const int n, const float* u, const float* v, float* result,
+                          float* gradU, float* gradV, float* velocity) const
+{
+    if (height.empty() || current < 0) {
+        for (int p = 0; p < n; p++) {
+            result[p] = 0.0f;
+            if (gradU)
+                gradU[p] = 0.0f;
+            if (gradV)
+                gradV[p] = 0.0f;
+            if (velocity)
+                velocity[p] = 0.0f;
+        }
+        return;
+    }
+
+    const int cells = params.resolution;
+    const float dx = params.size/cells;
+    const float half = params.size/2;
+    const float rate = ripple_steps(params)/params.frameLength;
+    const float* h = &height[0];
+    const float* before = &previous[0];
+
+    #pragma omp parallel for schedule(static, 256)
+    for (int p = 0; p < n; p++) {
+        // cell centers, the halo around the grid is still water
+        float x = (u[p] + half)/dx - 0.5f, z = (v[p] + half)/dx - 0.5f;
+        float sum = 0.0f, du = 0.0f, dv = 0.0f, dt = 0.0f;
+        if (x > -1.0f && z > -1.0f && x < cells && z < cells) {
+            int col = (int)floor(x), row = (int)floor(z);
+            float fx = x - col, fz = z - row;
+            float weight[4] = {(1 - fx)*(1 - fz), fx*(1 - fz), (1 - fx)*fz, fx*fz};
+            int at[4] = {(row + 1)*stride + col + 1, (row + 1)*stride + col + 2,
+                         (row + 2)*stride + col + 1, (row + 2)*stride + col + 2};
+            for (int k = 0; k < 4; k++) {
+                int i = at[k];
+                sum += weight[k]*h[i];
+                dt += weight[k]*(h[i] - before[i]);
+                // central differences, one sided on the halo
+                bool inside = i > stride && i < stride*(stride - 1) - 1 && i % stride > 0 && i % stride < stride - 1;
+                if (inside) {
+                    du += weight[k]*(h[i + 1] - h[i - 1]);
+                    dv += weight[k]*(h[i + stride] - h[i - stride]);
+                }
+            }
+        }
+        result[p] = sum;
+        if (gradU)
+            gradU[p] = du/(2*dx);
+        if (gradV)
+            gradV[p] = dv/(2*dx);
+        if (velocity)
+            velocity[p] = dt*rate;
+    }
+}
+
+
+WaterHash ripple_signature(const RippleParams& params)
+{
+    WaterHash hash = WATER_HASH_BASIS;
+    hash = water_hash(hash, &params.resolution, sizeof(params.resolution));
+    hash = water_hash(hash, &params.size, sizeof(params.size));
+    hash = water_hash(hash, &params.speed, sizeof(params.speed));
+    hash = water_hash(hash, &params.damping, sizeof(params.damping));
+    hash = water_hash(hash, &params.strength, sizeof(params.strength));
+    hash = water_hash(hash, &params.frameLength, sizeof(params.frameLength));
+    hash = water_hash(hash, &params.checkpoint, sizeof(params.checkpoint));
+    return hash;
+}
@@ -0,0 +1,102 @@
+//
+//  File: rippleSolver.h
+//
+//  Description:
+//		Ripples and wakes of objects moving through the water, added on
+//		top of the procedural displacement. The damped wave equation
+//
+//			d2h/dt2 = c^2 (d2h/dx2 + d2h/dz2) - damping dh/dt + sources
+//
+//		is stepped on a regular grid with a leapfrog scheme, four cells
+//		at a time with SSE2 and in cache sized tiles over the threads.
+//		The grid keeps a sponge layer along its border that soaks up the
+//		waves instead of reflecting them.
+//
+//		Unlike the procedural engines the ripples depend on every earlier
+//		frame. The state is saved every few frames, so scrubbing backwards
+//		restarts from the closest saved frame instead of from frame 0.
+//
+
+#ifndef RIPPLE_SOLVER_H_
+#define RIPPLE_SOLVER_H_
+
+#include <vector>
+#include <map>
+
+#include "waterHash.h"
+
+
+// Attribute values of the proWater node that the ripples depend on.
+struct RippleParams {
+    int resolution;         // cells along a side of the grid
+    double size;            // side of the grid, centered on the origin of the rest plane
+    double speed;           // of the waves, units per second
+    double damping;         // per second
+    double strength;        // of the sources
+    double frameLength;     // seconds per frame
+    int checkpoint;         // frames between saved states
+
+    RippleParams();
+};
+
+// A sphere pushing the water, in the space of the rest plane with y up.
+struct RippleSource {
+    float x, y, z;
+    float radius;
+};
+
+class RippleSolver {
+public:
+    RippleSolver(const unsigned int maxCheckpoints = 64);
+
+    void clear();
+
+    // Starts over from still water if the parameters changed.
+    void validate(const RippleParams& params, const WaterHash signature);
+
+    // Positions of the sources at a frame. Frames that were never given
+    // interpolate between the closest given ones. Changing the sources of
+    // a frame drops the states that depended on them.
+    void setSources(const int frame, const std::vector<RippleSource>& sources);
+
+    // Steps the grid to the frame, from the closest saved state before it
+    // when going backwards.
+    void advance(const int frame);
+
+    // Height of the ripples, its derivatives along u and v and its rate of
+    // change over the last step at n points of the rest plane, 0 outside
+    // of the grid.
+    void sample(const int n, const float* u, const float* v, float* height,
+                float* gradU = 0, float* gradV = 0, float* velocity = 0) const;
+
+    int frame() const { return current; }
+
+    // Largest |height| of the frames stepped to since the parameters
+    // changed, the ripples have stayed within it so far.
+    float peak() const { return highest; }
+
+private:
+    void reset();
+    void step(const std::vector<RippleSource>& from, const std::vector<RippleSource>& to,
+              const float begin, const float end);
+    void sourcesAt(const int frame, std::vector<RippleSource>& sources) const;
+
+    unsigned int maxCheckpoints;
+    WaterHash signature;
+    RippleParams params;
+    int stride;                         // of a grid row, with a cell of halo on each side
+    int current;                        // frame of the state
+    float highest;                      // see peak()
+    std::vector<float> height;          // at the current frame
+    std::vector<float> previous;        // one step earlier
+    std::vector<float> sponge;          // damping factor per row and column
+    std::map<int, std::vector<float> > checkpoints;     // height then previous
+    std::map<int, std::vector<RippleSource> > sources;
+};
+
+// Hash of the parameters, everything the state of a frame depends on
+// besides the sources.
+WaterHash ripple_signature(const RippleParams& params);
+
+
+#endif /*RIPPLE_SOLVER_H_*/
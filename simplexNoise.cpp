@@ -18,7 +18,9 @@
 
 #include <math.h>
 
-#include "simplexnoise.h"
+#include "waterSimd.h"
+
+#include "simplexNoise.h"
 
 
 /* 2D, 3D and 4D Simplex Noise functions return 'random' values in (-1, 1).
@@ -468,6 +470,724 @@ float raw_noise_4d( const float x, const float y, const float z, const float w )
 }
 
 
+// Rounds a period up to the next multiple of 3, the shortest translation along
+// a single axis that maps the 3D simplex lattice onto itself.
+int noise_period( const float period ) {
+    if( period <= 0 ) return 0;
+    int p = (int)ceilf(period / 3 - 1e-4f) * 3;
+    return p < 3 ? 3 : p;
+}
+
+
+// Wraps a into [0, m).
+static inline int wrap( const int a, const int m ) {
+    int r = a % m;
+    return r < 0 ? r + m : r;
+}
+
+// Hashed gradient index of lattice point (i,j,k), identical for every lattice
+// point that is a whole number of periods away.
+//
+// A shift of 3m along x is the lattice vector (4m,m,m), so (i,j,k) is first
+// unskewed to six times its position, (5i-j-k, 5j-i-k, 5k-i-j), wrapped there
+// and skewed back.
+static int periodic_gradient( const int i, const int j, const int k, const int px, const int py, const int pz ) {
+    int a = 5*i - j - k;
+    int b = 5*j - i - k;
+    int c = 5*k - i - j;
+    if( px > 0 ) a = wrap(a, 6*px);
+    if( py > 0 ) b = wrap(b, 6*py);
+    if( pz > 0 ) c = wrap(c, 6*pz);
+    int ii = ((4*a + b + c) / 18) & 255;
+    int jj = ((a + 4*b + c) / 18) & 255;
+    int kk = ((a + b + 4*c) / 18) & 255;
+    return perm[ii+perm[jj+perm[kk]]] % 12;
+}
+
+
+// 3D periodic raw Simplex noise
+//
+// Same as raw_noise_3d(), except for the hashing of the simplex corners.
+float raw_noise_3d_periodic( const float x, const float y, const float z, const int periodX, const int periodY, const int periodZ ) {
+    float n0, n1, n2, n3; // Noise contributions from the four corners
+
+    int px = noise_period(periodX);
+    int py = noise_period(periodY);
+    int pz = noise_period(periodZ);
+
+    float F3 = 1.0/3.0;
+    float s = (x+y+z)*F3;
+    int i = fastfloor(x+s);
+    int j = fastfloor(y+s);
+    int k = fastfloor(z+s);
+
+    float G3 = 1.0/6.0;
+    float t = (i+j+k)*G3;
+    float x0 = x-(i-t);
+    float y0 = y-(j-t);
+    float z0 = z-(k-t);
+
+    int i1, j1, k1;
+    int i2, j2, k2;
+
+    if(x0>=y0) {
+        if(y0>=z0) { i1=1; j1=0; k1=0; i2=1; j2=1; k2=0; }
+        else if(x0>=z0) { i1=1; j1=0; k1=0; i2=1; j2=0; k2=1; }
+        else { i1=0; j1=0; k1=1; i2=1; j2=0; k2=1; }
+    }
+    else {
+        if(y0<z0) { i1=0; j1=0; k1=1; i2=0; j2=1; k2=1; }
+        else if(x0<z0) { i1=0; j1=1; k1=0; i2=0; j2=1; k2=1; }
+        else { i1=0; j1=1; k1=0; i2=1; j2=1; k2=0; }
+    }
+
+    float x1 = x0 - i1 + G3;
+    float y1 = y0 - j1 + G3;
+    float z1 = z0 - k1 + G3;
+    float x2 = x0 - i2 + 2.0*G3;
+    float y2 = y0 - j2 + 2.0*G3;
+    float z2 = z0 - k2 + 2.0*G3;
+    float x3 = x0 - 1.0 + 3.0*G3;
+    float y3 = y0 - 1.0 + 3.0*G3;
+    float z3 = z0 - 1.0 + 3.0*G3;
+
+    int gi0 = periodic_gradient(i, j, k, px, py, pz);
+    int gi1 = periodic_gradient(i+i1, j+j1, k+k1, px, py, pz);
+    int gi2 = periodic_gradient(i+i2, j+j2, k+k2, px, py, pz);
+    int gi3 = periodic_gradient(i+1, j+1, k+1, px, py, pz);
+
+    float t0 = 0.6 - x0*x0 - y0*y0 - z0*z0;
+    if(t0<0) n0 = 0.0;
+    else {
+        t0 *= t0;
+        n0 = t0 * t0 * dot(grad3[gi0], x0, y0, z0);
+    }
+
+    float t1 = 0.6 - x1*x1 - y1*y1 - z1*z1;
+    if(t1<0) n1 = 0.0;
+    else {
+        t1 *= t1;
+        n1 = t1 * t1 * dot(grad3[gi1], x1, y1, z1);
+    }
+
+    float t2 = 0.6 - x2*x2 - y2*y2 - z2*z2;
+    if(t2<0) n2 = 0.0;
+    else {
+        t2 *= t2;
+        n2 = t2 * t2 * dot(grad3[gi2], x2, y2, z2);
+    }
+
+    float t3 = 0.6 - x3*x3 - y3*y3 - z3*z3;
+    if(t3<0) n3 = 0.0;
+    else {
+        t3 *= t3;
+        n3 = t3 * t3 * dot(grad3[gi3], x3, y3, z3);
+    }
+
+    return 32.0*(n0 + n1 + n2 + n3);
+}
+
+
+
+// 2D raw Simplex noise with its gradient.
+float raw_noise_2d_deriv( const float x, const float y, float* gradient ) {
+    float F2 = 0.5 * (sqrtf(3.0) - 1.0);
+    float s = (x + y) * F2;
+    int i = fastfloor( x + s );
+    int j = fastfloor( y + s );
+
+    float G2 = (3.0 - sqrtf(3.0)) / 6.0;
+    float t = (i + j) * G2;
+    float x0 = x-(i-t);
+    float y0 = y-(j-t);
+
+    int i1, j1;
+    if(x0>y0) {i1=1; j1=0;}
+    else {i1=0; j1=1;}
+
+    float xs[3] = { x0, x0 - i1 + G2, x0 - 1.0f + 2.0f*G2 };
+    float ys[3] = { y0, y0 - j1 + G2, y0 - 1.0f + 2.0f*G2 };
+
+    int ii = i & 255;
+    int jj = j & 255;
+    int gi[3] = { perm[ii+perm[jj]] % 12, perm[ii+i1+perm[jj+j1]] % 12, perm[ii+1+perm[jj+1]] % 12 };
+
+    float n = 0, dx = 0, dy = 0;
+    for( int c=0; c < 3; c++ ) {
+        float tc = 0.5 - xs[c]*xs[c] - ys[c]*ys[c];
+        if( tc < 0 ) continue;
+        float t2 = tc*tc;
+        float t4 = t2*t2;
+        float gx = dot(grad3[gi[c]], xs[c], ys[c]);
+        float k = -8*t2*tc*gx;
+        n += t4*gx;
+        dx += t4*grad3[gi[c]][0] + k*xs[c];
+        dy += t4*grad3[gi[c]][1] + k*ys[c];
+    }
+
+    gradient[0] = 70.0*dx;
+    gradient[1] = 70.0*dy;
+    return 70.0*n;
+}
+
+
+// Multi-octave Simplex noise with its gradient.
+//
+// Each octave's gradient is scaled by its frequency, the chain rule for
+// sampling at x*frequency.
+float octave_noise_2d_deriv( const float octaves, const float persistence, const float scale, const float x, const float y, float* gradient ) {
+    float total = 0;
+    float frequency = scale;
+    float amplitude = 1;
+    float maxAmplitude = 0;
+    gradient[0] = gradient[1] = 0;
+
+    for( int i=0; i < octaves; i++ ) {
+        float g[2];
+        total += raw_noise_2d_deriv( x * frequency, y * frequency, g ) * amplitude;
+        gradient[0] += g[0] * amplitude * frequency;
+        gradient[1] += g[1] * amplitude * frequency;
+
+        frequency *= 2;
+        maxAmplitude += amplitude;
+        amplitude *= persistence;
+    }
+
+    gradient[0] /= maxAmplitude;
+    gradient[1] /= maxAmplitude;
+    return total / maxAmplitude;
+}
+
+float octave_noise_3d_deriv( const float octaves, const float persistence, const float scale, const float x, const float y, const float z, float* gradient ) {
+    float total = 0;
+    float frequency = scale;
+    float amplitude = 1;
+    float maxAmplitude = 0;
+    gradient[0] = gradient[1] = gradient[2] = 0;
+
+    for( int i=0; i < octaves; i++ ) {
+        float g[3];
+        total += raw_noise_3d_deriv( x * frequency, y * frequency, z * frequency, g ) * amplitude;
+        gradient[0] += g[0] * amplitude * frequency;
+        gradient[1] += g[1] * amplitude * frequency;
+        gradient[2] += g[2] * amplitude * frequency;
+
+        frequency *= 2;
+        maxAmplitude += amplitude;
+        amplitude *= persistence;
+    }
+
+    gradient[0] /= maxAmplitude;
+    gradient[1] /= maxAmplitude;
+    gradient[2] /= maxAmplitude;
+    return total / maxAmplitude;
+}
+
+
+// The ridge at n = 0 has no derivative, the side of n > 0 is used there.
+float ridged_deriv( const float amplitude, const float n, const float* dn, const int dims, float* d ) {
+    float slope = amplitude*n < 0 ? amplitude : -amplitude;
+    for( int k=0; k < dims; k++ )
+        d[k] = slope*dn[k];
+    return -(fabsf(amplitude*n) - amplitude);
+}
+
+float product_deriv( const float a, const float* da, const float b, const float* db, const int dims, float* d ) {
+    for( int k=0; k < dims; k++ )
+        d[k] = da[k]*b + a*db[k];
+    return a*b;
+}
+
+
+// Contribution of one corner, its gradient is added to d.
+// The corner term is t^4 (g.x) with t = 0.6 - |x|^2, so its derivative is
+// t^4 g - 8 t^3 (g.x) x.
+static inline float corner_deriv_3d( const int* g, const float x, const float y, const float z, float* d ) {
+    float t = 0.6 - x*x - y*y - z*z;
+    if( t < 0 ) return 0.0;
+    float t2 = t*t;
+    float t4 = t2*t2;
+    float gx = dot(g, x, y, z);
+    float k = -8*t2*t*gx;
+    d[0] += t4*g[0] + k*x;
+    d[1] += t4*g[1] + k*y;
+    d[2] += t4*g[2] + k*z;
+    return t4*gx;
+}
+
+static inline float corner_deriv_4d( const int* g, const float x, const float y, const float z, const float w, float* d ) {
+    float t = 0.6 - x*x - y*y - z*z - w*w;
+    if( t < 0 ) return 0.0;
+    float t2 = t*t;
+    float t4 = t2*t2;
+    float gx = dot(g, x, y, z, w);
+    float k = -8*t2*t*gx;
+    d[0] += t4*g[0] + k*x;
+    d[1] += t4*g[1] + k*y;
+    d[2] += t4*g[2] + k*z;
+    d[3] += t4*g[3] + k*w;
+    return t4*gx;
+}
+
+// raw_noise_3d() and raw_noise_3d_periodic() with the gradient. The periods
+// are already rounded, periodic selects the hashing of the corners.
+static float noise_deriv_3d( const float x, const float y, const float z, const int px, const int py, const int pz,
+                             const bool periodic, float* gradient ) {
+    float F3 = 1.0/3.0;
+    float s = (x+y+z)*F3;
+    int i = fastfloor(x+s);
+    int j = fastfloor(y+s);
+    int k = fastfloor(z+s);
+
+    float G3 = 1.0/6.0;
+    float t = (i+j+k)*G3;
+    float x0 = x-(i-t);
+    float y0 = y-(j-t);
+    float z0 = z-(k-t);
+
+    int i1, j1, k1;
+    int i2, j2, k2;
+
+    if(x0>=y0) {
+        if(y0>=z0) { i1=1; j1=0; k1=0; i2=1; j2=1; k2=0; }
+        else if(x0>=z0) { i1=1; j1=0; k1=0; i2=1; j2=0; k2=1; }
+        else { i1=0; j1=0; k1=1; i2=1; j2=0; k2=1; }
+    }
+    else {
+        if(y0<z0) { i1=0; j1=0; k1=1; i2=0; j2=1; k2=1; }
+        else if(x0<z0) { i1=0; j1=1; k1=0; i2=0; j2=1; k2=1; }
+        else { i1=0; j1=1; k1=0; i2=1; j2=1; k2=0; }
+    }
+
+    int gi0, gi1, gi2, gi3;
+    if( periodic ) {
+        gi0 = periodic_gradient(i, j, k, px, py, pz);
+        gi1 = periodic_gradient(i+i1, j+j1, k+k1, px, py, pz);
+        gi2 = periodic_gradient(i+i2, j+j2, k+k2, px, py, pz);
+        gi3 = periodic_gradient(i+1, j+1, k+1, px, py, pz);
+    }
+    else {
+        int ii = i & 255;
+        int jj = j & 255;
+        int kk = k & 255;
+        gi0 = perm[ii+perm[jj+perm[kk]]] % 12;
+        gi1 = perm[ii+i1+perm[jj+j1+perm[kk+k1]]] % 12;
+        gi2 = perm[ii+i2+perm[jj+j2+perm[kk+k2]]] % 12;
+        gi3 = perm[ii+1+perm[jj+1+perm[kk+1]]] % 12;
+    }
+
+    float d[3] = { 0, 0, 0 };
+    float n = corner_deriv_3d(grad3[gi0], x0, y0, z0, d)
+        + corner_deriv_3d(grad3[gi1], x0 - i1 + G3, y0 - j1 + G3, z0 - k1 + G3, d)
+        + corner_deriv_3d(grad3[gi2], x0 - i2 + 2.0*G3, y0 - j2 + 2.0*G3, z0 - k2 + 2.0*G3, d)
+        + corner_deriv_3d(grad3[gi3], x0 - 1.0 + 3.0*G3, y0 - 1.0 + 3.0*G3, z0 - 1.0 + 3.0*G3, d);
+
+    gradient[0] = 32.0*d[0];
+    gradient[1] = 32.0*d[1];
+    gradient[2] = 32.0*d[2];
+    return 32.0*n;
+}
+
+float raw_noise_3d_deriv( const float x, const float y, const float z, float* gradient ) {
+    return noise_deriv_3d(x, y, z, 0, 0, 0, false, gradient);
+}
+
+float raw_noise_3d_periodic_deriv( const float x, const float y, const float z, const int periodX, const int periodY, const int periodZ, float* gradient ) {
+    return noise_deriv_3d(x, y, z, noise_period(periodX), noise_period(periodY), noise_period(periodZ), true, gradient);
+}
+
+float raw_noise_4d_deriv( const float x, const float y, const float z, const float w, float* gradient ) {
+    float F4 = (sqrtf(5.0)-1.0)/4.0;
+    float G4 = (5.0-sqrtf(5.0))/20.0;
+
+    float s = (x + y + z + w) * F4;
+    int i = fastfloor(x + s);
+    int j = fastfloor(y + s);
+    int k = fastfloor(z + s);
+    int l = fastfloor(w + s);
+    float t = (i + j + k + l) * G4;
+    float x0 = x - (i - t);
+    float y0 = y - (j - t);
+    float z0 = z - (k - t);
+    float w0 = w - (l - t);
+
+    int c = ((x0 > y0) ? 32 : 0) + ((x0 > z0) ? 16 : 0) + ((y0 > z0) ? 8 : 0)
+        + ((x0 > w0) ? 4 : 0) + ((y0 > w0) ? 2 : 0) + ((z0 > w0) ? 1 : 0);
+
+    int i1 = simplex[c][0]>=3 ? 1 : 0;
+    int j1 = simplex[c][1]>=3 ? 1 : 0;
+    int k1 = simplex[c][2]>=3 ? 1 : 0;
+    int l1 = simplex[c][3]>=3 ? 1 : 0;
+    int i2 = simplex[c][0]>=2 ? 1 : 0;
+    int j2 = simplex[c][1]>=2 ? 1 : 0;
+    int k2 = simplex[c][2]>=2 ? 1 : 0;
+    int l2 = simplex[c][3]>=2 ? 1 : 0;
+    int i3 = simplex[c][0]>=1 ? 1 : 0;
+    int j3 = simplex[c][1]>=1 ? 1 : 0;
+    int k3 = simplex[c][2]>=1 ? 1 : 0;
+    int l3 = simplex[c][3]>=1 ? 1 : 0;
+
+    int ii = i & 255;
+    int jj = j & 255;
+    int kk = k & 255;
+    int ll = l & 255;
+    int gi0 = perm[ii+perm[jj+perm[kk+perm[ll]]]] % 32;
+    int gi1 = perm[ii+i1+perm[jj+j1+perm[kk+k1+perm[ll+l1]]]] % 32;
+    int gi2 = perm[ii+i2+perm[jj+j2+perm[kk+k2+perm[ll+l2]]]] % 32;
+    int gi3 = perm[ii+i3+perm[jj+j3+perm[kk+k3+perm[ll+l3]]]] % 32;
+    int gi4 = perm[ii+1+perm[jj+1+perm[kk+1+perm[ll+1]]]] % 32;
+
+    float d[4] = { 0, 0, 0, 0 };
+    float n = corner_deriv_4d(grad4[gi0], x0, y0, z0, w0, d)
+        + corner_deriv_4d(grad4[gi1], x0 - i1 + G4, y0 - j1 + G4, z0 - k1 + G4, w0 - l1 + G4, d)
+        + corner_deriv_4d(grad4[gi2], x0 - i2 + 2.0*G4, y0 - j2 + 2.0*G4, z0 - k2 + 2.0*G4, w0 - l2 + 2.0*G4, d)
+        + corner_deriv_4d(grad4[gi3], x0 - i3 + 3.0*G4, y0 - j3 + 3.0*G4, z0 - k3 + 3.0*G4, w0 - l3 + 3.0*G4, d)
+        + corner_deriv_4d(grad4[gi4], x0 - 1.0 + 4.0*G4, y0 - 1.0 + 4.0*G4, z0 - 1.0 + 4.0*G4, w0 - 1.0 + 4.0*G4, d);
+
+    gradient[0] = 27.0*d[0];
+    gradient[1] = 27.0*d[1];
+    gradient[2] = 27.0*d[2];
+    gradient[3] = 27.0*d[3];
+    return 27.0*n;
+}
+
+
+#if defined(WATER_SSE2)
+// fastfloor() for four lanes, with the same rounding of non-positive values.
+static inline __m128i fastfloor4( const __m128 x ) {
+    __m128i truncated = _mm_cvttps_epi32(x);
+    __m128i positive = _mm_castps_si128(_mm_cmpgt_ps(x, _mm_setzero_ps()));
+    return _mm_add_epi32(truncated, _mm_andnot_si128(positive, _mm_set1_epi32(-1)));
+}
+
+// 1.0 in every lane where rank >= r, 0.0 elsewhere.
+static inline __m128 rank_offset4( const __m128i rank, const int r ) {
+    __m128i mask = _mm_cmpgt_epi32(rank, _mm_set1_epi32(r - 1));
+    return _mm_and_ps(_mm_castsi128_ps(mask), _mm_set1_ps(1.0f));
+}
+
+// Contribution of one simplex corner for four lanes.
+static inline __m128 corner4( const __m128 x, const __m128 y, const __m128 z, const __m128 w, const float* g ) {
+    __m128 t = _mm_sub_ps(_mm_set1_ps(0.6f), _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)),
+                                                       _mm_add_ps(_mm_mul_ps(z, z), _mm_mul_ps(w, w))));
+    t = _mm_max_ps(t, _mm_setzero_ps());
+    t = _mm_mul_ps(t, t);
+    __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_load_ps(g), x), _mm_mul_ps(_mm_load_ps(g + 4), y)),
+                          _mm_add_ps(_mm_mul_ps(_mm_load_ps(g + 8), z), _mm_mul_ps(_mm_load_ps(g + 12), w)));
+    return _mm_mul_ps(_mm_mul_ps(t, t), d);
+}
+
+// Four points of 4D raw Simplex noise.
+//
+// Follows raw_noise_4d(), but finds the simplex from the coordinate ranks
+// instead of the simplex[] table so the traversal stays in registers. Only the
+// permutation and gradient lookups are done per lane.
+static void raw_noise_4d_sse( const float* x, const float* y, const float* z, const float* w, float* out ) {
+    const float F4 = (sqrtf(5.0)-1.0)/4.0;
+    const float G4 = (5.0-sqrtf(5.0))/20.0;
+
+    __m128 vx = _mm_loadu_ps(x);
+    __m128 vy = _mm_loadu_ps(y);
+    __m128 vz = _mm_loadu_ps(z);
+    __m128 vw = _mm_loadu_ps(w);
+
+    __m128 s = _mm_mul_ps(_mm_add_ps(_mm_add_ps(vx, vy), _mm_add_ps(vz, vw)), _mm_set1_ps(F4));
+    __m128i i = fastfloor4(_mm_add_ps(vx, s));
+    __m128i j = fastfloor4(_mm_add_ps(vy, s));
+    __m128i k = fastfloor4(_mm_add_ps(vz, s));
+    __m128i l = fastfloor4(_mm_add_ps(vw, s));
+    __m128 t = _mm_mul_ps(_mm_cvtepi32_ps(_mm_add_epi32(_mm_add_epi32(i, j), _mm_add_epi32(k, l))), _mm_set1_ps(G4));
+
+    __m128 x0 = _mm_sub_ps(vx, _mm_sub_ps(_mm_cvtepi32_ps(i), t));
+    __m128 y0 = _mm_sub_ps(vy, _mm_sub_ps(_mm_cvtepi32_ps(j), t));
+    __m128 z0 = _mm_sub_ps(vz, _mm_sub_ps(_mm_cvtepi32_ps(k), t));
+    __m128 w0 = _mm_sub_ps(vw, _mm_sub_ps(_mm_cvtepi32_ps(l), t));
+
+    // Rank of each coordinate, equal to the entry simplex[c] holds for it.
+    // Comparison masks are -1, so the ranks are accumulated by subtraction.
+    __m128i xy = _mm_castps_si128(_mm_cmpgt_ps(x0, y0));
+    __m128i xz = _mm_castps_si128(_mm_cmpgt_ps(x0, z0));
+    __m128i yz = _mm_castps_si128(_mm_cmpgt_ps(y0, z0));
+    __m128i xw = _mm_castps_si128(_mm_cmpgt_ps(x0, w0));
+    __m128i yw = _mm_castps_si128(_mm_cmpgt_ps(y0, w0));
+    __m128i zw = _mm_castps_si128(_mm_cmpgt_ps(z0, w0));
+    __m128i one = _mm_set1_epi32(1);
+    __m128i rankx = _mm_sub_epi32(_mm_setzero_si128(), _mm_add_epi32(_mm_add_epi32(xy, xz), xw));
+    __m128i ranky = _mm_add_epi32(_mm_add_epi32(_mm_andnot_si128(xy, one), _mm_sub_epi32(_mm_setzero_si128(), yz)),
+                                  _mm_sub_epi32(_mm_setzero_si128(), yw));
+    __m128i rankz = _mm_add_epi32(_mm_add_epi32(_mm_andnot_si128(xz, one), _mm_andnot_si128(yz, one)),
+                                  _mm_sub_epi32(_mm_setzero_si128(), zw));
+    __m128i rankw = _mm_add_epi32(_mm_add_epi32(_mm_andnot_si128(xw, one), _mm_andnot_si128(yw, one)),
+                                  _mm_andnot_si128(zw, one));
+
+    // Corner offsets, indexed [corner][axis] with corner 0 and 4 implied.
+    __m128 off[3][4];
+    for( int c=0; c < 3; c++ ) {
+        off[c][0] = rank_offset4(rankx, 3 - c);
+        off[c][1] = rank_offset4(ranky, 3 - c);
+        off[c][2] = rank_offset4(rankz, 3 - c);
+        off[c][3] = rank_offset4(rankw, 3 - c);
+    }
+
+    // Hash the five corners and gather their gradients, laid out as
+    // [corner][component][lane].
+    int ia[4], ja[4], ka[4], la[4], ra[4][4];
+    _mm_storeu_si128((__m128i*)ia, i);
+    _mm_storeu_si128((__m128i*)ja, j);
+    _mm_storeu_si128((__m128i*)ka, k);
+    _mm_storeu_si128((__m128i*)la, l);
+    _mm_storeu_si128((__m128i*)ra[0], rankx);
+    _mm_storeu_si128((__m128i*)ra[1], ranky);
+    _mm_storeu_si128((__m128i*)ra[2], rankz);
+    _mm_storeu_si128((__m128i*)ra[3], rankw);
+
+    WATER_ALIGN16 float g[5][16];
+    for( int lane=0; lane < 4; lane++ ) {
+        int ii = ia[lane] & 255;
+        int jj = ja[lane] & 255;
+        int kk = ka[lane] & 255;
+        int ll = la[lane] & 255;
+        for( int c=0; c < 5; c++ ) {
+            // Corner c steps along every axis whose rank is at least 4-c.
+            int i1 = ra[0][lane] >= 4-c ? 1 : 0;
+            int j1 = ra[1][lane] >= 4-c ? 1 : 0;
+            int k1 = ra[2][lane] >= 4-c ? 1 : 0;
+            int l1 = ra[3][lane] >= 4-c ? 1 : 0;
+            int gi = perm[ii+i1+perm[jj+j1+perm[kk+k1+perm[ll+l1]]]] % 32;
+            g[c][lane] = grad4[gi][0];
+            g[c][4 + lane] = grad4[gi][1];
+            g[c][8 + lane] = grad4[gi][2];
+            g[c][12 + lane] = grad4[gi][3];
+        }
+    }
+
+    __m128 n = corner4(x0, y0, z0, w0, g[0]);
+    for( int c=1; c < 4; c++ ) {
+        __m128 bias = _mm_set1_ps(c * G4);
+        n = _mm_add_ps(n, corner4(_mm_add_ps(_mm_sub_ps(x0, off[c-1][0]), bias),
+                                  _mm_add_ps(_mm_sub_ps(y0, off[c-1][1]), bias),
+                                  _mm_add_ps(_mm_sub_ps(z0, off[c-1][2]), bias),
+                                  _mm_add_ps(_mm_sub_ps(w0, off[c-1][3]), bias), g[c]));
+    }
+    __m128 last = _mm_set1_ps(-1.0f + 4.0f*G4);
+    n = _mm_add_ps(n, corner4(_mm_add_ps(x0, last), _mm_add_ps(y0, last),
+                              _mm_add_ps(z0, last), _mm_add_ps(w0, last), g[4]));
+
+    _mm_storeu_ps(out, _mm_mul_ps(n, _mm_set1_ps(27.0f)));
+}
+#endif
+
+
+#if defined(WATER_SSE2)
+// Accumulates one 3D corner and its gradient for four lanes, g holds the
+// gradient components as [component][lane].
+static inline void corner_deriv4_3d( const __m128 x, const __m128 y, const __m128 z, const float* g,
+                                     __m128& n, __m128& dx, __m128& dy, __m128& dz ) {
+    __m128 t = _mm_sub_ps(_mm_set1_ps(0.6f), _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z)));
+    t = _mm_max_ps(t, _mm_setzero_ps());
+    __m128 t2 = _mm_mul_ps(t, t);
+    __m128 t4 = _mm_mul_ps(t2, t2);
+    __m128 gx = _mm_load_ps(g);
+    __m128 gy = _mm_load_ps(g + 4);
+    __m128 gz = _mm_load_ps(g + 8);
+    __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(gx, x), _mm_mul_ps(gy, y)), _mm_mul_ps(gz, z));
+    __m128 k = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(-8.0f), _mm_mul_ps(t2, t)), d);
+    n = _mm_add_ps(n, _mm_mul_ps(t4, d));
+    dx = _mm_add_ps(dx, _mm_add_ps(_mm_mul_ps(t4, gx), _mm_mul_ps(k, x)));
+    dy = _mm_add_ps(dy, _mm_add_ps(_mm_mul_ps(t4, gy), _mm_mul_ps(k, y)));
+    dz = _mm_add_ps(dz, _mm_add_ps(_mm_mul_ps(t4, gz), _mm_mul_ps(k, z)));
+}
+
+// Four points of 3D raw Simplex noise with the gradient.
+//
+// The branches of raw_noise_3d() that pick the simplex reduce to comparison
+// masks: x leads if it is at least y and z, and is not last if it is at
+// least one of them, with the same tie breaking.
+static void raw_noise_3d_deriv_sse( const float* x, const float* y, const float* z,
+                                    float* out, float* dxOut, float* dyOut, float* dzOut ) {
+    const float F3 = 1.0/3.0;
+    const float G3 = 1.0/6.0;
+
+    __m128 vx = _mm_loadu_ps(x);
+    __m128 vy = _mm_loadu_ps(y);
+    __m128 vz = _mm_loadu_ps(z);
+
+    __m128 s = _mm_mul_ps(_mm_add_ps(_mm_add_ps(vx, vy), vz), _mm_set1_ps(F3));
+    __m128i i = fastfloor4(_mm_add_ps(vx, s));
+    __m128i j = fastfloor4(_mm_add_ps(vy, s));
+    __m128i k = fastfloor4(_mm_add_ps(vz, s));
+    __m128 t = _mm_mul_ps(_mm_cvtepi32_ps(_mm_add_epi32(_mm_add_epi32(i, j), k)), _mm_set1_ps(G3));
+
+    __m128 x0 = _mm_sub_ps(vx, _mm_sub_ps(_mm_cvtepi32_ps(i), t));
+    __m128 y0 = _mm_sub_ps(vy, _mm_sub_ps(_mm_cvtepi32_ps(j), t));
+    __m128 z0 = _mm_sub_ps(vz, _mm_sub_ps(_mm_cvtepi32_ps(k), t));
+
+    __m128 xy = _mm_cmpge_ps(x0, y0);
+    __m128 xz = _mm_cmpge_ps(x0, z0);
+    __m128 yz = _mm_cmpge_ps(y0, z0);
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 i1 = _mm_and_ps(_mm_and_ps(xy, xz), one);
+    __m128 j1 = _mm_and_ps(_mm_andnot_ps(xy, yz), one);
+    __m128 k1 = _mm_sub_ps(_mm_sub_ps(one, i1), j1);
+    __m128 i2 = _mm_and_ps(_mm_or_ps(xy, xz), one);
+    __m128 j2 = _mm_and_ps(_mm_or_ps(_mm_andnot_ps(xy, _mm_castsi128_ps(_mm_set1_epi32(-1))), yz), one);
+    __m128 k2 = _mm_sub_ps(_mm_sub_ps(_mm_set1_ps(2.0f), i2), j2);
+
+    int ia[4], ja[4], ka[4];
+    float o1[3][4], o2[3][4];
+    _mm_storeu_si128((__m128i*)ia, i);
+    _mm_storeu_si128((__m128i*)ja, j);
+    _mm_storeu_si128((__m128i*)ka, k);
+    _mm_storeu_ps(o1[0], i1);
+    _mm_storeu_ps(o1[1], j1);
+    _mm_storeu_ps(o1[2], k1);
+    _mm_storeu_ps(o2[0], i2);
+    _mm_storeu_ps(o2[1], j2);
+    _mm_storeu_ps(o2[2], k2);
+
+    WATER_ALIGN16 float g[4][12];
+    for( int lane=0; lane < 4; lane++ ) {
+        int ii = ia[lane] & 255;
+        int jj = ja[lane] & 255;
+        int kk = ka[lane] & 255;
+        int a1 = (int)o1[0][lane], b1 = (int)o1[1][lane], c1 = (int)o1[2][lane];
+        int a2 = (int)o2[0][lane], b2 = (int)o2[1][lane], c2 = (int)o2[2][lane];
+        int gi[4] = { perm[ii+perm[jj+perm[kk]]] % 12,
+                      perm[ii+a1+perm[jj+b1+perm[kk+c1]]] % 12,
+                      perm[ii+a2+perm[jj+b2+perm[kk+c2]]] % 12,
+                      perm[ii+1+perm[jj+1+perm[kk+1]]] % 12 };
+        for( int c=0; c < 4; c++ ) {
+            g[c][lane] = grad3[gi[c]][0];
+            g[c][4 + lane] = grad3[gi[c]][1];
+            g[c][8 + lane] = grad3[gi[c]][2];
+        }
+    }
+
+    __m128 n = _mm_setzero_ps(), dx = _mm_setzero_ps(), dy = _mm_setzero_ps(), dz = _mm_setzero_ps();
+    __m128 g1 = _mm_set1_ps(G3);
+    __m128 g2 = _mm_set1_ps(2.0f*G3);
+    __m128 g3 = _mm_set1_ps(-1.0f + 3.0f*G3);
+    corner_deriv4_3d(x0, y0, z0, g[0], n, dx, dy, dz);
+    corner_deriv4_3d(_mm_add_ps(_mm_sub_ps(x0, i1), g1), _mm_add_ps(_mm_sub_ps(y0, j1), g1),
+                     _mm_add_ps(_mm_sub_ps(z0, k1), g1), g[1], n, dx, dy, dz);
+    corner_deriv4_3d(_mm_add_ps(_mm_sub_ps(x0, i2), g2), _mm_add_ps(_mm_sub_ps(y0, j2), g2),
+                     _mm_add_ps(_mm_sub_ps(z0, k2), g2), g[2], n, dx, dy, dz);
+    corner_deriv4_3d(_mm_add_ps(x0, g3), _mm_add_ps(y0, g3), _mm_add_ps(z0, g3), g[3], n, dx, dy, dz);
+
+    __m128 scale = _mm_set1_ps(32.0f);
+    _mm_storeu_ps(out, _mm_mul_ps(n, scale));
+    _mm_storeu_ps(dxOut, _mm_mul_ps(dx, scale));
+    _mm_storeu_ps(dyOut, _mm_mul_ps(dy, scale));
+    _mm_storeu_ps(dzOut, _mm_mul_ps(dz, scale));
+}
+
+// Four points of 2D raw Simplex noise with the gradient.
+static void raw_noise_2d_deriv_sse( const float* x, const float* y, float* out, float* dxOut, float* dyOut ) {
+    const float F2 = 0.5 * (sqrtf(3.0) - 1.0);
+    const float G2 = (3.0 - sqrtf(3.0)) / 6.0;
+
+    __m128 vx = _mm_loadu_ps(x);
+    __m128 vy = _mm_loadu_ps(y);
+
+    __m128 s = _mm_mul_ps(_mm_add_ps(vx, vy), _mm_set1_ps(F2));
+    __m128i i = fastfloor4(_mm_add_ps(vx, s));
+    __m128i j = fastfloor4(_mm_add_ps(vy, s));
+    __m128 t = _mm_mul_ps(_mm_cvtepi32_ps(_mm_add_epi32(i, j)), _mm_set1_ps(G2));
+
+    __m128 x0 = _mm_sub_ps(vx, _mm_sub_ps(_mm_cvtepi32_ps(i), t));
+    __m128 y0 = _mm_sub_ps(vy, _mm_sub_ps(_mm_cvtepi32_ps(j), t));
+
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 i1 = _mm_and_ps(_mm_cmpgt_ps(x0, y0), one);
+    __m128 j1 = _mm_sub_ps(one, i1);
+
+    int ia[4], ja[4];
+    float o1[4];
+    _mm_storeu_si128((__m128i*)ia, i);
+    _mm_storeu_si128((__m128i*)ja, j);
+    _mm_storeu_ps(o1, i1);
+
+    WATER_ALIGN16 float g[3][8];
+    for( int lane=0; lane < 4; lane++ ) {
+        int ii = ia[lane] & 255;
+        int jj = ja[lane] & 255;
+        int a1 = (int)o1[lane];
+        int gi[3] = { perm[ii+perm[jj]] % 12, perm[ii+a1+perm[jj+1-a1]] % 12, perm[ii+1+perm[jj+1]] % 12 };
+        for( int c=0; c < 3; c++ ) {
+            g[c][lane] = grad3[gi[c]][0];
+            g[c][4 + lane] = grad3[gi[c]][1];
+        }
+    }
+
+    __m128 cx[3] = { x0, _mm_add_ps(_mm_sub_ps(x0, i1), _mm_set1_ps(G2)), _mm_add_ps(x0, _mm_set1_ps(-1.0f + 2.0f*G2)) };
+    __m128 cy[3] = { y0, _mm_add_ps(_mm_sub_ps(y0, j1), _mm_set1_ps(G2)), _mm_add_ps(y0, _mm_set1_ps(-1.0f + 2.0f*G2)) };
+    __m128 n = _mm_setzero_ps(), dx = _mm_setzero_ps(), dy = _mm_setzero_ps();
+    for( int c=0; c < 3; c++ ) {
+        __m128 tc = _mm_sub_ps(_mm_set1_ps(0.5f), _mm_add_ps(_mm_mul_ps(cx[c], cx[c]), _mm_mul_ps(cy[c], cy[c])));
+        tc = _mm_max_ps(tc, _mm_setzero_ps());
+        __m128 t2 = _mm_mul_ps(tc, tc);
+        __m128 t4 = _mm_mul_ps(t2, t2);
+        __m128 gx = _mm_load_ps(g[c]);
+        __m128 gy = _mm_load_ps(g[c] + 4);
+        __m128 d = _mm_add_ps(_mm_mul_ps(gx, cx[c]), _mm_mul_ps(gy, cy[c]));
+        __m128 k = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(-8.0f), _mm_mul_ps(t2, tc)), d);
+        n = _mm_add_ps(n, _mm_mul_ps(t4, d));
+        dx = _mm_add_ps(dx, _mm_add_ps(_mm_mul_ps(t4, gx), _mm_mul_ps(k, cx[c])));
+        dy = _mm_add_ps(dy, _mm_add_ps(_mm_mul_ps(t4, gy), _mm_mul_ps(k, cy[c])));
+    }
+
+    __m128 scale = _mm_set1_ps(70.0f);
+    _mm_storeu_ps(out, _mm_mul_ps(n, scale));
+    _mm_storeu_ps(dxOut, _mm_mul_ps(dx, scale));
+    _mm_storeu_ps(dyOut, _mm_mul_ps(dy, scale));
+}
+#endif
+
+
+// Batched raw Simplex noise with gradients
+void raw_noise_2d_deriv_n( const int n, const float* x, const float* y, float* out, float* dx, float* dy ) {
+    int i = 0;
+#if defined(WATER_SSE2)
+    for( ; i+4 <= n; i += 4 )
+        raw_noise_2d_deriv_sse(x+i, y+i, out+i, dx+i, dy+i);
+#endif
+    for( ; i < n; i++ ) {
+        float g[2];
+        out[i] = raw_noise_2d_deriv(x[i], y[i], g);
+        dx[i] = g[0];
+        dy[i] = g[1];
+    }
+}
+
+void raw_noise_3d_deriv_n( const int n, const float* x, const float* y, const float* z,
+                           float* out, float* dx, float* dy, float* dz ) {
+    int i = 0;
+#if defined(WATER_SSE2)
+    for( ; i+4 <= n; i += 4 )
+        raw_noise_3d_deriv_sse(x+i, y+i, z+i, out+i, dx+i, dy+i, dz+i);
+#endif
+    for( ; i < n; i++ ) {
+        float g[3];
+        out[i] = raw_noise_3d_deriv(x[i], y[i], z[i], g);
+        dx[i] = g[0];
+        dy[i] = g[1];
+        dz[i] = g[2];
+    }
+}
+
+
+// Batched 4D raw Simplex noise
+void raw_noise_4d_n( const int n, const float* x, const float* y, const float* z, const float* w, float* out ) {
+    int i = 0;
+#if defined(WATER_SSE2)
+    for( ; i+4 <= n; i += 4 )
+        raw_noise_4d_sse(x+i, y+i, z+i, w+i, out+i);
+#endif
+    for( ; i < n; i++ )
+        out[i] = raw_noise_4d(x[i], y[i], z[i], w[i]);
+}
+
+
 int fastfloor( const float x ) { return x > 0 ? (int) x : (int) x - 1; }
 
 float dot( const int* g, const float x, const float y ) { return g[0]*x + g[1]*y; }
@@ -120,6 +120,53 @@ float raw_noise_3d(const float x, const float y, const float z);
 float raw_noise_4d(const float x, const float y, const float, const float w);
 
 
+// Periodic Raw Simplex noise - repeats every px, py and pz units.
+// The periods are rounded up to multiples of 3, a period of 0 disables wrapping
+// along that axis.
+float raw_noise_3d_periodic(const float x, const float y, const float z, const int px, const int py, const int pz);
+int noise_period(const float period);
+
+
+// Raw Simplex noise with its analytic gradient, written to gradient[0..1]
+// (gradient[0..2] in 3D, gradient[0..3] in 4D). Same value as the functions above.
+float raw_noise_2d_deriv(const float x, const float y, float* gradient);
+float raw_noise_3d_deriv(const float x, const float y, const float z, float* gradient);
+float raw_noise_3d_periodic_deriv(const float x, const float y, const float z, const int px, const int py, const int pz, float* gradient);
+float raw_noise_4d_deriv(const float x, const float y, const float z, const float w, float* gradient);
+
+
+// Batched Raw Simplex noise - n values from separate coordinate arrays.
+// Uses SSE2 four points at a time when available.
+void raw_noise_4d_n(const int n, const float* x, const float* y, const float* z, const float* w, float* out);
+
+// Batched Raw Simplex noise with the gradient in separate arrays.
+void raw_noise_2d_deriv_n(const int n, const float* x, const float* y, float* out, float* dx, float* dy);
+void raw_noise_3d_deriv_n(const int n, const float* x, const float* y, const float* z,
+                          float* out, float* dx, float* dy, float* dz);
+
+
+// Multi-octave Simplex noise with its gradient, see octave_noise_2d().
+float octave_noise_2d_deriv(const float octaves,
+                    const float persistence,
+                    const float scale,
+                    const float x,
+                    const float y,
+                    float* gradient);
+float octave_noise_3d_deriv(const float octaves,
+                    const float persistence,
+                    const float scale,
+                    const float x,
+                    const float y,
+                    const float z,
+                    float* gradient);
+
+// Combining noise values that carry dims derivatives, dims is at most 4.
+// Ridged noise -(|amplitude*n| - amplitude) and its derivatives.
+float ridged_deriv(const float amplitude, const float n, const float* dn, const int dims, float* d);
+// Product a*b and its derivatives.
+float product_deriv(const float a, const float* da, const float b, const float* db, const int dims, float* d);
+
+
 int fastfloor(const float x);
 
 float dot(const int* g, const float x, const float y);
@@ -0,0 +1,125 @@
+//
+//  File: terrainGrid.cpp
+//
+//  Description:
+//		Uniform grid of terrain heights.
+//
+
+#include <math.h>
+#include <vector>
+
+#include "terrainGrid.h"
+
+
+void terrain_build(const int vertexCount, const float* points, const int triangleCount,
+                   const int* triangles, const int resolution, TerrainGrid& grid)
+{
+    grid = TerrainGrid();
+    if (vertexCount <= 0 || triangleCount <= 0 || resolution < 1)
+        return;
+
+    float u0 = points[0], u1 = points[0];
+    float v0 = points[2], v1 = points[2];
+    for (int i = 1; i < vertexCount; i++) {
+        const float* p = points + 3*i;
+        u0 = p[0] < u0 ? p[0] : u0;
+        u1 = p[0] > u1 ? p[0] : u1;
+        v0 = p[2] < v0 ? p[2] : v0;
+        v1 = p[2] > v1 ? p[2] : v1;
+    }
+
+    float extent = (u1 - u0) > (v1 - v0) ? u1 - u0 : v1 - v0;
+    grid.cellSize = extent > 0.0f ? extent/resolution : 1.0f;
+    grid.nu = (int)ceil((u1 - u0)/grid.cellSize) + 1;
+    grid.nv = (int)ceil((v1 - v0)/grid.cellSize) + 1;
+    grid.originU = u0;
+    grid.originV = v0;
+    grid.height.assign((size_t)grid.nu*grid.nv, TERRAIN_NONE);
+
+    float inv = 1.0f/grid.cellSize;
+    for (int t = 0; t < triangleCount; t++) {
+        const float* a = points + 3*triangles[3*t];
+        const float* b = points + 3*triangles[3*t + 1];
+        const float* c = points + 3*triangles[3*t + 2];
+
+        // in cell units, cell centers on the integers
+        float ax = (a[0] - u0)*inv, az = (a[2] - v0)*inv;
+        float bx = (b[0] - u0)*inv, bz = (b[2] - v0)*inv;
+        float cx = (c[0] - u0)*inv, cz = (c[2] - v0)*inv;
+        float area = (bx - ax)*(cz - az) - (cx - ax)*(bz - az);
+        if (area == 0.0f)
+            continue;   // seen edge on, its edges are in the neighbours
+
+        float lo = ax < bx ? ax : bx, hi = ax > bx ? ax : bx;
+        int i0 = (int)ceil(cx < lo ? cx : lo), i1 = (int)floor(cx > hi ? cx : hi);
+        lo = az < bz ? az : bz; hi = az > bz ? az : bz;
+        int j0 = (int)ceil(cz < lo ? cz : lo), j1 = (int)floor(cz > hi ? cz : hi);
+        i0 = i0 < 0 ? 0 : i0; i1 = i1 >= grid.nu ? grid.nu - 1 : i1;
+        j0 = j0 < 0 ? 0 : j0; j1 = j1 >= grid.nv ? grid.nv - 1 : j1;
+
+        // a little slack so centers on shared edges are not lost between
+        // both triangles
+        float inside = -1e-5f*area*area;
+        float invArea = 1.0f/area;
+        for (int j = j0; j <= j1; j++) {
+            float* row = &grid.height[(size_t)j*grid.nu];
+            for (int i = i0; i <= i1; i++) {
+                float wa = (bx - i)*(cz - j) - (cx - i)*(bz - j);
+                float wb = (cx - i)*(az - j) - (ax - i)*(cz - j);
+                float wc = area - wa - wb;
+                if (wa*area < inside || wb*area < inside || wc*area < inside)
+                    continue;
+                float h = (wa*a[1] + wb*b[1] + wc*c[1])*invArea;
+                if (h > row[i])
+                    row[i] = h;
+            }
+        }
+    }
+}
+
+void terrain_height_n(const TerrainGrid& grid, const int n, const float* u, const float* v,
+                      float* height, float* gradU, float* gradV)
+{
+    const bool slopes = gradU && gradV;
+    if (slopes)
+        for (int i = 0; i < n; i++)
+            gradU[i] = gradV[i] = 0.0f;
+    if (grid.nu == 0) {
+        for (int i = 0; i < n; i++)
+            height[i] = TERRAIN_NONE;
+        return;
+    }
+
+    float inv = 1.0f/grid.cellSize;
+    const float* h = &grid.height[0];
+    #pragma omp parallel for
+    for (int i = 0; i < n; i++) {
+        float x = (u[i] - grid.originU)*inv;
+        float z = (v[i] - grid.originV)*inv;
+        if (!(x >= 0.0f && z >= 0.0f && x <= grid.nu - 1 && z <= grid.nv - 1)) {
+            height[i] = TERRAIN_NONE;
+            continue;
+        }
+        int x0 = (int)x, z0 = (int)z;
+        int x1 = x0 + 1 < grid.nu ? x0 + 1 : x0;
+        int z1 = z0 + 1 < grid.nv ? z0 + 1 : z0;
+        float fx = x - x0, fz = z - z0;
+        float h00 = h[(size_t)z0*grid.nu + x0], h10 = h[(size_t)z0*grid.nu + x1];
+        float h01 = h[(size_t)z1*grid.nu + x0], h11 = h[(size_t)z1*grid.nu + x1];
+
+        // a missing corner means the terrain ends here, no blending with it
+        if (h00 == TERRAIN_NONE || h10 == TERRAIN_NONE || h01 == TERRAIN_NONE || h11 == TERRAIN_NONE) {
+            float best = h00;
+            best = h10 > best ? h10 : best;
+            best = h01 > best ? h01 : best;
+            best = h11 > best ? h11 : best;
+            height[i] = best;
+            continue;
+        }
+        height[i] = (h00*(1 - fx) + h10*fx)*(1 - fz) + (h01*(1 - fx) + h11*fx)*fz;
+        if (slopes) {
+            gradU[i] = ((h10 - h00)*(1 - fz) + (h11 - h01)*fz)*inv;
+            gradV[i] = ((h01 - h00)*(1 - fx) + (h11 - h10)*fx)*inv;
+        }
+    }
+}
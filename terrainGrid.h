@@ -0,0 +1,43 @@
+//
+//  File: terrainGrid.h
+//
+//  Description:
+//		Height of a terrain mesh under the water, for attenuating the
+//		waves in the shallows. The triangles are rasterized once into a
+//		uniform grid over the rest plane that keeps the highest point of
+//		the terrain at every cell center, so a lookup per vertex is a
+//		bilinear fetch instead of a search through the triangles.
+//
+
+#ifndef TERRAIN_GRID_H_
+#define TERRAIN_GRID_H_
+
+#include <vector>
+
+
+// Height of the cells no triangle covers.
+static const float TERRAIN_NONE = -1e30f;
+
+struct TerrainGrid {
+    float originU, originV;     // of the first cell center
+    float cellSize;
+    int nu, nv;                 // cells along u and v
+    std::vector<float> height;  // highest terrain per cell, rows along u
+
+    TerrainGrid() : originU(0.0f), originV(0.0f), cellSize(1.0f), nu(0), nv(0) {}
+};
+
+// Rasterizes the triangles, three vertex indices each, of a terrain given
+// by x, y and z per vertex in the space of the rest plane with y up. The
+// grid spans the terrain with resolution cells along its longer side.
+void terrain_build(const int vertexCount, const float* points, const int triangleCount,
+                   const int* triangles, const int resolution, TerrainGrid& grid);
+
+// Height of the terrain at n points (u, v) of the rest plane. Points off
+// the terrain get TERRAIN_NONE, as deep as it gets. The slopes along u and
+// v are written when gradU and gradV are given, 0 where the terrain ends.
+void terrain_height_n(const TerrainGrid& grid, const int n, const float* u, const float* v,
+                      float* height, float* gradU = 0, float* gradV = 0);
+
+
+#endif /*TERRAIN_GRID_H_*/
@@ -0,0 +1,371 @@
+//
+//  File: vatExport.cpp
+//
+//  Description:
+//		Vertex animation textures and their files.
+//
+
+#include <math.h>
+#include <stdio.h>
+#include <vector>
+
+#include "meshNormals.h"
+#include "vatExport.h"
+
+
+WaterVatParams::WaterVatParams()
+    : start(1), end(120), timeStep(1.0), fps(24.0), maxWidth(4096), format(WATER_VAT_PNG16)
+{}
+
+
+void water_vat_bake(const WaterParams& params, const WaterVatParams& vatParams, const int n,
+                    const float* u, const float* v, const float* restNormals, WaterVat& vat,
+                    const MeshTopology* topology, const float* restPoints)
+{
+    vat.vertexCount = n > 0 ? n : 0;
+    vat.frames = vatParams.end >= vatParams.start ? vatParams.end - vatParams.start + 1 : 0;
+    int maxWidth = vatParams.maxWidth > 0 ? vatParams.maxWidth : 4096;
+    vat.width = n < maxWidth ? (n > 0 ? n : 1) : maxWidth;
+    vat.rowsPerFrame = (vat.vertexCount + vat.width - 1)/vat.width;
+    vat.height = vat.rowsPerFrame*vat.frames;
+    vat.offsets.assign((size_t)vat.width*vat.height*4, 0.0f);
+    vat.normals.assign((size_t)vat.width*vat.height*4, 0.0f);
+    for (int k = 0; k < 3; k++) {
+        vat.low[k] = 0.0f;
+        vat.high[k] = 0.0f;
+    }
+    if (vat.vertexCount == 0 || vat.frames == 0)
+        return;
+
+    bool rebuild = topology && restPoints && topology->vertexCount == n;
+
+    // one frame per thread, the engine and the normals run serially
+    // within it
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int f = 0; f < vat.frames; f++) {
+        WaterParams frameParams = params;
+        frameParams.time = (vatParams.start + f)*vatParams.timeStep;
+        WaterPlan plan;
+        water_build_plan(frameParams, plan);
+
+        std::vector<float> disp(n), gradU(rebuild ? 0 : n), gradV(rebuild ? 0 : n);
+        std::vector<float> points(rebuild ? 3*n : 0), normals(rebuild ? 3*n : 0);
+        if (rebuild) {
+            water_displacement_n(plan, n, u, v, &disp[0]);
+            for (int i = 0; i < 3*n; i++)
+                points[i] = restPoints[i] + restNormals[i]*disp[i/3];
+            mesh_normals(*topology, &points[0], &normals[0]);
+        }
+        else
+            water_displacement_deriv_n(plan, n, u, v, &disp[0], 0, &gradU[0], &gradV[0]);
+
+        float* offset = &vat.offsets[(size_t)f*vat.rowsPerFrame*vat.width*4];
+        float* normal = &vat.normals[(size_t)f*vat.rowsPerFrame*vat.width*4];
+        for (int i = 0; i < n; i++) {
+            const float* m = restNormals + 3*i;
+            offset[4*i] = m[0]*disp[i];
+            offset[4*i + 1] = m[1]*disp[i];
+            offset[4*i + 2] = m[2]*disp[i];
+            offset[4*i + 3] = 1.0f;
+            normal[4*i + 3] = 1.0f;
+            if (rebuild) {
+                normal[4*i] = normals[3*i];
+                normal[4*i + 1] = normals[3*i + 1];
+                normal[4*i + 2] = normals[3*i + 2];
+                continue;
+            }
+
+            // tilted by the gradient as in the deformer, exact for a
+            // flat input
+            float gn = gradU[i]*m[0] + gradV[i]*m[2];
+            float x = m[0] - (gradU[i] - m[0]*gn);
+            float y = m[1] - (-m[1]*gn);
+            float z = m[2] - (gradV[i] - m[2]*gn);
+            float length = sqrtf(x*x + y*y + z*z);
+            length = length > 0.0f ? length : 1.0f;
+            normal[4*i] = x/length;
+            normal[4*i + 1] = y/length;
+            normal[4*i + 2] = z/length;
+        }
+    }
+
+    for (int f = 0; f < vat.frames; f++) {
+        const float* offset = &vat.offsets[(size_t)f*vat.rowsPerFrame*vat.width*4];
+        for (int i = 0; i < n; i++)
+            for (int k = 0; k < 3; k++) {
+                float x = offset[4*i + k];
+                vat.low[k] = x < vat.low[k] ? x : vat.low[k];
+                vat.high[k] = x > vat.high[k] ? x : vat.high[k];
+            }
+    }
+}
+
+void water_vat_uv(const WaterVat& vat, const int vertex, float& s, float& t)
+{
+    s = (vertex % vat.width + 0.5f)/vat.width;
+    t = (vertex/vat.width + 0.5f)/vat.height;
+}
+
+
+static unsigned int crc_table[256];
+static bool crc_ready = false;
+
+static unsigned int png_crc(unsigned int crc, const unsigned char* data, const size_t size)
+{
+    if (!crc_ready) {
+        for (unsigned int i = 0; i < 256; i++) {
+            unsigned int c = i;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            crc_table[i] = c;
+        }
+        crc_ready = true;
+    }
+    for (size_t i = 0; i < size; i++)
+        crc = crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+static void put_big(std::vector<unsigned char>& out, const unsigned int x)
+{
+    out.push_back((unsigned char)(x >> 24));
+    out.push_back((unsigned char)(x >> 16));
+    out.push_back((unsigned char)(x >> 8));
+    out.push_back((unsigned char)x);
+}
+
+static bool png_chunk(FILE* file, const char* type, const std::vector<unsigned char>& data)
+{
+    std::vector<unsigned char> head;
+    put_big(head, (unsigned int)data.size());
+    head.insert(head.end(), type, type + 4);
+    unsigned int crc = png_crc(0xffffffffu, &head[4], 4);
+    if (!data.empty())
+        crc = png_crc(crc, &data[0], data.size());
+    std::vector<unsigned char> tail;
+    put_big(tail, crc ^ 0xffffffffu);
+    return fwrite(&head[0], 1, head.size(), file) == head.size()
+        && (data.empty() || fwrite(&data[0], 1, data.size(), file) == data.size())
+        && fwrite(&tail[0], 1, 4, file) == 4;
+}
+
+// 16 bit RGBA without compression, the deflate stream is made of stored
+// blocks so no zlib is needed and any PNG reader takes it.
+static bool write_png16(const char* path, const int width, const int height, const std::vector<unsigned short>& texels)
+{
+    FILE* file = fopen(path, "wb");
+    if (!file)
+        return false;
+
+    std::vector<unsigned char> raw;
+    raw.reserve((size_t)height*(1 + width*8));
+    for (int y = 0; y < height; y++) {
+        raw.push_back(0);   // no filter
+        const unsigned short* row = &texels[(size_t)y*width*4];
+        for (int x = 0; x < 4*width; x++) {
+            raw.push_back((unsigned char)(row[x] >> 8));
+            raw.push_back((unsigned char)row[x]);
+        }
+    }
+
+    std::vector<unsigned char> zlib;
+    zlib.reserve(raw.size() + raw.size()/65535*5 + 16);
+    zlib.push_back(0x78);
+    zlib.push_back(0x01);
+    unsigned int a = 1, b = 0;
+    for (size_t at = 0; at < raw.size() || at == 0; ) {
+        size_t size = raw.size() - at < 65535 ? raw.size() - at : 65535;
+        zlib.push_back(at + size == raw.size() ? 1 : 0);
+        zlib.push_back((unsigned char)size);
+        zlib.push_back((unsigned char)(size >> 8));
+        zlib.push_back((unsigned char)~size);
+        zlib.push_back((unsigned char)(~size >> 8));
+        for (size_t i = 0; i < size; i++) {
+            unsigned char c = raw[at + i];
+            zlib.push_back(c);
+            a = (a + c) % 65521;
+            b = (b + a) % 65521;
+        }
+        at += size;
+        if (size == 0)
+            break;
+    }
+    put_big(zlib, (b << 16) | a);
+
+    static const unsigned char signature[8] = { 137, 'P', 'N', 'G', 13, 10, 26, 10 };
+    std::vector<unsigned char> header;
+    put_big(header, width);
+    put_big(header, height);
+    header.push_back(16);   // bits per channel
+    header.push_back(6);    // RGBA
+    header.push_back(0);
+    header.push_back(0);
+    header.push_back(0);
+    bool ok = fwrite(signature, 1, 8, file) == 8
+        && png_chunk(file, "IHDR", header)
+        && png_chunk(file, "IDAT", zlib)
+        && png_chunk(file, "IEND", std::vector<unsigned char>());
+    return fclose(file) == 0 && ok;
+}
+
+static void put_little(std::vector<unsigned char>& out, const void* data, const int size)
+{
+    // EXR is little endian whatever the machine
+    unsigned int one = 1;
+    const unsigned char* bytes = (const unsigned char*)data;
+    if (*(const unsigned char*)&one == 1)
+        out.insert(out.end(), bytes, bytes + size);
+    else
+        for (int i = size - 1; i >= 0; i--)
+            out.push_back(bytes[i]);
+}
+
+static void exr_attribute(std::vector<unsigned char>& out, const char* name, const char* type, const int size)
+{
+    for (const char* c = name; ; c++) { out.push_back(*c); if (!*c) break; }
+    for (const char* c = type; ; c++) { out.push_back(*c); if (!*c) break; }
+    put_little(out, &size, 4);
+}
+
+// Scanline OpenEXR with one line per block and no compression, channels
+// A, B, G and R as 32 bit floats.
+static bool write_exr(const char* path, const int width, const int height, const std::vector<float>& texels)
+{
+    FILE* file = fopen(path, "wb");
+    if (!file)
+        return false;
+
+    std::vector<unsigned char> out;
+    static const unsigned char magic[8] = { 0x76, 0x2f, 0x31, 0x01, 2, 0, 0, 0 };
+    out.insert(out.end(), magic, magic + 8);
+
+    static const char* channels[4] = { "A", "B", "G", "R" };
+    exr_attribute(out, "channels", "chlist", 4*(2 + 16) + 1);
+    for (int c = 0; c < 4; c++) {
+        int pixelType = 2, sampling = 1;
+        out.push_back(channels[c][0]);
+        out.push_back(0);
+        put_little(out, &pixelType, 4);
+        for (int k = 0; k < 4; k++)
+            out.push_back(0);   // pLinear and reserved
+        put_little(out, &sampling, 4);
+        put_little(out, &sampling, 4);
+    }
+    out.push_back(0);
+    exr_attribute(out, "compression", "compression", 1);
+    out.push_back(0);
+    int window[4] = { 0, 0, width - 1, height - 1 };
+    exr_attribute(out, "dataWindow", "box2i", 16);
+    for (int k = 0; k < 4; k++)
+        put_little(out, &window[k], 4);
+    exr_attribute(out, "displayWindow", "box2i", 16);
+    for (int k = 0; k < 4; k++)
+        put_little(out, &window[k], 4);
+    exr_attribute(out, "lineOrder", "lineOrder", 1);
+    out.push_back(0);
+    float one = 1.0f, zero = 0.0f;
+    exr_attribute(out, "pixelAspectRatio", "float", 4);
+    put_little(out, &one, 4);
+    exr_attribute(out, "screenWindowCenter", "v2f", 8);
+    put_little(out, &zero, 4);
+    put_little(out, &zero, 4);
+    exr_attribute(out, "screenWindowWidth", "float", 4);
+    put_little(out, &one, 4);
+    out.push_back(0);
+
+    // offsets of the lines, each is its y, its size and its data
+    int lineSize = width*4*4;
+    unsigned long long at = out.size() + (unsigned long long)height*8;
+    for (int y = 0; y < height; y++, at += 8 + lineSize)
+        put_little(out, &at, 8);
+    bool ok = fwrite(&out[0], 1, out.size(), file) == out.size();
+
+    std::vector<unsigned char> line;
+    for (int y = 0; y < height && ok; y++) {
+        line.clear();
+        put_little(line, &y, 4);
+        put_little(line, &lineSize, 4);
+        const float* row = &texels[(size_t)y*width*4];
+        for (int c = 3; c >= 0; c--)
+            for (int x = 0; x < width; x++)
+                put_little(line, &row[4*x + c], 4);
+        ok = fwrite(&line[0], 1, line.size(), file) == line.size();
+    }
+    return fclose(file) == 0 && ok;
+}
+
+bool water_vat_write_image(const char* path, const WaterVat& vat, const std::vector<float>& texels,
+                           const int format, const bool isNormal)
+{
+    if (texels.empty())
+        return false;
+    if (format == WATER_VAT_EXR)
+        return write_exr(path, vat.width, vat.height, texels);
+
+    // into [0, 1] for the 16 bit channels
+    float low[4], scale[4];
+    for (int k = 0; k < 3; k++) {
+        low[k] = isNormal ? -1.0f : vat.low[k];
+        float range = isNormal ? 2.0f : vat.high[k] - vat.low[k];
+        scale[k] = range > 0.0f ? 1.0f/range : 0.0f;
+    }
+    low[3] = 0.0f;
+    scale[3] = 1.0f;
+    std::vector<unsigned short> quantized(texels.size());
+    for (size_t i = 0; i < texels.size(); i++) {
+        float x = (texels[i] - low[i & 3])*scale[i & 3];
+        x = x < 0.0f ? 0.0f : x > 1.0f ? 1.0f : x;
+        quantized[i] = (unsigned short)(x*65535.0f + 0.5f);
+    }
+    return write_png16(path, vat.width, vat.height, quantized);
+}
+
+// A JSON string with the quotes, backslashes and control characters of
+// text escaped, such as those of Windows paths, or null for 0.
+static void vat_write_json_string(FILE* file, const char* text)
+{
+    if (!text) {
+        fputs("null", file);
+        return;
+    }
+    fputc('"', file);
+    for (const unsigned char* c = (const unsigned char*)text; *c; c++) {
+        if (*c == '"' || *c == '\\')
+            fprintf(file, "\\%c", *c);
+        else if (*c < 0x20)
+            fprintf(file, "\\u%04x", *c);
+        else
+            fputc(*c, file);
+    }
+    fputc('"', file);
+}
+
+bool water_vat_write_json(const char* path, const WaterVat& vat, const WaterVatParams& vatParams,
+                          const char* offsetFile, const char* normalFile, const char* uvSet)
+{
+    FILE* file = fopen(path, "w");
+    if (!file)
+        return false;
+    fprintf(file, "{\n");
+    fprintf(file, "    \"format\": \"%s\",\n", vatParams.format == WATER_VAT_EXR ? "exr32" : "png16");
+    fprintf(file, "    \"offsetTexture\": ");
+    vat_write_json_string(file, offsetFile);
+    fprintf(file, ",\n    \"normalTexture\": ");
+    vat_write_json_string(file, normalFile);
+    fprintf(file, ",\n    \"uvSet\": ");
+    vat_write_json_string(file, uvSet);
+    fprintf(file, ",\n");
+    fprintf(file, "    \"startFrame\": %d,\n", vatParams.start);
+    fprintf(file, "    \"frameCount\": %d,\n", vat.frames);
+    fprintf(file, "    \"fps\": %g,\n", vatParams.fps);
+    fprintf(file, "    \"vertexCount\": %d,\n", vat.vertexCount);
+    fprintf(file, "    \"width\": %d,\n", vat.width);
+    fprintf(file, "    \"height\": %d,\n", vat.height);
+    fprintf(file, "    \"rowsPerFrame\": %d,\n", vat.rowsPerFrame);
+    fprintf(file, "    \"frameStepV\": %.9g,\n", (double)vat.rowsPerFrame/vat.height);
+    fprintf(file, "    \"offsetMin\": [%.9g, %.9g, %.9g],\n", vat.low[0], vat.low[1], vat.low[2]);
+    fprintf(file, "    \"offsetMax\": [%.9g, %.9g, %.9g],\n", vat.high[0], vat.high[1], vat.high[2]);
+    fprintf(file, "    \"normalEncoding\": \"%s\"\n", vatParams.format == WATER_VAT_EXR ? "raw" : "n*0.5+0.5");
+    fprintf(file, "}\n");
+    return fclose(file) == 0;
+}
@@ -0,0 +1,83 @@
+//
+//  File: vatExport.h
+//
+//  Description:
+//		Vertex animation textures of the height field, for playing the
+//		water back in a game engine without evaluating any noise. Every
+//		frame of the range takes rowsPerFrame rows of two RGBA images,
+//		one texel per vertex: the offset of the vertex from its rest
+//		position and its displaced normal. A vertex finds its texel of
+//		frame 0 through a second UV set, later frames are rowsPerFrame
+//		rows further down.
+//
+//		The frames are independent, so they are evaluated in parallel,
+//		each frame on one thread.
+//
+//		Images are written as 16 bit PNG, with the offsets scaled into
+//		[0, 1] by bounds given in the metadata and the normals as
+//		n*0.5 + 0.5, or as uncompressed 32 bit float OpenEXR with the
+//		values as they are. The metadata is a small JSON file.
+//
+
+#ifndef VAT_EXPORT_H_
+#define VAT_EXPORT_H_
+
+#include <vector>
+
+#include "waterEngine.h"
+#include "meshNormals.h"
+
+
+enum WaterVatFormat {
+    WATER_VAT_PNG16 = 0,
+    WATER_VAT_EXR = 1
+};
+
+// Frame range and layout of the textures.
+struct WaterVatParams {
+    int start, end;         // frames, both included
+    double timeStep;        // of WaterParams::time per frame, 1 when time is the frame number
+    double fps;             // playback rate, only written to the metadata
+    int maxWidth;           // texels per row, vertices wrap into more rows per frame
+    int format;             // WaterVatFormat
+
+    WaterVatParams();
+};
+
+struct WaterVat {
+    int vertexCount;
+    int frames;
+    int width, height;
+    int rowsPerFrame;
+    std::vector<float> offsets;     // RGBA per texel, the alpha is 1
+    std::vector<float> normals;     // RGBA per texel, the alpha is 1
+    float low[3], high[3];          // bounds of the offsets over all frames
+
+    WaterVat() : vertexCount(0), frames(0), width(0), height(0), rowsPerFrame(0) {}
+};
+
+// Bakes n vertices at rest positions (u[i], v[i]) of the plane with rest
+// normals x, y and z per vertex. The vertices move along their normals as
+// in the deformer. With the topology and the rest points, x, y and z per
+// vertex, the normals are rebuilt from the displaced mesh, otherwise the
+// rest normals are tilted by the gradient, which is exact for flat input.
+void water_vat_bake(const WaterParams& params, const WaterVatParams& vatParams, const int n,
+                    const float* u, const float* v, const float* restNormals, WaterVat& vat,
+                    const MeshTopology* topology = 0, const float* restPoints = 0);
+
+// Texture coordinate of the texel of a vertex at frame 0, at the texel
+// center with t = 0 at the first row.
+void water_vat_uv(const WaterVat& vat, const int vertex, float& s, float& t);
+
+// Writes the RGBA texels in the chosen format, see above. Returns false if
+// the file could not be written.
+bool water_vat_write_image(const char* path, const WaterVat& vat, const std::vector<float>& texels,
+                           const int format, const bool isNormal);
+
+// Writes the layout of the textures as JSON, with uvSet null when it is
+// 0. Returns false if the file could not be written.
+bool water_vat_write_json(const char* path, const WaterVat& vat, const WaterVatParams& vatParams,
+                          const char* offsetFile, const char* normalFile, const char* uvSet);
+
+
+#endif /*VAT_EXPORT_H_*/
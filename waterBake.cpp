@@ -0,0 +1,213 @@
+//
+//  File: waterBake.cpp
+//
+//  Description:
+//		Baking the height field into float images.
+//
+
+#include <math.h>
+#include <stdio.h>
+#include <vector>
+
+#include "waterBake.h"
+
+
+WaterBakeParams::WaterBakeParams()
+    : u0(-50.0f), v0(-50.0f), u1(50.0f), v1(50.0f), width(1024), height(1024), tileSize(64),
+      normals(false), foam(false)
+{}
+
+
+int water_bake_channels(const WaterBakeParams& params)
+{
+    return 1 + (params.normals ? 3 : 0) + (params.foam ? 1 : 0);
+}
+
+void water_bake(const WaterPlan& plan, const WaterBakeParams& params, WaterImage& image)
+{
+    image.width = params.width > 0 ? params.width : 1;
+    image.height = params.height > 0 ? params.height : 1;
+    image.channels = water_bake_channels(params);
+    image.pixels.assign((size_t)image.width*image.height*image.channels, 0.0f);
+
+    const int tile = params.tileSize > 0 ? params.tileSize : 64;
+    const int tilesU = (image.width + tile - 1)/tile;
+    const int tilesV = (image.height + tile - 1)/tile;
+    const float du = (params.u1 - params.u0)/image.width;
+    const float dv = (params.v1 - params.v0)/image.height;
+    const bool derivatives = params.normals || params.foam;
+
+    // the engine threads over blocks of points itself, within a tile it
+    // runs on the thread of the tile
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int t = 0; t < tilesU*tilesV; t++) {
+        int x0 = (t % tilesU)*tile, y0 = (t/tilesU)*tile;
+        int w = image.width - x0 < tile ? image.width - x0 : tile;
+        int h = image.height - y0 < tile ? image.height - y0 : tile;
+        int n = w*h;
+
+        std::vector<float> u(n), v(n), disp(n);
+        std::vector<float> gradU(params.normals ? n : 0), gradV(params.normals ? n : 0);
+        std::vector<float> foam(params.foam ? n : 0);
+        for (int y = 0; y < h; y++)
+            for (int x = 0; x < w; x++) {
+                u[y*w + x] = params.u0 + (x0 + x + 0.5f)*du;
+                v[y*w + x] = params.v0 + (y0 + y + 0.5f)*dv;
+            }
+
+        if (derivatives)
+            water_displacement_deriv_n(plan, n, &u[0], &v[0], &disp[0], 0,
+                                       params.normals ? &gradU[0] : 0, params.normals ? &gradV[0] : 0,
+                                       0, params.foam ? &foam[0] : 0);
+        else
+            water_displacement_n(plan, n, &u[0], &v[0], &disp[0]);
+
+        for (int y = 0; y < h; y++)
+            for (int x = 0; x < w; x++) {
+                int i = y*w + x;
+                float* p = image.at(x0 + x, y0 + y);
+                *p++ = disp[i];
+                if (params.normals) {
+                    // the surface is y = height(u, v) with u along x and v along z
+                    float length = sqrtf(gradU[i]*gradU[i] + 1.0f + gradV[i]*gradV[i]);
+                    *p++ = -gradU[i]/length;
+                    *p++ = 1.0f/length;
+                    *p++ = -gradV[i]/length;
+                }
+                if (params.foam)
+                    *p++ = foam[i];
+            }
+    }
+}
+
+void water_downsample(const WaterImage& image, const int firstNormal, WaterImage& half)
+{
+    half.width = image.width > 1 ? image.width/2 : 1;
+    half.height = image.height > 1 ? image.height/2 : 1;
+    half.channels = image.channels;
+    half.pixels.assign((size_t)half.width*half.height*half.channels, 0.0f);
+
+    const int c = image.channels;
+    #pragma omp parallel for
+    for (int y = 0; y < half.height; y++)
+        for (int x = 0; x < half.width; x++) {
+            int xa = 2*x < image.width ? 2*x : image.width - 1;
+            int ya = 2*y < image.height ? 2*y : image.height - 1;
+            int xb = xa + 1 < image.width ? xa + 1 : xa;
+            int yb = ya + 1 < image.height ? ya + 1 : ya;
+            const float* a = image.at(xa, ya);
+            const float* b = image.at(xb, ya);
+            const float* d = image.at(xa, yb);
+            const float* e = image.at(xb, yb);
+            float* p = half.at(x, y);
+            for (int k = 0; k < c; k++)
+                p[k] = 0.25f*(a[k] + b[k] + d[k] + e[k]);
+            if (firstNormal >= 0) {
+                float* m = p + firstNormal;
+                float length = sqrtf(m[0]*m[0] + m[1]*m[1] + m[2]*m[2]);
+                if (length > 0.0f) {
+                    m[0] /= length;
+                    m[1] /= length;
+                    m[2] /= length;
+                }
+            }
+        }
+}
+
+
+static bool little_endian()
+{
+    unsigned int one = 1;
+    return *(const unsigned char*)&one == 1;
+}
+
+bool water_write_pfm(const char* path, const WaterImage& image, const int first, const int count)
+{
+    if ((count != 1 && count != 3) || first < 0 || first + count > image.channels)
+        return false;
+    FILE* file = fopen(path, "wb");
+    if (!file)
+        return false;
+
+    // a negative scale marks little endian data, rows go bottom up
+    fprintf(file, "%s\n%d %d\n%s\n", count == 3 ? "PF" : "Pf", image.width, image.height,
+            little_endian() ? "-1.0" : "1.0");
+    std::vector<float> row((size_t)image.width*count);
+    bool ok = true;
+    for (int y = 0; y < image.height && ok; y++) {
+        for (int x = 0; x < image.width; x++)
+            for (int k = 0; k < count; k++)
+                row[(size_t)x*count + k] = image.at(x, y)[first + k];
+        ok = fwrite(&row[0], sizeof(float), row.size(), file) == row.size();
+    }
+    return fclose(file) == 0 && ok;
+}
+
+static bool write_ints(FILE* file, const int* values, const int count)
+{
+    // the format is little endian whatever the machine
+    for (int i = 0; i < count; i++) {
+        unsigned int x = (unsigned int)values[i];
+        unsigned char bytes[4] = { (unsigned char)x, (unsigned char)(x >> 8),
+                                   (unsigned char)(x >> 16), (unsigned char)(x >> 24) };
+        if (fwrite(bytes, 1, 4, file) != 4)
+            return false;
+    }
+    return true;
+}
+
+static bool write_floats(FILE* file, std::vector<float>& values)
+{
+    if (!little_endian())
+        for (size_t i = 0; i < values.size(); i++) {
+            unsigned char* b = (unsigned char*)&values[i];
+            unsigned char t = b[0]; b[0] = b[3]; b[3] = t;
+            t = b[1]; b[1] = b[2]; b[2] = t;
+        }
+    return fwrite(&values[0], sizeof(float), values.size(), file) == values.size();
+}
+
+bool water_write_tiled(const char* path, const WaterImage& image, const int tileSize, const int firstNormal)
+{
+    if (image.pixels.empty() || tileSize <= 0)
+        return false;
+    FILE* file = fopen(path, "wb");
+    if (!file)
+        return false;
+
+    int levels = 1;
+    for (int w = image.width, h = image.height; w > 1 || h > 1; levels++) {
+        w = w > 1 ? w/2 : 1;
+        h = h > 1 ? h/2 : 1;
+    }
+    int header[6] = { 1, image.width, image.height, image.channels, tileSize, levels };
+    bool ok = fwrite("PWTR", 1, 4, file) == 4 && write_ints(file, header, 6);
+
+    const int c = image.channels;
+    std::vector<float> tile((size_t)tileSize*tileSize*c);
+    WaterImage level = image, next;
+    for (int l = 0; l < levels && ok; l++) {
+        if (l > 0) {
+            water_downsample(level, firstNormal, next);
+            level.pixels.swap(next.pixels);
+            level.width = next.width;
+            level.height = next.height;
+        }
+        int tilesU = (level.width + tileSize - 1)/tileSize;
+        int tilesV = (level.height + tileSize - 1)/tileSize;
+        for (int ty = 0; ty < tilesV && ok; ty++)
+            for (int tx = 0; tx < tilesU && ok; tx++) {
+                for (int y = 0; y < tileSize; y++) {
+                    int sy = ty*tileSize + y < level.height ? ty*tileSize + y : level.height - 1;
+                    for (int x = 0; x < tileSize; x++) {
+                        int sx = tx*tileSize + x < level.width ? tx*tileSize + x : level.width - 1;
+                        const float* p = level.at(sx, sy);
+                        for (int k = 0; k < c; k++)
+                            tile[((size_t)y*tileSize + x)*c + k] = p[k];
+                    }
+                }
+                ok = write_floats(file, tile);
+            }
+    }
+    return fclose(file) == 0 && ok;
+}
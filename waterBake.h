@@ -0,0 +1,77 @@
+//
+//  File: waterBake.h
+//
+//  Description:
+//		Bakes the height field over a rectangle of the rest plane into
+//		float images, so renderers can displace a light mesh with a
+//		texture instead of reading a deformed mesh every frame. The image
+//		is evaluated in square tiles that are spread over the threads,
+//		each tile one batch of points for the engine.
+//
+//		Images go out as PFM, one file per channel group, or as a tiled
+//		raw file that holds every channel and every mip level:
+//
+//			char magic[4]       "PWTR"
+//			int version         1
+//			int width, height   of level 0
+//			int channels        per pixel, interleaved
+//			int tileSize        pixels along a tile side
+//			int levels          down to 1x1
+//
+//		followed by the levels from the finest on, each as its tiles in
+//		rows, each tile as tileSize x tileSize pixels in rows. Tiles that
+//		overhang the level repeat its last row and column. Everything is
+//		little endian, rows run along u and the first row is at v0.
+//
+
+#ifndef WATER_BAKE_H_
+#define WATER_BAKE_H_
+
+#include <vector>
+
+#include "waterEngine.h"
+
+
+// What to bake and where.
+struct WaterBakeParams {
+    float u0, v0, u1, v1;   // rectangle of the rest plane
+    int width, height;      // pixels
+    int tileSize;           // pixels along the side of an evaluated tile
+    bool normals;           // x, y and z of the unit normal, y up
+    bool foam;
+
+    WaterBakeParams();
+};
+
+// Pixels with their channels interleaved, rows along u.
+struct WaterImage {
+    int width, height;
+    int channels;
+    std::vector<float> pixels;
+
+    WaterImage() : width(0), height(0), channels(0) {}
+
+    float* at(const int x, const int y) { return &pixels[((size_t)y*width + x)*channels]; }
+    const float* at(const int x, const int y) const { return &pixels[((size_t)y*width + x)*channels]; }
+};
+
+// Channels of a baked pixel: the height, then the normal and then the
+// foam for the ones that are baked.
+int water_bake_channels(const WaterBakeParams& params);
+
+// Evaluates the pixel centers of the rectangle.
+void water_bake(const WaterPlan& plan, const WaterBakeParams& params, WaterImage& image);
+
+// Half the size, the mean of every 2x2 pixels. The normal channels,
+// firstNormal on, are made unit length again, -1 if there are none.
+void water_downsample(const WaterImage& image, const int firstNormal, WaterImage& half);
+
+// Writes count channels from first on, 1 as a grey PFM and 3 as a color
+// one. Returns false if the file could not be written.
+bool water_write_pfm(const char* path, const WaterImage& image, const int first, const int count);
+
+// Writes the image and all its mip levels in the tiled raw format.
+bool water_write_tiled(const char* path, const WaterImage& image, const int tileSize, const int firstNormal);
+
+
+#endif /*WATER_BAKE_H_*/
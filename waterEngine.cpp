@@ -0,0 +1,1778 @@
+//
+//  File: waterEngine.cpp
+//
+//  Description:
+//		Maya independent evaluation of the proWater height field.
+//
+
+#include <math.h>
+#include <string.h>
+#include <cmath>
+#include <algorithm>
+
+#include "simplexNoise.h"
+#include "noiseTable.h"
+#include "waterEngine.h"
+
+
+static const double WATER_PI = 3.14159265358979323846;
+
+// Points handed to the noise functions at a time.
+static const int WATER_BLOCK = 256;
+
+// Waves feel the bottom in water shallower than this share of their
+// wavelength.
+static const float WATER_SHOAL_DEPTH = 0.5f;
+
+
+WaterParams::WaterParams()
+    : time(0.0), direction(45.0), bigAmplitude(3.0),
+      amplitude1(0.5), frequency1(0.5), amplitude2(1.3), frequency2(0.7),
+      loopLength(0.0), tileSize(0.0), tableLayers(WATER_TABLE_NONE),
+      coarseTolerance(0.0), driftTolerance(0.0), timeStep(0.0), timeTolerance(0.01)
+{}
+
+
+double water_wrap_time(const WaterParams& params)
+{
+    if (params.loopLength <= 0.0)
+        return params.time;
+
+    double t = fmod(params.time, params.loopLength);
+    if (t < 0.0)
+        t += params.loopLength;
+    return t;
+}
+
+
+static void set_layer(WaterLayer& layer, const float amplitude, const int shape,
+                      const float scaleX, const float scaleY, const float speed,
+                      const float z0, const float zRate)
+{
+    layer.amplitude = amplitude;
+    layer.shape = shape;
+    layer.scaleX = scaleX;
+    layer.scaleY = scaleY;
+    layer.speed = speed;
+    layer.z0 = z0;
+    layer.zRate = zRate;
+    layer.loopRadius = 0.0f;
+    layer.periodX = 0;
+    layer.periodY = 0;
+    layer.table = false;
+}
+
+// Snaps a noise frequency so that a whole number of periods fits in a tile.
+static float tile_scale(const float scale, const float tileSize, int& period)
+{
+    float cycles = std::abs(scale*tileSize);
+    if (cycles < 1e-6f) {
+        period = 0;
+        return scale;
+    }
+    period = noise_period(cycles);
+    return (scale < 0 ? -period : period)/tileSize;
+}
+
+void water_build_plan(const WaterParams& params, WaterPlan& plan)
+{
+    float dir = params.direction * WATER_PI/180;
+    plan.dirX = cos(dir);
+    plan.dirY = sin(dir);
+    plan.time = water_wrap_time(params);
+    plan.bigAmplitude = params.bigAmplitude;
+    plan.coarseTolerance = params.coarseTolerance;
+    plan.driftTolerance = params.driftTolerance;
+
+    float bigFreq = 0.01;
+    float frequency1 = params.frequency1/10;
+    float frequency2 = params.frequency2/10;
+    float amplitude1 = params.amplitude1;
+    float amplitude2 = params.amplitude2;
+
+    set_layer(plan.layers[WATER_BIG_WAVES], 1, WATER_SHAPE_UNIT,
+              bigFreq*plan.dirX, bigFreq*plan.dirY*2, 3, 0, 0.01);
+    set_layer(plan.layers[WATER_FIRST_OCTAVE], amplitude1, WATER_SHAPE_RIDGED,
+              frequency1*0.4, frequency1*0.6, 0.7, 0, 0.05);
+    set_layer(plan.layers[WATER_SECOND_OCTAVE], amplitude2, WATER_SHAPE_RIDGED,
+              frequency2*0.35, frequency2*0.65, 0.7, 0, 0.005);
+    set_layer(plan.layers[WATER_THIRD_OCTAVE], amplitude1/1.5, WATER_SHAPE_RIDGED,
+              frequency1*0.4, frequency1*0.6, 0.5, 30, 0);
+    set_layer(plan.layers[WATER_FOURTH_OCTAVE], amplitude2/1.5, WATER_SHAPE_PLAIN,
+              frequency2*0.4, frequency2*0.6, 0.5, 50, 0);
+    set_layer(plan.layers[WATER_FIFTH_OCTAVE], amplitude2/2, WATER_SHAPE_PLAIN,
+              params.frequency2*0.15, params.frequency2*0.85, 0.5, 0, 0.001);
+
+    plan.loop = params.loopLength > 0.0;
+    plan.loopCos = 1.0f;
+    plan.loopSin = 0.0f;
+    plan.loopRate = 0.0f;
+    if (plan.loop) {
+        // Walk the time circle at the same rate the layer moved through the
+        // noise domain before, so looping does not change how fast it evolves.
+        double angle = 2*WATER_PI * plan.time/params.loopLength;
+        plan.loopCos = cos(angle);
+        plan.loopSin = sin(angle);
+        plan.loopRate = 2*WATER_PI/params.loopLength;
+        for (int i = 0; i < WATER_LAYERS; i++) {
+            WaterLayer& layer = plan.layers[i];
+            float vx = layer.speed*plan.dirX*layer.scaleX;
+            float vy = layer.speed*plan.dirY*layer.scaleY;
+            float rate = sqrt(vx*vx + vy*vy + layer.zRate*layer.zRate);
+            layer.loopRadius = rate*params.loopLength/(2*WATER_PI);
+        }
+    }
+
+    // Tiling needs a lattice period along u and v, which only the 3D noise
+    // has, so a looping field is never tiled.
+    plan.tiled = !plan.loop && params.tileSize > 0.0;
+    plan.tileSize = plan.tiled ? params.tileSize : 0.0f;
+    if (plan.tiled) {
+        for (int i = 0; i < WATER_LAYERS; i++) {
+            WaterLayer& layer = plan.layers[i];
+            layer.scaleX = tile_scale(layer.scaleX, plan.tileSize, layer.periodX);
+            layer.scaleY = tile_scale(layer.scaleY, plan.tileSize, layer.periodY);
+        }
+    }
+
+    // The wavetable repeats every NOISE_TABLE_PERIOD units and has no fourth
+    // dimension, so loop and tile mode keep the analytic noise.
+    bool anyTable = false;
+    for (int i = 0; i < WATER_LAYERS; i++) {
+        plan.layers[i].table = !plan.loop && !plan.tiled && (params.tableLayers & (1 << i));
+        anyTable = anyTable || plan.layers[i].table;
+    }
+    if (anyTable)
+        noise_table_init();
+}
+
+float water_tile_snap(const WaterParams& params, int& layer, float& minTileSize)
+{
+    layer = -1;
+    minTileSize = 0.0f;
+    WaterPlan tiled;
+    water_build_plan(params, tiled);
+    if (!tiled.tiled)
+        return 1.0f;
+
+    // the plan as it would be without tiles, the time does not matter
+    WaterParams free = params;
+    free.tileSize = 0.0;
+    WaterPlan plan;
+    water_build_plan(free, plan);
+
+    // a period is at most 3 cells more than the cycles in a tile, so at
+    // least 3/(WATER_TILE_SNAP - 1) cycles stay within the factor
+    const float minCycles = 3.0f/(WATER_TILE_SNAP - 1.0f);
+    float worst = 1.0f;
+    for (int i = 0; i < WATER_LAYERS; i++) {
+        if (plan.layers[i].amplitude == 0.0f)
+            continue;
+        float scales[2] = { plan.layers[i].scaleX, plan.layers[i].scaleY };
+        float snapped[2] = { tiled.layers[i].scaleX, tiled.layers[i].scaleY };
+        for (int axis = 0; axis < 2; axis++) {
+            float scale = std::abs(scales[axis]);
+            if (scale < 1e-6f)
+                continue;
+            float factor = std::abs(snapped[axis])/scale;
+            if (factor > worst) {
+                worst = factor;
+                layer = i;
+            }
+            minTileSize = std::max(minTileSize, minCycles/scale);
+        }
+    }
+    return worst;
+}
+
+
+void water_layer_coords(const WaterPlan& plan, const int layer, const float u, const float v,
+                        float& x, float& y, float& z, float& w)
+{
+    const WaterLayer& l = plan.layers[layer];
+    if (plan.loop) {
+        x = u*l.scaleX;
+        y = v*l.scaleY;
+        z = l.z0 + l.loopRadius*plan.loopCos;
+        w = l.loopRadius*plan.loopSin;
+    }
+    else {
+        x = (u + l.speed*plan.time*plan.dirX)*l.scaleX;
+        y = (v + l.speed*plan.time*plan.dirY)*l.scaleY;
+        z = l.z0 + l.zRate*plan.time;
+        w = 0.0f;
+    }
+}
+
+float water_layer_noise(const WaterPlan& plan, const int layer, const float u, const float v)
+{
+    float x, y, z, w;
+    water_layer_coords(plan, layer, u, v, x, y, z, w);
+    return water_layer_noise_at(plan, layer, x, y, z, w);
+}
+
+float water_layer_noise_at(const WaterPlan& plan, const int layer, const float x, const float y, const float z, const float w)
+{
+    if (plan.loop)
+        return raw_noise_4d(x, y, z, w);
+    if (plan.tiled)
+        return raw_noise_3d_periodic(x, y, z, plan.layers[layer].periodX, plan.layers[layer].periodY, 0);
+    if (plan.layers[layer].table)
+        return table_noise_3d(x, y, z);
+    return raw_noise_3d(x, y, z);
+}
+
+
+float water_layer_noise_deriv(const WaterPlan& plan, const int layer, const float u, const float v, float* gradient)
+{
+    float x, y, z, w;
+    water_layer_coords(plan, layer, u, v, x, y, z, w);
+    gradient[3] = 0.0f;
+    if (plan.loop)
+        return raw_noise_4d_deriv(x, y, z, w, gradient);
+    if (plan.tiled)
+        return raw_noise_3d_periodic_deriv(x, y, z, plan.layers[layer].periodX, plan.layers[layer].periodY, 0, gradient);
+    if (plan.layers[layer].table) {
+        // the trilinear table has no useful analytic derivative, difference
+        // it over one table cell instead
+        float h = 0.5f*NOISE_TABLE_PERIOD/NOISE_TABLE_SIZE;
+        gradient[0] = (table_noise_3d(x + h, y, z) - table_noise_3d(x - h, y, z))/(2*h);
+        gradient[1] = (table_noise_3d(x, y + h, z) - table_noise_3d(x, y - h, z))/(2*h);
+        gradient[2] = (table_noise_3d(x, y, z + h) - table_noise_3d(x, y, z - h))/(2*h);
+        return table_noise_3d(x, y, z);
+    }
+    return raw_noise_3d_deriv(x, y, z, gradient);
+}
+
+void water_layer_rates(const WaterPlan& plan, const int layer, float* rates)
+{
+    const WaterLayer& l = plan.layers[layer];
+    if (plan.loop) {
+        rates[0] = 0.0f;
+        rates[1] = 0.0f;
+        rates[2] = -l.loopRadius*plan.loopSin*plan.loopRate;
+        rates[3] = l.loopRadius*plan.loopCos*plan.loopRate;
+    }
+    else {
+        rates[0] = l.speed*plan.dirX*l.scaleX;
+        rates[1] = l.speed*plan.dirY*l.scaleY;
+        rates[2] = l.zRate;
+        rates[3] = 0.0f;
+    }
+}
+
+
+bool water_layer_translates(const WaterPlan& plan, const int layer)
+{
+    // in loop mode every layer moves around the time circle
+    return !plan.loop && plan.layers[layer].zRate == 0.0f;
+}
+
+
+float water_shape(const WaterLayer& layer, const float n)
+{
+    switch (layer.shape) {
+        case WATER_SHAPE_UNIT:
+            return 0.5f*n + 0.5f;
+        case WATER_SHAPE_RIDGED:
+            return -(std::abs(layer.amplitude*n) - layer.amplitude);
+        default:
+            return layer.amplitude*n;
+    }
+}
+
+float water_shape_deriv(const WaterLayer& layer, const float n, const float dn)
+{
+    switch (layer.shape) {
+        case WATER_SHAPE_UNIT:
+            return 0.5f*dn;
+        case WATER_SHAPE_RIDGED: {
+            float d;
+            ridged_deriv(layer.amplitude, n, &dn, 1, &d);
+            return d;
+        }
+        default:
+            return layer.amplitude*dn;
+    }
+}
+
+float water_layer_weight(const WaterPlan& plan, const int layer)
+{
+    // Shaped layers stay within [0, 1] for the big waves, [0, amplitude]
+    // when ridged and [-amplitude, amplitude] otherwise.
+    const WaterLayer* l = plan.layers;
+    switch (layer) {
+        case WATER_BIG_WAVES:
+            return 0.5f*(std::abs(plan.bigAmplitude) + 7*l[WATER_FIRST_OCTAVE].amplitude + l[WATER_FIFTH_OCTAVE].amplitude);
+        case WATER_FIRST_OCTAVE:
+            return 7*l[WATER_FIRST_OCTAVE].amplitude;
+        case WATER_THIRD_OCTAVE:
+            return 2*l[WATER_THIRD_OCTAVE].amplitude*l[WATER_THIRD_OCTAVE].amplitude;
+        default:
+            return l[layer].amplitude;
+    }
+}
+
+void water_shape_range(const WaterLayer& layer, float& low, float& high)
+{
+    float a = std::abs(layer.amplitude);
+    switch (layer.shape) {
+        case WATER_SHAPE_UNIT:
+            low = 0.0f;
+            high = 1.0f;
+            break;
+        case WATER_SHAPE_RIDGED:
+            // |a*n| goes from 0 to |a|
+            low = layer.amplitude - a;
+            high = layer.amplitude;
+            break;
+        default:
+            low = -a;
+            high = a;
+    }
+}
+
+// Range of the product of two ranges.
+static void range_product(const float lowA, const float highA, const float lowB, const float highB,
+                          float& low, float& high)
+{
+    float p[4] = {lowA*lowB, lowA*highB, highA*lowB, highA*highB};
+    low = std::min(std::min(p[0], p[1]), std::min(p[2], p[3]));
+    high = std::max(std::max(p[0], p[1]), std::max(p[2], p[3]));
+}
+
+void water_displacement_range(const WaterPlan& plan, float& low, float& high)
+{
+    float lo[WATER_LAYERS], hi[WATER_LAYERS];
+    for (int layer = 0; layer < WATER_LAYERS; layer++)
+        water_shape_range(plan.layers[layer], lo[layer], hi[layer]);
+
+    // bigAmplitude*bigWaves + 7*bigWaves*firstOctave = bigWaves*(bigAmplitude + 7*firstOctave)
+    float l, h;
+    range_product(lo[WATER_BIG_WAVES], hi[WATER_BIG_WAVES],
+                  plan.bigAmplitude + 7*lo[WATER_FIRST_OCTAVE], plan.bigAmplitude + 7*hi[WATER_FIRST_OCTAVE], l, h);
+    low = l;
+    high = h;
+
+    low += lo[WATER_SECOND_OCTAVE];
+    high += hi[WATER_SECOND_OCTAVE];
+
+    range_product(lo[WATER_THIRD_OCTAVE], hi[WATER_THIRD_OCTAVE], lo[WATER_THIRD_OCTAVE], hi[WATER_THIRD_OCTAVE], l, h);
+    if (lo[WATER_THIRD_OCTAVE] <= 0.0f && hi[WATER_THIRD_OCTAVE] >= 0.0f)
+        l = 0.0f;
+    low += l;
+    high += h;
+
+    low += lo[WATER_FOURTH_OCTAVE];
+    high += hi[WATER_FOURTH_OCTAVE];
+
+    // |bigWaves - 1| stays within [0, 1] as bigWaves does
+    range_product(0.0f, 1.0f, lo[WATER_FIFTH_OCTAVE], hi[WATER_FIFTH_OCTAVE], l, h);
+    low += l;
+    high += h;
+}
+
+// The combination itself, of layers that are already shaped.
+static float combine_shaped(const WaterPlan& plan, const float* shaped)
+{
+    float bigWaves = shaped[WATER_BIG_WAVES];
+    float firstOctave = shaped[WATER_FIRST_OCTAVE];
+    float secondOctave = shaped[WATER_SECOND_OCTAVE];
+    float thirdOctave = shaped[WATER_THIRD_OCTAVE];
+    float fourthOctave = shaped[WATER_FOURTH_OCTAVE];
+    float fifthOctave = shaped[WATER_FIFTH_OCTAVE];
+
+    return plan.bigAmplitude*bigWaves + 7*(bigWaves)*firstOctave + secondOctave
+        + thirdOctave*thirdOctave + fourthOctave + std::abs(bigWaves-1)*fifthOctave;
+}
+
+float water_combine(const WaterPlan& plan, const float* n)
+{
+    float shaped[WATER_LAYERS];
+    for (int layer = 0; layer < WATER_LAYERS; layer++)
+        shaped[layer] = water_shape(plan.layers[layer], n[layer]);
+    return combine_shaped(plan, shaped);
+}
+
+// The combination and its derivatives, of layers that are already shaped
+// and the derivatives ds of the shaped layers.
+static float combine_shaped_deriv(const WaterPlan& plan, const float* shaped, const float ds[][4],
+                                  const int dims, float* d)
+{
+    float bigWaves = shaped[WATER_BIG_WAVES];
+    float calm = std::abs(bigWaves - 1), dCalm[4];
+    for (int k = 0; k < dims; k++)
+        dCalm[k] = bigWaves < 1 ? -ds[WATER_BIG_WAVES][k] : ds[WATER_BIG_WAVES][k];
+
+    float dFirst[4], dThird[4], dFifth[4];
+    float first = product_deriv(bigWaves, ds[WATER_BIG_WAVES], shaped[WATER_FIRST_OCTAVE], ds[WATER_FIRST_OCTAVE], dims, dFirst);
+    float third = product_deriv(shaped[WATER_THIRD_OCTAVE], ds[WATER_THIRD_OCTAVE],
+                                shaped[WATER_THIRD_OCTAVE], ds[WATER_THIRD_OCTAVE], dims, dThird);
+    float fifth = product_deriv(calm, dCalm, shaped[WATER_FIFTH_OCTAVE], ds[WATER_FIFTH_OCTAVE], dims, dFifth);
+
+    for (int k = 0; k < dims; k++)
+        d[k] = plan.bigAmplitude*ds[WATER_BIG_WAVES][k] + 7*dFirst[k] + ds[WATER_SECOND_OCTAVE][k]
+            + dThird[k] + ds[WATER_FOURTH_OCTAVE][k] + dFifth[k];
+
+    return plan.bigAmplitude*bigWaves + 7*first + shaped[WATER_SECOND_OCTAVE]
+        + third + shaped[WATER_FOURTH_OCTAVE] + fifth;
+}
+
+float water_combine_deriv(const WaterPlan& plan, const float* n, const float* dn, const int dims, float* d)
+{
+    // shaped layers and their derivatives
+    float shaped[WATER_LAYERS], ds[WATER_LAYERS][4];
+    for (int layer = 0; layer < WATER_LAYERS; layer++) {
+        const WaterLayer& l = plan.layers[layer];
+        shaped[layer] = water_shape(l, n[layer]);
+        for (int k = 0; k < dims; k++)
+            ds[layer][k] = water_shape_deriv(l, n[layer], dn[layer*dims + k]);
+    }
+    return combine_shaped_deriv(plan, shaped, ds, dims, d);
+}
+
+// The crest of a ridged layer is where its noise crosses zero and the
+// slope of the layer folds over. Its sharpness is the change of slope
+// across the fold, 2*amplitude*|grad n|, times how much the displacement
+// depends on the layer there, faded out within WATER_CREST_WIDTH of noise.
+static const float WATER_CREST_WIDTH = 0.15f;
+
+float water_crest(const WaterPlan& plan, const float* n, const float* slopeU, const float* slopeV,
+                  const float* attenuation)
+{
+    float bigWaves = water_shape(plan.layers[WATER_BIG_WAVES], n[WATER_BIG_WAVES]);
+    if (attenuation)
+        bigWaves *= attenuation[WATER_BIG_WAVES];
+    float crest = 0.0f;
+    for (int layer = 0; layer < WATER_LAYERS; layer++) {
+        const WaterLayer& l = plan.layers[layer];
+        if (l.shape != WATER_SHAPE_RIDGED)
+            continue;
+        float a = attenuation ? attenuation[layer] : 1.0f;
+
+        float proximity = 1.0f - std::abs(n[layer])/WATER_CREST_WIDTH;
+        if (proximity <= 0.0f)
+            continue;
+
+        // derivative of water_combine() with respect to the shaped layer
+        float influence;
+        switch (layer) {
+            case WATER_FIRST_OCTAVE:
+                influence = 7*bigWaves;
+                break;
+            case WATER_THIRD_OCTAVE:
+                influence = 2*a*water_shape(l, n[layer]);
+                break;
+            case WATER_FIFTH_OCTAVE:
+                influence = std::abs(bigWaves - 1);
+                break;
+            default:
+                influence = 1.0f;
+        }
+
+        float slope = std::sqrt(slopeU[layer]*slopeU[layer] + slopeV[layer]*slopeV[layer]);
+        crest += proximity*proximity*2*std::abs(a*l.amplitude*influence)*slope;
+    }
+    return crest;
+}
+
+float water_foam(const WaterPlan& plan, const float* n, const float crest, const float* attenuation)
+{
+    float bigWaves = water_shape(plan.layers[WATER_BIG_WAVES], n[WATER_BIG_WAVES]);
+    if (attenuation)
+        bigWaves *= attenuation[WATER_BIG_WAVES];
+    return 1.0f - std::exp(-crest*bigWaves);
+}
+
+float water_displacement(const WaterPlan& plan, const float u, const float v)
+{
+    float n[WATER_LAYERS];
+    for (int i = 0; i < WATER_LAYERS; i++)
+        n[i] = water_layer_noise(plan, i, u, v);
+    return water_combine(plan, n);
+}
+
+float water_displacement_velocity(const WaterPlan& plan, const float u, const float v, float& velocity)
+{
+    float n[WATER_LAYERS], dn[WATER_LAYERS];
+    for (int layer = 0; layer < WATER_LAYERS; layer++) {
+        float gradient[4], rates[4];
+        n[layer] = water_layer_noise_deriv(plan, layer, u, v, gradient);
+        water_layer_rates(plan, layer, rates);
+        dn[layer] = gradient[0]*rates[0] + gradient[1]*rates[1] + gradient[2]*rates[2] + gradient[3]*rates[3];
+    }
+    return water_combine_deriv(plan, n, dn, 1, &velocity);
+}
+
+
+
+// Where the raw noise of each layer comes from in displacement_block().
+enum WaterSource {
+    WATER_SOURCE_NOISE,     // evaluated per point
+    WATER_SOURCE_POINTS,    // interpolated from a lattice over (u, v)
+    WATER_SOURCE_FIELD      // interpolated from a lattice over noise coordinates
+};
+
+struct WaterSources {
+    int source[WATER_LAYERS];
+    const WaterGrid2D* grid[WATER_LAYERS];
+};
+
+static void plain_sources(WaterSources& sources)
+{
+    for (int layer = 0; layer < WATER_LAYERS; layer++) {
+        sources.source[layer] = WATER_SOURCE_NOISE;
+        sources.grid[layer] = 0;
+    }
+}
+
+// Raw noise of one layer for at most WATER_BLOCK points.
+static void layer_noise_values(const WaterPlan& plan, const WaterSources& sources, const int layer,
+                               const int count, const float* u, const float* v, float* n)
+{
+    // lattices hold the raw noise, the shape is applied per point so
+    // ridges stay sharp
+    const WaterGrid2D* grid = sources.grid[layer];
+    if (sources.source[layer] == WATER_SOURCE_POINTS) {
+        for (int i = 0; i < count; i++)
+            n[i] = grid->sample(u[i], v[i]);
+        return;
+    }
+
+    float x[WATER_BLOCK], y[WATER_BLOCK], z[WATER_BLOCK], w[WATER_BLOCK];
+    for (int i = 0; i < count; i++)
+        water_layer_coords(plan, layer, u[i], v[i], x[i], y[i], z[i], w[i]);
+
+    if (sources.source[layer] == WATER_SOURCE_FIELD)
+        for (int i = 0; i < count; i++)
+            n[i] = grid->sample(x[i], y[i]);
+    else if (plan.loop)
+        raw_noise_4d_n(count, x, y, z, w, n);
+    else if (plan.tiled) {
+        int px = plan.layers[layer].periodX;
+        int py = plan.layers[layer].periodY;
+        for (int i = 0; i < count; i++)
+            n[i] = raw_noise_3d_periodic(x[i], y[i], z[i], px, py, 0);
+    }
+    else if (plan.layers[layer].table)
+        table_noise_3d_n(count, x, y, z, n);
+    else
+        for (int i = 0; i < count; i++)
+            n[i] = raw_noise_3d(x[i], y[i], z[i]);
+}
+
+// Raw noise of all layers for one block of at most WATER_BLOCK points.
+static void layer_noise_block(const WaterPlan& plan, const WaterSources& sources,
+                              const int count, const float* u, const float* v, float n[][WATER_BLOCK])
+{
+    for (int layer = 0; layer < WATER_LAYERS; layer++)
+        layer_noise_values(plan, sources, layer, count, u, v, n[layer]);
+}
+
+// One block of at most WATER_BLOCK points.
+static void displacement_block(const WaterPlan& plan, const WaterSources& sources,
+                               const int count, const float* u, const float* v, float* disp)
+{
+    float n[WATER_LAYERS][WATER_BLOCK];
+    layer_noise_block(plan, sources, count, u, v, n);
+
+    float values[WATER_LAYERS];
+    for (int i = 0; i < count; i++) {
+        for (int layer = 0; layer < WATER_LAYERS; layer++)
+            values[layer] = n[layer][i];
+        disp[i] = water_combine(plan, values);
+    }
+}
+
+// Raw noise and its gradient in noise coordinates for all layers of one block.
+static void layer_deriv_block(const WaterPlan& plan, const int count, const float* u, const float* v,
+                              float n[][WATER_BLOCK], float g[][4][WATER_BLOCK])
+{
+    float x[WATER_BLOCK], y[WATER_BLOCK], z[WATER_BLOCK], w[WATER_BLOCK];
+
+    for (int layer = 0; layer < WATER_LAYERS; layer++) {
+        for (int i = 0; i < count; i++)
+            water_layer_coords(plan, layer, u[i], v[i], x[i], y[i], z[i], w[i]);
+
+        if (!plan.loop && !plan.tiled && !plan.layers[layer].table) {
+            raw_noise_3d_deriv_n(count, x, y, z, n[layer], g[layer][0], g[layer][1], g[layer][2]);
+            for (int i = 0; i < count; i++)
+                g[layer][3][i] = 0.0f;
+            continue;
+        }
+
+        for (int i = 0; i < count; i++) {
+            float gradient[4];
+            n[layer][i] = water_layer_noise_deriv(plan, layer, u[i], v[i], gradient);
+            for (int k = 0; k < 4; k++)
+                g[layer][k][i] = gradient[k];
+        }
+    }
+}
+
+static void deriv_block(const WaterPlan& plan, const int count, const float* u, const float* v,
+                        float* disp, float* velocity, float* gradU, float* gradV, float* crest, float* foam)
+{
+    float n[WATER_LAYERS][WATER_BLOCK], g[WATER_LAYERS][4][WATER_BLOCK];
+    layer_deriv_block(plan, count, u, v, n, g);
+
+    // each derivative is a direction in noise coordinates per layer: the
+    // rates for time, the scales for u and v. The crests need the slopes
+    // even when the gradient is not asked for.
+    bool slopes = (gradU && gradV) || crest || foam;
+    float directions[3][WATER_LAYERS][4];
+    int dims = 0;
+    if (velocity) {
+        for (int layer = 0; layer < WATER_LAYERS; layer++)
+            water_layer_rates(plan, layer, directions[dims][layer]);
+        dims++;
+    }
+    int slope = dims;
+    if (slopes) {
+        for (int layer = 0; layer < WATER_LAYERS; layer++) {
+            float* du = directions[dims][layer];
+            float* dv = directions[dims + 1][layer];
+            du[0] = plan.layers[layer].scaleX;
+            du[1] = du[2] = du[3] = 0.0f;
+            dv[1] = plan.layers[layer].scaleY;
+            dv[0] = dv[2] = dv[3] = 0.0f;
+        }
+        dims += 2;
+    }
+
+    float values[WATER_LAYERS], dn[WATER_LAYERS*3], d[3];
+    float slopeU[WATER_LAYERS], slopeV[WATER_LAYERS];
+    for (int i = 0; i < count; i++) {
+        for (int layer = 0; layer < WATER_LAYERS; layer++) {
+            values[layer] = n[layer][i];
+            for (int k = 0; k < dims; k++) {
+                const float* r = directions[k][layer];
+                dn[layer*dims + k] = g[layer][0][i]*r[0] + g[layer][1][i]*r[1] + g[layer][2][i]*r[2] + g[layer][3][i]*r[3];
+            }
+        }
+        disp[i] = water_combine_deriv(plan, values, dn, dims, d);
+
+        if (velocity)
+            velocity[i] = d[0];
+        if (gradU && gradV) {
+            gradU[i] = d[slope];
+            gradV[i] = d[slope + 1];
+        }
+        if (crest || foam) {
+            for (int layer = 0; layer < WATER_LAYERS; layer++) {
+                slopeU[layer] = dn[layer*dims + slope];
+                slopeV[layer] = dn[layer*dims + slope + 1];
+            }
+            float c = water_crest(plan, values, slopeU, slopeV);
+            if (crest)
+                crest[i] = c;
+            if (foam)
+                foam[i] = water_foam(plan, values, c);
+        }
+    }
+}
+
+void water_displacement_deriv_n(const WaterPlan& plan, const int n, const float* u, const float* v, float* disp,
+                                float* velocity, float* gradU, float* gradV, float* crest, float* foam)
+{
+    int blocks = (n + WATER_BLOCK - 1)/WATER_BLOCK;
+
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (int b = 0; b < blocks; b++) {
+        int first = b*WATER_BLOCK;
+        int count = n - first < WATER_BLOCK ? n - first : WATER_BLOCK;
+        deriv_block(plan, count, u + first, v + first, disp + first,
+                    velocity ? velocity + first : 0, gradU ? gradU + first : 0, gradV ? gradV + first : 0,
+                    crest ? crest + first : 0, foam ? foam + first : 0);
+    }
+}
+
+void water_displacement_velocity_n(const WaterPlan& plan, const int n, const float* u, const float* v, float* disp, float* velocity)
+{
+    water_displacement_deriv_n(plan, n, u, v, disp, velocity, 0, 0, 0, 0);
+}
+
+void water_query_n(const WaterPlan& plan, const int n, const float* u, const float* v, float* height,
+                   float* normals, float* velocity)
+{
+    if (n <= 0)
+        return;
+
+    if (!normals && !velocity) {
+        WaterPlan exact = plan;
+        exact.coarseTolerance = 0.0f;
+        water_displacement_n(exact, n, u, v, height);
+        return;
+    }
+    if (!normals) {
+        water_displacement_deriv_n(plan, n, u, v, height, velocity, 0, 0);
+        return;
+    }
+
+    std::vector<float> gradU(n), gradV(n);
+    water_displacement_deriv_n(plan, n, u, v, height, velocity, &gradU[0], &gradV[0]);
+
+    // the surface is y = height(u, v) with u along x and v along z
+    for (int i = 0; i < n; i++) {
+        float length = std::sqrt(gradU[i]*gradU[i] + 1.0f + gradV[i]*gradV[i]);
+        normals[3*i] = -gradU[i]/length;
+        normals[3*i + 1] = 1.0f/length;
+        normals[3*i + 2] = -gradV[i]/length;
+    }
+}
+
+// Displacement of the same points for several plans, disp[s*n + i].
+static void displacement_plans(const WaterPlan* plans, const int times, const int n, const float* u, const float* v,
+                               float* disp, WaterCaches* caches)
+{
+    if (times <= 0 || n <= 0)
+        return;
+
+    // cached fields need no evaluation at all, so they go before the
+    // coarse lattices which are evaluated every time
+    int fieldMask = 0;
+    if (caches && plans[0].driftTolerance > 0.0f)
+        fieldMask = water_update_fields(plans, times, n, u, v, *caches);
+
+    std::vector<WaterCoarseLayers> coarse(plans[0].coarseTolerance > 0.0f ? times : 0);
+    std::vector<WaterSources> sources(times);
+    for (int s = 0; s < times; s++) {
+        if (!coarse.empty())
+            water_build_coarse(plans[s], n, u, v, coarse[s], fieldMask);
+
+        plain_sources(sources[s]);
+        for (int layer = 0; layer < WATER_LAYERS; layer++) {
+            if (fieldMask & (1 << layer)) {
+                sources[s].source[layer] = WATER_SOURCE_FIELD;
+                sources[s].grid[layer] = &caches->fields[layer].grid;
+            }
+            else if (!coarse.empty() && coarse[s].active[layer]) {
+                sources[s].source[layer] = WATER_SOURCE_POINTS;
+                sources[s].grid[layer] = &coarse[s].grids[layer];
+            }
+        }
+    }
+
+    int blocks = (n + WATER_BLOCK - 1)/WATER_BLOCK;
+
+    // all times of a block in a row, while its points are in cache
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (int b = 0; b < blocks; b++) {
+        int first = b*WATER_BLOCK;
+        int count = n - first < WATER_BLOCK ? n - first : WATER_BLOCK;
+        for (int s = 0; s < times; s++)
+            displacement_block(plans[s], sources[s], count, u + first, v + first, disp + (size_t)s*n + first);
+    }
+}
+
+void water_displacement_n(const WaterPlan& plan, const int n, const float* u, const float* v, float* disp,
+                          WaterCaches* caches)
+{
+    displacement_plans(&plan, 1, n, u, v, disp, caches);
+}
+
+float water_layer_wavelength(const WaterPlan& plan, const int layer)
+{
+    const WaterLayer& l = plan.layers[layer];
+    float scale = std::max(std::abs(l.scaleX), std::abs(l.scaleY));
+    return scale > 0.0f ? 1.0f/scale : 1e30f;
+}
+
+float water_shoaling(const float depth, const float wavelength)
+{
+    float x = depth/(WATER_SHOAL_DEPTH*wavelength);
+    if (x <= 0.0f)
+        return 0.0f;
+    if (x >= 1.0f)
+        return 1.0f;
+    return x*x*(3 - 2*x);
+}
+
+float water_depth_attenuation(const WaterPlan& plan, const int layer, const float depth)
+{
+    return water_shoaling(depth, water_layer_wavelength(plan, layer));
+}
+
+// water_depth_attenuation() and its derivative along the depth.
+static float depth_attenuation_deriv(const WaterPlan& plan, const int layer, const float depth, float& slope)
+{
+    float scale = 1.0f/(WATER_SHOAL_DEPTH*water_layer_wavelength(plan, layer));
+    float x = depth*scale;
+    slope = 0.0f;
+    if (x <= 0.0f)
+        return 0.0f;
+    if (x >= 1.0f)
+        return 1.0f;
+    slope = 6*x*(1 - x)*scale;
+    return x*x*(3 - 2*x);
+}
+
+float water_depth_factor(const WaterPlan& plan, const float depth)
+{
+    float sum = 0.0f, total = 0.0f;
+    for (int layer = 0; layer < WATER_LAYERS; layer++) {
+        float weight = std::abs(water_layer_weight(plan, layer));
+        sum += weight*water_depth_attenuation(plan, layer, depth);
+        total += weight;
+    }
+    return total > 0.0f ? sum/total : 1.0f;
+}
+
+// One block of at most WATER_BLOCK points over the given depths. Dry
+// points are dropped first, then every layer is only evaluated for the
+// points it is not attenuated away at.
+static void depth_block(const WaterPlan& plan, const WaterSources& sources, const int count,
+                        const float* u, const float* v, const float* depth, const float shallow, float* disp)
+{
+    int wet[WATER_BLOCK];
+    int wetCount = 0;
+    for (int i = 0; i < count; i++) {
+        disp[i] = 0.0f;
+        if (depth[i] > shallow)
+            wet[wetCount++] = i;
+    }
+    if (wetCount == 0)
+        return;
+
+    float shaped[WATER_LAYERS][WATER_BLOCK];
+    float su[WATER_BLOCK], sv[WATER_BLOCK], n[WATER_BLOCK], attenuation[WATER_BLOCK];
+    int slot[WATER_BLOCK];
+    for (int layer = 0; layer < WATER_LAYERS; layer++) {
+        const WaterLayer& l = plan.layers[layer];
+        int live = 0;
+        for (int k = 0; k < wetCount; k++) {
+            int i = wet[k];
+            float a = water_depth_attenuation(plan, layer, depth[i]);
+            shaped[layer][k] = 0.0f;
+            if (a > 0.0f) {
+                su[live] = u[i];
+                sv[live] = v[i];
+                attenuation[live] = a;
+                slot[live++] = k;
+            }
+        }
+        if (live == 0)
+            continue;
+        layer_noise_values(plan, sources, layer, live, su, sv, n);
+        for (int k = 0; k < live; k++)
+            shaped[layer][slot[k]] = attenuation[k]*water_shape(l, n[k]);
+    }
+
+    float values[WATER_LAYERS];
+    for (int k = 0; k < wetCount; k++) {
+        for (int layer = 0; layer < WATER_LAYERS; layer++)
+            values[layer] = shaped[layer][k];
+        disp[wet[k]] = combine_shaped(plan, values);
+    }
+}
+
+void water_displacement_depth_n(const WaterPlan& plan, const int n, const float* u, const float* v,
+                                const float* depth, const float shallow, float* disp)
+{
+    WaterSources sources;
+    plain_sources(sources);
+
+    int blocks = (n + WATER_BLOCK - 1)/WATER_BLOCK;
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (int b = 0; b < blocks; b++) {
+        int first = b*WATER_BLOCK;
+        int count = n - first < WATER_BLOCK ? n - first : WATER_BLOCK;
+        depth_block(plan, sources, count, u + first, v + first, depth + first, shallow, disp + first);
+    }
+}
+
+// depth_block() with the derivatives of water_displacement_deriv_n(). The
+// wet points are packed together and evaluated with every layer, since
+// the derivatives come from one noise pass for all of them. A shaped
+// layer is a*shape(n), so its derivatives along u and v also take the
+// change of the attenuation a with the depth.
+static void depth_deriv_block(const WaterPlan& plan, const int count, const float* u, const float* v,
+                              const float* depth, const float* depthU, const float* depthV, const float shallow,
+                              float* disp, float* velocity, float* gradU, float* gradV, float* crest, float* foam)
+{
+    int wet[WATER_BLOCK];
+    float wu[WATER_BLOCK], wv[WATER_BLOCK];
+    int wetCount = 0;
+    for (int i = 0; i < count; i++) {
+        disp[i] = 0.0f;
+        if (velocity)
+            velocity[i] = 0.0f;
+        if (gradU && gradV)
+            gradU[i] = gradV[i] = 0.0f;
+        if (crest)
+            crest[i] = 0.0f;
+        if (foam)
+            foam[i] = 0.0f;
+        if (depth[i] > shallow) {
+            wu[wetCount] = u[i];
+            wv[wetCount] = v[i];
+            wet[wetCount++] = i;
+        }
+    }
+    if (wetCount == 0)
+        return;
+
+    float n[WATER_LAYERS][WATER_BLOCK], g[WATER_LAYERS][4][WATER_BLOCK];
+    layer_deriv_block(plan, wetCount, wu, wv, n, g);
+
+    // time first, then u and v, which the crests need even without the
+    // gradient
+    float rates[WATER_LAYERS][4];
+    for (int layer = 0; layer < WATER_LAYERS; layer++)
+        water_layer_rates(plan, layer, rates[layer]);
+    bool slopes = (gradU && gradV) || crest || foam;
+    const int dims = 3;
+
+    float values[WATER_LAYERS], attenuation[WATER_LAYERS], shaped[WATER_LAYERS], ds[WATER_LAYERS][4], d[3];
+    float slopeU[WATER_LAYERS], slopeV[WATER_LAYERS];
+    for (int k = 0; k < wetCount; k++) {
+        int i = wet[k];
+        for (int layer = 0; layer < WATER_LAYERS; layer++) {
+            const WaterLayer& l = plan.layers[layer];
+            const float* r = rates[layer];
+            float dt = g[layer][0][k]*r[0] + g[layer][1][k]*r[1] + g[layer][2][k]*r[2] + g[layer][3][k]*r[3];
+            slopeU[layer] = g[layer][0][k]*l.scaleX;
+            slopeV[layer] = g[layer][1][k]*l.scaleY;
+
+            float slope;
+            float a = depth_attenuation_deriv(plan, layer, depth[i], slope);
+            float s = water_shape(l, n[layer][k]);
+            values[layer] = n[layer][k];
+            attenuation[layer] = a;
+            shaped[layer] = a*s;
+            ds[layer][0] = velocity ? a*water_shape_deriv(l, n[layer][k], dt) : 0.0f;
+            ds[layer][1] = slopes ? a*water_shape_deriv(l, n[layer][k], slopeU[layer]) + s*slope*depthU[i] : 0.0f;
+            ds[layer][2] = slopes ? a*water_shape_deriv(l, n[layer][k], slopeV[layer]) + s*slope*depthV[i] : 0.0f;
+        }
+        disp[i] = combine_shaped_deriv(plan, shaped, ds, dims, d);
+
+        if (velocity)
+            velocity[i] = d[0];
+        if (gradU && gradV) {
+            gradU[i] = d[1];
+            gradV[i] = d[2];
+        }
+        if (crest || foam) {
+            float c = water_crest(plan, values, slopeU, slopeV, attenuation);
+            if (crest)
+                crest[i] = c;
+            if (foam)
+                foam[i] = water_foam(plan, values, c, attenuation);
+        }
+    }
+}
+
+void water_displacement_depth_deriv_n(const WaterPlan& plan, const int n, const float* u, const float* v,
+                                      const float* depth, const float* depthU, const float* depthV,
+                                      const float shallow, float* disp, float* velocity, float* gradU, float* gradV,
+                                      float* crest, float* foam)
+{
+    int blocks = (n + WATER_BLOCK - 1)/WATER_BLOCK;
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (int b = 0; b < blocks; b++) {
+        int first = b*WATER_BLOCK;
+        int count = n - first < WATER_BLOCK ? n - first : WATER_BLOCK;
+        depth_deriv_block(plan, count, u + first, v + first, depth + first, depthU + first, depthV + first,
+                          shallow, disp + first, velocity ? velocity + first : 0,
+                          gradU ? gradU + first : 0, gradV ? gradV + first : 0,
+                          crest ? crest + first : 0, foam ? foam + first : 0);
+    }
+}
+
+void water_displacement_times_n(const WaterParams& params, const int times, const double* t,
+                                const int n, const float* u, const float* v, float* disp, WaterCaches* caches)
+{
+    std::vector<WaterPlan> plans(times);
+    for (int s = 0; s < times; s++) {
+        WaterParams sample = params;
+        sample.time = t[s];
+        water_build_plan(sample, plans[s]);
+    }
+    if (times > 0)
+        displacement_plans(&plans[0], times, n, u, v, disp, caches);
+}
+
+
+static void point_bounds(const int n, const float* u, const float* v, float& u0, float& v0, float& u1, float& v1)
+{
+    u0 = u1 = u[0];
+    v0 = v1 = v[0];
+    for (int i = 1; i < n; i++) {
+        u0 = std::min(u0, u[i]);
+        u1 = std::max(u1, u[i]);
+        v0 = std::min(v0, v[i]);
+        v1 = std::max(v1, v[i]);
+    }
+}
+
+
+void WaterGrid2D::cover(const float u0, const float v0, const float u1, const float v1, const float su, const float sv)
+{
+    // one node of margin below and two above for the cubic stencil
+    spacingU = su;
+    spacingV = sv;
+    inverseU = 1.0f/su;
+    inverseV = 1.0f/sv;
+    originU = u0 - su;
+    originV = v0 - sv;
+    nu = (int)ceil((u1 - u0)/su) + 4;
+    nv = (int)ceil((v1 - v0)/sv) + 4;
+    firstU = firstV = 0;
+    wrapU = wrapV = 0;
+    values.assign(nu*nv, 0.0f);
+}
+
+void WaterGrid2D::anchor(const int i0, const int j0, const int nu, const int nv, const float s)
+{
+    spacingU = spacingV = s;
+    inverseU = inverseV = 1.0f/s;
+    this->nu = nu;
+    this->nv = nv;
+    wrapU = wrapV = 0;
+    firstU = i0;
+    firstV = j0;
+    originU = i0*s;
+    originV = j0*s;
+    values.assign(nu*nv, 0.0f);
+}
+
+void WaterGrid2D::scroll(const int i0, const int j0)
+{
+    // node (i0, j0) goes where node i0 - firstU of the old window is kept
+    wrapU = ((wrapU + i0 - firstU) % nu + nu) % nu;
+    wrapV = ((wrapV + j0 - firstV) % nv + nv) % nv;
+    firstU = i0;
+    firstV = j0;
+    originU = i0*spacingU;
+    originV = j0*spacingV;
+}
+
+static inline void catmull_rom(const float t, float* w)
+{
+    float t2 = t*t;
+    float t3 = t2*t;
+    w[0] = -0.5f*t3 + t2 - 0.5f*t;
+    w[1] = 1.5f*t3 - 2.5f*t2 + 1.0f;
+    w[2] = -1.5f*t3 + 2.0f*t2 + 0.5f*t;
+    w[3] = 0.5f*t3 - 0.5f*t2;
+}
+
+float WaterGrid2D::sample(const float u, const float v) const
+{
+    float fu = (u - originU)*inverseU;
+    float fv = (v - originV)*inverseV;
+    int i = fastfloor(fu);
+    int j = fastfloor(fv);
+    float wu[4], wv[4];
+    catmull_rom(fu - i, wu);
+    catmull_rom(fv - j, wv);
+
+    float sum = 0.0f;
+    if (i >= 1 && j >= 1 && i + 2 < nu && j + 2 < nv) {
+        // the rows of a scrolled window may wrap, its stencil only
+        // rarely straddles the column it wraps at
+        int si = i - 1 + wrapU;
+        int sj = j - 1 + wrapV;
+        si = si < nu ? si : si - nu;
+        sj = sj < nv ? sj : sj - nv;
+        if (si + 3 < nu) {
+            for (int b = 0; b < 4; b++) {
+                const float* row = &values[sj*nu + si];
+                sum += wv[b]*(wu[0]*row[0] + wu[1]*row[1] + wu[2]*row[2] + wu[3]*row[3]);
+                sj = sj + 1 < nv ? sj + 1 : 0;
+            }
+            return sum;
+        }
+    }
+
+    for (int b = 0; b < 4; b++) {
+        int jj = std::min(std::max(j + b - 1, 0), nv - 1) + wrapV;
+        const float* row = &values[(jj < nv ? jj : jj - nv)*nu];
+        float r = 0.0f;
+        for (int a = 0; a < 4; a++) {
+            int ii = std::min(std::max(i + a - 1, 0), nu - 1) + wrapU;
+            r += wu[a]*row[ii < nu ? ii : ii - nu];
+        }
+        sum += wv[b]*r;
+    }
+    return sum;
+}
+
+
+// Catmull-Rom interpolation of the simplex noise on a lattice of spacing h
+// (in noise units) was measured to err by at most about 12*h^3. On top of
+// that come the jumps of up to ~0.008 the 3D noise has at simplex borders,
+// where its 0.6 radius kernel is not quite zero, which no lattice resolves.
+static const float WATER_CUBIC_ERROR = 12.0f;
+
+// A layer only goes coarse if its lattice has at most this fraction of
+// the nodes there are points.
+static const float WATER_COARSE_FRACTION = 0.25f;
+
+void water_build_coarse(const WaterPlan& plan, const int n, const float* u, const float* v, WaterCoarseLayers& coarse,
+                        const int skipMask)
+{
+    for (int layer = 0; layer < WATER_LAYERS; layer++)
+        coarse.active[layer] = false;
+    if (n <= 0 || plan.coarseTolerance <= 0.0f)
+        return;
+
+    float u0, v0, u1, v1;
+    point_bounds(n, u, v, u0, v0, u1, v1);
+
+    for (int layer = 0; layer < WATER_LAYERS; layer++) {
+        const WaterLayer& l = plan.layers[layer];
+        float weight = water_layer_weight(plan, layer);
+        if (weight <= 0.0f || (skipMask & (1 << layer)))
+            continue;
+
+        // spacing in noise units that keeps weight*error below the layer's
+        // share of the tolerance
+        float h = cbrt(plan.coarseTolerance/(WATER_LAYERS*weight*WATER_CUBIC_ERROR));
+        float su = std::abs(l.scaleX) > 1e-12f ? h/std::abs(l.scaleX) : u1 - u0 + 1.0f;
+        float sv = std::abs(l.scaleY) > 1e-12f ? h/std::abs(l.scaleY) : v1 - v0 + 1.0f;
+        double nodes = (ceil((u1 - u0)/su) + 4)*(ceil((v1 - v0)/sv) + 4);
+        if (nodes > WATER_COARSE_FRACTION*n)
+            continue;
+
+        WaterGrid2D& grid = coarse.grids[layer];
+        grid.cover(u0, v0, u1, v1, su, sv);
+        coarse.active[layer] = true;
+
+        #pragma omp parallel for
+        for (int j = 0; j < grid.nv; j++)
+            for (int i = 0; i < grid.nu; i++)
+                grid.at(i, j) = water_layer_noise(plan, layer, grid.u(i), grid.v(j));
+    }
+}
+
+
+// Lattice spacing of the cached fields in noise units, interpolation
+// errs by about 12*h^3 = 0.003 of the noise range.
+static const float WATER_FIELD_SPACING = 1.0f/16;
+
+// Extra room a field gets downwind of the points, as a fraction of the
+// points' extent in noise coordinates, so it lasts while the water advects.
+static const float WATER_FIELD_MARGIN = 0.5f;
+
+// Bound on the slope of the raw noise along z, measured at about 6.3.
+static const float WATER_NOISE_SLOPE = 6.5f;
+
+// Identifies the noise function a layer is sampled with.
+static int layer_basis(const WaterPlan& plan, const int layer)
+{
+    const WaterLayer& l = plan.layers[layer];
+    if (plan.tiled)
+        return 2 + (l.periodX << 1) + (l.periodY << 16);
+    return l.table ? 1 : 0;
+}
+
+int water_update_fields(const WaterPlan* plans, const int times, const int n, const float* u, const float* v,
+                        WaterCaches& caches)
+{
+    const WaterPlan& plan = plans[0];
+    if (n <= 0 || times <= 0 || plan.loop || plan.driftTolerance <= 0.0f)
+        return 0;
+
+    float u0, v0, u1, v1;
+    point_bounds(n, u, v, u0, v0, u1, v1);
+
+    int mask = 0;
+    for (int layer = 0; layer < WATER_LAYERS; layer++) {
+        WaterAdvectedField& field = caches.fields[layer];
+        const WaterLayer& l = plan.layers[layer];
+        float weight = water_layer_weight(plan, layer);
+        if (weight <= 0.0f)
+            continue;
+
+        // noise coordinates are linear in (u, v), so the corners bound them,
+        // the field has to cover the points at every time
+        float x0 = 0, y0 = 0, x1 = 0, y1 = 0, z0 = 0, z1 = 0;
+        for (int s = 0; s < times; s++) {
+            float ax, ay, bx, by, z, w;
+            water_layer_coords(plans[s], layer, u0, v0, ax, ay, z, w);
+            water_layer_coords(plans[s], layer, u1, v1, bx, by, z, w);
+            if (ax > bx) std::swap(ax, bx);
+            if (ay > by) std::swap(ay, by);
+            x0 = s ? std::min(x0, ax) : ax;
+            y0 = s ? std::min(y0, ay) : ay;
+            x1 = s ? std::max(x1, bx) : bx;
+            y1 = s ? std::max(y1, by) : by;
+            z0 = s ? std::min(z0, z) : z;
+            z1 = s ? std::max(z1, z) : z;
+        }
+        float z = 0.5f*(z0 + z1);
+
+        // a slowly evolving layer is treated as translating until its z
+        // has drifted too far from the cached slice
+        bool translates = water_layer_translates(plan, layer);
+        float drift = translates ? 0.0f : plan.driftTolerance/(weight*WATER_NOISE_SLOPE);
+
+        const WaterGrid2D& grid = field.grid;
+        bool usable = field.valid && field.basis == layer_basis(plan, layer)
+            && std::abs(z0 - field.z) <= drift && std::abs(z1 - field.z) <= drift
+            && x0 >= grid.u(1) && x1 <= grid.u(grid.nu - 3)
+            && y0 >= grid.v(1) && y1 <= grid.v(grid.nv - 3);
+        if (usable) {
+            mask |= 1 << layer;
+            continue;
+        }
+
+        // only worth it for layers that last at least a time unit
+        if (!translates && (std::abs(l.zRate) > drift || z1 - z0 > 2*drift))
+            continue;
+
+        // leave room in the direction the points move through the noise
+        float vx = l.speed*plan.dirX*l.scaleX;
+        float vy = l.speed*plan.dirY*l.scaleY;
+        float mx = (x1 - x0)*WATER_FIELD_MARGIN + 1.0f;
+        float my = (y1 - y0)*WATER_FIELD_MARGIN + 1.0f;
+        float fx0 = vx < 0 ? x0 - mx : x0;
+        float fx1 = vx > 0 ? x1 + mx : x1;
+        float fy0 = vy < 0 ? y0 - my : y0;
+        float fy1 = vy > 0 ? y1 + my : y1;
+
+        // nodes on the lattice through the origin, one node of margin
+        // below and two above for the cubic stencil as in cover()
+        const float h = WATER_FIELD_SPACING;
+        int i0 = (int)floor(fx0/h) - 1;
+        int j0 = (int)floor(fy0/h) - 1;
+        int nu = (int)ceil(fx1/h) + 3 - i0;
+        int nv = (int)ceil(fy1/h) + 3 - j0;
+        if ((double)nu*nv > 0.5*n) {
+            field.valid = false;
+            field.grid.values.clear();
+            continue;
+        }
+
+        // a window over the same slice that is large enough scrolls
+        // toroidally, only the nodes it newly covers are evaluated, as when
+        // the points follow a camera or the water advects past them
+        WaterGrid2D& g = field.grid;
+        int basis = layer_basis(plan, layer);
+        bool scroll = field.valid && field.basis == basis && field.z == z && g.spacingU == h
+            && nu <= g.nu && nv <= g.nv && g.nu <= 2*nu && g.nv <= 2*nv;
+        int oldU = g.firstU, oldV = g.firstV;
+        if (scroll)
+            g.scroll(i0, j0);
+        else
+            g.anchor(i0, j0, nu, nv, h);
+        field.z = z;
+        field.basis = basis;
+        field.valid = true;
+
+        #pragma omp parallel for
+        for (int j = 0; j < g.nv; j++)
+            for (int i = 0; i < g.nu; i++)
+                if (!scroll || !g.covered(i, j, oldU, oldV))
+                    g.at(i, j) = water_layer_noise_at(plan, layer, g.u(i), g.v(j), z, 0.0f);
+
+        mask |= 1 << layer;
+    }
+    return mask;
+}
+
+
+// Bound on the gradient of the raw noise within a slice of constant z and
+// w, the steepest measured is about 6.3.
+static const float WATER_NOISE_GRADIENT = 6.5f;
+
+// Rays that have not converged after this many steps count as misses.
+static const int WATER_TRACE_STEPS = 512;
+
+float water_slope_bound(const WaterPlan& plan, const float du, const float dv)
+{
+    float bound = 0.0f;
+    for (int layer = 0; layer < WATER_LAYERS; layer++) {
+        const WaterLayer& l = plan.layers[layer];
+        float x = l.scaleX*du;
+        float y = l.scaleY*dv;
+        bound += water_layer_weight(plan, layer)*WATER_NOISE_GRADIENT*std::sqrt(x*x + y*y);
+    }
+    return bound;
+}
+
+// Sphere tracing steps this much further than the slope bound allows. A
+// step is kept if the bounds at both of its ends cover it, otherwise the
+// ray falls back to the safe step.
+static const float WATER_TRACE_RELAXATION = 1.8f;
+
+// One packet of at most WATER_BLOCK rays. Each step evaluates the surface
+// under all rays still tracing in one block.
+static void intersect_block(const WaterPlan& plan, const int count, const float* origins, const float* directions,
+                            const float maxDistance, const float tolerance, float* t, int* evaluations)
+{
+    WaterSources sources;
+    plain_sources(sources);
+
+    // s is where the surface is evaluated next, safe how far from last the
+    // ray is known not to cross it
+    float s[WATER_BLOCK], side[WATER_BLOCK], rate[WATER_BLOCK], last[WATER_BLOCK], safe[WATER_BLOCK];
+    int tracing[WATER_BLOCK], live = count;
+    float low, high;
+    water_displacement_range(plan, low, high);
+    for (int i = 0; i < count; i++) {
+        s[i] = last[i] = safe[i] = 0.0f;
+        side[i] = 0.0f;
+        tracing[i] = i;
+        t[i] = -1.0f;
+        if (evaluations)
+            evaluations[i] = 0;
+
+        // rays outside the range of the displacement start where they enter it
+        const float* o = origins + 3*i;
+        const float* d = directions + 3*i;
+        if (o[1] > high || o[1] < low) {
+            side[i] = o[1] > high ? 1.0f : -1.0f;
+            rate[i] = water_slope_bound(plan, d[0], d[2]) - side[i]*d[1];
+            float entry = side[i] > 0.0f ? high : low;
+            last[i] = s[i] = side[i]*d[1] < 0.0f ? (entry - o[1])/d[1] : 2*maxDistance;
+        }
+    }
+
+    float u[WATER_BLOCK], v[WATER_BLOCK], height[WATER_BLOCK];
+    for (int step = 0; step < WATER_TRACE_STEPS && live > 0; step++) {
+        int m = 0;
+        for (int k = 0; k < live; k++) {
+            int i = tracing[k];
+            const float* o = origins + 3*i;
+            const float* d = directions + 3*i;
+            if (s[i] > maxDistance)
+                continue;
+            tracing[m] = i;
+            u[m] = o[0] + s[i]*d[0];
+            v[m] = o[2] + s[i]*d[2];
+            m++;
+            if (evaluations)
+                evaluations[i]++;
+        }
+        live = m;
+        displacement_block(plan, sources, live, u, v, height);
+
+        m = 0;
+        for (int k = 0; k < live; k++) {
+            int i = tracing[k];
+            const float* o = origins + 3*i;
+            const float* d = directions + 3*i;
+            float f = o[1] + s[i]*d[1] - height[k];
+            if (side[i] == 0.0f) {
+                side[i] = f >= 0.0f ? 1.0f : -1.0f;
+
+                // the fastest the ray can close in on the surface, if at all
+                rate[i] = water_slope_bound(plan, d[0], d[2]) - side[i]*d[1];
+            }
+
+            // an overrelaxed step the two bounds do not cover is taken again
+            float gap = side[i]*f;
+            if (s[i] - last[i] > safe[i] && (gap < 0.0f || s[i] - last[i] > safe[i] + gap/rate[i])) {
+                last[i] = s[i] = last[i] + safe[i];
+                safe[i] = 0.0f;
+                tracing[m++] = i;
+                continue;
+            }
+
+            if (gap <= tolerance) {
+                t[i] = s[i];
+                continue;
+            }
+            if (rate[i] <= 0.0f)
+                continue;
+
+            last[i] = s[i];
+            safe[i] = gap/rate[i];
+            s[i] += WATER_TRACE_RELAXATION*safe[i];
+            tracing[m++] = i;
+        }
+        live = m;
+    }
+}
+
+void water_intersect_n(const WaterPlan& plan, const int n, const float* origins, const float* directions,
+                       const float maxDistance, const float tolerance, float* t,
+                       int* evaluations)
+{
+    WaterPlan exact = plan;
+    exact.coarseTolerance = 0.0f;
+
+    int blocks = (n + WATER_BLOCK - 1)/WATER_BLOCK;
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int b = 0; b < blocks; b++) {
+        int first = b*WATER_BLOCK;
+        int count = n - first < WATER_BLOCK ? n - first : WATER_BLOCK;
+        intersect_block(exact, count, origins + 3*first, directions + 3*first,
+                        maxDistance, tolerance, t + first, evaluations ? evaluations + first : 0);
+    }
+}
+
+
+WaterHash water_signature(const WaterParams& params, const int n, const float* u, const float* v)
+{
+    // field by field and without the time, the padding of the struct
+    // is not initialized
+    WaterHash hash = water_points_signature(n, u, v);
+    hash = water_hash(hash, &params.direction, sizeof(params.direction));
+    hash = water_hash(hash, &params.bigAmplitude, sizeof(params.bigAmplitude));
+    hash = water_hash(hash, &params.amplitude1, sizeof(params.amplitude1));
+    hash = water_hash(hash, &params.frequency1, sizeof(params.frequency1));
+    hash = water_hash(hash, &params.amplitude2, sizeof(params.amplitude2));
+    hash = water_hash(hash, &params.frequency2, sizeof(params.frequency2));
+    hash = water_hash(hash, &params.loopLength, sizeof(params.loopLength));
+    hash = water_hash(hash, &params.tileSize, sizeof(params.tileSize));
+    hash = water_hash(hash, &params.tableLayers, sizeof(params.tableLayers));
+    hash = water_hash(hash, &params.coarseTolerance, sizeof(params.coarseTolerance));
+    hash = water_hash(hash, &params.driftTolerance, sizeof(params.driftTolerance));
+    hash = water_hash(hash, &params.timeStep, sizeof(params.timeStep));
+    hash = water_hash(hash, &params.timeTolerance, sizeof(params.timeTolerance));
+    return hash;
+}
+
+WaterHash water_points_signature(const int n, const float* u, const float* v)
+{
+    WaterHash hash = WATER_HASH_BASIS;
+    hash = water_hash(hash, &n, sizeof(n));
+    hash = water_hash(hash, u, n*sizeof(float));
+    hash = water_hash(hash, v, n*sizeof(float));
+    return hash;
+}
+
+
+// Positions within a tile are compared at 1/65536 of the tile size.
+static const long WATER_TILE_STEPS = 65536;
+
+static long tile_step(const float x, const float tileSize)
+{
+    double local = x/tileSize - floor(x/tileSize);
+    return (long)floor(local*WATER_TILE_STEPS + 0.5) % WATER_TILE_STEPS;
+}
+
+void water_build_tile_map(const float tileSize, const int n, const float* u, const float* v, WaterTileMap& map)
+{
+    map.signature = water_points_signature(n, u, v);
+    map.tileSize = tileSize;
+    map.u.clear();
+    map.v.clear();
+    map.slot.resize(n);
+
+    std::vector<std::pair<long, int> > keys(n);
+    for (int i = 0; i < n; i++)
+        keys[i] = std::make_pair(tile_step(u[i], tileSize)*WATER_TILE_STEPS + tile_step(v[i], tileSize), i);
+    std::sort(keys.begin(), keys.end());
+
+    for (int i = 0; i < n; i++) {
+        if (i == 0 || keys[i].first != keys[i-1].first) {
+            // any vertex of the group will do, the field is periodic
+            map.u.push_back(u[keys[i].second]);
+            map.v.push_back(v[keys[i].second]);
+        }
+        map.slot[keys[i].second] = (int)map.u.size() - 1;
+    }
+}
+
+void water_displacement_tiled(const WaterPlan& plan, const WaterTileMap& map, float* disp,
+                              float* velocity, float* gradU, float* gradV, float* crest, float* foam)
+{
+    int unique = (int)map.u.size();
+    bool gradient = gradU && gradV;
+    std::vector<float> shared(unique), sharedVelocity(velocity ? unique : 0);
+    std::vector<float> sharedU(gradient ? unique : 0), sharedV(gradient ? unique : 0);
+    std::vector<float> sharedCrest(crest ? unique : 0), sharedFoam(foam ? unique : 0);
+    if (unique > 0 && (velocity || gradient || crest || foam))
+        water_displacement_deriv_n(plan, unique, &map.u[0], &map.v[0], &shared[0], velocity ? &sharedVelocity[0] : 0,
+                                   gradient ? &sharedU[0] : 0, gradient ? &sharedV[0] : 0,
+                                   crest ? &sharedCrest[0] : 0, foam ? &sharedFoam[0] : 0);
+    else if (unique > 0)
+        water_displacement_n(plan, unique, &map.u[0], &map.v[0], &shared[0]);
+
+    int n = (int)map.slot.size();
+    for (int i = 0; i < n; i++)
+        disp[i] = shared[map.slot[i]];
+    if (velocity)
+        for (int i = 0; i < n; i++)
+            velocity[i] = sharedVelocity[map.slot[i]];
+    if (gradient)
+        for (int i = 0; i < n; i++) {
+            gradU[i] = sharedU[map.slot[i]];
+            gradV[i] = sharedV[map.slot[i]];
+        }
+    if (crest)
+        for (int i = 0; i < n; i++)
+            crest[i] = sharedCrest[map.slot[i]];
+    if (foam)
+        for (int i = 0; i < n; i++)
+            foam[i] = sharedFoam[map.slot[i]];
+}
+
+
+WaterFrameCache::WaterFrameCache(const size_t maxBytes)
+    : maxBytes(maxBytes), stored(0), signature(0)
+{}
+
+void WaterFrameCache::clear()
+{
+    frames.clear();
+    order.clear();
+    stored = 0;
+}
+
+void WaterFrameCache::validate(const WaterHash newSignature)
+{
+    if (newSignature != signature) {
+        clear();
+        signature = newSignature;
+    }
+}
+
+void WaterFrameCache::setMaxBytes(const size_t newMaxBytes)
+{
+    maxBytes = newMaxBytes;
+    evict(0);
+}
+
+const std::vector<float>* WaterFrameCache::find(const double key) const
+{
+    std::map<double, std::vector<float> >::const_iterator it = frames.find(key);
+    if (it == frames.end())
+        return 0;
+    return &it->second;
+}
+
+std::vector<float>& WaterFrameCache::insert(const double key, const unsigned int size)
+{
+    std::map<double, std::vector<float> >::iterator it = frames.find(key);
+    if (it != frames.end()) {
+        stored -= it->second.size()*sizeof(float);
+        it->second.resize(size);
+        stored += it->second.size()*sizeof(float);
+        return it->second;
+    }
+
+    evict(size*sizeof(float));
+    order.push_back(key);
+    std::vector<float>& frame = frames[key];
+    frame.resize(size);
+    stored += frame.size()*sizeof(float);
+    return frame;
+}
+
+// Evicts the oldest frames until room more bytes fit the budget.
+void WaterFrameCache::evict(const size_t room)
+{
+    while (!order.empty() && stored + room > maxBytes) {
+        std::map<double, std::vector<float> >::iterator it = frames.find(order.front());
+        stored -= it->second.size()*sizeof(float);
+        frames.erase(it);
+        order.pop_front();
+    }
+}
+
+
+
+
+// Rough size of a map node besides its value.
+static const size_t WATER_NODE_BYTES = 4*sizeof(void*);
+
+// A key or a decision of some chunk, ordered by its last use.
+struct WaterKeyEntry {
+    unsigned long long used;
+    size_t chunk;
+    long long id;
+    bool key;
+    bool operator<(const WaterKeyEntry& other) const { return used < other.used; }
+};
+
+WaterTimeSampler::WaterTimeSampler(const int maxLevel, const size_t maxBytes)
+    : maxLevel(maxLevel), maxBytes(maxBytes), calls(0), signature(0)
+{}
+
+void WaterTimeSampler::clear()
+{
+    chunks.clear();
+}
+
+void WaterTimeSampler::validate(const WaterHash newSignature)
+{
+    if (newSignature != signature) {
+        clear();
+        signature = newSignature;
+    }
+}
+
+void WaterTimeSampler::displacement(const WaterParams& params, const int n, const float* u, const float* v, float* disp)
+{
+    WaterPlan plan;
+    water_build_plan(params, plan);
+    if (params.timeStep <= 0.0) {
+        water_displacement_n(plan, n, u, v, disp);
+        return;
+    }
+
+    int blocks = (n + WATER_BLOCK - 1)/WATER_BLOCK;
+    if ((int)chunks.size() != blocks) {
+        chunks.clear();
+        chunks.resize(blocks);
+    }
+    calls++;
+
+    // chunks refine independently, so each one owns its keys
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int b = 0; b < blocks; b++) {
+        int first = b*WATER_BLOCK;
+        int count = n - first < WATER_BLOCK ? n - first : WATER_BLOCK;
+        sample(params, plan, chunks[b], count, u + first, v + first, disp + first);
+    }
+
+    // no key is in use any more, so this is the time to trim them
+    evict();
+}
+
+void WaterTimeSampler::evict()
+{
+    size_t total = 0;
+    for (size_t c = 0; c < chunks.size(); c++)
+        total += chunks[c].bytes;
+    if (total <= maxBytes)
+        return;
+
+    std::vector<WaterKeyEntry> entries;
+    for (size_t c = 0; c < chunks.size(); c++) {
+        for (std::map<long long, Key>::const_iterator it = chunks[c].keys.begin(); it != chunks[c].keys.end(); ++it) {
+            WaterKeyEntry entry = { it->second.used, c, it->first, true };
+            entries.push_back(entry);
+        }
+        for (std::map<long long, Decision>::const_iterator it = chunks[c].decisions.begin();
+             it != chunks[c].decisions.end(); ++it) {
+            WaterKeyEntry entry = { it->second.used, c, it->first, false };
+            entries.push_back(entry);
+        }
+    }
+    std::sort(entries.begin(), entries.end());
+
+    // down to three quarters of the budget, so the sort is not repeated on
+    // every call once the budget is reached
+    size_t target = maxBytes/4*3;
+    for (size_t e = 0; e < entries.size() && total > target; e++) {
+        Chunk& chunk = chunks[entries[e].chunk];
+        size_t bytes;
+        if (entries[e].key) {
+            std::map<long long, Key>::iterator it = chunk.keys.find(entries[e].id);
+            bytes = sizeof(*it) + WATER_NODE_BYTES + it->second.values.size()*sizeof(float);
+            chunk.keys.erase(it);
+        }
+        else {
+            bytes = sizeof(std::pair<const long long, Decision>) + WATER_NODE_BYTES;
+            chunk.decisions.erase(entries[e].id);
+        }
+        chunk.bytes -= bytes;
+        total -= bytes;
+    }
+}
+
+const float* WaterTimeSampler::key(const WaterParams& params, Chunk& chunk, const int level, const long long index,
+                                   const int count, const float* u, const float* v)
+{
+    // a multiplication, index is -1 next to t = 0 and shifting a negative
+    // value left is undefined
+    long long id = index*(1LL << (maxLevel - level));
+    std::map<long long, Key>::iterator it = chunk.keys.find(id);
+    if (it != chunk.keys.end()) {
+        it->second.used = calls;
+        return &it->second.values[0];
+    }
+
+    WaterParams keyParams = params;
+    keyParams.time = id*params.timeStep/(1 << maxLevel);
+    WaterPlan plan;
+    water_build_plan(keyParams, plan);
+
+    WaterSources sources;
+    plain_sources(sources);
+    float noise[WATER_LAYERS][WATER_BLOCK];
+    layer_noise_block(plan, sources, count, u, v, noise);
+
+    // only as many values as the chunk has points, the last chunk is
+    // usually short
+    Key& stored = chunk.keys[id];
+    stored.used = calls;
+    stored.values.resize(WATER_LAYERS*count);
+    for (int layer = 0; layer < WATER_LAYERS; layer++)
+        std::copy(noise[layer], noise[layer] + count, &stored.values[layer*count]);
+    chunk.bytes += sizeof(std::pair<const long long, Key>) + WATER_NODE_BYTES + stored.values.size()*sizeof(float);
+    return &stored.values[0];
+}
+
+// Displacement of a chunk interpolated from four keys of count values per
+// layer, s is the position between p1 and p2.
+static void interpolate_keys(const WaterPlan& plan, const float* p0, const float* p1, const float* p2, const float* p3,
+                             const int count, const float s, float* disp)
+{
+    // Catmull-Rom weights
+    float w0 = 0.5f*s*(-1 + s*(2 - s));
+    float w1 = 1 + 0.5f*s*s*(-5 + 3*s);
+    float w2 = 0.5f*s*(1 + s*(4 - 3*s));
+    float w3 = 0.5f*s*s*(s - 1);
+
+    float n[WATER_LAYERS][WATER_BLOCK];
+    for (int layer = 0; layer < WATER_LAYERS; layer++) {
+        int k = layer*count;
+        for (int i = 0; i < count; i++)
+            n[layer][i] = w0*p0[k + i] + w1*p1[k + i] + w2*p2[k + i] + w3*p3[k + i];
+    }
+
+    float values[WATER_LAYERS];
+    for (int i = 0; i < count; i++) {
+        for (int layer = 0; layer < WATER_LAYERS; layer++)
+            values[layer] = n[layer][i];
+        disp[i] = water_combine(plan, values);
+    }
+}
+
+void WaterTimeSampler::sample(const WaterParams& params, const WaterPlan& plan, Chunk& chunk,
+                              const int count, const float* u, const float* v, float* disp)
+{
+    for (int level = 0; ; level++) {
+        double h = params.timeStep/(1 << level);
+        double position = params.time/h;
+        long long j = (long long)floor(position);
+        float s = (float)(position - j);
+
+        if (s == 0.0f) {
+            const float* p1 = key(params, chunk, level, j, count, u, v);
+            interpolate_keys(plan, p1, p1, p1, p1, count, 0.0f, disp);
+            return;
+        }
+
+        const float* p0 = key(params, chunk, level, j - 1, count, u, v);
+        const float* p1 = key(params, chunk, level, j, count, u, v);
+        const float* p2 = key(params, chunk, level, j + 1, count, u, v);
+        const float* p3 = key(params, chunk, level, j + 2, count, u, v);
+
+        if (level < maxLevel) {
+            // the interval's middle is a key of the next level, so a failed
+            // test is not wasted
+            long long interval = j*(maxLevel + 1) + level;
+            std::map<long long, Decision>::iterator it = chunk.decisions.find(interval);
+            if (it == chunk.decisions.end()) {
+                const float* middle = key(params, chunk, level + 1, 2*j + 1, count, u, v);
+                // RMS over the chunk, the kernel's small jumps would fail
+                // a maximum at every level
+                float guess[WATER_BLOCK], exact[WATER_BLOCK];
+                interpolate_keys(plan, p0, p1, p2, p3, count, 0.5f, guess);
+                interpolate_keys(plan, middle, middle, middle, middle, count, 0.0f, exact);
+                float error = 0.0f;
+                for (int i = 0; i < count; i++)
+                    error += (guess[i] - exact[i])*(guess[i] - exact[i]);
+                error = sqrtf(error/count);
+                Decision decision = { error <= params.timeTolerance, calls };
+                it = chunk.decisions.insert(std::make_pair(interval, decision)).first;
+                chunk.bytes += sizeof(std::pair<const long long, Decision>) + WATER_NODE_BYTES;
+            }
+            it->second.used = calls;
+            if (!it->second.accepted)
+                continue;
+        }
+
+        interpolate_keys(plan, p0, p1, p2, p3, count, s, disp);
+        return;
+    }
+}
@@ -0,0 +1,458 @@
+//
+//  File: waterEngine.h
+//
+//  Description:
+//		Maya independent evaluation of the proWater height field.
+//		The displacement is a fixed combination of six simplex noise
+//		layers. Each layer samples the noise at
+//
+//			( (u + speed*t*dirX)*scaleX, (v + speed*t*dirY)*scaleY, z0 + zRate*t )
+//
+//		which is what proWater::compute() used to evaluate inline.
+//
+
+#ifndef WATER_ENGINE_H_
+#define WATER_ENGINE_H_
+
+#include <vector>
+#include <map>
+#include <list>
+
+#include "waterHash.h"
+
+
+// Attribute values of the proWater node that the height field depends on.
+struct WaterParams {
+    double time;
+    double direction;       // wind direction in degrees
+    double bigAmplitude;
+    double amplitude1;
+    double frequency1;
+    double amplitude2;
+    double frequency2;
+    double loopLength;      // length of a seamless cycle in time units, 0 disables looping
+    double tileSize;        // repeat the field every tileSize units in u and v, 0 disables tiling
+    int tableLayers;        // bit i set samples layer i from the noise wavetable
+    double coarseTolerance; // error allowed for layers evaluated on a coarse lattice, 0 disables it
+    double driftTolerance;  // error allowed from the z drift of cached layers, 0 disables the cache
+    double timeStep;        // spacing of the evaluated time keys, 0 evaluates every time directly
+    double timeTolerance;   // error allowed when interpolating between time keys
+
+    WaterParams();
+};
+
+
+// How a layer's raw noise value enters the displacement.
+enum WaterShape {
+    WATER_SHAPE_UNIT,       // scaled to [0, 1]
+    WATER_SHAPE_RIDGED,     // -(|amplitude*n| - amplitude)
+    WATER_SHAPE_PLAIN       // amplitude*n
+};
+
+// Presets for WaterParams::tableLayers.
+enum {
+    WATER_TABLE_NONE = 0,
+    WATER_TABLE_ALL = 0x3f,
+    WATER_TABLE_DETAIL = 0x3e      // everything but the big waves
+};
+
+enum WaterLayerId {
+    WATER_BIG_WAVES,
+    WATER_FIRST_OCTAVE,
+    WATER_SECOND_OCTAVE,
+    WATER_THIRD_OCTAVE,
+    WATER_FOURTH_OCTAVE,
+    WATER_FIFTH_OCTAVE,
+    WATER_LAYERS
+};
+
+struct WaterLayer {
+    float amplitude;
+    int shape;
+    float scaleX, scaleY;   // noise frequency along u and v
+    float speed;            // advection along the wind, in world units per time unit
+    float z0, zRate;        // third noise coordinate is z0 + zRate*t
+
+    // Loop mode: the time axis becomes a circle of this radius in the
+    // third and fourth noise coordinates.
+    float loopRadius;
+
+    // Tile mode: noise periods along u and v, in noise units.
+    int periodX, periodY;
+
+    // Sample the approximate wavetable instead of the analytic noise.
+    bool table;
+};
+
+// Everything needed to evaluate the height field at one point in time.
+struct WaterPlan {
+    WaterLayer layers[WATER_LAYERS];
+    float time;
+    float dirX, dirY;
+    float bigAmplitude;
+    bool loop;
+    float loopCos, loopSin; // position on the time circle
+    float loopRate;         // angular speed on the time circle
+    bool tiled;             // never set together with loop
+    float tileSize;
+    float coarseTolerance;
+    float driftTolerance;
+};
+
+
+// Time actually evaluated, wrapped into [0, loopLength) in loop mode so that
+// t and t + loopLength are bit identical.
+double water_wrap_time(const WaterParams& params);
+
+void water_build_plan(const WaterParams& params, WaterPlan& plan);
+
+// Tile mode raises each layer frequency to a whole number of periods per
+// tile, and a period is a multiple of 3 lattice cells. Snapping by more
+// than this factor is worth a warning.
+#define WATER_TILE_SNAP 1.25f
+
+// Largest factor by which tile mode raises the frequency of a layer that has
+// some amplitude, 1 when params do not tile. layer gets that layer, and
+// minTileSize the smallest tileSize that keeps every layer within
+// WATER_TILE_SNAP.
+float water_tile_snap(const WaterParams& params, int& layer, float& minTileSize);
+
+// Noise coordinates of a layer. w is only used in loop mode.
+void water_layer_coords(const WaterPlan& plan, const int layer, const float u, const float v,
+                        float& x, float& y, float& z, float& w);
+
+// Raw noise value of a layer in (-1, 1).
+float water_layer_noise(const WaterPlan& plan, const int layer, const float u, const float v);
+float water_layer_noise_at(const WaterPlan& plan, const int layer, const float x, const float y, const float z, const float w);
+
+// True if the layer is a pure translation of a fixed noise slice.
+bool water_layer_translates(const WaterPlan& plan, const int layer);
+
+// Raw noise of a layer and its gradient in noise coordinates (x, y, z, w).
+float water_layer_noise_deriv(const WaterPlan& plan, const int layer, const float u, const float v, float* gradient);
+
+// Derivative of a layer's noise coordinates with respect to time.
+void water_layer_rates(const WaterPlan& plan, const int layer, float* rates);
+
+// Layer value after its amplitude and shape are applied.
+float water_shape(const WaterLayer& layer, const float n);
+
+// Derivative of water_shape() for a change dn of the raw noise.
+float water_shape_deriv(const WaterLayer& layer, const float n, const float dn);
+
+// Bound on how much the displacement changes per unit of a layer's raw noise.
+float water_layer_weight(const WaterPlan& plan, const int layer);
+
+// Range of a layer's value after its amplitude and shape are applied.
+void water_shape_range(const WaterLayer& layer, float& low, float& high);
+
+// Range of the displacement over all points and times, from the shaped
+// layer ranges combined the way water_combine() does. Nothing is evaluated,
+// so it is free for bounding boxes and culling before any evaluation.
+void water_displacement_range(const WaterPlan& plan, float& low, float& high);
+
+// Combine the raw noise values of all layers into a displacement.
+float water_combine(const WaterPlan& plan, const float* n);
+
+// water_combine() and its derivatives along dims <= 4 directions, given the
+// raw noise derivatives dn[layer*dims + k]. The derivatives go to d[0..dims-1].
+float water_combine_deriv(const WaterPlan& plan, const float* n, const float* dn, const int dims, float* d);
+
+// Sharpness of the ridged crests at a point, the sum over ridged layers of
+// the change of slope across their fold, given the raw noise derivatives
+// along u and v of every layer. 0 away from the crests. The layers are
+// scaled by attenuation[layer] when it is given, as in the shallows.
+float water_crest(const WaterPlan& plan, const float* n, const float* slopeU, const float* slopeV,
+                  const float* attenuation = 0);
+
+// Foam mask in [0, 1): crests count more on top of the big waves.
+float water_foam(const WaterPlan& plan, const float* n, const float crest, const float* attenuation = 0);
+
+float water_displacement(const WaterPlan& plan, const float u, const float v);
+
+// Displacement and its time derivative, the velocity along the normal in
+// units per unit of time.
+float water_displacement_velocity(const WaterPlan& plan, const float u, const float v, float& velocity);
+
+// Both for n points in one pass. Every layer is evaluated analytically,
+// the lattices and caches of water_displacement_n() only hold values.
+void water_displacement_velocity_n(const WaterPlan& plan, const int n, const float* u, const float* v, float* disp, float* velocity);
+
+// Displacement with any of its time derivative, its derivatives along u
+// and v, and the crest and foam masks in one pass. Arrays that are 0 are
+// not evaluated.
+void water_displacement_deriv_n(const WaterPlan& plan, const int n, const float* u, const float* v, float* disp,
+                                float* velocity, float* gradU, float* gradV, float* crest = 0, float* foam = 0);
+
+// Water surface at n arbitrary points, such as the hulls of boats or spray
+// particles: the height above the undisplaced plane and, for the arrays
+// that are given, the unit normals (x, y, z per point, y up) and the
+// vertical velocity. Evaluated exactly, without the lattices and caches.
+void water_query_n(const WaterPlan& plan, const int n, const float* u, const float* v, float* height,
+                   float* normals = 0, float* velocity = 0);
+
+// Length of a layer's features along its shorter noise period.
+float water_layer_wavelength(const WaterPlan& plan, const int layer);
+
+// Share of a wave left in water of the given depth, 1 deeper than half
+// its wavelength and easing to 0 at the bottom.
+float water_shoaling(const float depth, const float wavelength);
+
+// water_shoaling() of a layer.
+float water_depth_attenuation(const WaterPlan& plan, const int layer, const float depth);
+
+// The attenuations of all layers weighted like water_layer_weight(), a
+// per point scale for outputs that are not evaluated per layer.
+float water_depth_factor(const WaterPlan& plan, const float depth);
+
+// Displacement of n points over water depth[i] deep, such as above a
+// terrain. Points at most shallow deep are not evaluated and get 0, the
+// others evaluate a layer only where the depth leaves anything of it.
+// Every layer is evaluated analytically, without lattices and caches.
+void water_displacement_depth_n(const WaterPlan& plan, const int n, const float* u, const float* v,
+                                const float* depth, const float shallow, float* disp);
+
+// water_displacement_deriv_n() over water depth[i] deep, with the depth
+// changing by depthU[i] and depthV[i] along u and v. Dry points get 0 for
+// everything, the gradient includes the change of the attenuation with
+// the depth.
+void water_displacement_depth_deriv_n(const WaterPlan& plan, const int n, const float* u, const float* v,
+                                      const float* depth, const float* depthU, const float* depthV,
+                                      const float shallow, float* disp, float* velocity, float* gradU, float* gradV,
+                                      float* crest = 0, float* foam = 0);
+
+struct WaterCaches;
+
+// Displacement of the same n points at several times, such as the samples
+// of a shutter, written to disp[s*n + i] for time t[s]. The points are
+// read once per block for all times, and with a driftTolerance one cached
+// field per translating layer serves every time.
+void water_displacement_times_n(const WaterParams& params, const int times, const double* t,
+                                const int n, const float* u, const float* v, float* disp, WaterCaches* caches = 0);
+
+// Displacement of n points, threaded over blocks of points. Layers that are
+// smooth enough for plan.coarseTolerance are evaluated on a coarse lattice.
+// With caches, translating layers are resampled from a cached field.
+void water_displacement_n(const WaterPlan& plan, const int n, const float* u, const float* v, float* disp,
+                          WaterCaches* caches = 0);
+
+
+// Values on a regular lattice over (u, v), or any other pair of coordinates.
+struct WaterGrid2D {
+    float originU, originV;
+    float spacingU, spacingV;
+    float inverseU, inverseV;
+    int nu, nv;
+    int firstU, firstV;         // index of node (0, 0) on the anchored lattice
+    int wrapU, wrapV;           // column and row node (0, 0) is stored at
+    std::vector<float> values;  // u varies fastest, toroidally from (wrapU, wrapV)
+
+    WaterGrid2D() : originU(0), originV(0), spacingU(1), spacingV(1), inverseU(1), inverseV(1), nu(0), nv(0),
+                    firstU(0), firstV(0), wrapU(0), wrapV(0) {}
+
+    // Lattice with spacing (su, sv) whose cubic stencils cover [u0,u1]x[v0,v1].
+    void cover(const float u0, const float v0, const float u1, const float v1, const float su, const float sv);
+
+    // Window of nu x nv nodes of the lattice with spacing s through the
+    // origin, from node (i0, j0) on. Windows of the same spacing share
+    // their nodes wherever they overlap.
+    void anchor(const int i0, const int j0, const int nu, const int nv, const float s);
+
+    // Moves an anchored window to start at node (i0, j0) without moving
+    // any values. The nodes it still shares with where it was keep theirs,
+    // the others hold stale values until they are evaluated again.
+    void scroll(const int i0, const int j0);
+
+    // True if node (i, j) of the window was also in the window starting
+    // at node (i0, j0) of the same size.
+    bool covered(const int i, const int j, const int i0, const int j0) const
+    {
+        int ai = firstU + i - i0, aj = firstV + j - j0;
+        return ai >= 0 && ai < nu && aj >= 0 && aj < nv;
+    }
+
+    float& at(const int i, const int j)
+    {
+        int si = i + wrapU, sj = j + wrapV;
+        return values[(sj < nv ? sj : sj - nv)*nu + (si < nu ? si : si - nu)];
+    }
+    float u(const int i) const { return originU + i*spacingU; }
+    float v(const int j) const { return originV + j*spacingV; }
+
+    // Catmull-Rom interpolation, clamped at the border.
+    float sample(const float u, const float v) const;
+};
+
+// Raw noise of the layers that are evaluated on a coarse lattice.
+struct WaterCoarseLayers {
+    bool active[WATER_LAYERS];
+    WaterGrid2D grids[WATER_LAYERS];
+};
+
+// Picks the layers whose lattice, sized from the tolerance, has far fewer
+// nodes than there are points, and evaluates them. Layers in skipMask are
+// left alone.
+void water_build_coarse(const WaterPlan& plan, const int n, const float* u, const float* v, WaterCoarseLayers& coarse,
+                        const int skipMask = 0);
+
+
+// Raw noise of a layer that only translates over time, cached as its noise
+// slice z on a lattice in noise coordinates. Advection only moves where the
+// lattice is sampled, so it stays valid until z drifts. When the points
+// leave it the window scrolls toroidally and only evaluates the nodes it
+// did not cover yet.
+struct WaterAdvectedField {
+    bool valid;
+    float z;
+    int basis;              // which noise function filled the lattice
+    WaterGrid2D grid;
+
+    WaterAdvectedField() : valid(false), z(0.0f), basis(0) {}
+};
+
+// State kept between evaluations so the engine can reuse work.
+struct WaterCaches {
+    WaterAdvectedField fields[WATER_LAYERS];
+};
+
+// Brings the fields of the translating layers up to date for the points at
+// the times of all plans and returns the mask of layers that can be
+// resampled from them.
+int water_update_fields(const WaterPlan* plans, const int times, const int n, const float* u, const float* v,
+                        WaterCaches& caches);
+
+
+// Bound on how much the displacement changes over an offset (du, dv), or
+// on its slope along the direction (du, dv) per unit of that vector.
+float water_slope_bound(const WaterPlan& plan, const float du, const float dv);
+
+// Distance along each of n rays to the surface y = displacement(x, z), or
+// -1 if the ray does not reach it within maxDistance. origins and directions
+// hold x, y, z per ray, distances are in units of the direction's length.
+// Rays that start below the surface find where they leave the water. The
+// rays are sphere traced in packets, stepping as far as the slope bound
+// allows, until they are within tolerance of the surface height. They
+// start where they enter water_displacement_range(). evaluations, when
+// given, gets the number of surface evaluations of each ray.
+void water_intersect_n(const WaterPlan& plan, const int n, const float* origins, const float* directions,
+                       const float maxDistance, const float tolerance, float* t, int* evaluations = 0);
+
+
+// Hash of everything except time that a cached displacement depends on.
+WaterHash water_signature(const WaterParams& params, const int n, const float* u, const float* v);
+WaterHash water_points_signature(const int n, const float* u, const float* v);
+
+
+// Vertices grouped by their position within a tile. All vertices of a group
+// get the same displacement in tile mode, so only one per group is evaluated.
+struct WaterTileMap {
+    WaterHash signature;        // of the points the map was built from
+    float tileSize;
+    std::vector<float> u, v;    // one representative per distinct tile position
+    std::vector<int> slot;      // representative of each vertex
+
+    WaterTileMap() : signature(0), tileSize(0.0f) {}
+};
+
+void water_build_tile_map(const float tileSize, const int n, const float* u, const float* v, WaterTileMap& map);
+
+// Evaluates the representatives and scatters them to all map.slot.size() vertices.
+// The derivatives are only evaluated for the arrays that are given.
+void water_displacement_tiled(const WaterPlan& plan, const WaterTileMap& map, float* disp,
+                              float* velocity = 0, float* gradU = 0, float* gradV = 0,
+                              float* crest = 0, float* foam = 0);
+
+
+// Displacement arrays of already evaluated frames, keyed by (wrapped) time.
+// In loop mode the keys repeat every cycle so only one cycle is ever stored.
+// The frames stay within maxBytes, the oldest going first, except that
+// insert always keeps the frame it is asked for.
+class WaterFrameCache {
+public:
+    WaterFrameCache(const size_t maxBytes = 256 << 20);
+
+    void clear();
+
+    // Drops every frame if the signature differs from the stored frames.
+    void validate(const WaterHash signature);
+
+    // Changes the budget, dropping the oldest frames that no longer fit.
+    void setMaxBytes(const size_t maxBytes);
+
+    const std::vector<float>* find(const double key) const;
+    // Storage of size values for key, making room for it first.
+    std::vector<float>& insert(const double key, const unsigned int size);
+
+    unsigned int size() const { return (unsigned int)frames.size(); }
+    size_t bytes() const { return stored; }
+
+private:
+    void evict(const size_t room);
+
+    size_t maxBytes;
+    size_t stored;
+    WaterHash signature;
+    std::map<double, std::vector<float> > frames;
+    std::list<double> order;
+};
+
+
+// Displacement at arbitrary times, interpolated in time from keys evaluated
+// every params.timeStep. Keys hold the raw layer noise so the ridges are
+// shaped after interpolation and stay sharp. Each chunk of points checks the Catmull-Rom
+// interpolation of an interval against an exact evaluation at its middle
+// and halves the key spacing, up to maxLevel times, while that errs by more
+// than params.timeTolerance. Keys and decisions are kept for later times, so
+// rendering many subframes costs about two evaluations per key interval.
+// Together they stay within maxBytes, the least recently used going first
+// across all chunks.
+class WaterTimeSampler {
+public:
+    WaterTimeSampler(const int maxLevel = 4, const size_t maxBytes = 256 << 20);
+
+    void clear();
+
+    // Drops every key if the signature differs from the stored keys.
+    void validate(const WaterHash signature);
+
+    // Displacement of n points at params.time.
+    void displacement(const WaterParams& params, const int n, const float* u, const float* v, float* disp);
+
+private:
+    // Layer noise of a chunk's points at one key time, all points of the
+    // first layer then the next. used is the call that last read it.
+    struct Key {
+        std::vector<float> values;
+        unsigned long long used;
+    };
+
+    // Error test of one interval.
+    struct Decision {
+        bool accepted;
+        unsigned long long used;
+    };
+
+    // Keys of one chunk of points, indexed in units of the finest key
+    // spacing, and the decisions of its intervals. bytes is their size.
+    struct Chunk {
+        std::map<long long, Key> keys;
+        std::map<long long, Decision> decisions;
+        size_t bytes;
+        Chunk() : bytes(0) {}
+    };
+
+    const float* key(const WaterParams& params, Chunk& chunk, const int level, const long long index,
+                     const int count, const float* u, const float* v);
+    void sample(const WaterParams& params, const WaterPlan& plan, Chunk& chunk,
+                const int count, const float* u, const float* v, float* disp);
+    void evict();
+
+    int maxLevel;
+    size_t maxBytes;        // over all chunks
+    unsigned long long calls;
+    WaterHash signature;
+    std::vector<Chunk> chunks;
+};
+
+
+#endif /*WATER_ENGINE_H_*/
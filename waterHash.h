@@ -0,0 +1,34 @@
+//
+//  File: waterHash.h
+//
+//  Description:
+//		The hash every engine builds the signatures of its caches from,
+//		64 bit FNV-1a. unsigned long is only 32 bits with MSVC, so the
+//		signatures are unsigned long long on every platform.
+//
+
+#ifndef WATER_HASH_H_
+#define WATER_HASH_H_
+
+#include <stddef.h>
+
+
+typedef unsigned long long WaterHash;
+
+static const WaterHash WATER_HASH_BASIS = 14695981039346656037ULL;
+static const WaterHash WATER_HASH_PRIME = 1099511628211ULL;
+
+// FNV-1a over raw bytes. Structs are hashed field by field, their padding
+// is not initialized.
+inline WaterHash water_hash(WaterHash hash, const void* data, const size_t size)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= WATER_HASH_PRIME;
+    }
+    return hash;
+}
+
+
+#endif /*WATER_HASH_H_*/
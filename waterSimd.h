@@ -0,0 +1,27 @@
+//
+//  File: waterSimd.h
+//
+//  Description:
+//		Whether the SSE2 paths are compiled and how their arrays are
+//		aligned. GCC and Clang define __SSE2__ when the target has it.
+//		MSVC never does, SSE2 is always there on x64 and with /arch:SSE2
+//		or higher on x86.
+//
+
+#ifndef WATER_SIMD_H_
+#define WATER_SIMD_H_
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define WATER_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// Put in front of a declaration.
+#if defined(_MSC_VER)
+#define WATER_ALIGN16 __declspec(align(16))
+#else
+#define WATER_ALIGN16 __attribute__((aligned(16)))
+#endif
+
+
+#endif /*WATER_SIMD_H_*/
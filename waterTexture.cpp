@@ -0,0 +1,231 @@
+//
+//  File: waterTexture.cpp
+//
+//  Description:
+//		Lazily evaluated tiles of the height field.
+//
+
+#include <math.h>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include "waterTexture.h"
+
+
+#ifdef _WIN32
+
+WaterSharedMutex::WaterSharedMutex()
+{
+    SRWLOCK* lock = new SRWLOCK;
+    InitializeSRWLock(lock);
+    handle = lock;
+}
+
+WaterSharedMutex::~WaterSharedMutex() { delete (SRWLOCK*)handle; }
+void WaterSharedMutex::lock() { AcquireSRWLockExclusive((SRWLOCK*)handle); }
+void WaterSharedMutex::unlock() { ReleaseSRWLockExclusive((SRWLOCK*)handle); }
+void WaterSharedMutex::lockShared() { AcquireSRWLockShared((SRWLOCK*)handle); }
+void WaterSharedMutex::unlockShared() { ReleaseSRWLockShared((SRWLOCK*)handle); }
+
+// Readers stamp the tiles they read while holding the shared lock.
+static void water_store(volatile long* target, const long value) { InterlockedExchange(target, value); }
+
+#else
+
+WaterSharedMutex::WaterSharedMutex()
+{
+    pthread_rwlock_t* lock = new pthread_rwlock_t;
+    pthread_rwlock_init(lock, 0);
+    handle = lock;
+}
+
+WaterSharedMutex::~WaterSharedMutex()
+{
+    pthread_rwlock_destroy((pthread_rwlock_t*)handle);
+    delete (pthread_rwlock_t*)handle;
+}
+
+void WaterSharedMutex::lock() { pthread_rwlock_wrlock((pthread_rwlock_t*)handle); }
+void WaterSharedMutex::unlock() { pthread_rwlock_unlock((pthread_rwlock_t*)handle); }
+void WaterSharedMutex::lockShared() { pthread_rwlock_rdlock((pthread_rwlock_t*)handle); }
+void WaterSharedMutex::unlockShared() { pthread_rwlock_unlock((pthread_rwlock_t*)handle); }
+
+// Readers stamp the tiles they read while holding the shared lock.
+static void water_store(volatile long* target, const long value) { __sync_lock_test_and_set(target, value); }
+
+#endif
+
+
+WaterTileCache::WaterTileCache(const unsigned int maxTiles)
+    : maxTiles(maxTiles), signature(0), texelSize(1.0f), tileSize(64), inserts(0), generation(0), filled(0)
+{}
+
+void WaterTileCache::clear()
+{
+    mutex.lock();
+    drop();
+    mutex.unlock();
+}
+
+// Drops every tile, with the lock held. Tiles still being filled are
+// dropped too, their threads see the new generation and discard them.
+void WaterTileCache::drop()
+{
+    tiles.clear();
+    generation++;
+}
+
+void WaterTileCache::setLattice(const float newTexelSize, const int newTileSize, const unsigned int newMaxTiles)
+{
+    unsigned int bound = newMaxTiles > 0 ? newMaxTiles : 1;
+    mutex.lockShared();
+    bool same = newTexelSize == texelSize && newTileSize == tileSize && bound == maxTiles;
+    mutex.unlockShared();
+    if (same)
+        return;
+
+    mutex.lock();
+    if (newTexelSize != texelSize || newTileSize != tileSize) {
+        drop();
+        texelSize = newTexelSize;
+        tileSize = newTileSize;
+    }
+    maxTiles = bound;
+    mutex.unlock();
+}
+
+static long long tile_key(const int i, const int j)
+{
+    return ((long long)i << 32) ^ (unsigned int)j;
+}
+
+static int tile_stripe(const long long key)
+{
+    unsigned long long h = (unsigned long long)key*0x9e3779b97f4a7c15ULL;
+    return (int)(h >> 60) % WATER_FILL_STRIPES;
+}
+
+// Evicts the least recently read tiles first, with the lock held. Tiles
+// being filled are left alone.
+void WaterTileCache::evict()
+{
+    while (tiles.size() >= maxTiles) {
+        std::map<long long, Tile>::iterator oldest = tiles.end();
+        unsigned long age = 0;
+        for (std::map<long long, Tile>::iterator it = tiles.begin(); it != tiles.end(); ++it) {
+            unsigned long itAge = (unsigned long)inserts - (unsigned long)it->second.used;
+            if (it->second.ready && (oldest == tiles.end() || itAge > age)) {
+                oldest = it;
+                age = itAge;
+            }
+        }
+        if (oldest == tiles.end())
+            return;
+        tiles.erase(oldest);
+    }
+}
+
+void WaterTileCache::fill(const WaterHash newSignature, const WaterPlan& plan, const long long key,
+                          const int i, const int j)
+{
+    // the stripe is taken before the tile shows up in the map, so threads
+    // that find the tile not ready can wait on it
+    WaterSharedMutex& stripe = stripes[tile_stripe(key)];
+    stripe.lock();
+    mutex.lock();
+    if (newSignature != signature || tiles.find(key) != tiles.end()) {
+        // another thread filled it or moved on to another plan meanwhile
+        mutex.unlock();
+        stripe.unlock();
+        return;
+    }
+    evict();
+    Tile& tile = tiles[key];
+    tile.ready = false;
+    tile.used = ++inserts;
+    const unsigned int fillGeneration = generation;
+    const int size = tileSize;
+    const float texel = texelSize;
+    mutex.unlock();
+
+    const int side = size + 1;
+    const int n = side*side;
+    std::vector<float> u(n), v(n), texels(2*n);
+    for (int y = 0; y < side; y++)
+        for (int x = 0; x < side; x++) {
+            u[y*side + x] = ((double)i*size + x)*texel;
+            v[y*side + x] = ((double)j*size + y)*texel;
+        }
+    water_displacement_deriv_n(plan, n, &u[0], &v[0], &texels[0], 0, 0, 0, 0, &texels[n]);
+
+    mutex.lock();
+    std::map<long long, Tile>::iterator it = tiles.find(key);
+    if (generation == fillGeneration && it != tiles.end()) {
+        it->second.texels.swap(texels);
+        it->second.ready = true;
+        filled++;
+    }
+    mutex.unlock();
+    stripe.unlock();
+}
+
+void WaterTileCache::sample(const WaterHash newSignature, const WaterPlan& plan, const float u, const float v,
+                            float& height, float& foam)
+{
+    for (;;) {
+        mutex.lockShared();
+        if (newSignature != signature) {
+            mutex.unlockShared();
+            mutex.lock();
+            if (newSignature != signature) {
+                drop();
+                signature = newSignature;
+            }
+            mutex.unlock();
+            continue;
+        }
+
+        double fu = u/texelSize, fv = v/texelSize;
+        int i = (int)floor(fu/tileSize);
+        int j = (int)floor(fv/tileSize);
+        long long key = tile_key(i, j);
+        std::map<long long, Tile>::iterator it = tiles.find(key);
+        if (it != tiles.end() && it->second.ready) {
+            float x = (float)(fu - (double)i*tileSize);
+            float y = (float)(fv - (double)j*tileSize);
+            int xi = (int)x, yi = (int)y;
+            xi = xi < tileSize ? xi : tileSize - 1;
+            yi = yi < tileSize ? yi : tileSize - 1;
+            float fx = x - xi, fy = y - yi;
+
+            const Tile& tile = it->second;
+            water_store(&it->second.used, inserts);
+            const int side = tileSize + 1;
+            const float* h = &tile.texels[yi*side + xi];
+            const float* f = h + side*side;
+            height = (h[0]*(1 - fx) + h[1]*fx)*(1 - fy) + (h[side]*(1 - fx) + h[side + 1]*fx)*fy;
+            foam = (f[0]*(1 - fx) + f[1]*fx)*(1 - fy) + (f[side]*(1 - fx) + f[side + 1]*fx)*fy;
+            mutex.unlockShared();
+            return;
+        }
+        bool filling = it != tiles.end();
+        mutex.unlockShared();
+
+        if (filling) {
+            // wait for the thread filling it
+            WaterSharedMutex& stripe = stripes[tile_stripe(key)];
+            stripe.lock();
+            stripe.unlock();
+        }
+        else
+            fill(newSignature, plan, key, i, j);
+    }
+}
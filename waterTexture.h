@@ -0,0 +1,95 @@
+//
+//  File: waterTexture.h
+//
+//  Description:
+//		The height field as a texture for shading networks. Texels lie on
+//		a lattice over the rest plane and are evaluated lazily, a square
+//		tile at a time, the first time a sample falls into the tile. The
+//		engine threads over the texels of the tile. Tiles are kept in a
+//		bounded cache for one plan and time, and a sample is a bilinear
+//		lookup into its tile. Renderers sample from many threads at once:
+//		cached tiles are read under a shared lock, and a missing tile is
+//		filled once, outside the lock, by the first thread that needs it
+//		while the others wait for that tile only.
+//
+
+#ifndef WATER_TEXTURE_H_
+#define WATER_TEXTURE_H_
+
+#include <vector>
+#include <map>
+
+#include "waterEngine.h"
+
+
+// Many readers or one writer, on the reader/writer lock of the system.
+class WaterSharedMutex {
+public:
+    WaterSharedMutex();
+    ~WaterSharedMutex();
+
+    void lock();
+    void unlock();
+    void lockShared();
+    void unlockShared();
+
+private:
+    WaterSharedMutex(const WaterSharedMutex&);
+    WaterSharedMutex& operator=(const WaterSharedMutex&);
+
+    void* handle;
+};
+
+
+#define WATER_FILL_STRIPES 16
+
+class WaterTileCache {
+public:
+    WaterTileCache(const unsigned int maxTiles = 256);
+
+    void clear();
+
+    // Lattice of the texels and the bound on the tiles, dropping every
+    // tile if the lattice differs from the stored tiles.
+    void setLattice(const float texelSize, const int tileSize, const unsigned int maxTiles);
+
+    // Height and foam at (u, v) of the rest plane, bilinear between the
+    // texels around it. The signature has to cover the plan and its time,
+    // tiles of another signature are dropped. Safe to call from several
+    // threads at once.
+    void sample(const WaterHash signature, const WaterPlan& plan, const float u, const float v,
+                float& height, float& foam);
+
+    unsigned int size() const { return (unsigned int)tiles.size(); }
+    // Number of tiles evaluated since the cache was made.
+    unsigned int fills() const { return filled; }
+
+private:
+    // (tileSize + 1)^2 texels of height then foam, the last row and
+    // column repeat the first of the next tiles so lookups stay inside.
+    // A tile is in the map but not ready while it is being filled, used
+    // is the number of tiles inserted when it was last read.
+    struct Tile {
+        std::vector<float> texels;
+        bool ready;
+        volatile long used;
+    };
+
+    void drop();
+    void evict();
+    void fill(const WaterHash signature, const WaterPlan& plan, const long long key, const int i, const int j);
+
+    unsigned int maxTiles;
+    WaterHash signature;
+    float texelSize;
+    int tileSize;
+    std::map<long long, Tile> tiles;
+    long inserts;
+    unsigned int generation;    // of the map, changes when it is cleared
+    unsigned int filled;
+    WaterSharedMutex mutex;     // of everything above
+    WaterSharedMutex stripes[WATER_FILL_STRIPES];   // held while a tile of the stripe is filled
+};
+
+
+#endif /*WATER_TEXTURE_H_*/